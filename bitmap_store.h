@@ -0,0 +1,927 @@
+#ifndef BITMAP_STORE_H
+#define BITMAP_STORE_H
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
+#include "common.h"
+#include "number_store.h"
+
+// One 2^16-value chunk of the key space, stored the way roaring bitmaps do:
+// a sorted array for sparse chunks, a bitset for dense ones and run-length
+// intervals for long consecutive ranges. Timestamps live in a separate
+// column ordered by rank, so the i-th smallest member owns timestamps[i].
+class Container {
+public:
+    enum class Kind : uint8_t {
+        ARRAY,
+        BITMAP,
+        RUN
+    };
+    
+    static constexpr uint32_t ARRAY_MAX = 4096;  // Beyond this a bitset is smaller
+    static constexpr uint32_t WORDS = 1024;      // 65536 bits
+    static constexpr uint32_t BLOCK_WORDS = 8;   // Words covered by one rank counter
+    static constexpr uint32_t BLOCKS = WORDS / BLOCK_WORDS;
+    
+private:
+    struct Run {
+        uint16_t start;
+        uint16_t last;  // Inclusive
+    };
+    
+    Kind kind = Kind::ARRAY;
+    std::vector<uint16_t> values;       // ARRAY: sorted members
+    std::vector<uint64_t> words;        // BITMAP: membership bits
+    std::vector<uint16_t> block_rank;   // BITMAP: members before each block
+    std::vector<Run> runs;              // RUN: sorted, non-adjacent intervals
+    std::vector<uint32_t> run_rank;     // RUN: members before each run
+    std::vector<int64_t> timestamps;    // Rank-ordered timestamp column
+    
+    static size_t array_bytes(size_t cardinality) {
+        return cardinality * sizeof(uint16_t);
+    }
+    
+    static size_t bitmap_bytes() {
+        return WORDS * sizeof(uint64_t) + BLOCKS * sizeof(uint16_t);
+    }
+    
+    static size_t run_bytes(size_t run_count) {
+        return run_count * (sizeof(Run) + sizeof(uint32_t));
+    }
+    
+    // Finds whether low is a member and its rank: the index of its timestamp,
+    // or where that timestamp would be inserted
+    bool locate(uint16_t low, uint32_t& rank) const {
+        switch (kind) {
+            case Kind::ARRAY: {
+                auto it = std::lower_bound(values.begin(), values.end(), low);
+                rank = static_cast<uint32_t>(it - values.begin());
+                return it != values.end() && *it == low;
+            }
+            case Kind::BITMAP: {
+                uint32_t word = low >> 6;
+                uint32_t block = word / BLOCK_WORDS;
+                rank = block_rank[block];
+                for (uint32_t w = block * BLOCK_WORDS; w < word; ++w) {
+                    rank += __builtin_popcountll(words[w]);
+                }
+                uint64_t bit = uint64_t(1) << (low & 63);
+                rank += __builtin_popcountll(words[word] & (bit - 1));
+                return (words[word] & bit) != 0;
+            }
+            case Kind::RUN: {
+                auto it = std::lower_bound(runs.begin(), runs.end(), low,
+                                           [](const Run& run, uint16_t v) { return run.last < v; });
+                size_t index = it - runs.begin();
+                if (it == runs.end()) {
+                    rank = static_cast<uint32_t>(timestamps.size());
+                    return false;
+                }
+                rank = run_rank[index];
+                if (it->start <= low) {
+                    rank += low - it->start;
+                    return true;
+                }
+                return false;
+            }
+        }
+        return false;
+    }
+    
+    void rebuild_block_rank() {
+        block_rank.assign(BLOCKS, 0);
+        uint32_t count = 0;
+        for (uint32_t block = 0; block < BLOCKS; ++block) {
+            block_rank[block] = static_cast<uint16_t>(count);
+            for (uint32_t w = block * BLOCK_WORDS; w < (block + 1) * BLOCK_WORDS; ++w) {
+                count += __builtin_popcountll(words[w]);
+            }
+        }
+    }
+    
+    void rebuild_run_rank() {
+        run_rank.resize(runs.size());
+        uint32_t count = 0;
+        for (size_t i = 0; i < runs.size(); ++i) {
+            run_rank[i] = count;
+            count += runs[i].last - runs[i].start + 1;
+        }
+    }
+    
+    // Members in ascending order, independent of the representation
+    std::vector<uint16_t> members() const {
+        std::vector<uint16_t> result;
+        result.reserve(timestamps.size());
+        for_each([&result](uint16_t low, int64_t) { result.push_back(low); });
+        return result;
+    }
+    
+    size_t count_runs() const {
+        if (kind == Kind::RUN) {
+            return runs.size();
+        }
+        size_t count = 0;
+        int32_t previous = -2;
+        for_each([&count, &previous](uint16_t low, int64_t) {
+            if (low != previous + 1) {
+                ++count;
+            }
+            previous = low;
+        });
+        return count;
+    }
+    
+    // Re-encodes the members as kind; the rank order, and thus the timestamp
+    // column, is unaffected
+    void convert(Kind target) {
+        if (target == kind) {
+            return;
+        }
+        auto sorted = members();
+        values.clear();
+        values.shrink_to_fit();
+        words.clear();
+        words.shrink_to_fit();
+        block_rank.clear();
+        block_rank.shrink_to_fit();
+        runs.clear();
+        runs.shrink_to_fit();
+        run_rank.clear();
+        run_rank.shrink_to_fit();
+        
+        kind = target;
+        switch (kind) {
+            case Kind::ARRAY:
+                values = std::move(sorted);
+                break;
+            case Kind::BITMAP:
+                words.assign(WORDS, 0);
+                for (uint16_t low : sorted) {
+                    words[low >> 6] |= uint64_t(1) << (low & 63);
+                }
+                rebuild_block_rank();
+                break;
+            case Kind::RUN:
+                for (uint16_t low : sorted) {
+                    if (!runs.empty() && runs.back().last + 1 == low) {
+                        runs.back().last = low;
+                    } else {
+                        runs.push_back({low, low});
+                    }
+                }
+                rebuild_run_rank();
+                break;
+        }
+    }
+    
+    // Cheapest representation that is not a run container
+    Kind array_or_bitmap() const {
+        return timestamps.size() > ARRAY_MAX ? Kind::BITMAP : Kind::ARRAY;
+    }
+    
+public:
+    Kind container_kind() const {
+        return kind;
+    }
+    
+    uint32_t cardinality() const {
+        return static_cast<uint32_t>(timestamps.size());
+    }
+    
+    bool empty() const {
+        return timestamps.empty();
+    }
+    
+    bool find(uint16_t low, int64_t& timestamp) const {
+        uint32_t rank;
+        if (!locate(low, rank)) {
+            return false;
+        }
+        timestamp = timestamps[rank];
+        return true;
+    }
+    
+    // Members below low
+    uint32_t rank(uint16_t low) const {
+        uint32_t result;
+        locate(low, result);
+        return result;
+    }
+    
+    // The member with the given rank, which must be below cardinality()
+    uint16_t select(uint32_t rank, int64_t& timestamp) const {
+        timestamp = timestamps[rank];
+        switch (kind) {
+            case Kind::ARRAY:
+                return values[rank];
+            case Kind::BITMAP: {
+                // Last block starting at or before rank, then word by word
+                uint32_t block = static_cast<uint32_t>(
+                    std::upper_bound(block_rank.begin(), block_rank.end(), rank) - block_rank.begin()) - 1;
+                uint32_t left = rank - block_rank[block];
+                uint32_t w = block * BLOCK_WORDS;
+                for (uint32_t bits; left >= (bits = __builtin_popcountll(words[w])); ++w) {
+                    left -= bits;
+                }
+                uint64_t word = words[w];
+                for (; left > 0; --left) {
+                    word &= word - 1;
+                }
+                return static_cast<uint16_t>(w * 64 + __builtin_ctzll(word));
+            }
+            case Kind::RUN: {
+                size_t index = std::upper_bound(run_rank.begin(), run_rank.end(), rank) - run_rank.begin() - 1;
+                return static_cast<uint16_t>(runs[index].start + (rank - run_rank[index]));
+            }
+        }
+        return 0;
+    }
+    
+    // Adds low with the given timestamp. For a duplicate, returns false and
+    // reports the timestamp already stored.
+    bool insert(uint16_t low, int64_t& timestamp) {
+        uint32_t rank;
+        if (locate(low, rank)) {
+            timestamp = timestamps[rank];
+            return false;
+        }
+        timestamps.insert(timestamps.begin() + rank, timestamp);
+        
+        switch (kind) {
+            case Kind::ARRAY:
+                values.insert(values.begin() + rank, low);
+                if (values.size() > ARRAY_MAX) {
+                    convert(Kind::BITMAP);
+                }
+                break;
+            case Kind::BITMAP:
+                words[low >> 6] |= uint64_t(1) << (low & 63);
+                for (uint32_t block = (low >> 6) / BLOCK_WORDS + 1; block < BLOCKS; ++block) {
+                    ++block_rank[block];
+                }
+                break;
+            case Kind::RUN: {
+                auto it = std::lower_bound(runs.begin(), runs.end(), low,
+                                           [](const Run& run, uint16_t v) { return run.last < v; });
+                size_t index = it - runs.begin();
+                bool extends_previous = index > 0 && runs[index - 1].last + 1 == low;
+                bool extends_next = index < runs.size() && runs[index].start == low + 1;
+                if (extends_previous && extends_next) {
+                    runs[index - 1].last = runs[index].last;
+                    runs.erase(runs.begin() + index);
+                } else if (extends_previous) {
+                    runs[index - 1].last = low;
+                } else if (extends_next) {
+                    runs[index].start = low;
+                } else {
+                    runs.insert(runs.begin() + index, Run{low, low});
+                }
+                rebuild_run_rank();
+                if (run_bytes(runs.size()) > std::min(array_bytes(timestamps.size()), bitmap_bytes())) {
+                    convert(array_or_bitmap());
+                }
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Removes low, reporting the timestamp it had
+    bool remove(uint16_t low, int64_t& timestamp) {
+        uint32_t rank;
+        if (!locate(low, rank)) {
+            return false;
+        }
+        timestamp = timestamps[rank];
+        timestamps.erase(timestamps.begin() + rank);
+        
+        switch (kind) {
+            case Kind::ARRAY:
+                values.erase(values.begin() + rank);
+                break;
+            case Kind::BITMAP:
+                words[low >> 6] &= ~(uint64_t(1) << (low & 63));
+                for (uint32_t block = (low >> 6) / BLOCK_WORDS + 1; block < BLOCKS; ++block) {
+                    --block_rank[block];
+                }
+                if (timestamps.size() <= ARRAY_MAX) {
+                    convert(Kind::ARRAY);
+                }
+                break;
+            case Kind::RUN: {
+                auto it = std::lower_bound(runs.begin(), runs.end(), low,
+                                           [](const Run& run, uint16_t v) { return run.last < v; });
+                Run run = *it;
+                if (run.start == run.last) {
+                    runs.erase(it);
+                } else if (low == run.start) {
+                    it->start = low + 1;
+                } else if (low == run.last) {
+                    it->last = low - 1;
+                } else {
+                    it->last = low - 1;
+                    runs.insert(it + 1, Run{static_cast<uint16_t>(low + 1), run.last});
+                }
+                rebuild_run_rank();
+                if (run_bytes(runs.size()) > std::min(array_bytes(timestamps.size()), bitmap_bytes())) {
+                    convert(array_or_bitmap());
+                }
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Replaces the contents with count distinct members of this chunk, given
+    // in ascending order with their timestamps
+    void assign(const int32_t* numbers, const int64_t* stamps, size_t count) {
+        kind = Kind::ARRAY;
+        values.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            values[i] = static_cast<uint16_t>(numbers[i] & 0xffff);
+        }
+        timestamps.assign(stamps, stamps + count);
+        words.clear();
+        block_rank.clear();
+        runs.clear();
+        run_rank.clear();
+        optimize();
+    }
+    
+    // Switches to run encoding when that is the smallest representation.
+    // Called after bulk changes; single inserts never create run containers.
+    void optimize() {
+        size_t run_cost = run_bytes(count_runs());
+        Kind best = array_or_bitmap();
+        size_t best_cost = best == Kind::ARRAY ? array_bytes(timestamps.size()) : bitmap_bytes();
+        convert(run_cost < best_cost ? Kind::RUN : best);
+    }
+    
+    // Calls f(low, timestamp) for every member in ascending order. Bitsets
+    // are walked a word at a time with count-trailing-zeros, and the
+    // timestamp column is read sequentially.
+    template <typename F>
+    void for_each(F&& f) const {
+        scan_from(0, [&f](uint16_t low, int64_t timestamp) {
+            f(low, timestamp);
+            return true;
+        });
+    }
+    
+    // Calls f(low, timestamp) for members >= from in ascending order until f
+    // returns false. Returns false if f stopped the scan.
+    template <typename F>
+    bool scan_from(uint16_t from, F&& f) const {
+        uint32_t rank;
+        locate(from, rank);
+        switch (kind) {
+            case Kind::ARRAY:
+                for (size_t i = rank; i < values.size(); ++i) {
+                    if (!f(values[i], timestamps[i])) {
+                        return false;
+                    }
+                }
+                break;
+            case Kind::BITMAP: {
+                uint64_t bits = words[from >> 6] & (~uint64_t(0) << (from & 63));
+                for (uint32_t w = from >> 6; w < WORDS; bits = ++w < WORDS ? words[w] : 0) {
+                    while (bits) {
+                        uint32_t low = w * 64 + __builtin_ctzll(bits);
+                        if (!f(static_cast<uint16_t>(low), timestamps[rank++])) {
+                            return false;
+                        }
+                        bits &= bits - 1;
+                    }
+                }
+                break;
+            }
+            case Kind::RUN: {
+                auto it = std::lower_bound(runs.begin(), runs.end(), from,
+                                           [](const Run& run, uint16_t v) { return run.last < v; });
+                for (; it != runs.end(); ++it) {
+                    for (uint32_t low = std::max<uint32_t>(it->start, from); low <= it->last; ++low) {
+                        if (!f(static_cast<uint16_t>(low), timestamps[rank++])) {
+                            return false;
+                        }
+                    }
+                }
+                break;
+            }
+        }
+        return true;
+    }
+    
+    // Approximate heap footprint
+    size_t memory_usage() const {
+        return sizeof(*this) +
+               values.capacity() * sizeof(uint16_t) +
+               words.capacity() * sizeof(uint64_t) +
+               block_rank.capacity() * sizeof(uint16_t) +
+               runs.capacity() * sizeof(Run) +
+               run_rank.capacity() * sizeof(uint32_t) +
+               timestamps.capacity() * sizeof(int64_t);
+    }
+};
+
+// Fenwick tree over the cardinalities of a shard's containers, so the
+// members in the slots before a given one are counted in O(log slots)
+class SlotCounts {
+private:
+    std::vector<uint32_t> tree;  // 1-based
+    
+public:
+    void reset(size_t slots) {
+        tree.assign(slots + 1, 0);
+    }
+    
+    void add(size_t slot, int64_t delta) {
+        for (size_t i = slot + 1; i < tree.size(); i += i & -i) {
+            tree[i] += static_cast<uint32_t>(delta);
+        }
+    }
+    
+    // Members in slots [0, slots)
+    uint64_t prefix(size_t slots) const {
+        uint64_t sum = 0;
+        for (size_t i = slots; i > 0; i -= i & -i) {
+            sum += tree[i];
+        }
+        return sum;
+    }
+};
+
+// Compressed bitmap engine for non-negative numbers. The high 16 bits of a
+// number select a Container; chunks are spread over the shards round-robin
+// and each shard indexes its chunks directly, so FIND is one array lookup
+// plus a container probe. Negative numbers are never stored.
+class BitmapStore : public NumberStore {
+private:
+    static constexpr uint32_t CHUNKS = 1u << 15;  // High halves of non-negative int32
+    
+    struct alignas(64) Shard {
+        std::vector<std::unique_ptr<Container>> slots;  // Indexed by chunk >> shard_bits
+        SlotCounts slot_counts;                          // Cardinality of each slot
+        size_t count = 0;
+        std::atomic<size_t> bytes{0};  // Held by the containers; written under the lock, read without
+        mutable std::shared_mutex mutex;
+    };
+    
+    std::unique_ptr<Shard[]> shards;
+    size_t num_shards;
+    unsigned shard_bits;
+    
+    static uint32_t chunk_of(int32_t number) {
+        return static_cast<uint32_t>(number) >> 16;
+    }
+    
+    static uint16_t low_of(int32_t number) {
+        return static_cast<uint16_t>(number & 0xffff);
+    }
+    
+    size_t shard_index(int32_t number) const {
+        return chunk_of(number) & (num_shards - 1);
+    }
+    
+    const Container* container_for(const Shard& shard, int32_t number) const {
+        return shard.slots[chunk_of(number) >> shard_bits].get();
+    }
+    
+    std::vector<std::vector<uint32_t>> partition(const std::vector<int32_t>& keys) const {
+        return partition_sorted(keys, num_shards,
+                                [this](int32_t number) { return shard_index(number); });
+    }
+    
+    // Adds a container's change in size, from before bytes, to its shard's total
+    static void account(Shard& shard, size_t before, const Container* container) {
+        size_t after = container ? container->memory_usage() : 0;
+        shard.bytes.store(shard.bytes.load(std::memory_order_relaxed) + after - before,
+                          std::memory_order_relaxed);
+    }
+    
+    static void optimize_locked(Shard& shard, Container* container) {
+        size_t before = container->memory_usage();
+        container->optimize();
+        account(shard, before, container);
+    }
+    
+    // Inserts into a shard whose lock is already held
+    bool insert_locked(Shard& shard, int32_t number, int64_t& timestamp) {
+        size_t index = chunk_of(number) >> shard_bits;
+        auto& slot = shard.slots[index];
+        if (!slot) {
+            slot = std::make_unique<Container>();
+        }
+        size_t before = slot->memory_usage();
+        if (!slot->insert(low_of(number), timestamp)) {
+            return false;
+        }
+        account(shard, before, slot.get());
+        ++shard.count;
+        shard.slot_counts.add(index, 1);
+        return true;
+    }
+    
+    // Removes from a shard whose lock is already held
+    bool remove_locked(Shard& shard, int32_t number, int64_t& timestamp) {
+        size_t index = chunk_of(number) >> shard_bits;
+        auto& slot = shard.slots[index];
+        if (!slot) {
+            return false;
+        }
+        size_t before = slot->memory_usage();
+        if (!slot->remove(low_of(number), timestamp)) {
+            return false;
+        }
+        --shard.count;
+        shard.slot_counts.add(index, -1);
+        if (slot->empty()) {
+            slot.reset();
+        }
+        account(shard, before, slot.get());
+        return true;
+    }
+    
+    // Members in the chunks below chunk, which may be CHUNKS. Shard s holds
+    // chunks s, s + num_shards, ..., so its slots below are counted in one
+    // prefix sum. Every shard must be locked.
+    uint64_t count_chunks_below(uint32_t chunk) const {
+        uint64_t total = 0;
+        for (size_t s = 0; s < num_shards && s < chunk; ++s) {
+            total += shards[s].slot_counts.prefix((chunk - s + num_shards - 1) >> shard_bits);
+        }
+        return total;
+    }
+    
+    // Members below bound, which may be 2^31; every shard must be locked
+    uint64_t count_below_locked(int64_t bound) const {
+        if (bound <= 0) {
+            return 0;
+        }
+        uint32_t chunk = static_cast<uint32_t>(std::min<int64_t>(bound, int64_t(1) << 31) >> 16);
+        uint64_t total = count_chunks_below(chunk);
+        if (chunk < CHUNKS) {
+            const Container* container = shards[chunk & (num_shards - 1)].slots[chunk >> shard_bits].get();
+            if (container) {
+                total += container->rank(low_of(static_cast<int32_t>(bound)));
+            }
+        }
+        return total;
+    }
+    
+    // The entry with rank k, found by binary search for the last chunk with
+    // at most k members below it; every shard must be locked
+    std::optional<NumberEntry> select_locked(uint64_t k) const {
+        if (k >= count_chunks_below(CHUNKS)) {
+            return std::nullopt;
+        }
+        uint32_t lo = 0;
+        uint32_t hi = CHUNKS - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo + 1) / 2;
+            if (count_chunks_below(mid) <= k) {
+                lo = mid;
+            } else {
+                hi = mid - 1;
+            }
+        }
+        const Container* container = shards[lo & (num_shards - 1)].slots[lo >> shard_bits].get();
+        int64_t timestamp;
+        uint16_t low = container->select(static_cast<uint32_t>(k - count_chunks_below(lo)), timestamp);
+        return NumberEntry(static_cast<int32_t>(lo << 16) | low, timestamp);
+    }
+    
+    std::vector<std::shared_lock<std::shared_mutex>> lock_all_shared() const {
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+        }
+        return locks;
+    }
+    
+protected:
+    // Input is sorted, so each chunk is a contiguous run of entries that
+    // fills a new container in one pass
+    void load_shard(size_t s, const int32_t* numbers, const int64_t* timestamps,
+                    size_t count) override {
+        Shard& shard = shards[s];
+        std::unique_lock lock(shard.mutex);
+        size_t i = std::lower_bound(numbers, numbers + count, 0) - numbers;
+        while (i < count) {
+            uint32_t chunk = chunk_of(numbers[i]);
+            size_t end = count;
+            if (chunk + 1 < CHUNKS) {
+                end = std::lower_bound(numbers + i, numbers + count,
+                                       static_cast<int32_t>((chunk + 1) << 16)) - numbers;
+            }
+            if ((chunk & (num_shards - 1)) == s) {
+                auto& slot = shard.slots[chunk >> shard_bits];
+                if (!slot) {
+                    slot = std::make_unique<Container>();
+                    slot->assign(numbers + i, timestamps + i, end - i);
+                    account(shard, 0, slot.get());
+                    shard.count += end - i;
+                    shard.slot_counts.add(chunk >> shard_bits, static_cast<int64_t>(end - i));
+                } else {
+                    for (size_t j = i; j < end; ++j) {
+                        int64_t timestamp = timestamps[j];
+                        insert_locked(shard, numbers[j], timestamp);
+                    }
+                    optimize_locked(shard, slot.get());
+                }
+            }
+            i = end;
+        }
+    }
+    
+public:
+    using NumberStore::insert;
+    
+    // shard_count is rounded up to a power of two
+    explicit BitmapStore(size_t shard_count = DEFAULT_SHARD_COUNT)
+        : shard_bits(shard_bits_for(shard_count)) {
+        num_shards = size_t(1) << shard_bits;
+        shards.reset(new Shard[num_shards]);
+        for (size_t i = 0; i < num_shards; ++i) {
+            shards[i].slots.resize(CHUNKS >> shard_bits);
+            shards[i].slot_counts.reset(CHUNKS >> shard_bits);
+        }
+    }
+    
+    const char* engine_name() const override {
+        return "bitmap";
+    }
+    
+    size_t shard_count() const override {
+        return num_shards;
+    }
+    
+    bool insert(int32_t number, int64_t& timestamp, int64_t expires_at) override {
+        if (number < 0) {
+            return false;
+        }
+        Shard& shard = shards[shard_index(number)];
+        std::unique_lock lock(shard.mutex);
+        timestamp = now_micros();
+        if (!insert_locked(shard, number, timestamp)) {
+            return false;
+        }
+        notify_insert(&number, 1, timestamp, expires_at);
+        return true;
+    }
+    
+    void insert_batch_at(const std::vector<int32_t>& keys, int64_t timestamp,
+                         int64_t expires_at, std::vector<bool>& inserted) override {
+        auto groups = partition(keys);
+        inserted.assign(keys.size(), false);
+        std::vector<int32_t> added;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Shard& shard = shards[s];
+            std::unique_lock lock(shard.mutex);
+            Container* touched = nullptr;
+            added.clear();
+            for (uint32_t i : groups[s]) {
+                if (keys[i] < 0) {
+                    continue;
+                }
+                int64_t assigned = timestamp;
+                inserted[i] = insert_locked(shard, keys[i], assigned);
+                if (inserted[i] && listening()) {
+                    added.push_back(keys[i]);
+                }
+                
+                // Keys arrive sorted, so each container is finished before
+                // the next one starts: re-encode it once it is complete
+                Container* current = shard.slots[chunk_of(keys[i]) >> shard_bits].get();
+                if (touched && touched != current) {
+                    optimize_locked(shard, touched);
+                }
+                touched = current;
+            }
+            if (touched) {
+                optimize_locked(shard, touched);
+            }
+            notify_insert(added.data(), added.size(), timestamp, expires_at);
+        }
+    }
+    
+    bool remove(int32_t number) override {
+        if (number < 0) {
+            return false;
+        }
+        Shard& shard = shards[shard_index(number)];
+        std::unique_lock lock(shard.mutex);
+        int64_t timestamp;
+        if (!remove_locked(shard, number, timestamp)) {
+            return false;
+        }
+        notify_remove(&number, &timestamp, 1);
+        return true;
+    }
+    
+    void remove_batch_if(const std::vector<int32_t>& keys, const RemoveCondition& condition,
+                         std::vector<bool>& removed) override {
+        auto groups = partition(keys);
+        removed.assign(keys.size(), false);
+        std::vector<int32_t> gone;
+        std::vector<int64_t> gone_timestamps;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Shard& shard = shards[s];
+            std::unique_lock lock(shard.mutex);
+            gone.clear();
+            gone_timestamps.clear();
+            for (uint32_t i : groups[s]) {
+                int64_t timestamp;
+                removed[i] = keys[i] >= 0 && (!condition || condition(keys[i])) &&
+                             remove_locked(shard, keys[i], timestamp);
+                if (removed[i] && listening()) {
+                    gone.push_back(keys[i]);
+                    gone_timestamps.push_back(timestamp);
+                }
+            }
+            notify_remove(gone.data(), gone_timestamps.data(), gone.size());
+        }
+    }
+    
+    void clear() override {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+        }
+        for (size_t i = 0; i < num_shards; ++i) {
+            for (auto& slot : shards[i].slots) {
+                slot.reset();
+            }
+            shards[i].count = 0;
+            shards[i].bytes.store(0, std::memory_order_relaxed);
+            shards[i].slot_counts.reset(CHUNKS >> shard_bits);
+        }
+        notify_clear();
+    }
+    
+    std::optional<NumberEntry> find(int32_t number) const override {
+        if (number < 0) {
+            return std::nullopt;
+        }
+        const Shard& shard = shards[shard_index(number)];
+        std::shared_lock lock(shard.mutex);
+        const Container* container = container_for(shard, number);
+        int64_t timestamp;
+        if (!container || !container->find(low_of(number), timestamp)) {
+            return std::nullopt;
+        }
+        return NumberEntry(number, timestamp);
+    }
+    
+    std::vector<int64_t> find_batch(const std::vector<int32_t>& keys) const override {
+        auto groups = partition(keys);
+        std::vector<int64_t> timestamps(keys.size(), -1);
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            const Shard& shard = shards[s];
+            std::shared_lock lock(shard.mutex);
+            for (uint32_t i : groups[s]) {
+                if (keys[i] < 0) {
+                    continue;
+                }
+                const Container* container = container_for(shard, keys[i]);
+                if (container) {
+                    container->find(low_of(keys[i]), timestamps[i]);
+                }
+            }
+        }
+        return timestamps;
+    }
+    
+    // Chunks are visited in ascending order, so no merge step is needed
+    std::vector<NumberEntry> getAllSorted() const override {
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards);
+        size_t total = 0;
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+            total += shards[i].count;
+        }
+        
+        std::vector<NumberEntry> result;
+        result.reserve(total);
+        for (uint32_t chunk = 0; chunk < CHUNKS; ++chunk) {
+            const Shard& shard = shards[chunk & (num_shards - 1)];
+            const Container* container = shard.slots[chunk >> shard_bits].get();
+            if (!container) {
+                continue;
+            }
+            int32_t high = static_cast<int32_t>(chunk << 16);
+            container->for_each([&result, high](uint16_t low, int64_t timestamp) {
+                result.emplace_back(high | low, timestamp);
+            });
+        }
+        return result;
+    }
+    
+    std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const override {
+        std::vector<NumberEntry> result;
+        lo = std::max(lo, 0);
+        if (hi < lo || limit == 0) {
+            return result;
+        }
+        
+        auto locks = lock_all_shared();
+        for (uint32_t chunk = chunk_of(lo); chunk <= chunk_of(hi); ++chunk) {
+            const Shard& shard = shards[chunk & (num_shards - 1)];
+            const Container* container = shard.slots[chunk >> shard_bits].get();
+            if (!container) {
+                continue;
+            }
+            int32_t high = static_cast<int32_t>(chunk << 16);
+            uint16_t from = chunk == chunk_of(lo) ? low_of(lo) : 0;
+            bool more = container->scan_from(from, [&](uint16_t low, int64_t timestamp) {
+                int32_t number = high | low;
+                if (number > hi || result.size() == limit) {
+                    return false;
+                }
+                result.emplace_back(number, timestamp);
+                return true;
+            });
+            if (!more) {
+                break;
+            }
+        }
+        return result;
+    }
+    
+    std::optional<NumberEntry> min_entry() const override {
+        auto locks = lock_all_shared();
+        return select_locked(0);
+    }
+    
+    std::optional<NumberEntry> max_entry() const override {
+        auto locks = lock_all_shared();
+        uint64_t total = count_chunks_below(CHUNKS);
+        return total == 0 ? std::nullopt : select_locked(total - 1);
+    }
+    
+    uint64_t rank(int32_t number) const override {
+        auto locks = lock_all_shared();
+        return count_below_locked(number);
+    }
+    
+    std::optional<NumberEntry> select(uint64_t k) const override {
+        auto locks = lock_all_shared();
+        return select_locked(k);
+    }
+    
+    uint64_t count_range(int32_t lo, int32_t hi) const override {
+        if (hi < lo) {
+            return 0;
+        }
+        auto locks = lock_all_shared();
+        return count_below_locked(int64_t(hi) + 1) - count_below_locked(lo);
+    }
+    
+    size_t size() const override {
+        size_t total = 0;
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::shared_lock lock(shards[i].mutex);
+            total += shards[i].count;
+        }
+        return total;
+    }
+    
+protected:
+    // The slot tables plus every shard's containers, read without locks
+    size_t engine_memory_usage() const override {
+        size_t total = num_shards * (sizeof(Shard) + (CHUNKS >> shard_bits) * sizeof(std::unique_ptr<Container>));
+        for (size_t i = 0; i < num_shards; ++i) {
+            total += shards[i].bytes.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+    
+    // A timestamp and a 16-bit array slot
+    size_t engine_entry_bytes() const override {
+        return sizeof(int64_t) + sizeof(uint16_t);
+    }
+};
+
+#endif
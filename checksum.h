@@ -0,0 +1,64 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC-32C (Castagnoli) as used by the write-ahead log and snapshot files.
+// Uses the SSE4.2 crc32 instruction when the CPU has it; the table-driven
+// fallback produces the same values.
+
+inline uint32_t crc32c_table(uint32_t crc, const char* data, size_t len) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value >> 1) ^ (0x82f63b78u & (0u - (value & 1)));
+            }
+            t[i] = value;
+        }
+        return t;
+    }();
+    
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+inline uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t len) {
+    uint64_t value = crc;
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = static_cast<uint32_t>(value);
+    for (; len > 0; ++data, --len) {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data));
+    }
+    return crc;
+}
+#endif
+
+// Continues a checksum; start with crc = 0
+inline uint32_t crc32c(const char* data, size_t len, uint32_t crc = 0) {
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~crc32c_sse42(~crc, data, len);
+    }
+#endif
+    return ~crc32c_table(~crc, data, len);
+}
+
+#endif
@@ -4,39 +4,89 @@
 #include <iomanip>
 #include <ctime>
 #include <cstring>
-#include <sys/socket.h>
-#include <sys/un.h>
-#include <unistd.h>
 #include <limits>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cerrno>
+#include <memory>
+#include <deque>
+#include <fstream>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <condition_variable>
 
 #include "common.h"
+#include "protocol.h"
+#include "number_client.h"
+
+// One command of a batch, e.g. "insert 5" or "range 1 100 10"
+struct BatchCommand {
+    std::string text;     // As given, for syntax errors
+    std::string verb;
+    MessageType type;
+    int64_t args[3] = {0, 0, 0};
+    size_t argc = 0;
+    std::string path;     // import and export
+    uint8_t format = NUMBER_FILE_TEXT;
+    bool valid = false;
+};
 
 class NumberCLI {
 private:
-    std::string socket_path;
+    NumberClient client;
+    
+    // Sends a request and waits for its reply; false, after saying so, if
+    // the connection failed
+    bool transact(Request request, Reply& reply) {
+        reply = client.call(std::move(request));
+        if (reply.lost) {
+            std::cerr << "Error: Connection to daemon lost" << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    // numbers[offset, offset + count) as one batch frame
+    static Request batch_request(MessageType type, const std::vector<int32_t>& numbers,
+                                 size_t offset, uint32_t count) {
+        Request request;
+        FrameBuilder(request.frame, 0, type)
+            .put_u32(count)
+            .put_bytes(numbers.data() + offset, count * sizeof(int32_t))
+            .finish();
+        return request;
+    }
+    
+    // Prints the entries of a PRINT_ALL, RANGE or TIME_RANGE reply as they
+    // arrive, counting them in printed
+    Request listing(Request request, uint64_t& printed) {
+        request.on_entries = [this, &printed](const std::vector<NumberEntry>& entries) {
+            if (printed == 0 && !entries.empty()) {
+                std::cout << "\nStored numbers (sorted):" << std::endl;
+                std::cout << std::setw(10) << "Number" << " | " << "Timestamp" << std::endl;
+                std::cout << std::string(35, '-') << std::endl;
+            }
+            for (const auto& entry : entries) {
+                std::cout << std::setw(10) << entry.number << " | "
+                          << format_timestamp(entry.timestamp) << std::endl;
+                ++printed;
+            }
+        };
+        return request;
+    }
     
 public:
-    NumberCLI(const std::string& path) : socket_path(path) {}
+    explicit NumberCLI(const ClientOptions& options) : client(options) {}
     
-    int connect_to_daemon() {
-        int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (sockfd < 0) {
-            std::cerr << "Error: Failed to create socket" << std::endl;
-            return -1;
+    bool connect() {
+        std::string error;
+        if (!client.connect(error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return false;
         }
-        
-        struct sockaddr_un addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
-        
-        if (connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            std::cerr << "Error: Cannot connect to daemon. Is the daemon running?" << std::endl;
-            close(sockfd);
-            return -1;
-        }
-        
-        return sockfd;
+        return true;
     }
     
     void show_menu() {
@@ -46,8 +96,18 @@ public:
         std::cout << "3. Print all numbers" << std::endl;
         std::cout << "4. Delete all numbers" << std::endl;
         std::cout << "5. Find a number" << std::endl;
-        std::cout << "6. Exit" << std::endl;
-        std::cout << "Choose an option (1-6): ";
+        std::cout << "6. Insert multiple numbers" << std::endl;
+        std::cout << "7. Delete multiple numbers" << std::endl;
+        std::cout << "8. Find multiple numbers" << std::endl;
+        std::cout << "9. Print a range of numbers" << std::endl;
+        std::cout << "10. Show daemon statistics" << std::endl;
+        std::cout << "11. Print recently inserted numbers" << std::endl;
+        std::cout << "12. Show count, smallest and largest number" << std::endl;
+        std::cout << "13. Find the k-th smallest number" << std::endl;
+        std::cout << "14. Import numbers from a file" << std::endl;
+        std::cout << "15. Export numbers to a file" << std::endl;
+        std::cout << "16. Exit" << std::endl;
+        std::cout << "Choose an option (1-16): ";
     }
     
     int get_positive_integer(const std::string& prompt) {
@@ -69,176 +129,911 @@ public:
         }
     }
     
+    // Reads a line of positive integers separated by spaces or commas
+    std::vector<int32_t> get_number_list(const std::string& prompt) {
+        while (true) {
+            std::cout << prompt;
+            std::string line;
+            if (!std::getline(std::cin, line)) {
+                return {};
+            }
+            for (char& c : line) {
+                if (c == ',') c = ' ';
+            }
+            
+            std::istringstream input(line);
+            std::vector<int32_t> numbers;
+            std::string token;
+            bool valid = true;
+            while (input >> token) {
+                char* end = nullptr;
+                errno = 0;
+                long value = std::strtol(token.c_str(), &end, 10);
+                if (*end != '\0' || errno != 0 || value <= 0 ||
+                    value > std::numeric_limits<int32_t>::max()) {
+                    valid = false;
+                    break;
+                }
+                numbers.push_back(static_cast<int32_t>(value));
+            }
+            
+            if (!valid) {
+                std::cout << "Error: '" << token << "' is not a positive integer." << std::endl;
+            } else if (numbers.empty()) {
+                std::cout << "Error: Please enter at least one positive integer." << std::endl;
+            } else {
+                return numbers;
+            }
+        }
+    }
+    
     void insert_number() {
         int number = get_positive_integer("Enter number to insert: ");
         
-        int sockfd = connect_to_daemon();
-        if (sockfd < 0) return;
+        Reply reply;
+        if (transact(make_request(MessageType::INSERT, number), reply)) {
+            if (reply.ok()) {
+                PayloadReader reader = reply.reader();
+                int32_t inserted = reader.get_i32();
+                int64_t timestamp = reader.get_i64();
+                std::cout << "Number " << inserted << " inserted successfully." << std::endl;
+                std::cout << "Timestamp: " << format_timestamp(timestamp) << std::endl;
+            } else {
+                std::cout << error_string(reply.status) << std::endl;
+            }
+        }
+    }
+    
+    void delete_number() {
+        int number = get_positive_integer("Enter number to delete: ");
         
-        IPCMessage msg;
-        msg.type = MessageType::INSERT;
-        msg.number = number;
+        Reply reply;
+        if (transact(make_request(MessageType::DELETE, number), reply)) {
+            if (reply.ok()) {
+                std::cout << "Number " << reply.reader().get_i32() << " deleted successfully." << std::endl;
+            } else {
+                std::cout << error_string(reply.status) << std::endl;
+            }
+        }
+    }
+    
+    void print_all_numbers() {
+        uint64_t printed = 0;
+        Reply reply;
+        if (transact(listing(make_request(MessageType::PRINT_ALL), printed), reply)) {
+            if (!reply.ok()) {
+                std::cout << error_string(reply.status) << std::endl;
+            } else if (printed == 0) {
+                std::cout << "No numbers stored." << std::endl;
+            }
+        }
+    }
+    
+    // Pages through [lo, hi] with RANGE requests, resuming from the cursor
+    // returned by the previous page
+    void print_range() {
+        int32_t lo = get_positive_integer("Enter lower bound: ");
+        int32_t hi = get_positive_integer("Enter upper bound: ");
+        uint32_t page_size = get_positive_integer("Enter page size: ");
         
-        if (write(sockfd, &msg, sizeof(msg)) < 0) {
-            std::cerr << "Error: Failed to send message to daemon" << std::endl;
-            close(sockfd);
+        Request request;
+        FrameBuilder(request.frame, 0, MessageType::COUNT_RANGE).put_i32(lo).put_i32(hi).finish();
+        Reply reply;
+        if (!transact(std::move(request), reply)) {
+            return;
+        }
+        if (!reply.ok()) {
+            std::cout << error_string(reply.status) << std::endl;
             return;
         }
+        std::cout << reply.reader().get_u64() << " numbers stored in range." << std::endl;
         
-        IPCMessage response;
-        if (read(sockfd, &response, sizeof(response)) > 0) {
-            if (response.type == MessageType::RESPONSE_SUCCESS) {
-                std::cout << "Number " << response.number << " inserted successfully." << std::endl;
-                std::cout << "Timestamp: " << format_timestamp(response.timestamp) << std::endl;
-            } else {
-                std::cout << response.error_msg << std::endl;
+        uint64_t printed = 0;
+        while (true) {
+            Request page;
+            FrameBuilder(page.frame, 0, MessageType::RANGE)
+                .put_i32(lo)
+                .put_i32(hi)
+                .put_u32(page_size)
+                .finish();
+            if (!transact(listing(std::move(page), printed), reply)) {
+                break;
+            }
+            if (!reply.ok()) {
+                std::cout << error_string(reply.status) << std::endl;
+                break;
+            }
+            
+            PayloadReader reader = reply.reader();
+            reader.get_u64();
+            int32_t cursor = reader.get_i32();
+            if (!reader.good() || cursor == -1) {
+                break;
+            }
+            
+            std::cout << "More? (y/n): ";
+            std::string answer;
+            if (!std::getline(std::cin, answer) || answer.empty() ||
+                (answer[0] != 'y' && answer[0] != 'Y')) {
+                break;
             }
+            lo = cursor;
         }
+    }
+    
+    // Pages through the numbers inserted in the last N seconds, oldest first,
+    // with TIME_RANGE requests resuming from the previous page's cursor
+    void print_recent() {
+        int32_t seconds = get_positive_integer("Enter number of seconds: ");
+        uint32_t page_size = get_positive_integer("Enter page size: ");
+        
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        int64_t from = std::chrono::duration_cast<std::chrono::microseconds>(now).count() -
+                       static_cast<int64_t>(seconds) * MICROS_PER_SECOND;
+        Request request;
+        FrameBuilder(request.frame, 0, MessageType::COUNT_SINCE).put_i64(from).finish();
+        Reply reply;
+        if (!transact(std::move(request), reply)) {
+            return;
+        }
+        if (!reply.ok()) {
+            std::cout << error_string(reply.status) << std::endl;
+            return;
+        }
+        std::cout << reply.reader().get_u64() << " numbers inserted in the last "
+                  << seconds << " seconds." << std::endl;
         
-        close(sockfd);
+        int32_t from_number = 0;
+        uint64_t printed = 0;
+        while (true) {
+            Request page;
+            FrameBuilder(page.frame, 0, MessageType::TIME_RANGE)
+                .put_i64(from)
+                .put_i64(std::numeric_limits<int64_t>::max())
+                .put_u32(page_size)
+                .put_i32(from_number)
+                .finish();
+            if (!transact(listing(std::move(page), printed), reply)) {
+                break;
+            }
+            if (!reply.ok()) {
+                std::cout << error_string(reply.status) << std::endl;
+                break;
+            }
+            
+            PayloadReader reader = reply.reader();
+            reader.get_u64();
+            int64_t next_timestamp = reader.get_i64();
+            int32_t next_number = reader.get_i32();
+            if (!reader.good() || next_number == -1) {
+                break;
+            }
+            
+            std::cout << "More? (y/n): ";
+            std::string answer;
+            if (!std::getline(std::cin, answer) || answer.empty() ||
+                (answer[0] != 'y' && answer[0] != 'Y')) {
+                break;
+            }
+            from = next_timestamp;
+            from_number = next_number;
+        }
     }
     
-    void delete_number() {
-        int number = get_positive_integer("Enter number to delete: ");
+    // Prints the entry named by a MIN_NUMBER, MAX_NUMBER or SELECT reply
+    // after label. Returns false if the connection failed.
+    bool print_order_entry(std::future<Reply> pending, const std::string& label) {
+        Reply reply = pending.get();
+        if (reply.lost) {
+            std::cerr << "Error: Connection to daemon lost" << std::endl;
+            return false;
+        }
+        if (!reply.ok()) {
+            std::cout << error_string(reply.status) << std::endl;
+            return true;
+        }
+        PayloadReader reader = reply.reader();
+        int32_t number = reader.get_i32();
+        int64_t timestamp = reader.get_i64();
+        std::cout << label;
+        if (timestamp == -1) {
+            std::cout << "none" << std::endl;
+        } else {
+            std::cout << number << " (inserted " << format_timestamp(timestamp) << ")" << std::endl;
+        }
+        return true;
+    }
+    
+    // The three requests are in flight together
+    void show_order_statistics() {
+        auto count = client.submit(make_request(MessageType::COUNT));
+        auto smallest = client.submit(make_request(MessageType::MIN_NUMBER));
+        auto largest = client.submit(make_request(MessageType::MAX_NUMBER));
         
-        int sockfd = connect_to_daemon();
-        if (sockfd < 0) return;
+        Reply reply = count.get();
+        if (reply.lost) {
+            std::cerr << "Error: Connection to daemon lost" << std::endl;
+        } else if (!reply.ok()) {
+            std::cout << error_string(reply.status) << std::endl;
+        } else {
+            std::cout << "Stored numbers: " << reply.reader().get_u64() << std::endl;
+            if (print_order_entry(std::move(smallest), "Smallest: ")) {
+                print_order_entry(std::move(largest), "Largest: ");
+            }
+        }
+    }
+    
+    void select_number() {
+        int k = get_positive_integer("Enter k: ");
         
-        IPCMessage msg;
-        msg.type = MessageType::DELETE;
-        msg.number = number;
+        Request request;
+        FrameBuilder(request.frame, 0, MessageType::SELECT).put_u64(k - 1).finish();
+        print_order_entry(client.submit(std::move(request)),
+                          "Number " + std::to_string(k) + " in ascending order: ");
+    }
+    
+    // A file format named by the user; text unless the answer starts with b
+    uint8_t get_file_format() {
+        std::cout << "Format (text/binary) [text]: ";
+        std::string answer;
+        std::getline(std::cin, answer);
+        return !answer.empty() && (answer[0] == 'b' || answer[0] == 'B') ? NUMBER_FILE_BINARY
+                                                                         : NUMBER_FILE_TEXT;
+    }
+    
+    // Has the daemon read or write path, which is relative to its --files directory
+    static Request file_request(MessageType type, const std::string& path, uint8_t format) {
+        Request request;
+        FrameBuilder(request.frame, 0, type).put_u8(format).put_bytes(path.data(), path.size()).finish();
+        return request;
+    }
+    
+    void import_numbers() {
+        std::cout << "File to import (on the daemon's host): ";
+        std::string path;
+        std::getline(std::cin, path);
+        uint8_t format = get_file_format();
         
-        if (write(sockfd, &msg, sizeof(msg)) < 0) {
-            std::cerr << "Error: Failed to send message to daemon" << std::endl;
-            close(sockfd);
-            return;
+        Reply reply;
+        if (transact(file_request(MessageType::IMPORT, path, format), reply)) {
+            if (reply.ok()) {
+                PayloadReader reader = reply.reader();
+                uint64_t read = reader.get_u64();
+                uint64_t inserted = reader.get_u64();
+                uint64_t invalid = reader.get_u64();
+                std::cout << "Read " << read << " numbers: " << inserted << " inserted, "
+                          << read - inserted - invalid << " already stored, " << invalid
+                          << " invalid." << std::endl;
+            } else {
+                std::cout << error_string(reply.status) << std::endl;
+            }
         }
+    }
+    
+    void export_numbers() {
+        std::cout << "File to export to (on the daemon's host): ";
+        std::string path;
+        std::getline(std::cin, path);
+        uint8_t format = get_file_format();
         
-        IPCMessage response;
-        if (read(sockfd, &response, sizeof(response)) > 0) {
-            if (response.type == MessageType::RESPONSE_SUCCESS) {
-                std::cout << "Number " << response.number << " deleted successfully." << std::endl;
+        Reply reply;
+        if (transact(file_request(MessageType::EXPORT, path, format), reply)) {
+            if (reply.ok()) {
+                PayloadReader reader = reply.reader();
+                uint64_t count = reader.get_u64();
+                std::cout << "Exported " << count << " numbers (" << reader.get_u64() << " bytes)."
+                          << std::endl;
+            } else {
+                std::cout << error_string(reply.status) << std::endl;
+            }
+        }
+    }
+    
+    void delete_all_numbers() {
+        Reply reply;
+        if (transact(make_request(MessageType::DELETE_ALL), reply)) {
+            if (reply.ok()) {
+                std::cout << "All numbers deleted successfully." << std::endl;
             } else {
-                std::cout << response.error_msg << std::endl;
+                std::cout << error_string(reply.status) << std::endl;
             }
         }
+    }
+    
+    void find_number() {
+        int number = get_positive_integer("Enter number to find: ");
         
-        close(sockfd);
+        Reply reply;
+        if (transact(make_request(MessageType::FIND, number), reply)) {
+            if (reply.ok()) {
+                PayloadReader reader = reply.reader();
+                int32_t found = reader.get_i32();
+                int64_t timestamp = reader.get_i64();
+                if (timestamp != -1) {
+                    std::cout << "Number " << found << " found." << std::endl;
+                    std::cout << "Inserted at: " << format_timestamp(timestamp) << std::endl;
+                } else {
+                    std::cout << "Number " << found << " not found." << std::endl;
+                }
+            } else {
+                std::cout << error_string(reply.status) << std::endl;
+            }
+        }
     }
     
-    void print_all_numbers() {
-        int sockfd = connect_to_daemon();
-        if (sockfd < 0) return;
+    // Sends every MAX_BATCH_SIZE slice of numbers at once; the replies are
+    // taken in order
+    std::vector<std::future<Reply>> submit_batches(MessageType type, const std::vector<int32_t>& numbers) {
+        std::vector<std::future<Reply>> replies;
+        for (size_t offset = 0; offset < numbers.size(); offset += MAX_BATCH_SIZE) {
+            uint32_t count = std::min<size_t>(MAX_BATCH_SIZE, numbers.size() - offset);
+            replies.push_back(client.submit(batch_request(type, numbers, offset, count)));
+        }
+        return replies;
+    }
+    
+    // Waits for the reply to one batch; false, after saying why, if it failed
+    bool batch_reply(std::future<Reply>& pending, Reply& reply) {
+        reply = pending.get();
+        if (reply.lost) {
+            std::cerr << "Error: Connection to daemon lost" << std::endl;
+            return false;
+        }
+        if (!reply.ok()) {
+            std::cout << error_string(reply.status) << std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    void insert_numbers() {
+        auto numbers = get_number_list("Enter numbers to insert (space separated): ");
+        if (numbers.empty()) return;
         
-        IPCMessage msg;
-        msg.type = MessageType::PRINT_ALL;
+        auto replies = submit_batches(MessageType::INSERT_BATCH, numbers);
+        std::vector<int32_t> duplicates;
+        size_t inserted = 0;
+        int64_t timestamp = 0;
         
-        if (write(sockfd, &msg, sizeof(msg)) < 0) {
-            std::cerr << "Error: Failed to send message to daemon" << std::endl;
-            close(sockfd);
-            return;
+        for (size_t b = 0; b < replies.size(); ++b) {
+            size_t offset = b * MAX_BATCH_SIZE;
+            uint32_t count = std::min<size_t>(MAX_BATCH_SIZE, numbers.size() - offset);
+            Reply reply;
+            if (!batch_reply(replies[b], reply)) {
+                break;
+            }
+            
+            PayloadReader reader = reply.reader();
+            reader.get_u32();
+            timestamp = reader.get_i64();
+            auto bitmap = reinterpret_cast<const uint8_t*>(reader.get_bytes(bitmap_size(count)));
+            if (!bitmap) break;
+            for (uint32_t i = 0; i < count; ++i) {
+                if (bitmap_test(bitmap, i)) {
+                    ++inserted;
+                } else {
+                    duplicates.push_back(numbers[offset + i]);
+                }
+            }
         }
         
-        std::vector<NumberEntry> entries;
-        IPCMessage response;
+        std::cout << inserted << " of " << numbers.size() << " numbers inserted successfully." << std::endl;
+        if (inserted > 0) {
+            std::cout << "Timestamp: " << format_timestamp(timestamp) << std::endl;
+        }
+        if (!duplicates.empty()) {
+            std::cout << "Duplicates not inserted:";
+            for (int32_t number : duplicates) {
+                std::cout << " " << number;
+            }
+            std::cout << std::endl;
+        }
+    }
+    
+    void delete_numbers() {
+        auto numbers = get_number_list("Enter numbers to delete (space separated): ");
+        if (numbers.empty()) return;
         
-        // Read initial response
-        if (read(sockfd, &response, sizeof(response)) > 0) {
-            if (response.type == MessageType::RESPONSE_SUCCESS) {
-                // Read data messages until end marker
-                while (read(sockfd, &response, sizeof(response)) > 0) {
-                    if (response.type == MessageType::RESPONSE_DATA) {
-                        entries.emplace_back(response.number, response.timestamp);
-                    } else if (response.type == MessageType::RESPONSE_SUCCESS && response.number == -1) {
-                        break; // End marker
-                    }
+        auto replies = submit_batches(MessageType::DELETE_BATCH, numbers);
+        std::vector<int32_t> missing;
+        size_t deleted = 0;
+        
+        for (size_t b = 0; b < replies.size(); ++b) {
+            size_t offset = b * MAX_BATCH_SIZE;
+            uint32_t count = std::min<size_t>(MAX_BATCH_SIZE, numbers.size() - offset);
+            Reply reply;
+            if (!batch_reply(replies[b], reply)) {
+                break;
+            }
+            
+            PayloadReader reader = reply.reader();
+            reader.get_u32();
+            auto bitmap = reinterpret_cast<const uint8_t*>(reader.get_bytes(bitmap_size(count)));
+            if (!bitmap) break;
+            for (uint32_t i = 0; i < count; ++i) {
+                if (bitmap_test(bitmap, i)) {
+                    ++deleted;
+                } else {
+                    missing.push_back(numbers[offset + i]);
                 }
-            } else {
-                std::cout << response.error_msg << std::endl;
-                close(sockfd);
-                return;
             }
         }
         
-        close(sockfd);
+        std::cout << deleted << " of " << numbers.size() << " numbers deleted successfully." << std::endl;
+        if (!missing.empty()) {
+            std::cout << "Not found:";
+            for (int32_t number : missing) {
+                std::cout << " " << number;
+            }
+            std::cout << std::endl;
+        }
+    }
+    
+    void find_numbers() {
+        auto numbers = get_number_list("Enter numbers to find (space separated): ");
+        if (numbers.empty()) return;
+        
+        auto replies = submit_batches(MessageType::FIND_BATCH, numbers);
+        std::vector<NumberEntry> results;
         
-        if (entries.empty()) {
-            std::cout << "No numbers stored." << std::endl;
-        } else {
-            std::cout << "\nStored numbers (sorted):" << std::endl;
-            std::cout << std::setw(10) << "Number" << " | " << "Timestamp" << std::endl;
-            std::cout << std::string(35, '-') << std::endl;
+        for (size_t b = 0; b < replies.size(); ++b) {
+            size_t offset = b * MAX_BATCH_SIZE;
+            uint32_t count = std::min<size_t>(MAX_BATCH_SIZE, numbers.size() - offset);
+            Reply reply;
+            if (!batch_reply(replies[b], reply)) {
+                break;
+            }
             
-            for (const auto& entry : entries) {
-                std::cout << std::setw(10) << entry.number << " | " 
-                         << format_timestamp(entry.timestamp) << std::endl;
+            PayloadReader reader = reply.reader();
+            reader.get_u32();
+            for (uint32_t i = 0; i < count && reader.good(); ++i) {
+                results.emplace_back(numbers[offset + i], reader.get_i64());
             }
         }
+        
+        if (results.empty()) return;
+        
+        std::cout << std::setw(10) << "Number" << " | " << "Inserted at" << std::endl;
+        std::cout << std::string(35, '-') << std::endl;
+        for (const auto& entry : results) {
+            std::cout << std::setw(10) << entry.number << " | "
+                      << (entry.timestamp != -1 ? format_timestamp(entry.timestamp) : "not found")
+                      << std::endl;
+        }
     }
     
-    void delete_all_numbers() {
-        int sockfd = connect_to_daemon();
-        if (sockfd < 0) return;
+    void show_stats() {
+        Reply reply;
+        DaemonStats stats;
+        if (transact(make_request(MessageType::STATS), reply)) {
+            PayloadReader reader = reply.reader();
+            if (!reply.ok()) {
+                std::cout << error_string(reply.status) << std::endl;
+            } else if (!stats.parse(reader)) {
+                std::cout << error_string(ErrorCode::MALFORMED) << std::endl;
+            } else {
+                std::cout << "\nUptime: " << stats.uptime_sec << " s, " << stats.reactors
+                          << " reactor threads" << std::endl;
+                std::cout << "Stored numbers: " << stats.store_size << std::endl;
+                std::cout << "Connections: " << stats.active_connections << " open, "
+                          << stats.accepted_connections << " accepted" << std::endl;
+                if (stats.has_io) {
+                    std::cout << "I/O: " << stats.io_backend_name() << ", " << stats.io_syscalls
+                              << " socket system calls" << std::endl;
+                }
+                if (stats.has_memory) {
+                    std::cout << "Memory: " << std::fixed << std::setprecision(1)
+                              << stats.memory_used / (1024.0 * 1024.0) << " MiB held by the store, ";
+                    if (stats.memory_limit > 0) {
+                        std::cout << "limit " << stats.memory_limit / (1024.0 * 1024.0) << " MiB" << std::endl;
+                    } else {
+                        std::cout << "no limit" << std::endl;
+                    }
+                }
+                if (stats.has_replication && stats.replica_state != STATS_PRIMARY) {
+                    std::cout << "Replication: " << stats.replica_state_name() << ", applied change "
+                              << stats.applied_seq << " of " << std::max(stats.primary_seq, stats.applied_seq)
+                              << ", " << std::fixed << std::setprecision(1) << stats.lag_us / 1e3
+                              << " ms behind" << std::endl;
+                }
+                std::cout << "\nService time in microseconds:" << std::endl;
+                std::cout << std::setw(12) << "Request" << std::setw(12) << "Count"
+                          << std::setw(10) << "Errors" << std::setw(10) << "Mean"
+                          << std::setw(10) << "p50" << std::setw(10) << "p99"
+                          << std::setw(10) << "p99.9" << std::setw(10) << "Max" << std::endl;
+                std::cout << std::string(84, '-') << std::endl;
+                std::cout << std::fixed << std::setprecision(1);
+                for (const auto& row : stats.rows) {
+                    std::cout << std::setw(12) << DaemonStats::type_name(row.type)
+                              << std::setw(12) << row.count << std::setw(10) << row.errors
+                              << std::setw(10) << row.mean_ns / 1e3 << std::setw(10) << row.p50_ns / 1e3
+                              << std::setw(10) << row.p99_ns / 1e3 << std::setw(10) << row.p999_ns / 1e3
+                              << std::setw(10) << row.max_ns / 1e3 << std::endl;
+                }
+                std::cout.unsetf(std::ios::floatfield);
+            }
+        }
+    }
+    
+    // Parses a batch line; returns false for blank lines and # comments
+    static bool parse_command(const std::string& line, BatchCommand& command) {
+        std::istringstream input(line);
+        std::string verb;
+        if (!(input >> verb) || verb[0] == '#') {
+            return false;
+        }
         
-        IPCMessage msg;
-        msg.type = MessageType::DELETE_ALL;
+        // The first wide arguments are 64-bit (microsecond times and select's
+        // rank); every other argument must fit in 32 bits
+        struct Syntax { const char* verb; MessageType type; size_t min_args, max_args, wide; };
+        static const Syntax syntax[] = {
+            {"insert", MessageType::INSERT, 1, 2, 0},  // number [ttl]
+            {"delete", MessageType::DELETE, 1, 1, 0},
+            {"find", MessageType::FIND, 1, 1, 0},
+            {"clear", MessageType::DELETE_ALL, 0, 0, 0},
+            {"print", MessageType::PRINT_ALL, 0, 0, 0},
+            {"range", MessageType::RANGE, 2, 3, 0},
+            {"stats", MessageType::STATS, 0, 0, 0},
+            {"inserted", MessageType::TIME_RANGE, 2, 3, 2},  // from to [limit]
+            {"since", MessageType::COUNT_SINCE, 1, 1, 1},
+            {"count", MessageType::COUNT, 0, 0, 0},
+            {"min", MessageType::MIN_NUMBER, 0, 0, 0},
+            {"max", MessageType::MAX_NUMBER, 0, 0, 0},
+            {"rank", MessageType::RANK, 1, 1, 0},
+            {"select", MessageType::SELECT, 1, 1, 1},
+            {"countrange", MessageType::COUNT_RANGE, 2, 2, 0},
+            {"import", MessageType::IMPORT, 0, 0, 0},  // path [text|binary]
+            {"export", MessageType::EXPORT, 0, 0, 0},
+        };
         
-        if (write(sockfd, &msg, sizeof(msg)) < 0) {
-            std::cerr << "Error: Failed to send message to daemon" << std::endl;
-            close(sockfd);
-            return;
+        command = BatchCommand();
+        command.text = line;
+        command.verb = verb;
+        const Syntax* match = nullptr;
+        for (const auto& entry : syntax) {
+            if (verb == entry.verb) {
+                match = &entry;
+            }
+        }
+        if (!match) {
+            return true;
         }
         
-        IPCMessage response;
-        if (read(sockfd, &response, sizeof(response)) > 0) {
-            if (response.type == MessageType::RESPONSE_SUCCESS) {
-                std::cout << "All numbers deleted successfully." << std::endl;
-            } else {
-                std::cout << response.error_msg << std::endl;
+        std::string token;
+        if (match->type == MessageType::IMPORT || match->type == MessageType::EXPORT) {
+            command.type = match->type;
+            if (!(input >> command.path)) {
+                return true;
+            }
+            if (input >> token) {
+                if (token != "text" && token != "binary") {
+                    return true;
+                }
+                command.format = token == "binary" ? NUMBER_FILE_BINARY : NUMBER_FILE_TEXT;
+            }
+            command.valid = !(input >> token);
+            return true;
+        }
+        while (input >> token) {
+            char* end = nullptr;
+            errno = 0;
+            long long value = std::strtoll(token.c_str(), &end, 10);
+            bool wide = command.argc < match->wide;
+            if (*end != '\0' || errno != 0 || command.argc == match->max_args ||
+                (!wide && (value < std::numeric_limits<int32_t>::min() ||
+                           value > std::numeric_limits<int32_t>::max()))) {
+                return true;
+            }
+            command.args[command.argc++] = value;
+        }
+        command.type = match->type;
+        command.valid = command.argc >= match->min_args &&
+                        (command.type != MessageType::INSERT || command.argc < 2 || command.args[1] >= 0) &&
+                        (command.type != MessageType::SELECT || command.args[0] >= 0);
+        return true;
+    }
+    
+    static Request encode_command(const BatchCommand& command) {
+        if (command.type == MessageType::IMPORT || command.type == MessageType::EXPORT) {
+            return file_request(command.type, command.path, command.format);
+        }
+        Request request;
+        FrameBuilder frame(request.frame, 0, command.type);
+        if (command.type == MessageType::RANGE) {
+            frame.put_i32(command.args[0]).put_i32(command.args[1]).put_u32(command.args[2]);
+        } else if (command.type == MessageType::TIME_RANGE) {
+            frame.put_i64(command.args[0]).put_i64(command.args[1]).put_u32(command.args[2]).put_i32(0);
+        } else if (command.type == MessageType::COUNT_SINCE) {
+            frame.put_i64(command.args[0]);
+        } else if (command.type == MessageType::SELECT) {
+            frame.put_u64(command.args[0]);
+        } else if (command.type == MessageType::INSERT && command.argc == 2) {
+            frame.put_i32(command.args[0]).put_u32(command.args[1]);
+        } else {
+            for (size_t i = 0; i < command.argc; ++i) {
+                frame.put_i32(command.args[i]);
             }
         }
+        frame.finish();
+        return request;
+    }
+    
+    // Prints the reply to command as tab-separated lines:
+    //   <verb> <args...> <status> [<values...>]
+    // where status is "ok" or an error name; min, max and select report the
+    // number and its timestamp, import the numbers read, inserted and left out
+    // and their timestamp, export the numbers and bytes written. print, range
+    // and inserted first list their entries as "entry <number> <timestamp>"
+    // lines; stats is followed by "stat <request> <count> <errors> <mean>
+    // <p50> <p99> <p99.9> <max>" lines with times in nanoseconds.
+    static void print_result(const BatchCommand& command, const Reply& reply, std::ostream& out) {
+        for (const auto& entry : reply.entries) {
+            out << "entry\t" << entry.number << '\t' << entry.timestamp << '\n';
+        }
+        
+        out << command.verb;
+        for (size_t i = 0; i < command.argc; ++i) {
+            out << '\t' << command.args[i];
+        }
+        if (!command.path.empty()) {
+            out << '\t' << command.path << '\t' << (command.format == NUMBER_FILE_BINARY ? "binary" : "text");
+        }
         
-        close(sockfd);
+        PayloadReader reader = reply.reader();
+        if (!reply.ok()) {
+            out << '\t' << error_name(reply.status) << '\n';
+            return;
+        }
+        switch (command.type) {
+            case MessageType::INSERT:
+                reader.get_i32();
+                out << "\tok\t" << reader.get_i64();
+                break;
+            case MessageType::FIND: {
+                reader.get_i32();
+                int64_t timestamp = reader.get_i64();
+                if (timestamp == -1) {
+                    out << '\t' << error_name(ErrorCode::NOT_FOUND);
+                } else {
+                    out << "\tok\t" << timestamp;
+                }
+                break;
+            }
+            case MessageType::MIN_NUMBER:
+            case MessageType::MAX_NUMBER:
+            case MessageType::SELECT: {
+                int32_t number = reader.get_i32();
+                int64_t timestamp = reader.get_i64();
+                if (timestamp == -1) {
+                    out << '\t' << error_name(ErrorCode::NOT_FOUND);
+                } else {
+                    out << "\tok\t" << number << '\t' << timestamp;
+                }
+                break;
+            }
+            case MessageType::PRINT_ALL:
+                out << "\tok\t" << reader.get_u64();
+                break;
+            case MessageType::RANGE: {
+                uint64_t total = reader.get_u64();
+                out << "\tok\t" << total << '\t' << reader.get_i32();
+                break;
+            }
+            case MessageType::TIME_RANGE: {
+                uint64_t total = reader.get_u64();
+                int64_t next_timestamp = reader.get_i64();
+                out << "\tok\t" << total << '\t' << next_timestamp << '\t' << reader.get_i32();
+                break;
+            }
+            case MessageType::COUNT_SINCE:
+            case MessageType::COUNT:
+            case MessageType::RANK:
+            case MessageType::COUNT_RANGE:
+                out << "\tok\t" << reader.get_u64();
+                break;
+            case MessageType::IMPORT: {
+                uint64_t read = reader.get_u64();
+                uint64_t inserted = reader.get_u64();
+                uint64_t invalid = reader.get_u64();
+                out << "\tok\t" << read << '\t' << inserted << '\t' << invalid << '\t' << reader.get_i64();
+                break;
+            }
+            case MessageType::EXPORT: {
+                uint64_t count = reader.get_u64();
+                out << "\tok\t" << count << '\t' << reader.get_u64();
+                break;
+            }
+            case MessageType::STATS: {
+                DaemonStats stats;
+                if (!stats.parse(reader)) {
+                    out << '\t' << error_name(ErrorCode::MALFORMED) << '\n';
+                    return;
+                }
+                out << "\tok\t" << stats.uptime_sec << '\t' << stats.store_size << '\t'
+                    << stats.active_connections << '\t' << stats.accepted_connections << '\n';
+                if (stats.has_replication && stats.replica_state != STATS_PRIMARY) {
+                    out << "replication\t" << stats.replica_state_name() << '\t' << stats.applied_seq
+                        << '\t' << stats.primary_seq << '\t' << stats.lag_us << '\n';
+                }
+                for (const auto& row : stats.rows) {
+                    out << "stat\t" << DaemonStats::type_name(row.type) << '\t' << row.count
+                        << '\t' << row.errors << '\t' << row.mean_ns << '\t' << row.p50_ns
+                        << '\t' << row.p99_ns << '\t' << row.p999_ns << '\t' << row.max_ns << '\n';
+                }
+                return;
+            }
+            default:
+                out << "\tok";
+                break;
+        }
+        out << '\n';
     }
     
-    void find_number() {
-        int number = get_positive_integer("Enter number to find: ");
+    // Runs commands from next_line, keeping up to window requests in
+    // flight, and prints one result line per command in input order.
+    // Returns the process exit status.
+    template <typename NextLine>
+    int run_batch(NextLine next_line, size_t window) {
+        std::ios::sync_with_stdio(false);
+        window = std::max<size_t>(window, 1);
         
-        int sockfd = connect_to_daemon();
-        if (sockfd < 0) return;
+        struct Slot {
+            BatchCommand command;
+            Reply reply;
+            bool done = false;  // reply is set; guarded by Replies::mutex
+        };
         
-        IPCMessage msg;
-        msg.type = MessageType::FIND;
-        msg.number = number;
+        // Replies are handed over in bulk: waking this thread for each one
+        // would cost a context switch per command. It sleeps until half of
+        // what is in flight has been replied to.
+        struct Replies {
+            std::mutex mutex;
+            std::condition_variable arrived;
+            size_t received = 0;  // In total
+            size_t wanted = 0;    // Wake once received reaches it
+        } replies;
         
-        if (write(sockfd, &msg, sizeof(msg)) < 0) {
-            std::cerr << "Error: Failed to send message to daemon" << std::endl;
-            close(sockfd);
-            return;
+        auto start = std::chrono::steady_clock::now();
+        std::deque<Slot> pending;  // Not yet printed; references stay valid
+        size_t in_flight = 0;      // Submitted and not yet printed
+        size_t printed = 0;        // Replies printed
+        size_t completed = 0;
+        bool input_done = false;
+        bool ok = true;
+        std::string line;
+        
+        while (true) {
+            // Refill in bursts, so that requests go out many per write
+            if (in_flight <= window / 2) {
+                while (!input_done && in_flight < window) {
+                    BatchCommand command;
+                    if (!next_line(line)) {
+                        input_done = true;
+                    } else if (parse_command(line, command)) {
+                        pending.push_back(Slot{std::move(command), Reply(), false});
+                        Slot& slot = pending.back();
+                        if (slot.command.valid) {
+                            client.defer(encode_command(slot.command), [state = &replies, target = &slot](Reply& reply) {
+                                std::lock_guard lock(state->mutex);
+                                target->reply = std::move(reply);
+                                target->done = true;
+                                if (++state->received == state->wanted) {
+                                    state->arrived.notify_one();
+                                }
+                            });
+                            ++in_flight;
+                        }
+                    }
+                }
+                client.flush();
+            }
+            if (pending.empty()) {
+                break;
+            }
+            
+            Slot& slot = pending.front();
+            if (!slot.command.valid) {
+                std::cout << "invalid\t" << slot.command.text << '\n';
+            } else {
+                {
+                    std::unique_lock lock(replies.mutex);
+                    while (!slot.done) {
+                        size_t outstanding = in_flight - (replies.received - printed);
+                        replies.wanted = replies.received + std::max<size_t>(outstanding / 2, 1);
+                        replies.arrived.wait(lock, [&] { return replies.received >= replies.wanted; });
+                    }
+                }
+                if (slot.reply.lost) {
+                    ok = false;
+                    break;
+                }
+                print_result(slot.command, slot.reply, std::cout);
+                --in_flight;
+                ++printed;
+            }
+            pending.pop_front();
+            ++completed;
         }
         
-        IPCMessage response;
-        if (read(sockfd, &response, sizeof(response)) > 0) {
-            if (response.type == MessageType::RESPONSE_SUCCESS) {
-                if (response.timestamp != -1) {
-                    std::cout << "Number " << response.number << " found." << std::endl;
-                    std::cout << "Inserted at: " << format_timestamp(response.timestamp) << std::endl;
+        std::cout.flush();
+        if (!ok) {
+            std::cerr << "Error: Connection to daemon lost" << std::endl;
+            return 1;
+        }
+        
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+        std::cerr << completed << " commands in " << std::fixed << std::setprecision(3)
+                  << elapsed.count() << " s (" << std::setprecision(0)
+                  << completed / std::max(elapsed.count(), 1e-9) << " ops/s)" << std::endl;
+        return 0;
+    }
+    
+    // Mirrors the daemon's set on stdout until the connection ends: the
+    // current entries as "entry <number> <timestamp>" lines and a
+    // "synced <total> <seq>" line, then one line per changed number, e.g.
+    // "insert <seq> <number> <timestamp>", "delete <seq> <number>" or
+    // "clear <seq>". Everything is printed on the client's I/O thread, in
+    // the order it arrives. Returns the process exit status.
+    int run_watch() {
+        std::ios::sync_with_stdio(false);
+        std::promise<int> ended;
+        
+        Request request = make_request(MessageType::WATCH);
+        request.on_entries = [](const std::vector<NumberEntry>& entries) {
+            for (const auto& entry : entries) {
+                std::cout << "entry\t" << entry.number << '\t' << entry.timestamp << '\n';
+            }
+        };
+        request.on_event = [](PayloadReader& reader) {
+            uint64_t seq = reader.get_u64();
+            MessageType op = static_cast<MessageType>(reader.get_u8());
+            int64_t timestamp = reader.get_i64();
+            uint32_t count = reader.get_u32();
+            if (op == MessageType::DELETE_ALL) {
+                std::cout << "clear\t" << seq << '\n';
+            }
+            for (uint32_t i = 0; i < count && reader.good(); ++i) {
+                int32_t number = reader.get_i32();
+                if (op == MessageType::INSERT) {
+                    std::cout << "insert\t" << seq << '\t' << number << '\t' << timestamp << '\n';
                 } else {
-                    std::cout << "Number " << response.number << " not found." << std::endl;
+                    std::cout << "delete\t" << seq << '\t' << number << '\n';
                 }
+            }
+            std::cout.flush();
+        };
+        request.on_closed = [&ended] {
+            ended.set_value(0);
+        };
+        client.submit(std::move(request), [&ended](Reply& reply) {
+            if (reply.lost) {
+                ended.set_value(0);
+            } else if (!reply.ok()) {
+                std::cerr << error_string(reply.status) << std::endl;
+                ended.set_value(1);
             } else {
-                std::cout << response.error_msg << std::endl;
+                PayloadReader reader = reply.reader();
+                uint64_t total = reader.get_u64();
+                std::cout << "synced\t" << total << '\t' << reader.get_u64() << std::endl;
             }
-        }
+        });
         
-        close(sockfd);
+        int status = ended.get_future().get();
+        std::cout.flush();
+        if (status == 0) {
+            std::cerr << "Connection to daemon closed" << std::endl;
+        }
+        return status;
     }
     
+    // timestamp is in microseconds
     std::string format_timestamp(int64_t timestamp) {
-        std::time_t time = timestamp;
+        std::time_t time = timestamp / MICROS_PER_SECOND;
         std::tm* tm_info = std::localtime(&time);
         char buffer[80];
-        std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+        size_t len = std::strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S", tm_info);
+        snprintf(buffer + len, sizeof(buffer) - len, ".%06lld",
+                 static_cast<long long>(timestamp % MICROS_PER_SECOND));
         return std::string(buffer) + " (" + std::to_string(timestamp) + ")";
     }
     
@@ -254,7 +1049,7 @@ public:
             if (std::cin.fail()) {
                 std::cin.clear();
                 std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-                std::cout << "Error: Invalid input. Please enter a number between 1-6." << std::endl;
+                std::cout << "Error: Invalid input. Please enter a number between 1-16." << std::endl;
                 continue;
             }
             
@@ -277,18 +1072,141 @@ public:
                     find_number();
                     break;
                 case 6:
+                    insert_numbers();
+                    break;
+                case 7:
+                    delete_numbers();
+                    break;
+                case 8:
+                    find_numbers();
+                    break;
+                case 9:
+                    print_range();
+                    break;
+                case 10:
+                    show_stats();
+                    break;
+                case 11:
+                    print_recent();
+                    break;
+                case 12:
+                    show_order_statistics();
+                    break;
+                case 13:
+                    select_number();
+                    break;
+                case 14:
+                    import_numbers();
+                    break;
+                case 15:
+                    export_numbers();
+                    break;
+                case 16:
                     std::cout << "Goodbye!" << std::endl;
                     return;
                 default:
-                    std::cout << "Error: Invalid choice. Please enter a number between 1-6." << std::endl;
+                    std::cout << "Error: Invalid choice. Please enter a number between 1-16." << std::endl;
                     break;
             }
         }
     }
 };
 
-int main() {
-    NumberCLI cli("/tmp/number_daemon.sock");
+void print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [options]" << std::endl;
+    std::cout << "  -e, --exec CMD    Run CMD in batch mode instead of the menu; may be repeated" << std::endl;
+    std::cout << "  -f, --file FILE   Run the commands in FILE (one per line, - for stdin) in batch mode" << std::endl;
+    std::cout << "  -w, --window N    Batch requests kept in flight (default: 256)" << std::endl;
+    std::cout << "  --watch           Print the stored numbers, then every change as it happens" << std::endl;
+    std::cout << "  --shm             Talk to the daemon through shared-memory rings" << std::endl;
+    std::cout << "  --busy-poll       Same as --shm, spinning instead of sleeping while waiting" << std::endl;
+    std::cout << "  -s, --socket PATH Connect to the daemon listening on PATH (default: "
+              << ClientOptions().socket_path << ")" << std::endl;
+    std::cout << "  -h, --help        Show this help" << std::endl;
+    std::cout << "Batch commands: insert N [TTL], delete N, find N, clear, print, range LO HI [LIMIT], stats," << std::endl;
+    std::cout << "  inserted FROM TO [LIMIT], since T (times in Unix microseconds)," << std::endl;
+    std::cout << "  count, min, max, rank N, select K (0-based), countrange LO HI," << std::endl;
+    std::cout << "  import PATH [text|binary], export PATH [text|binary] (files on the daemon's host)" << std::endl;
+    std::cout << "Each prints one tab-separated line: the command, ok or an error name, and any values." << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    bool shared_memory = false;
+    bool busy_poll = false;
+    bool watch = false;
+    std::vector<std::string> commands;
+    std::string file;
+    size_t window = 256;
+    ClientOptions options;
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-e" || arg == "--exec") && i + 1 < argc) {
+            commands.push_back(argv[++i]);
+        } else if ((arg == "-f" || arg == "--file") && i + 1 < argc) {
+            file = argv[++i];
+        } else if ((arg == "-w" || arg == "--window") && i + 1 < argc) {
+            if (!parse_count(argv[++i], window)) {
+                std::cerr << "Invalid value for " << arg << ": " << argv[i] << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--shm") {
+            shared_memory = true;
+        } else if (arg == "--busy-poll") {
+            shared_memory = true;
+            busy_poll = true;
+        } else if ((arg == "-s" || arg == "--socket") && i + 1 < argc) {
+            options.socket_path = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    options.shared_memory = shared_memory;
+    options.busy_poll = busy_poll;
+    NumberCLI cli(options);
+    if (!cli.connect()) {
+        return 1;
+    }
+    
+    if (watch) {
+        return cli.run_watch();
+    }
+    
+    if (!commands.empty()) {
+        size_t next = 0;
+        return cli.run_batch([&](std::string& line) {
+            if (next == commands.size()) {
+                return false;
+            }
+            line = commands[next++];
+            return true;
+        }, window);
+    }
+    
+    if (!file.empty()) {
+        std::ifstream stream;
+        if (file != "-") {
+            stream.open(file);
+            if (!stream) {
+                std::cerr << "Error: Cannot open " << file << std::endl;
+                return 1;
+            }
+        }
+        std::istream& input = file == "-" ? std::cin : stream;
+        return cli.run_batch([&](std::string& line) {
+            return static_cast<bool>(std::getline(input, line));
+        }, window);
+    }
+    
     cli.run();
     return 0;
 }
\ No newline at end of file
@@ -2,7 +2,9 @@
 #define COMMON_H
 
 #include <string>
+#include <charconv>
 #include <cstdint>
+#include <cstddef>
 
 // Message types for IPC
 enum class MessageType {
@@ -13,10 +15,105 @@ enum class MessageType {
     FIND,
     RESPONSE_SUCCESS,
     RESPONSE_ERROR,
-    RESPONSE_DATA
+    RESPONSE_DATA,
+    INSERT_BATCH,
+    DELETE_BATCH,
+    FIND_BATCH,
+    RANGE,
+    SHM_ATTACH,
+    STATS,
+    TIME_RANGE,
+    COUNT_SINCE,
+    WATCH,
+    WATCH_EVENT,
+    COUNT,
+    MIN_NUMBER,
+    MAX_NUMBER,
+    RANK,
+    SELECT,
+    COUNT_RANGE,
+    IMPORT,
+    EXPORT,
+    HANDOFF,
+    GOAWAY
 };
 
-// IPC message structure
+constexpr size_t MESSAGE_TYPE_COUNT = static_cast<size_t>(MessageType::GOAWAY) + 1;
+
+inline const char* message_type_name(MessageType type) {
+    static const char* const names[MESSAGE_TYPE_COUNT] = {
+        "insert", "delete", "print_all", "delete_all", "find",
+        "response_success", "response_error", "response_data",
+        "insert_batch", "delete_batch", "find_batch", "range", "shm_attach", "stats",
+        "time_range", "count_since", "watch", "watch_event",
+        "count", "min", "max", "rank", "select", "count_range", "import", "export",
+        "handoff", "goaway"
+    };
+    size_t index = static_cast<size_t>(type);
+    return index < MESSAGE_TYPE_COUNT ? names[index] : "unknown";
+}
+
+// Error codes carried by RESPONSE_ERROR frames
+enum class ErrorCode : uint8_t {
+    NONE = 0,
+    INVALID_NUMBER,
+    DUPLICATE,
+    NOT_FOUND,
+    UNKNOWN_TYPE,
+    MALFORMED,
+    UNAVAILABLE,
+    DISABLED,       // A request the daemon was not started to serve, e.g. TIME_RANGE without --time-index
+    MEMORY_LIMIT,   // An insert would take the store past the daemon's memory budget
+    FILE_ERROR,     // IMPORT or EXPORT could not read or write its file
+    READ_ONLY,      // A mutation sent to a follower (--follow)
+    NOT_PERMITTED,  // HANDOFF from a process of another user
+    LOG_FAILED      // A mutation the write-ahead log could not make durable
+};
+
+inline const char* error_string(ErrorCode code) {
+    switch (code) {
+        case ErrorCode::NONE:           return "Success";
+        case ErrorCode::INVALID_NUMBER: return "Error: Only positive integers are allowed";
+        case ErrorCode::DUPLICATE:      return "Error: Duplicate number not allowed";
+        case ErrorCode::NOT_FOUND:      return "Error: Number not found";
+        case ErrorCode::UNKNOWN_TYPE:   return "Error: Unknown message type";
+        case ErrorCode::MALFORMED:      return "Error: Malformed request";
+        case ErrorCode::UNAVAILABLE:    return "Error: Daemon is out of resources";
+        case ErrorCode::DISABLED:       return "Error: Not enabled on this daemon";
+        case ErrorCode::MEMORY_LIMIT:   return "Error: Memory limit reached";
+        case ErrorCode::FILE_ERROR:     return "Error: Cannot access the file";
+        case ErrorCode::READ_ONLY:      return "Error: Daemon is a read-only follower";
+        case ErrorCode::NOT_PERMITTED:  return "Error: Operation not permitted";
+        case ErrorCode::LOG_FAILED:     return "Error: Write-ahead log failed";
+    }
+    return "Error: Unknown error";
+}
+
+// Stable lower-case name of an error code, for machine-readable output
+inline const char* error_name(ErrorCode code) {
+    switch (code) {
+        case ErrorCode::NONE:           return "ok";
+        case ErrorCode::INVALID_NUMBER: return "invalid_number";
+        case ErrorCode::DUPLICATE:      return "duplicate";
+        case ErrorCode::NOT_FOUND:      return "not_found";
+        case ErrorCode::UNKNOWN_TYPE:   return "unknown_type";
+        case ErrorCode::MALFORMED:      return "malformed";
+        case ErrorCode::UNAVAILABLE:    return "unavailable";
+        case ErrorCode::DISABLED:       return "disabled";
+        case ErrorCode::MEMORY_LIMIT:   return "memory_limit";
+        case ErrorCode::FILE_ERROR:     return "file_error";
+        case ErrorCode::READ_ONLY:      return "read_only";
+        case ErrorCode::NOT_PERMITTED:  return "not_permitted";
+        case ErrorCode::LOG_FAILED:     return "log_failed";
+    }
+    return "unknown_error";
+}
+
+// Entry timestamps are Unix microseconds; protocol versions before 3 and
+// files written before the switch carry whole seconds
+constexpr int64_t MICROS_PER_SECOND = 1000000;
+
+// Legacy fixed-size IPC message structure (protocol version 1)
 struct IPCMessage {
     MessageType type;
     int32_t number;  // For INSERT, DELETE, FIND operations
@@ -37,4 +134,18 @@ struct NumberEntry {
     }
 };
 
+// Parses a command-line count: decimal digits only (with a fraction and
+// exponent if T is floating-point), within the range of T. False for
+// anything else, so that callers can report it and print usage.
+template <typename T>
+inline bool parse_count(const std::string& text, T& value) {
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+    if (begin == end || *begin < '0' || *begin > '9') {
+        return false;
+    }
+    auto [next, error] = std::from_chars(begin, end, value);
+    return error == std::errc() && next == end;
+}
+
 #endif
\ No newline at end of file
@@ -1,291 +1,2975 @@
 #include <iostream>
-#include <set>
-#include <map>
 #include <vector>
 #include <string>
 #include <thread>
 #include <mutex>
-#include <shared_mutex>
-#include <chrono>
 #include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <memory>
+#include <optional>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "protocol.h"
+#include "number_store.h"
+#include "map_store.h"
+#include "bitmap_store.h"
+#include "mvcc_store.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "number_file.h"
+#include "expiry.h"
+#include "watch.h"
+#include "shm_ring.h"
+#include "stats.h"
+#include "uring.h"
+#include "executor.h"
+#include "replica.h"
 
-class NumberStore {
-private:
-    std::map<int32_t, int64_t> numbers;  // number -> timestamp mapping
-    mutable std::shared_mutex mutex;
+// Wire protocol spoken on a connection, decided by its first bytes
+enum class ConnMode {
+    HANDSHAKE,
+    LEGACY,
+    FRAMED,
+    SHM      // Framed, through shared-memory rings set up by SHM_ATTACH
+};
 
-public:
-    bool insert(int32_t number) {
-        std::unique_lock lock(mutex);
-        auto now = std::chrono::system_clock::now();
-        auto timestamp = std::chrono::duration_cast<std::chrono::seconds>(
-            now.time_since_epoch()).count();
-        
-        auto result = numbers.emplace(number, timestamp);
-        return result.second; // true if inserted, false if duplicate
+// How the reactors talk to the kernel, chosen with --io
+enum class IoBackend {
+    EPOLL,  // Readiness events, then read() and send()
+    URING   // Completions of multishot receives and queued sends on an io_uring
+};
+
+// A PRINT_ALL, RANGE, TIME_RANGE or WATCH listing still being streamed. Pages are
+// read from the store only as the client drains its output, so a slow reader
+// holds no more than one page of results in memory.
+struct ScanState {
+    uint32_t id;          // Request id, framed connections only
+    int32_t next;         // Lowest number not yet sent
+    int32_t hi;           // Inclusive upper bound
+    uint64_t remaining;   // Entries still allowed by the request's limit
+    bool by_time = false;   // TIME_RANGE: next is qualified by the times below
+    int64_t next_time = 0;  // Timestamp of the next entry to send
+    int64_t time_hi = 0;    // Inclusive upper bound on timestamps
+    uint64_t sent = 0;
+    bool legacy = false;  // Reply with IPCMessages instead of frames
+    MessageType type = MessageType::PRINT_ALL;
+    std::chrono::steady_clock::time_point started{};  // For STATS, which counts the whole scan
+    std::shared_ptr<const StoreView> view = nullptr;  // Pinned entries to page through, if the engine has versions
+};
+
+// A connection's requests on its reactor's io_uring. The socket is closed
+// only once none is left in flight, so a completion never outlives it.
+struct UringIo {
+    IoUring* ring = nullptr;    // Set when the reactor runs on io_uring
+    std::vector<char> sending;  // Output handed to the send in flight
+    size_t sending_pos = 0;     // First byte of sending the kernel has not taken yet
+    struct msghdr message;      // The SHM_ATTACH reply, which carries descriptors
+    struct iovec iov;
+    std::vector<char> control;
+    unsigned in_flight = 0;     // Requests whose last completion is still due
+    bool recv_armed = false;
+    bool recv_cancelled = false;  // Stopped while input waits to be parsed
+    bool send_armed = false;
+    bool watch_armed = false;   // Polling the WATCH bell
+    bool bell_armed = false;    // Polling the SHM ring bell
+    bool closing = false;
+    
+    size_t pending() const {
+        return sending.size() - sending_pos;
+    }
+};
+
+// Output of a request run on the executor, handed back to its connection's reactor
+struct OffloadResult {
+    int fd;
+    uint64_t serial;            // Tells the connection that asked from a later one on its fd
+    MessageType type;
+    bool failed = false;
+    std::chrono::steady_clock::time_point started;
+    std::vector<char> output;
+    uint64_t commit_lsn = 0;
+    std::optional<ScanState> scan;  // Progress of a scan, which continues from here
+    bool scan_done = false;
+    std::vector<int> fds;           // Passed with the output: a HANDOFF reply's socket and snapshot
+};
+
+// Where the executor posts results for one reactor. The bell is an eventfd
+// in the reactor's epoll set or io_uring, rung when the list stops being empty.
+struct ReactorInbox {
+    std::mutex mutex;
+    std::vector<OffloadResult> results;
+    int bell;
+    uint64_t opened = 0;  // Connections accepted by the reactor, numbering them; reactor only
+    
+    ReactorInbox() : bell(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+    
+    ~ReactorInbox() {
+        if (bell >= 0) {
+            close(bell);
+        }
     }
     
-    bool remove(int32_t number) {
-        std::unique_lock lock(mutex);
-        return numbers.erase(number) > 0;
+    void post(OffloadResult result) {
+        bool was_empty;
+        {
+            std::lock_guard lock(mutex);
+            was_empty = results.empty();
+            results.push_back(std::move(result));
+        }
+        if (was_empty) {
+            ring();
+        }
     }
     
-    void clear() {
-        std::unique_lock lock(mutex);
-        numbers.clear();
+    // Also wakes the reactor to follow the daemon into or out of draining
+    void ring() {
+        uint64_t one = 1;
+        ssize_t ignored = write(bell, &one, sizeof(one));
+        (void)ignored;
     }
     
-    bool contains(int32_t number) const {
-        std::shared_lock lock(mutex);
-        return numbers.find(number) != numbers.end();
+    std::vector<OffloadResult> take() {
+        uint64_t value;
+        ssize_t ignored = read(bell, &value, sizeof(value));
+        (void)ignored;
+        std::vector<OffloadResult> taken;
+        std::lock_guard lock(mutex);
+        taken.swap(results);
+        return taken;
     }
+};
+
+// Per-connection state, owned by exactly one reactor thread
+struct Connection {
+    int fd;
+    ReactorStats& stats;        // Of the owning reactor
+    ReactorInbox& inbox;        // Likewise
+    uint64_t serial;
+    ConnMode mode = ConnMode::HANDSHAKE;
+    bool error_text = false;    // Client asked for text in error frames
+    bool micros = false;        // Timestamps on the wire are microseconds, not seconds
+    std::vector<char> in_buf;   // Bytes received but not yet consumed as a full frame
+    size_t in_pos = 0;          // First unconsumed byte in in_buf
+    std::vector<char> out_buf;  // Bytes queued for the client
+    size_t out_pos = 0;         // First unsent byte in out_buf
+    bool read_paused = false;   // Input left in the kernel until out_buf drains
+    bool peer_closed = false;   // Client shut down its write side
+    std::optional<ScanState> scan;  // Reply being streamed; requests wait behind it
+    uint64_t commit_lsn = 0;    // Output is held until the log is durable up to here
+    bool log_deferred = false;  // A flush was held back by commit_lsn
+    bool log_listed = false;    // Queued to be flushed on the next durability event
+    std::vector<size_t> held_replies;  // Offsets in out_buf of mutation replies held for the log
+    std::unique_ptr<ShmChannel> shm;  // Rings handed out by SHM_ATTACH
+    bool shm_passed = false;    // Ring descriptors have been sent with the reply
+    bool request_failed = false;  // The request being served was answered with an error
+    std::unique_ptr<Subscription> watch;  // Set by WATCH
+    uint32_t watch_id = 0;      // Request id that change events are pushed under
+    bool watch_listed = false;  // watch's bell is in the reactor's epoll set
+    bool offloaded = false;     // A request is on the executor; requests wait behind it
+    bool draining = false;      // Takes no new requests; let go by release()
+    bool released = false;      // GOAWAY is queued and input is dropped
+    bool handing_off = false;   // Sent HANDOFF, which is answered once the daemon has drained
+    bool handed_off = false;    // The HANDOFF reply is queued; the daemon stops once it is sent
+    std::vector<int> passing;   // Descriptors to pass with the next send, for the HANDOFF reply
+    UringIo uring;
     
-    std::vector<NumberEntry> getAllSorted() const {
-        std::shared_lock lock(mutex);
-        std::vector<NumberEntry> result;
-        result.reserve(numbers.size());
-        
-        for (const auto& [num, ts] : numbers) {
-            result.emplace_back(num, ts);
-        }
-        
-        // Numbers are already sorted in the map by key
-        return result;
+    Connection(int client_fd, ReactorStats& reactor_stats, ReactorInbox& reactor_inbox)
+        : fd(client_fd), stats(reactor_stats), inbox(reactor_inbox), serial(++reactor_inbox.opened) {
+        bump(stats.accepted);
     }
     
-    size_t size() const {
-        std::shared_lock lock(mutex);
-        return numbers.size();
+    ~Connection() {
+        bump(stats.closed);
+    }
+    
+    void queue(const void* data, size_t len) {
+        const char* bytes = static_cast<const char*>(data);
+        out_buf.insert(out_buf.end(), bytes, bytes + len);
+    }
+    
+    size_t pending_output() const {
+        return out_buf.size() - out_pos + uring.pending();
     }
 };
 
+// Outcome of a single-number operation, independent of the wire protocol
+struct OpResult {
+    ErrorCode code;
+    int32_t number;
+    int64_t timestamp;
+};
+
 class NumberDaemon {
 private:
-    NumberStore store;
+    // Stop parsing requests once this much output is waiting on a slow client
+    static constexpr size_t OUTPUT_HIGH_WATER = 4 * 1024 * 1024;
+    // Next scan page is produced only once output drops below this
+    static constexpr size_t SCAN_LOW_WATER = 256 * 1024;
+    static constexpr size_t READ_CHUNK = 64 * 1024;
+    static constexpr int MAX_EVENTS = 256;
+    // Marks the epoll key of a connection's ring bell; the low bits hold the connection fd
+    static constexpr uint64_t BELL_KEY = uint64_t(1) << 63;
+    // Marks the epoll key of a subscriber's change feed bell, likewise
+    static constexpr uint64_t WATCH_KEY = uint64_t(1) << 62;
+    // io_uring backend: submission queue size per reactor, and the receive
+    // buffers its connections share; at most 65536
+    static constexpr unsigned URING_ENTRIES = 256;
+    static constexpr unsigned RECV_BUFFERS = 256;
+    static constexpr unsigned RECV_BUFFER_SIZE = 16 * 1024;
+    // Receiving stops while this much input waits for a paused connection
+    static constexpr size_t INPUT_HIGH_WATER = 1024 * 1024;
+    // With an executor, batches of more numbers run on it, in the bulk lane
+    // above the second size
+    static constexpr size_t OFFLOAD_BATCH_SIZE = 1024;
+    static constexpr size_t BULK_BATCH_SIZE = 16 * 1024;
+    // Draining connections still open after this are cut off
+    static constexpr auto DRAIN_TIMEOUT = std::chrono::seconds(10);
+    
+public:
+    // What main() lends a HANDOFF: quiesce stops the threads other than the
+    // reactors that write to the store or the log, and resume starts them
+    // again if the handoff falls through
+    struct HandoffHooks {
+        std::function<void()> quiesce;
+        std::function<void()> resume;
+        const ExpiryIndex* expiry = nullptr;  // Snapshotted with the store
+    };
+    
+private:
+
+    // io_uring user_data holds one of these above a connection fd in the low 32 bits
+    enum UringOp : uint64_t {
+        URING_ACCEPT = 1,
+        URING_WAKE,
+        URING_DURABLE,
+        URING_RECV,
+        URING_SEND,
+        URING_WATCH_BELL,
+        URING_SHM_BELL,
+        URING_CANCEL,
+        URING_INBOX,
+        URING_SIGNAL
+    };
+    
+    std::unique_ptr<NumberStore> store;
+    std::unique_ptr<WriteAheadLog> log;  // Optional; attached to the store as a listener
+    ChangeFeed* feed;  // Optional; attached to the store as a listener, serves WATCH
     int server_fd;
+    int wake_fd;
+    int durable_fd;  // Signalled by the log whenever more of it is durable
     std::string socket_path;
-    bool running;
-    std::vector<std::thread> client_threads;
+    std::atomic<bool> running;
+    size_t num_threads;
+    IoBackend io_backend;
+    std::vector<std::thread> reactor_threads;
+    std::vector<std::unique_ptr<ReactorStats>> reactor_stats;  // One per reactor, read by STATS
+    std::vector<std::unique_ptr<ReactorInbox>> reactor_inboxes;  // One per reactor
+    size_t num_workers;
+    size_t memory_limit;  // Bytes the store may hold before INSERTs are refused; 0 for no limit
+    std::string file_directory;  // Canonical; IMPORT and EXPORT only use files in it, none if empty
+    std::unique_ptr<Executor> executor;  // Runs scans and bulk requests; none with 0 workers
+    const Follower* follower;  // Set on a read-only follower, which refuses mutations
+    std::chrono::steady_clock::time_point started_at;
+    
+    // Draining, on HANDOFF or a stop signal: no connections are accepted and
+    // the open ones are let go; the drain thread then stops the daemon or
+    // hands it over
+    std::atomic<bool> draining;
+    std::atomic<bool> handed_off;  // The socket went to another process, which owns its path now
+    std::thread drain_thread;
+    HandoffHooks handoff;          // HANDOFF is refused without hooks
+    OffloadResult handoff_reply;   // Addressed to the connection the HANDOFF came on
+    uint32_t handoff_id = 0;
+    ReactorInbox* handoff_inbox = nullptr;
+    int handoff_snapshot = -1;     // memfd passed with the reply
+    std::optional<uint64_t> handoff_replayed;  // Log position the new process has caught up to
+    static inline std::atomic<int> signal_bell{-1};  // eventfd rung by SIGINT and SIGTERM
     
 public:
-    NumberDaemon(const std::string& path) : socket_path(path), running(false) {
+    NumberDaemon(const std::string& path, std::unique_ptr<NumberStore> number_store,
+                 std::unique_ptr<WriteAheadLog> write_ahead_log = nullptr, size_t threads = 1,
+                 ChangeFeed* change_feed = nullptr, IoBackend backend = IoBackend::EPOLL,
+                 size_t workers = 0, size_t memory_budget = 0, const std::string& files = "")
+        : store(std::move(number_store)), log(std::move(write_ahead_log)), feed(change_feed),
+          server_fd(-1),
+          wake_fd(-1), durable_fd(-1), socket_path(path), running(false),
+          num_threads(threads > 0 ? threads : 1), io_backend(backend), num_workers(workers),
+          memory_limit(memory_budget), file_directory(files), follower(nullptr), draining(false),
+          handed_off(false) {
         setup_signal_handlers();
     }
     
     ~NumberDaemon() {
         stop();
+        if (drain_thread.joinable()) {
+            drain_thread.join();
+        }
+        int bell = signal_bell.exchange(-1);
+        if (bell >= 0) {
+            close(bell);
+        }
+        if (handoff_snapshot >= 0) {
+            close(handoff_snapshot);
+        }
+        executor.reset();  // Its tasks use the store and the log
+        if (wake_fd >= 0) {
+            close(wake_fd);
+        }
+        log.reset();  // Joins the flusher, which signals durable_fd
+        if (durable_fd >= 0) {
+            close(durable_fd);
+        }
+    }
+    
+    // Makes the daemon a read-only follower that reports replica's progress
+    // in STATS; call before start()
+    void set_follower(const Follower* replica) {
+        follower = replica;
+    }
+    
+    // Lets a HANDOFF hand the daemon over to a new process; call before start()
+    void set_handoff(HandoffHooks hooks) {
+        handoff = std::move(hooks);
+    }
+    
+    // Serves the listening socket a daemon handed over (--takeover) instead
+    // of binding a new one; call before start()
+    void adopt_listener(int fd) {
+        server_fd = fd;
     }
     
     bool start() {
-        // Create socket
-        server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (server_fd < 0) {
-            std::cerr << "Failed to create socket" << std::endl;
+        raise_fd_limit();
+        
+        if (server_fd < 0 && !listen_on_path()) {
             return false;
         }
         
-        // Remove existing socket file
-        unlink(socket_path.c_str());
-        
-        // Bind socket
-        struct sockaddr_un addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
-        
-        if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            std::cerr << "Failed to bind socket" << std::endl;
+        // Used by stop() to wake every reactor out of epoll_wait
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wake_fd < 0) {
+            std::cerr << "Failed to create eventfd" << std::endl;
             close(server_fd);
+            server_fd = -1;
             return false;
         }
         
-        // Listen for connections
-        if (listen(server_fd, 10) < 0) {
-            std::cerr << "Failed to listen on socket" << std::endl;
+        // Replies held for the log are released when this fires
+        if (log && log->sync_policy() != SyncPolicy::ASYNC) {
+            durable_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (durable_fd < 0) {
+                std::cerr << "Failed to create eventfd" << std::endl;
+                close(server_fd);
+                server_fd = -1;
+                return false;
+            }
+            int fd = durable_fd;
+            log->set_durable_callback([fd] {
+                uint64_t one = 1;
+                ssize_t ignored = write(fd, &one, sizeof(one));
+                (void)ignored;
+            });
+        }
+        
+        int bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (bell < 0) {
+            std::cerr << "Failed to create eventfd" << std::endl;
             close(server_fd);
+            server_fd = -1;
             return false;
         }
+        signal_bell = bell;
         
         // Set socket permissions
         chmod(socket_path.c_str(), 0666);
         
+        reactor_stats.clear();
+        reactor_inboxes.clear();
+        for (size_t i = 0; i < num_threads; ++i) {
+            reactor_stats.push_back(std::make_unique<ReactorStats>());
+            reactor_inboxes.push_back(std::make_unique<ReactorInbox>());
+            if (reactor_inboxes.back()->bell < 0) {
+                std::cerr << "Failed to create eventfd" << std::endl;
+                close(server_fd);
+                server_fd = -1;
+                return false;
+            }
+        }
+        if (num_workers > 0) {
+            executor = std::make_unique<Executor>(num_workers);
+        }
+        started_at = std::chrono::steady_clock::now();
         running = true;
-        std::cout << "Number daemon started on " << socket_path << std::endl;
+        std::cout << "Number daemon started on " << socket_path
+                  << " (" << num_threads << " reactor thread"
+                  << (num_threads == 1 ? "" : "s") << ", "
+                  << store->engine_name() << " engine, "
+                  << store->shard_count() << " store shards, "
+                  << (io_backend == IoBackend::URING ? "io_uring" : "epoll") << " I/O, ";
+        if (executor) {
+            std::cout << num_workers << " worker" << (num_workers == 1 ? "" : "s");
+        } else {
+            std::cout << "no workers";
+        }
+        if (log) {
+            std::cout << ", " << sync_policy_name(log->sync_policy()) << " log sync";
+        }
+        if (memory_limit > 0) {
+            std::cout << ", " << (memory_limit >> 20) << " MiB memory limit";
+        }
+        if (follower) {
+            std::cout << ", following " << follower->primary();
+        }
+        std::cout << ")" << std::endl;
         
         return true;
     }
     
     void run() {
-        while (running) {
-            int client_fd = accept(server_fd, nullptr, nullptr);
-            if (client_fd < 0) {
-                if (running) {
-                    std::cerr << "Failed to accept client connection" << std::endl;
-                }
-                continue;
-            }
-            
-            // Handle client in separate thread
-            client_threads.emplace_back(&NumberDaemon::handle_client, this, client_fd);
+        // Every reactor owns its own epoll set; the listening socket is shared
+        // with EPOLLEXCLUSIVE so only one reactor is woken per incoming connection.
+        for (size_t i = 1; i < num_threads; ++i) {
+            reactor_threads.emplace_back(&NumberDaemon::reactor_loop, this, std::ref(*reactor_stats[i]),
+                                         std::ref(*reactor_inboxes[i]));
         }
+        reactor_loop(*reactor_stats[0], *reactor_inboxes[0]);
         
-        // Clean up client threads
-        for (auto& thread : client_threads) {
+        for (auto& thread : reactor_threads) {
             if (thread.joinable()) {
                 thread.join();
             }
         }
+        reactor_threads.clear();
+        // Done with main()'s hooks before it tears them down
+        if (drain_thread.joinable()) {
+            drain_thread.join();
+        }
     }
     
     void stop() {
         running = false;
+        if (wake_fd >= 0) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+        }
         if (server_fd >= 0) {
             close(server_fd);
             server_fd = -1;
         }
-        unlink(socket_path.c_str());
+        if (!handed_off) {
+            unlink(socket_path.c_str());
+        }
     }
     
 private:
+    bool listen_on_path() {
+        // Create socket
+        server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (server_fd < 0) {
+            std::cerr << "Failed to create socket" << std::endl;
+            return false;
+        }
+        
+        // Remove existing socket file
+        unlink(socket_path.c_str());
+        
+        // Bind socket
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        
+        if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            std::cerr << "Failed to bind socket" << std::endl;
+            close(server_fd);
+            server_fd = -1;
+            return false;
+        }
+        
+        // Listen for connections
+        if (listen(server_fd, SOMAXCONN) < 0) {
+            std::cerr << "Failed to listen on socket" << std::endl;
+            close(server_fd);
+            server_fd = -1;
+            return false;
+        }
+        return true;
+    }
+    
     void setup_signal_handlers() {
-        signal(SIGINT, [](int) {});
-        signal(SIGTERM, [](int) {});
+        // SIGINT and SIGTERM ring a bell the first reactor listens to, which
+        // drains the daemon and stops it
+        auto ring = [](int) {
+            int saved = errno;
+            uint64_t one = 1;
+            ssize_t ignored = write(signal_bell, &one, sizeof(one));
+            (void)ignored;
+            errno = saved;
+        };
+        signal(SIGINT, ring);
+        signal(SIGTERM, ring);
+        // Clients may disconnect with responses still queued
+        signal(SIGPIPE, SIG_IGN);
     }
     
-    void handle_client(int client_fd) {
-        IPCMessage msg;
-        ssize_t bytes_read;
-        
-        while ((bytes_read = read(client_fd, &msg, sizeof(msg))) > 0) {
-            process_message(client_fd, msg);
+    static void raise_fd_limit() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
         }
-        
-        close(client_fd);
     }
     
-    void process_message(int client_fd, const IPCMessage& msg) {
-        IPCMessage response;
-        memset(&response, 0, sizeof(response));
+    void reactor_loop(ReactorStats& stats, ReactorInbox& inbox) {
+        if (io_backend == IoBackend::URING) {
+            uring_loop(stats, inbox);
+            return;
+        }
         
-        switch (msg.type) {
-            case MessageType::INSERT: {
-                if (msg.number <= 0) {
-                    response.type = MessageType::RESPONSE_ERROR;
-                    strncpy(response.error_msg, "Error: Only positive integers are allowed", 
-                           sizeof(response.error_msg));
-                } else if (store.insert(msg.number)) {
-                    response.type = MessageType::RESPONSE_SUCCESS;
-                    response.number = msg.number;
-                    // Get the timestamp for the response
-                    auto entries = store.getAllSorted();
-                    for (const auto& entry : entries) {
-                        if (entry.number == msg.number) {
-                            response.timestamp = entry.timestamp;
-                            break;
-                        }
-                    }
-                } else {
-                    response.type = MessageType::RESPONSE_ERROR;
-                    strncpy(response.error_msg, "Error: Duplicate number not allowed", 
-                           sizeof(response.error_msg));
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0) {
+            std::cerr << "Failed to create epoll instance" << std::endl;
+            return;
+        }
+        
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.fd = server_fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+            std::cerr << "Failed to register listening socket" << std::endl;
+            close(epoll_fd);
+            return;
+        }
+        
+        // Level-triggered and never drained, so every reactor sees the stop request
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        
+        // Edge-triggered and never drained: every signal is a new edge for
+        // every reactor
+        if (durable_fd >= 0) {
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.fd = durable_fd;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, durable_fd, &ev);
+        }
+        
+        ev.events = EPOLLIN;
+        ev.data.fd = inbox.bell;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inbox.bell, &ev);
+        
+        bool first = &inbox == reactor_inboxes[0].get();
+        if (first) {
+            ev.data.fd = signal_bell;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_bell, &ev);
+        }
+        
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        std::vector<int> log_waiters;  // Connections whose output waits for the log
+        std::vector<struct epoll_event> events(MAX_EVENTS);
+        bool listening = true;  // Off while the daemon drains
+        
+        while (running) {
+            bump(stats.io_syscalls);
+            int n = epoll_wait(epoll_fd, events.data(), MAX_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
                 break;
             }
             
-            case MessageType::DELETE: {
-                if (msg.number <= 0) {
-                    response.type = MessageType::RESPONSE_ERROR;
-                    strncpy(response.error_msg, "Error: Only positive integers are allowed", 
-                           sizeof(response.error_msg));
-                } else if (store.remove(msg.number)) {
-                    response.type = MessageType::RESPONSE_SUCCESS;
-                    response.number = msg.number;
-                } else {
-                    response.type = MessageType::RESPONSE_ERROR;
-                    strncpy(response.error_msg, "Error: Number not found", 
-                           sizeof(response.error_msg));
+            for (int i = 0; i < n; ++i) {
+                uint64_t key = events[i].data.u64;
+                bool bell = (key & BELL_KEY) != 0;
+                bool watch = (key & WATCH_KEY) != 0;
+                int fd = bell || watch ? static_cast<int>(key & ~(BELL_KEY | WATCH_KEY))
+                                       : events[i].data.fd;
+                if (fd == wake_fd) {
+                    continue;
+                }
+                if (fd == durable_fd) {
+                    release_log_waiters(epoll_fd, connections, log_waiters);
+                    continue;
+                }
+                if (fd == inbox.bell) {
+                    drain_inbox(epoll_fd, inbox, connections, log_waiters);
+                    if (draining == listening) {
+                        // Connections waiting in the backlog are left to the next daemon
+                        listening = !draining;
+                        struct epoll_event listen_ev;
+                        memset(&listen_ev, 0, sizeof(listen_ev));
+                        listen_ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+                        listen_ev.data.fd = server_fd;
+                        epoll_ctl(epoll_fd, listening ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, server_fd, &listen_ev);
+                        if (draining) {
+                            drain_connections(epoll_fd, connections, log_waiters);
+                        }
+                    }
+                    continue;
+                }
+                if (first && fd == signal_bell) {
+                    take_signal();
+                    continue;
+                }
+                if (fd == server_fd) {
+                    accept_clients(epoll_fd, connections, stats, inbox);
+                    continue;
                 }
-                break;
-            }
-            
-            case MessageType::PRINT_ALL: {
-                auto entries = store.getAllSorted();
-                // Send success response first
-                response.type = MessageType::RESPONSE_SUCCESS;
-                write(client_fd, &response, sizeof(response));
                 
-                // Send each entry
-                for (const auto& entry : entries) {
-                    IPCMessage data_msg;
-                    data_msg.type = MessageType::RESPONSE_DATA;
-                    data_msg.number = entry.number;
-                    data_msg.timestamp = entry.timestamp;
-                    write(client_fd, &data_msg, sizeof(data_msg));
+                auto it = connections.find(fd);
+                if (it == connections.end()) {
+                    continue;
                 }
                 
-                // Send end marker
-                IPCMessage end_msg;
-                end_msg.type = MessageType::RESPONSE_SUCCESS;
-                end_msg.number = -1; // End marker
-                write(client_fd, &end_msg, sizeof(end_msg));
-                return; // Don't send another response
+                // A feed bell means there are changes to push, i.e. output to write
+                uint32_t conn_events = bell ? 0 : watch ? EPOLLOUT : events[i].events;
+                if (watch && it->second->mode == ConnMode::SHM) {
+                    conn_events = 0;
+                }
+                if (!serve(epoll_fd, *it->second, conn_events)) {
+                    drop(connections, it);
+                } else {
+                    list_log_waiter(*it->second, log_waiters);
+                }
             }
-            
-            case MessageType::DELETE_ALL: {
-                store.clear();
-                response.type = MessageType::RESPONSE_SUCCESS;
+        }
+        
+        for (auto& [fd, conn] : connections) {
+            close(fd);
+        }
+        close(epoll_fd);
+    }
+    
+    // The reactor on io_uring. Accepts, receives and sends complete on the
+    // ring instead of being retried on readiness, and a single io_uring_enter
+    // submits the requests queued since the last one and waits for more
+    // completions.
+    void uring_loop(ReactorStats& stats, ReactorInbox& inbox) {
+        IoUring ring;
+        if (!ring.init(URING_ENTRIES)) {
+            std::cerr << "Failed to set up io_uring" << std::endl;
+            return;
+        }
+        ring.provide_buffers(0, RECV_BUFFERS, RECV_BUFFER_SIZE);
+        
+        // Multishot, so each is submitted once and only re-armed if the kernel ends it
+        bool listening = true;  // Off while the daemon drains
+        bool accept_armed = false;
+        auto arm_listener = [&](UringOp op) {
+            io_uring_sqe* sqe = take_sqe(ring, stats);
+            if (op == URING_ACCEPT) {
+                IoUring::prep_accept_multishot(sqe, server_fd, uring_tag(op, 0));
+                accept_armed = true;
+            } else {
+                int fd = op == URING_WAKE ? wake_fd : op == URING_DURABLE ? durable_fd
+                       : op == URING_SIGNAL ? signal_bell.load() : inbox.bell;
+                IoUring::prep_poll_multishot(sqe, fd, uring_tag(op, 0));
+            }
+        };
+        arm_listener(URING_ACCEPT);
+        arm_listener(URING_WAKE);
+        arm_listener(URING_INBOX);
+        if (durable_fd >= 0) {
+            arm_listener(URING_DURABLE);
+        }
+        if (&inbox == reactor_inboxes[0].get()) {
+            arm_listener(URING_SIGNAL);
+        }
+        
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;
+        std::vector<int> log_waiters;  // Connections whose output waits for the log
+        
+        while (running) {
+            bump(stats.io_syscalls);
+            if (ring.wait() < 0 && errno != EINTR) {
+                std::cerr << "io_uring_enter failed: " << strerror(errno) << std::endl;
                 break;
             }
             
-            case MessageType::FIND: {
-                if (msg.number <= 0) {
-                    response.type = MessageType::RESPONSE_ERROR;
-                    strncpy(response.error_msg, "Error: Only positive integers are allowed", 
-                           sizeof(response.error_msg));
+            bool durable = false;
+            bool results = false;
+            bool signalled = false;
+            ring.for_each_completion([&](const io_uring_cqe& cqe) {
+                UringOp op = static_cast<UringOp>(cqe.user_data >> 32);
+                int fd = static_cast<int>(static_cast<uint32_t>(cqe.user_data));
+                bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+                if (op == URING_WAKE || op == URING_DURABLE || op == URING_INBOX || op == URING_ACCEPT ||
+                    op == URING_SIGNAL) {
+                    durable = durable || op == URING_DURABLE;
+                    results = results || op == URING_INBOX;
+                    signalled = signalled || op == URING_SIGNAL;
+                    if (op == URING_ACCEPT) {
+                        accept_uring(ring, connections, stats, inbox, cqe.res);
+                        accept_armed = more;
+                    }
+                    if (!more && running && (op != URING_ACCEPT || listening)) {
+                        arm_listener(op);
+                    }
+                    return;
+                }
+                
+                auto it = connections.find(fd);
+                if (it == connections.end()) {
+                    return;
+                }
+                Connection& conn = *it->second;
+                if (!complete_uring(conn, op, cqe) || conn.uring.closing) {
+                    drop(connections, it);
                 } else {
-                    response.type = MessageType::RESPONSE_SUCCESS;
-                    response.number = msg.number;
-                    if (store.contains(msg.number)) {
-                        // Get timestamp for found number
-                        auto entries = store.getAllSorted();
-                        for (const auto& entry : entries) {
-                            if (entry.number == msg.number) {
-                                response.timestamp = entry.timestamp;
-                                break;
-                            }
-                        }
-                    } else {
-                        response.timestamp = -1; // Not found marker
+                    arm_uring(conn);
+                    list_log_waiter(conn, log_waiters);
+                }
+            });
+            if (durable) {
+                release_log_waiters(-1, connections, log_waiters);
+            }
+            if (results) {
+                drain_inbox(-1, inbox, connections, log_waiters);
+                if (draining == listening) {
+                    // Connections waiting in the backlog are left to the next daemon
+                    listening = !draining;
+                    if (!listening && accept_armed) {
+                        IoUring::prep_cancel(take_sqe(ring, stats), uring_tag(URING_ACCEPT, 0),
+                                             uring_tag(URING_CANCEL, server_fd));
+                    } else if (listening && !accept_armed) {
+                        arm_listener(URING_ACCEPT);
+                    }
+                    if (draining) {
+                        drain_connections(-1, connections, log_waiters);
                     }
                 }
-                break;
             }
+            if (signalled) {
+                take_signal();
+            }
+        }
+        
+        // Whatever is still in flight ends with the ring
+        for (auto& [fd, conn] : connections) {
+            shutdown(fd, SHUT_RDWR);
+            close(fd);
+        }
+    }
+    
+    static uint64_t uring_tag(UringOp op, int fd) {
+        return (static_cast<uint64_t>(op) << 32) | static_cast<uint32_t>(fd);
+    }
+    
+    // A free submission entry; submits the queued ones first if there is none
+    static io_uring_sqe* take_sqe(IoUring& ring, ReactorStats& stats) {
+        io_uring_sqe* sqe;
+        while (!(sqe = ring.get_sqe())) {
+            bump(stats.io_syscalls);
+            ring.submit();
+        }
+        return sqe;
+    }
+    
+    void accept_uring(IoUring& ring, std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+                      ReactorStats& stats, ReactorInbox& inbox, int result) {
+        if (result < 0) {
+            if (result != -EINTR && result != -ECONNABORTED && result != -EAGAIN && result != -ECANCELED &&
+                running) {
+                std::cerr << "Failed to accept client connection: " << strerror(-result) << std::endl;
+            }
+            return;
+        }
+        auto conn = std::make_unique<Connection>(result, stats, inbox);
+        conn->uring.ring = &ring;
+        conn->draining = draining;  // Accepted before the cancel took effect
+        arm_uring(*conn);
+        connections[result] = std::move(conn);
+    }
+    
+    // Applies a completion to its connection. Returns false once the
+    // connection should be closed.
+    bool complete_uring(Connection& conn, UringOp op, const io_uring_cqe& cqe) {
+        UringIo& io = conn.uring;
+        bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+        if (!more) {
+            --io.in_flight;
+        }
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            unsigned id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !io.closing) {
+                const char* data = io.ring->buffer(id);
+                conn.in_buf.insert(conn.in_buf.end(), data, data + cqe.res);
+            }
+            io.ring->recycle(id);
+        }
+        
+        switch (op) {
+            case URING_RECV:
+                if (!more) {
+                    io.recv_armed = false;
+                }
+                if (io.closing) {
+                    return true;
+                }
+                if (conn.mode == ConnMode::SHM) {
+                    return false;  // Hung up, or sent bytes outside the rings
+                }
+                if (cqe.res > 0) {
+                    return serve(-1, conn, EPOLLIN);
+                }
+                if (cqe.res == 0) {
+                    conn.peer_closed = true;
+                    return serve(-1, conn, EPOLLRDHUP);
+                }
+                // Out of buffers, or cancelled for backpressure: armed again once possible
+                return cqe.res == -ENOBUFS || cqe.res == -ECANCELED;
+            
+            case URING_SEND:
+                io.send_armed = false;
+                if (io.closing) {
+                    return true;
+                }
+                if (cqe.res < 0) {
+                    return false;
+                }
+                io.sending_pos += cqe.res;
+                if (cqe.res > 0) {
+                    conn.shm_passed = conn.shm != nullptr;
+                    conn.passing.clear();
+                }
+                return serve(-1, conn, EPOLLOUT);
+            
+            case URING_WATCH_BELL:
+                if (!more) {
+                    io.watch_armed = false;
+                }
+                // Changes to push, i.e. output to write
+                return io.closing || serve(-1, conn, conn.mode == ConnMode::SHM ? 0u : uint32_t(EPOLLOUT));
+            
+            case URING_SHM_BELL:
+                if (!more) {
+                    io.bell_armed = false;
+                }
+                return io.closing || serve(-1, conn, 0);
             
             default:
-                response.type = MessageType::RESPONSE_ERROR;
-                strncpy(response.error_msg, "Error: Unknown message type", 
-                       sizeof(response.error_msg));
-                break;
+                return true;
         }
-        
-        write(client_fd, &response, sizeof(response));
     }
-};
-
-int main() {
-    NumberDaemon daemon("/tmp/number_daemon.sock");
     
-    if (!daemon.start()) {
-        std::cerr << "Failed to start daemon" << std::endl;
-        return 1;
+    // Re-arms what a served connection's state calls for: the receive, unless
+    // too much input is waiting behind a pause, and polls on its bells
+    void arm_uring(Connection& conn) {
+        UringIo& io = conn.uring;
+        if (io.closing) {
+            return;
+        }
+        // A paused connection takes no more input than this; others may be in a large frame
+        bool input_full = conn.read_paused && conn.in_buf.size() - conn.in_pos >= INPUT_HIGH_WATER;
+        if (!io.recv_armed && !conn.peer_closed && !input_full) {
+            io.ring->prep_recv_multishot(take_sqe(*io.ring, conn.stats), conn.fd,
+                                         uring_tag(URING_RECV, conn.fd));
+            io.recv_armed = true;
+            io.recv_cancelled = false;
+            ++io.in_flight;
+        } else if (io.recv_armed && !io.recv_cancelled && input_full) {
+            // Like a paused epoll connection, further input stays in the kernel
+            cancel_uring(conn, URING_RECV);
+            io.recv_cancelled = true;
+        }
+        if (conn.watch && !io.watch_armed) {
+            IoUring::prep_poll_multishot(take_sqe(*io.ring, conn.stats), conn.watch->bell_fd(),
+                                         uring_tag(URING_WATCH_BELL, conn.fd));
+            io.watch_armed = true;
+            ++io.in_flight;
+        }
+        if (conn.mode == ConnMode::SHM && !io.bell_armed) {
+            IoUring::prep_poll_multishot(take_sqe(*io.ring, conn.stats), conn.shm->bell_fd(),
+                                         uring_tag(URING_SHM_BELL, conn.fd));
+            io.bell_armed = true;
+            ++io.in_flight;
+        }
+    }
+    
+    void cancel_uring(Connection& conn, UringOp op) {
+        IoUring::prep_cancel(take_sqe(*conn.uring.ring, conn.stats), uring_tag(op, conn.fd),
+                             uring_tag(URING_CANCEL, conn.fd));
+        ++conn.uring.in_flight;
+    }
+    
+    // Closes a connection. On io_uring its requests in flight are cancelled
+    // first, and the socket is closed with the last of their completions.
+    void drop(std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+              std::unordered_map<int, std::unique_ptr<Connection>>::iterator it) {
+        Connection& conn = *it->second;
+        UringIo& io = conn.uring;
+        if (conn.handed_off && running) {
+            conn.handed_off = false;
+            if (conn.pending_output() == 0) {
+                std::cout << "Handed over to the new daemon" << std::endl;
+                stop();
+            } else {
+                resume();  // The new process went away before it had the reply
+            }
+        }
+        if (io.ring && io.in_flight > 0) {
+            if (!io.closing) {
+                io.closing = true;
+                shutdown(conn.fd, SHUT_RDWR);
+                for (auto [armed, op] : {std::make_pair(io.recv_armed, URING_RECV),
+                                         std::make_pair(io.send_armed, URING_SEND),
+                                         std::make_pair(io.watch_armed, URING_WATCH_BELL),
+                                         std::make_pair(io.bell_armed, URING_SHM_BELL)}) {
+                    if (armed) {
+                        cancel_uring(conn, op);
+                    }
+                }
+            }
+            return;
+        }
+        close(it->first);  // Also removes fd from the epoll set
+        connections.erase(it);
+    }
+    
+    static void list_log_waiter(Connection& conn, std::vector<int>& log_waiters) {
+        if (conn.log_deferred && !conn.log_listed) {
+            conn.log_listed = true;
+            log_waiters.push_back(conn.fd);
+        }
+    }
+    
+    // Flushes output that was waiting for the log to be synced
+    void release_log_waiters(int epoll_fd,
+                             std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+                             std::vector<int>& log_waiters) {
+        std::vector<int> waiting;
+        waiting.swap(log_waiters);
+        for (int fd : waiting) {
+            auto it = connections.find(fd);
+            if (it == connections.end() || it->second->uring.closing) {
+                continue;
+            }
+            Connection& conn = *it->second;
+            conn.log_listed = false;
+            conn.log_deferred = false;
+            if (!serve(epoll_fd, conn, EPOLLOUT)) {
+                drop(connections, it);
+            } else {
+                if (conn.uring.ring) {
+                    arm_uring(conn);
+                }
+                list_log_waiter(conn, log_waiters);
+            }
+        }
+    }
+    
+    // Hands the executor's results to their connections, which continue
+    // with the requests waiting behind them
+    void drain_inbox(int epoll_fd, ReactorInbox& inbox,
+                     std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+                     std::vector<int>& log_waiters) {
+        for (OffloadResult& result : inbox.take()) {
+            auto it = connections.find(result.fd);
+            if (it == connections.end() || it->second->serial != result.serial ||
+                it->second->uring.closing) {
+                if (!result.fds.empty()) {
+                    resume();  // Nobody left to take over
+                }
+                continue;  // Closed meanwhile
+            }
+            Connection& conn = *it->second;
+            conn.offloaded = false;
+            conn.handed_off = !result.fds.empty();
+            conn.passing = std::move(result.fds);
+            size_t reply_at = 0;  // The result's reply, if any, starts its output
+            if (conn.out_pos == conn.out_buf.size()) {
+                conn.out_buf.swap(result.output);
+                conn.out_pos = 0;
+            } else {
+                reply_at = conn.out_buf.size();
+                conn.out_buf.insert(conn.out_buf.end(), result.output.begin(), result.output.end());
+            }
+            hold_reply(conn, reply_at, result.commit_lsn);
+            if (!result.scan) {
+                conn.stats.record(result.type, result.failed, std::chrono::steady_clock::now() - result.started);
+            } else if (result.scan_done) {
+                finish_scan(conn);
+            } else {
+                conn.scan = result.scan;
+            }
+            
+            if (!serve(epoll_fd, conn, conn.mode == ConnMode::SHM ? 0u : uint32_t(EPOLLOUT))) {
+                drop(connections, it);
+            } else {
+                if (conn.uring.ring) {
+                    arm_uring(conn);
+                }
+                list_log_waiter(conn, log_waiters);
+            }
+        }
+    }
+    
+    void accept_clients(int epoll_fd,
+                        std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+                        ReactorStats& stats, ReactorInbox& inbox) {
+        while (running && !draining) {
+            bump(stats.io_syscalls, 2);  // With the epoll_ctl below
+            int client_fd = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK && running) {
+                    std::cerr << "Failed to accept client connection: "
+                              << strerror(errno) << std::endl;
+                }
+                return;
+            }
+            
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = client_fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+                std::cerr << "Failed to register client connection" << std::endl;
+                close(client_fd);
+                continue;
+            }
+            
+            connections[client_fd] = std::make_unique<Connection>(client_fd, stats, inbox);
+        }
+    }
+    
+    // Lets go of the reactor's connections as the daemon drains, all but the
+    // one a HANDOFF came on
+    void drain_connections(int epoll_fd,
+                           std::unordered_map<int, std::unique_ptr<Connection>>& connections,
+                           std::vector<int>& log_waiters) {
+        std::vector<int> fds;
+        for (auto& [fd, conn] : connections) {
+            if (!conn->draining && !conn->handing_off && !conn->uring.closing) {
+                fds.push_back(fd);
+            }
+        }
+        for (int fd : fds) {
+            auto it = connections.find(fd);
+            Connection& conn = *it->second;
+            conn.draining = true;
+            if (!serve(epoll_fd, conn, conn.mode == ConnMode::SHM ? 0u : uint32_t(EPOLLOUT))) {
+                drop(connections, it);
+            } else {
+                if (conn.uring.ring) {
+                    arm_uring(conn);
+                }
+                list_log_waiter(conn, log_waiters);
+            }
+        }
+    }
+    
+    // Handles socket events, or a ring bell when events is 0, for a connection
+    // in any mode. Returns false once the connection should be closed. On
+    // io_uring epoll_fd is -1 and the reactor polls the bells itself.
+    bool serve(int epoll_fd, Connection& conn, uint32_t events) {
+        if (conn.mode != ConnMode::SHM) {
+            if (!handle_event(conn, events)) {
+                return false;
+            }
+            if (conn.mode != ConnMode::SHM) {
+                return list_watch(epoll_fd, conn);
+            }
+            
+            // The SHM_ATTACH reply just went out; the client may already be using the rings
+            if (epoll_fd >= 0) {
+                struct epoll_event ev;
+                memset(&ev, 0, sizeof(ev));
+                ev.events = EPOLLIN;
+                ev.data.u64 = BELL_KEY | static_cast<uint32_t>(conn.fd);
+                bump(conn.stats.io_syscalls);
+                if (!conn.shm->watch(epoll_fd, ev)) {
+                    return false;
+                }
+            }
+            events = 0;
+        }
+        return handle_ring(conn, events) && list_watch(epoll_fd, conn);
+    }
+    
+    // Adds the bell of a subscription made by the last request to the epoll set
+    bool list_watch(int epoll_fd, Connection& conn) {
+        if (!conn.watch || conn.watch_listed || epoll_fd < 0) {
+            return true;
+        }
+        bump(conn.stats.io_syscalls);
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u64 = WATCH_KEY | static_cast<uint32_t>(conn.fd);
+        conn.watch_listed = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.watch->bell_fd(), &ev) == 0;
+        return conn.watch_listed;
+    }
+    
+    // Serves a connection attached to shared-memory rings until both
+    // directions are idle, then asks the client to ring the bell. The socket
+    // only tells us about a hangup.
+    bool handle_ring(Connection& conn, uint32_t events) {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            char byte;
+            bump(conn.stats.io_syscalls);
+            ssize_t n = recv(conn.fd, &byte, 1, MSG_DONTWAIT);
+            if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                return false;  // Hung up, or sent bytes outside the rings
+            }
+        }
+        
+        conn.shm->clear_bell();
+        while (true) {
+            if (!handle_event(conn, EPOLLIN | EPOLLOUT)) {
+                return false;
+            }
+            bool want_read = !conn.read_paused && !conn.draining;
+            bool want_write = conn.pending_output() > 0 && !conn.log_deferred;
+            if (conn.shm->busy_polling() && conn.shm->spin(want_read, want_write)) {
+                continue;
+            }
+            if (conn.shm->prepare_sleep(want_read, want_write)) {
+                return true;
+            }
+        }
+    }
+    
+    // Returns false once the connection should be closed
+    bool handle_event(Connection& conn, uint32_t events) {
+        if (events & EPOLLERR) {
+            return false;
+        }
+        
+        if (events & EPOLLOUT) {
+            if (!flush_output(conn)) {
+                return false;
+            }
+        }
+        
+        // Edge-triggered: drain the socket now, or resume a paused connection
+        // whose output just drained, since no new edge will be reported for
+        // bytes that are already waiting in the kernel.
+        if ((events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) ||
+            (conn.read_paused && !output_full(conn) && !conn.offloaded)) {
+            if (!read_input(conn)) {
+                return false;
+            }
+        }
+        
+        if (!pump_watch(conn)) {
+            return false;
+        }
+        
+        if (conn.peer_closed && conn.pending_output() == 0 && !conn.scan && !conn.offloaded) {
+            return false;
+        }
+        if (conn.draining && !release(conn)) {
+            return false;
+        }
+        // The new process has the socket once this reply is out; drop() stops the daemon
+        if (conn.handed_off && conn.pending_output() == 0) {
+            return false;
+        }
+        return true;
+    }
+    
+    // Lets a draining connection go once no request of it is under way:
+    // framed connections are sent GOAWAY, and input not yet served is
+    // dropped. Returns false once the connection can be closed.
+    bool release(Connection& conn) {
+        if (!conn.released) {
+            if (conn.mode == ConnMode::HANDSHAKE || conn.scan || conn.offloaded) {
+                return true;
+            }
+            conn.released = true;
+            conn.in_buf.clear();
+            conn.in_pos = 0;
+            if (conn.mode != ConnMode::LEGACY) {
+                FrameBuilder(conn.out_buf, 0, MessageType::GOAWAY).finish();
+            }
+            if (!flush_output(conn)) {
+                return false;
+            }
+        }
+        return conn.pending_output() > 0 || conn.log_deferred;
+    }
+    
+    bool read_input(Connection& conn) {
+        while (true) {
+            conn.read_paused = false;
+            
+            // Frames left over from an earlier pause are handled before reading more
+            if (!process_frames(conn)) {
+                return false;
+            }
+            
+            // A draining connection reads no more than its handshake
+            while (!conn.read_paused && !conn.peer_closed &&
+                   (!conn.draining || conn.mode == ConnMode::HANDSHAKE)) {
+                if (conn.mode == ConnMode::SHM) {
+                    size_t available = std::min(conn.shm->readable(), READ_CHUNK);
+                    if (available == 0) {
+                        break;
+                    }
+                    size_t old_size = conn.in_buf.size();
+                    conn.in_buf.resize(old_size + available);
+                    conn.shm->receive(conn.in_buf.data() + old_size, available);
+                    if (!process_frames(conn)) {
+                        return false;
+                    }
+                    continue;
+                }
+                
+                // On io_uring input arrives by completion, straight into in_buf
+                if (conn.uring.ring) {
+                    break;
+                }
+                
+                size_t old_size = conn.in_buf.size();
+                conn.in_buf.resize(old_size + READ_CHUNK);
+                bump(conn.stats.io_syscalls);
+                ssize_t bytes_read = read(conn.fd, conn.in_buf.data() + old_size, READ_CHUNK);
+                
+                if (bytes_read > 0) {
+                    conn.in_buf.resize(old_size + bytes_read);
+                    if (!process_frames(conn)) {
+                        return false;
+                    }
+                    continue;
+                }
+                
+                conn.in_buf.resize(old_size);
+                if (bytes_read == 0) {
+                    conn.peer_closed = true;
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    return false;
+                } else {
+                    break;
+                }
+            }
+            
+            if (!flush_output(conn)) {
+                return false;
+            }
+            
+            // Still over the limit means the socket is full and EPOLLOUT will
+            // resume us; otherwise keep going, no further edge would arrive.
+            // An offloaded request resumes us when its result is back.
+            if (!conn.read_paused || output_full(conn) || conn.offloaded) {
+                return true;
+            }
+        }
+    }
+    
+    // True while the connection must wait for EPOLLOUT before doing more work
+    static bool output_full(const Connection& conn) {
+        return conn.pending_output() >= (conn.scan ? SCAN_LOW_WATER : OUTPUT_HIGH_WATER);
+    }
+    
+    // Dispatches every complete frame in in_buf; a partial frame stays buffered.
+    // Returns false if the client violated the protocol.
+    bool process_frames(Connection& conn) {
+        // Not served: the client sends it again on another connection
+        if (conn.released) {
+            conn.in_buf.clear();
+            conn.in_pos = 0;
+            return true;
+        }
+        
+        bool ok = true;
+        while (ok) {
+            const char* data = conn.in_buf.data() + conn.in_pos;
+            size_t available = conn.in_buf.size() - conn.in_pos;
+            
+            if (conn.mode == ConnMode::HANDSHAKE) {
+                ok = negotiate(conn, data, available);
+                if (conn.mode == ConnMode::HANDSHAKE) {
+                    break;  // Need more bytes
+                }
+                continue;
+            }
+            
+            // Once SHM_ATTACH is answered nothing more may arrive on the socket
+            if (conn.shm && conn.mode == ConnMode::FRAMED) {
+                ok = available == 0;
+                break;
+            }
+            
+            // A streaming reply, or one coming from the executor, is finished
+            // before the next request is read
+            if (conn.scan) {
+                pump_scan(conn);
+            }
+            if (conn.scan || conn.offloaded || conn.pending_output() >= OUTPUT_HIGH_WATER) {
+                conn.read_paused = true;
+                break;
+            }
+            if (conn.draining) {
+                break;  // Takes no new requests
+            }
+            
+            if (conn.mode == ConnMode::LEGACY) {
+                if (available < sizeof(IPCMessage)) {
+                    break;
+                }
+                IPCMessage msg;
+                memcpy(&msg, data, sizeof(msg));
+                conn.in_pos += sizeof(msg);
+                auto started = std::chrono::steady_clock::now();
+                conn.request_failed = false;
+                process_message(conn, msg);
+                record_request(conn, msg.type, started);
+                continue;
+            }
+            
+            if (available < FRAME_HEADER_SIZE) {
+                break;
+            }
+            FrameHeader header;
+            if (!decode_frame_header(data, header)) {
+                ok = false;
+                break;
+            }
+            size_t frame_size = FRAME_LENGTH_SIZE + header.length;
+            if (available < frame_size) {
+                break;
+            }
+            conn.in_pos += frame_size;
+            auto started = std::chrono::steady_clock::now();
+            conn.request_failed = false;
+            process_frame(conn, header,
+                          PayloadReader(data + FRAME_HEADER_SIZE, header.payload_size()));
+            record_request(conn, header.type, started);
+        }
+        
+        // Compact consumed bytes
+        if (conn.in_pos > 0) {
+            conn.in_buf.erase(conn.in_buf.begin(), conn.in_buf.begin() + conn.in_pos);
+            conn.in_pos = 0;
+        }
+        return ok;
+    }
+    
+    // Counts a served request; scans and offloaded requests are counted once they complete
+    static void record_request(Connection& conn, MessageType type,
+                               std::chrono::steady_clock::time_point started) {
+        if (!conn.scan && !conn.offloaded) {
+            conn.stats.record(type, conn.request_failed, std::chrono::steady_clock::now() - started);
+        }
+    }
+    
+    // Picks the protocol from the first bytes of a connection. A HELLO selects
+    // the framed protocol; anything else is taken as a legacy IPCMessage.
+    bool negotiate(Connection& conn, const char* data, size_t available) {
+        if (available < sizeof(uint32_t)) {
+            return true;
+        }
+        
+        uint32_t magic;
+        memcpy(&magic, data, sizeof(magic));
+        if (magic != PROTOCOL_MAGIC) {
+            conn.mode = ConnMode::LEGACY;
+            return true;
+        }
+        if (available < HELLO_SIZE) {
+            return true;
+        }
+        
+        Hello hello = decode_hello(data);
+        conn.in_pos += HELLO_SIZE;
+        if (hello.version < PROTOCOL_VERSION_LEGACY) {
+            return false;
+        }
+        
+        uint16_t version = std::min(hello.version, PROTOCOL_VERSION);
+        uint16_t flags = hello.flags & HELLO_ERROR_TEXT;
+        conn.error_text = (flags & HELLO_ERROR_TEXT) != 0;
+        conn.micros = version >= PROTOCOL_VERSION;
+        conn.mode = version >= PROTOCOL_VERSION_SECONDS ? ConnMode::FRAMED : ConnMode::LEGACY;
+        encode_hello(conn.out_buf, version, flags);
+        return true;
+    }
+    
+    // Hands queued output to the kernel as one send. While it is in flight
+    // new output collects in out_buf and goes with the next.
+    void start_send(Connection& conn) {
+        UringIo& io = conn.uring;
+        if (io.send_armed) {
+            return;
+        }
+        if (io.pending() == 0) {
+            io.sending.clear();
+            io.sending.swap(conn.out_buf);
+            io.sending_pos = conn.out_pos;
+            conn.out_pos = 0;
+        }
+        const char* data = io.sending.data() + io.sending_pos;
+        io_uring_sqe* sqe = take_sqe(*io.ring, conn.stats);
+        uint64_t tag = uring_tag(URING_SEND, conn.fd);
+        std::vector<int> fds = passed_fds(conn);
+        if (!fds.empty()) {
+            build_fd_message(io.message, io.iov, io.control, data, io.pending(), fds);
+            IoUring::prep_sendmsg(sqe, conn.fd, &io.message, tag);
+        } else {
+            IoUring::prep_send(sqe, conn.fd, data, io.pending(), tag);
+        }
+        io.send_armed = true;
+        ++io.in_flight;
+    }
+    
+    // Descriptors the next send carries: the rings with the SHM_ATTACH reply,
+    // the socket and snapshot with the HANDOFF reply
+    static std::vector<int> passed_fds(const Connection& conn) {
+        return conn.shm && !conn.shm_passed ? conn.shm->client_fds() : conn.passing;
+    }
+    
+    // Writes as much queued output as the socket or ring accepts; the rest
+    // waits for EPOLLOUT or the ring bell. On io_uring it is handed to a send.
+    bool flush_output(Connection& conn) {
+        // Replies to mutations go out only once the log has them on disk
+        if (log && conn.commit_lsn > log->durable_lsn()) {
+            if (!log->failed()) {
+                conn.log_deferred = true;
+                return true;
+            }
+            fail_held_replies(conn);
+        }
+        
+        while (conn.pending_output() > 0) {
+            const char* data = conn.out_buf.data() + conn.out_pos;
+            if (conn.mode == ConnMode::SHM) {
+                size_t written = conn.shm->send(data, conn.pending_output());
+                conn.out_pos += written;
+                if (written == 0) {
+                    break;  // Ring full
+                }
+                continue;
+            }
+            
+            if (conn.uring.ring) {
+                start_send(conn);
+                break;
+            }
+            
+            bump(conn.stats.io_syscalls);
+            std::vector<int> fds = passed_fds(conn);
+            ssize_t written = !fds.empty() ? send_with_fds(conn.fd, data, conn.pending_output(), fds)
+                                           : send(conn.fd, data, conn.pending_output(), MSG_NOSIGNAL);
+            if (written > 0) {
+                conn.out_pos += written;
+                conn.shm_passed = conn.shm != nullptr;
+                conn.passing.clear();
+            } else if (written < 0 && errno == EINTR) {
+                continue;
+            } else if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        
+        if (conn.out_pos == conn.out_buf.size()) {
+            conn.out_buf.clear();
+            conn.out_pos = 0;
+        } else if (conn.out_pos >= OUTPUT_HIGH_WATER) {
+            conn.out_buf.erase(conn.out_buf.begin(), conn.out_buf.begin() + conn.out_pos);
+            conn.out_pos = 0;
+        }
+        
+        if (conn.shm && conn.mode == ConnMode::FRAMED && conn.pending_output() == 0) {
+            conn.mode = ConnMode::SHM;
+        }
+        return true;
+    }
+    
+    static bool is_mutation(MessageType type) {
+        return type == MessageType::INSERT || type == MessageType::DELETE ||
+               type == MessageType::DELETE_ALL || type == MessageType::INSERT_BATCH ||
+               type == MessageType::DELETE_BATCH || type == MessageType::IMPORT;
+    }
+    
+    // Records that output queued so far depends on the mutations made so
+    // far; the reply to the last of them is queued next
+    void commit_mutation(Connection& conn) {
+        hold_reply(conn, conn.out_buf.size(), commit_point());
+    }
+    
+    // Holds output until the log is durable up to lsn, keeping the offset of
+    // the mutation reply at out_buf[at] in case the log fails first
+    void hold_reply(Connection& conn, size_t at, uint64_t lsn) {
+        if (lsn == 0) {
+            return;
+        }
+        if (conn.commit_lsn <= log->durable_lsn()) {
+            conn.held_replies.clear();  // Left from output that went out since
+        }
+        conn.held_replies.push_back(at);
+        conn.commit_lsn = std::max(conn.commit_lsn, lsn);
+    }
+    
+    // The log failed before the held replies were durable: each becomes a
+    // LOG_FAILED error for its request. The mutations stay applied in
+    // memory. Replies to reads in between go out as they are.
+    void fail_held_replies(Connection& conn) {
+        std::vector<char> out(conn.out_buf.begin(), conn.out_buf.begin() + conn.out_pos);
+        size_t pos = conn.out_pos;
+        for (size_t at : conn.held_replies) {
+            out.insert(out.end(), conn.out_buf.begin() + pos, conn.out_buf.begin() + at);
+            if (conn.mode == ConnMode::LEGACY) {
+                IPCMessage response;
+                memset(&response, 0, sizeof(response));
+                response.type = MessageType::RESPONSE_ERROR;
+                strncpy(response.error_msg, error_string(ErrorCode::LOG_FAILED),
+                        sizeof(response.error_msg) - 1);
+                const char* bytes = reinterpret_cast<const char*>(&response);
+                out.insert(out.end(), bytes, bytes + sizeof(response));
+                pos = at + sizeof(response);
+            } else {
+                FrameHeader header;
+                decode_frame_header(conn.out_buf.data() + at, header);
+                put_error(out, header.id, ErrorCode::LOG_FAILED, conn.error_text);
+                pos = at + FRAME_LENGTH_SIZE + header.length;
+            }
+        }
+        out.insert(out.end(), conn.out_buf.begin() + pos, conn.out_buf.end());
+        conn.out_buf.swap(out);
+        conn.held_replies.clear();
+        conn.commit_lsn = 0;
+    }
+    
+    // Log position that replies to the mutations made so far must wait for
+    uint64_t commit_point() {
+        return log ? log->commit() : 0;
+    }
+    
+    // Runs job on the executor and holds the connection's further requests
+    // until its result is back. The job must not touch conn, which may be
+    // closed by then.
+    void offload(Connection& conn, Lane lane, MessageType type, std::function<void(OffloadResult&)> job) {
+        conn.offloaded = true;
+        OffloadResult result;
+        result.fd = conn.fd;
+        result.serial = conn.serial;
+        result.type = type;
+        result.started = std::chrono::steady_clock::now();
+        ReactorInbox& inbox = conn.inbox;
+        executor->submit(lane, [&inbox, job = std::move(job), result = std::move(result)]() mutable {
+            job(result);
+            inbox.post(std::move(result));
+        });
+    }
+    
+    // Executes a single-number operation (or DELETE_ALL) against the store;
+    // inserted numbers expire after ttl seconds unless it is 0
+    OpResult execute(MessageType type, int32_t number, uint32_t ttl = 0) {
+        switch (type) {
+            case MessageType::INSERT: {
+                if (number <= 0) {
+                    return {ErrorCode::INVALID_NUMBER, number, 0};
+                }
+                if (!admit(1)) {
+                    return {ErrorCode::MEMORY_LIMIT, number, 0};
+                }
+                int64_t timestamp;
+                if (!store->insert(number, timestamp, expiry_after(ttl))) {
+                    return {ErrorCode::DUPLICATE, number, 0};
+                }
+                return {ErrorCode::NONE, number, timestamp};
+            }
+            
+            case MessageType::DELETE: {
+                if (number <= 0) {
+                    return {ErrorCode::INVALID_NUMBER, number, 0};
+                }
+                if (!store->remove(number)) {
+                    return {ErrorCode::NOT_FOUND, number, 0};
+                }
+                return {ErrorCode::NONE, number, 0};
+            }
+            
+            case MessageType::DELETE_ALL: {
+                store->clear();
+                return {ErrorCode::NONE, 0, 0};
+            }
+            
+            case MessageType::FIND: {
+                if (number <= 0) {
+                    return {ErrorCode::INVALID_NUMBER, number, 0};
+                }
+                auto entry = store->find(number);
+                int64_t timestamp = entry ? entry->timestamp : -1; // -1 is the not found marker
+                return {ErrorCode::NONE, number, timestamp};
+            }
+            
+            default:
+                return {ErrorCode::UNKNOWN_TYPE, number, 0};
+        }
+    }
+    
+    // Admission control: false if inserting count more numbers could take
+    // the store past the memory limit. Replayed and loaded entries are
+    // never refused.
+    bool admit(size_t count) const {
+        return memory_limit == 0 || store->memory_usage() + count * store->entry_bytes() <= memory_limit;
+    }
+    
+    // A stored timestamp as the connection's protocol version expects it
+    static int64_t wire_time(const Connection& conn, int64_t timestamp) {
+        return wire_time(conn.micros, timestamp);
+    }
+    
+    static int64_t wire_time(bool micros, int64_t timestamp) {
+        return micros || timestamp < 0 ? timestamp : timestamp / MICROS_PER_SECOND;
+    }
+    
+    // A requested time in the store's microseconds; a bound in seconds
+    // covers its whole second when it is the upper one
+    static int64_t store_time(const Connection& conn, int64_t time, bool upper = false) {
+        if (conn.micros) {
+            return time;
+        }
+        const int64_t limit = std::numeric_limits<int64_t>::max() / MICROS_PER_SECOND - 1;
+        time = std::clamp(time, -limit, limit) * MICROS_PER_SECOND;
+        return upper ? time + MICROS_PER_SECOND - 1 : time;
+    }
+    
+    void send_error(Connection& conn, uint32_t id, ErrorCode code) {
+        conn.request_failed = true;
+        put_error(conn.out_buf, id, code, conn.error_text);
+    }
+    
+    static void put_error(std::vector<char>& out, uint32_t id, ErrorCode code, bool error_text) {
+        FrameBuilder frame(out, id, MessageType::RESPONSE_ERROR, code);
+        if (error_text) {
+            const char* text = error_string(code);
+            frame.put_bytes(text, strlen(text));
+        }
+        frame.finish();
+    }
+    
+    void process_frame(Connection& conn, const FrameHeader& header, PayloadReader payload) {
+        if (follower && is_mutation(header.type)) {
+            send_error(conn, header.id, ErrorCode::READ_ONLY);
+            return;
+        }
+        if (log && log->failed() && is_mutation(header.type)) {
+            send_error(conn, header.id, ErrorCode::LOG_FAILED);
+            return;
+        }
+        switch (header.type) {
+            case MessageType::INSERT:
+            case MessageType::DELETE:
+            case MessageType::FIND: {
+                int32_t number = payload.get_i32();
+                uint32_t ttl = 0;
+                if (header.type == MessageType::INSERT && payload.left() > 0) {
+                    ttl = payload.get_u32();
+                }
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                
+                OpResult result = execute(header.type, number, ttl);
+                if (is_mutation(header.type)) {
+                    commit_mutation(conn);
+                }
+                if (result.code != ErrorCode::NONE) {
+                    send_error(conn, header.id, result.code);
+                    return;
+                }
+                
+                FrameBuilder frame(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS);
+                frame.put_i32(result.number);
+                if (header.type != MessageType::DELETE) {
+                    frame.put_i64(wire_time(conn, result.timestamp));
+                }
+                frame.finish();
+                return;
+            }
+            
+            case MessageType::DELETE_ALL: {
+                // Clearing a large store takes a while
+                if (executor) {
+                    offload(conn, Lane::BULK, header.type, [this, id = header.id](OffloadResult& result) {
+                        execute(MessageType::DELETE_ALL, 0);
+                        result.commit_lsn = commit_point();
+                        FrameBuilder(result.output, id, MessageType::RESPONSE_SUCCESS).finish();
+                    });
+                    return;
+                }
+                execute(header.type, 0);
+                commit_mutation(conn);
+                FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS).finish();
+                return;
+            }
+            
+            case MessageType::PRINT_ALL:
+                start_scan(conn, header.type, header.id, std::numeric_limits<int32_t>::min(),
+                           std::numeric_limits<int32_t>::max(), 0, false);
+                return;
+            
+            case MessageType::RANGE: {
+                int32_t lo = payload.get_i32();
+                int32_t hi = payload.get_i32();
+                uint32_t limit = payload.get_u32();
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                start_scan(conn, header.type, header.id, lo, hi, limit, false);
+                return;
+            }
+            
+            case MessageType::TIME_RANGE: {
+                if (!store->has_time_index()) {
+                    send_error(conn, header.id, ErrorCode::DISABLED);
+                    return;
+                }
+                int64_t from = payload.get_i64();
+                int64_t to = payload.get_i64();
+                uint32_t limit = payload.get_u32();
+                int32_t from_number = payload.get_i32();
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                start_scan(conn, header.type, header.id, from_number,
+                           std::numeric_limits<int32_t>::max(), limit, false);
+                conn.scan->by_time = true;
+                conn.scan->next_time = store_time(conn, from);
+                conn.scan->time_hi = store_time(conn, to, true);
+                return;
+            }
+            
+            case MessageType::COUNT_SINCE: {
+                if (!store->has_time_index()) {
+                    send_error(conn, header.id, ErrorCode::DISABLED);
+                    return;
+                }
+                int64_t since = payload.get_i64();
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_u64(store->count_since(store_time(conn, since)))
+                    .finish();
+                return;
+            }
+            
+            case MessageType::COUNT:
+                FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_u64(store->size())
+                    .finish();
+                return;
+            
+            case MessageType::COUNT_RANGE:
+            case MessageType::RANK: {
+                int32_t lo = payload.get_i32();
+                int32_t hi = header.type == MessageType::COUNT_RANGE ? payload.get_i32() : 0;
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_u64(header.type == MessageType::RANK ? store->rank(lo)
+                                                              : store->count_range(lo, hi))
+                    .finish();
+                return;
+            }
+            
+            case MessageType::MIN_NUMBER:
+            case MessageType::MAX_NUMBER:
+            case MessageType::SELECT: {
+                uint64_t k = header.type == MessageType::SELECT ? payload.get_u64() : 0;
+                if (!payload.good()) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                std::optional<NumberEntry> entry;
+                if (header.type == MessageType::SELECT) {
+                    entry = store->select(k);
+                } else if (header.type == MessageType::MIN_NUMBER) {
+                    entry = store->min_entry();
+                } else {
+                    entry = store->max_entry();
+                }
+                FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_i32(entry ? entry->number : 0)
+                    .put_i64(entry ? wire_time(conn, entry->timestamp) : -1)
+                    .finish();
+                return;
+            }
+            
+            case MessageType::INSERT_BATCH:
+            case MessageType::DELETE_BATCH:
+            case MessageType::FIND_BATCH:
+                process_batch(conn, header, payload);
+                return;
+            
+            case MessageType::IMPORT:
+            case MessageType::EXPORT:
+                process_file(conn, header, payload);
+                return;
+            
+            case MessageType::SHM_ATTACH:
+                attach_shm(conn, header, payload);
+                return;
+            
+            case MessageType::STATS:
+                send_stats(conn, header.id);
+                return;
+            
+            case MessageType::WATCH:
+                if (!feed) {
+                    send_error(conn, header.id, ErrorCode::DISABLED);
+                    return;
+                }
+                if (conn.watch) {
+                    send_error(conn, header.id, ErrorCode::MALFORMED);
+                    return;
+                }
+                // Subscribed before the listing starts, so the feed has every change it misses
+                conn.watch = std::make_unique<Subscription>(*feed);
+                if (conn.watch->bell_fd() < 0) {
+                    conn.watch.reset();
+                    send_error(conn, header.id, ErrorCode::UNAVAILABLE);
+                    return;
+                }
+                conn.watch_id = header.id;
+                start_scan(conn, header.type, header.id, std::numeric_limits<int32_t>::min(),
+                           std::numeric_limits<int32_t>::max(), 0, false);
+                return;
+            
+            case MessageType::HANDOFF:
+                request_handoff(conn, header, payload);
+                return;
+            
+            default:
+                send_error(conn, header.id, ErrorCode::UNKNOWN_TYPE);
+                return;
+        }
+    }
+    
+    // Applies a batch request with one store call, i.e. one lock acquisition
+    void process_batch(Connection& conn, const FrameHeader& header, PayloadReader& payload) {
+        uint32_t count = payload.get_u32();
+        size_t numbers_size = static_cast<size_t>(count) * sizeof(int32_t);
+        bool has_ttl = header.type == MessageType::INSERT_BATCH &&
+                       payload.left() == numbers_size + sizeof(uint32_t);
+        if (!payload.good() || count > MAX_BATCH_SIZE ||
+            (payload.left() != numbers_size && !has_ttl)) {
+            send_error(conn, header.id, ErrorCode::MALFORMED);
+            return;
+        }
+        
+        // Non-positive numbers never reach the store; they report a clear bit or -1
+        std::vector<int32_t> keys;
+        std::vector<uint32_t> positions;
+        keys.reserve(count);
+        positions.reserve(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            int32_t number = payload.get_i32();
+            if (number > 0) {
+                keys.push_back(number);
+                positions.push_back(i);
+            }
+        }
+        uint32_t ttl = has_ttl ? payload.get_u32() : 0;
+        if (header.type == MessageType::INSERT_BATCH && !admit(keys.size())) {
+            send_error(conn, header.id, ErrorCode::MEMORY_LIMIT);
+            return;
+        }
+        
+        if (executor && keys.size() > OFFLOAD_BATCH_SIZE) {
+            Lane lane = keys.size() > BULK_BATCH_SIZE ? Lane::BULK : Lane::LATENCY;
+            offload(conn, lane, header.type,
+                    [this, header, count, keys = std::move(keys), positions = std::move(positions), ttl,
+                     micros = conn.micros](OffloadResult& result) {
+                        result.commit_lsn = apply_batch(header, count, keys, positions, ttl, micros,
+                                                        result.output);
+                    });
+            return;
+        }
+        size_t reply_at = conn.out_buf.size();
+        hold_reply(conn, reply_at, apply_batch(header, count, keys, positions, ttl, conn.micros, conn.out_buf));
+    }
+    
+    // Runs a parsed batch and queues its reply on out. Returns the commit
+    // point its reply waits for, 0 for FIND_BATCH.
+    uint64_t apply_batch(const FrameHeader& header, uint32_t count, const std::vector<int32_t>& keys,
+                         const std::vector<uint32_t>& positions, uint32_t ttl, bool micros,
+                         std::vector<char>& out) {
+        FrameBuilder frame(out, header.id, MessageType::RESPONSE_SUCCESS);
+        frame.put_u32(count);
+        
+        uint64_t lsn = 0;
+        if (header.type == MessageType::FIND_BATCH) {
+            std::vector<int64_t> timestamps(count, -1);
+            auto found = store->find_batch(keys);
+            for (size_t j = 0; j < keys.size(); ++j) {
+                timestamps[positions[j]] = wire_time(micros, found[j]);
+            }
+            frame.put_bytes(timestamps.data(), timestamps.size() * sizeof(int64_t));
+        } else {
+            std::vector<bool> applied;
+            if (header.type == MessageType::INSERT_BATCH) {
+                frame.put_i64(wire_time(micros, store->insert_batch(keys, applied, expiry_after(ttl))));
+            } else {
+                store->remove_batch(keys, applied);
+            }
+            lsn = commit_point();
+            
+            std::vector<uint8_t> bitmap(bitmap_size(count), 0);
+            for (size_t j = 0; j < keys.size(); ++j) {
+                if (applied[j]) {
+                    bitmap_set(bitmap.data(), positions[j]);
+                }
+            }
+            frame.put_bytes(bitmap.data(), bitmap.size());
+        }
+        frame.finish();
+        return lsn;
+    }
+    
+    // IMPORT and EXPORT go through a whole file, so they run in the
+    // executor's bulk lane when there is one
+    void process_file(Connection& conn, const FrameHeader& header, PayloadReader& payload) {
+        if (file_directory.empty()) {
+            send_error(conn, header.id, ErrorCode::DISABLED);
+            return;
+        }
+        uint8_t format = payload.get_u8();
+        std::string path = payload.get_rest();
+        if (!payload.good() || path.empty()) {
+            send_error(conn, header.id, ErrorCode::MALFORMED);
+            return;
+        }
+        
+        if (executor) {
+            offload(conn, Lane::BULK, header.type,
+                    [this, header, format, path = std::move(path), micros = conn.micros,
+                     error_text = conn.error_text](OffloadResult& result) {
+                        result.failed = !transfer_file(header, format, path, micros, error_text,
+                                                       result.output);
+                        result.commit_lsn = header.type == MessageType::IMPORT ? commit_point() : 0;
+                    });
+            return;
+        }
+        size_t reply_at = conn.out_buf.size();
+        conn.request_failed = !transfer_file(header, format, path, conn.micros, conn.error_text,
+                                             conn.out_buf);
+        if (header.type == MessageType::IMPORT) {
+            hold_reply(conn, reply_at, commit_point());
+        }
+    }
+    
+    // Runs an IMPORT or EXPORT and queues its reply on out; false if it failed
+    bool transfer_file(const FrameHeader& header, uint8_t format, const std::string& path, bool micros,
+                       bool error_text, std::vector<char>& out) {
+        std::string resolved;
+        ErrorCode code = ErrorCode::FILE_ERROR;
+        if (!resolve_number_file(file_directory, path, header.type == MessageType::EXPORT, resolved)) {
+            // Outside the directory, or missing
+        } else if (header.type == MessageType::EXPORT) {
+            uint64_t count;
+            uint64_t bytes;
+            code = write_number_file(resolved, format, *store, count, bytes);
+            if (code == ErrorCode::NONE) {
+                FrameBuilder(out, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_u64(count)
+                    .put_u64(bytes)
+                    .finish();
+                return true;
+            }
+        } else {
+            std::vector<int32_t> numbers;
+            uint64_t read;
+            uint64_t invalid;
+            code = read_number_file(resolved, format, std::max(1u, std::thread::hardware_concurrency()),
+                                    numbers, read, invalid);
+            if (code == ErrorCode::NONE && !admit(numbers.size())) {
+                code = ErrorCode::MEMORY_LIMIT;
+            }
+            if (code == ErrorCode::NONE) {
+                int64_t timestamp = NumberStore::now_micros();
+                uint64_t inserted = import_numbers(numbers, timestamp);
+                FrameBuilder(out, header.id, MessageType::RESPONSE_SUCCESS)
+                    .put_u64(read)
+                    .put_u64(inserted)
+                    .put_u64(invalid)
+                    .put_i64(wire_time(micros, timestamp))
+                    .finish();
+                return true;
+            }
+        }
+        put_error(out, header.id, code, error_text);
+        return false;
+    }
+    
+    // Inserts sorted numbers with one timestamp and returns how many were
+    // new. Goes a batch at a time, so no shard lock is held for the whole
+    // file and each log record stays the size of a batch.
+    uint64_t import_numbers(const std::vector<int32_t>& numbers, int64_t timestamp) {
+        std::vector<int32_t> slice;
+        std::vector<bool> inserted;
+        uint64_t added = 0;
+        for (size_t offset = 0; offset < numbers.size(); offset += MAX_BATCH_SIZE) {
+            size_t end = std::min(numbers.size(), offset + MAX_BATCH_SIZE);
+            slice.assign(numbers.begin() + offset, numbers.begin() + end);
+            store->insert_batch_at(slice, timestamp, NO_EXPIRY, inserted);
+            added += std::count(inserted.begin(), inserted.end(), true);
+        }
+        return added;
+    }
+    
+    // Sums every reactor's counters; see protocol.h for the layout
+    void send_stats(Connection& conn, uint32_t id) {
+        StatsTotals totals;
+        for (const auto& reactor : reactor_stats) {
+            totals.add(*reactor);
+        }
+        
+        std::vector<uint8_t> rows;
+        for (size_t i = 0; i <= MESSAGE_TYPE_COUNT; ++i) {
+            if (totals.count[i] > 0) {
+                rows.push_back(i < MESSAGE_TYPE_COUNT ? i : STATS_UNKNOWN_TYPE);
+            }
+        }
+        
+        auto uptime = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::steady_clock::now() - started_at);
+        FrameBuilder frame(conn.out_buf, id, MessageType::RESPONSE_SUCCESS);
+        frame.put_u64(uptime.count())
+            .put_u64(store->size())
+            .put_u64(totals.accepted - totals.closed)
+            .put_u64(totals.accepted)
+            .put_u32(static_cast<uint32_t>(reactor_stats.size()))
+            .put_u32(static_cast<uint32_t>(rows.size()));
+        for (uint8_t type : rows) {
+            size_t i = type == STATS_UNKNOWN_TYPE ? MESSAGE_TYPE_COUNT : type;
+            const auto& service_time = totals.service_time[i];
+            frame.put_u8(type)
+                .put_u64(totals.count[i])
+                .put_u64(totals.errors[i])
+                .put_u64(static_cast<uint64_t>(service_time.mean()))
+                .put_u64(service_time.percentile(0.5))
+                .put_u64(service_time.percentile(0.99))
+                .put_u64(service_time.percentile(0.999))
+                .put_u64(service_time.max());
+        }
+        Follower::Status replication;
+        if (follower) {
+            replication = follower->status();
+        } else {
+            replication.state = STATS_PRIMARY;
+        }
+        frame.put_u8(io_backend == IoBackend::URING ? STATS_IO_URING : STATS_IO_EPOLL)
+            .put_u64(totals.io_syscalls)
+            .put_u64(store->memory_usage())
+            .put_u64(memory_limit)
+            .put_u64(feed ? feed->next_sequence() - 1 : 0)
+            .put_u8(replication.state)
+            .put_u64(replication.applied_seq)
+            .put_u64(replication.primary_seq)
+            .put_u64(replication.lag_us)
+            .finish();
+    }
+    
+    // Hands out a ring pair; the connection switches to it once the reply,
+    // which carries the descriptors, has been sent
+    void attach_shm(Connection& conn, const FrameHeader& header, PayloadReader& payload) {
+        uint32_t ring_size = payload.get_u32();
+        uint32_t flags = payload.get_u32();
+        // The rings take over right after this reply, so nothing may be in flight around it
+        if (!payload.good() || conn.mode != ConnMode::FRAMED || conn.shm ||
+            conn.pending_output() > 0 || conn.in_pos < conn.in_buf.size()) {
+            send_error(conn, header.id, ErrorCode::MALFORMED);
+            return;
+        }
+        
+        conn.shm = ShmChannel::create(ring_size, (flags & SHM_BUSY_POLL) != 0);
+        if (!conn.shm) {
+            send_error(conn, header.id, ErrorCode::UNAVAILABLE);
+            return;
+        }
+        FrameBuilder(conn.out_buf, header.id, MessageType::RESPONSE_SUCCESS)
+            .put_u32(conn.shm->size())
+            .finish();
+    }
+    
+    // Starts handing the daemon over to the peer, a new daemon process.
+    // Its connection waits, like an offloaded request, for the reply the
+    // drain thread posts.
+    void request_handoff(Connection& conn, const FrameHeader& header, PayloadReader& payload) {
+        if (!handoff.quiesce) {
+            send_error(conn, header.id, ErrorCode::DISABLED);
+            return;
+        }
+        std::optional<uint64_t> replayed;
+        if (payload.left() > 0) {
+            replayed = payload.get_u64();
+        }
+        // The reply passes descriptors, which only the socket carries
+        if (conn.mode != ConnMode::FRAMED || conn.shm || !payload.good() || payload.left() > 0) {
+            send_error(conn, header.id, ErrorCode::MALFORMED);
+            return;
+        }
+        struct ucred peer;
+        socklen_t length = sizeof(peer);
+        if (getsockopt(conn.fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) < 0 ||
+            (peer.uid != geteuid() && peer.uid != 0)) {
+            send_error(conn, header.id, ErrorCode::NOT_PERMITTED);
+            return;
+        }
+        // Another HANDOFF or a stop signal may be draining the daemon already
+        if (!begin_drain(&conn, header, replayed)) {
+            send_error(conn, header.id, ErrorCode::UNAVAILABLE);
+            return;
+        }
+        conn.handing_off = true;
+        conn.offloaded = true;
+        std::cout << "Handing over to process " << peer.pid << ", draining connections" << std::endl;
+    }
+    
+    // A stop signal drains the daemon and stops it; another one during the
+    // drain stops it at once
+    void take_signal() {
+        uint64_t value;
+        if (read(signal_bell, &value, sizeof(value)) != sizeof(value)) {
+            return;
+        }
+        if (begin_drain(nullptr, FrameHeader{})) {
+            std::cout << "Draining connections before stopping" << std::endl;
+            return;
+        }
+        std::cout << "Stopping" << std::endl;
+        stop();
+    }
+    
+    // Stops taking connections and has every reactor let go of its own;
+    // the drain thread takes it from there. For a handover, the reply goes
+    // to the connection handover with the id of the HANDOFF in header, and
+    // replayed is how far the new process has replayed the log itself.
+    // False if the daemon is draining already. Called on a reactor.
+    bool begin_drain(Connection* handover, const FrameHeader& header,
+                     std::optional<uint64_t> replayed = std::nullopt) {
+        bool idle = false;
+        if (!draining.compare_exchange_strong(idle, true)) {
+            return false;
+        }
+        if (drain_thread.joinable()) {
+            drain_thread.join();  // Of a handoff that fell through
+        }
+        if (handover) {
+            handoff_reply = OffloadResult();
+            handoff_reply.fd = handover->fd;
+            handoff_reply.serial = handover->serial;
+            handoff_reply.type = header.type;
+            handoff_reply.started = std::chrono::steady_clock::now();
+            handoff_id = header.id;
+            handoff_inbox = &handover->inbox;
+            handoff_replayed = replayed;
+        }
+        for (auto& inbox : reactor_inboxes) {
+            inbox->ring();
+        }
+        drain_thread = std::thread(&NumberDaemon::finish_drain, this, handover != nullptr);
+        return true;
+    }
+    
+    // Waits up to DRAIN_TIMEOUT for the connections to close, all but the
+    // one a HANDOFF came on, then stops the daemon or hands it over
+    void finish_drain(bool handover) {
+        auto deadline = std::chrono::steady_clock::now() + DRAIN_TIMEOUT;
+        while (running && open_connections() > (handover ? 1 : 0) &&
+               std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        if (!running) {
+            return;
+        }
+        if (handover) {
+            hand_over();
+        } else {
+            stop();
+        }
+    }
+    
+    uint64_t open_connections() const {
+        StatsTotals totals;
+        for (const auto& reactor : reactor_stats) {
+            totals.add(*reactor);
+        }
+        return totals.accepted - totals.closed;
+    }
+    
+    // Quiesces the store and answers the HANDOFF with the listening socket
+    // and a snapshot in a memfd, which the log continues from. Nothing
+    // changes the store from here on: the connections left take no
+    // requests, and the hooks stop the other writers. A new process that
+    // has replayed the log itself gets the socket alone as long as the log
+    // still holds every record after the point it reached.
+    void hand_over() {
+        if (executor) {
+            executor->wait_idle();  // Requests of connections the timeout cut off
+        }
+        handoff.quiesce();
+        uint64_t lsn = 0;
+        if (log) {
+            log->sync();
+            lsn = log->appended_lsn();
+        }
+        
+        OffloadResult reply = handoff_reply;
+        if (log && log->failed()) {
+            // The log lost records the new process would have to replay
+            std::cerr << "Not handing off: the write-ahead log has failed" << std::endl;
+            reply.failed = true;
+            put_error(reply.output, handoff_id, ErrorCode::UNAVAILABLE, false);
+            handoff_inbox->post(std::move(reply));
+            resume();
+            return;
+        }
+        if (log && handoff_replayed && log->first_lsn() <= *handoff_replayed &&
+            *handoff_replayed <= lsn) {
+            handed_off = true;
+            FrameBuilder(reply.output, handoff_id, MessageType::RESPONSE_SUCCESS)
+                .put_u64(store->size())
+                .put_u64(lsn)
+                .finish();
+            reply.fds = {server_fd};
+            std::cout << "Passing the socket; the log continues from " << *handoff_replayed
+                      << " to " << lsn << std::endl;
+            handoff_inbox->post(std::move(reply));
+            return;
+        }
+        size_t count = 0;
+        int fd = memfd_create("number_daemon_handoff", MFD_CLOEXEC);
+        bool ok = fd >= 0 && write_snapshot_to(fd, *store, handoff.expiry, lsn, count);
+        if (ok) {
+            handoff_snapshot = fd;
+            handed_off = true;
+            FrameBuilder(reply.output, handoff_id, MessageType::RESPONSE_SUCCESS)
+                .put_u64(count)
+                .put_u64(lsn)
+                .finish();
+            reply.fds = {server_fd, fd};
+            std::cout << "Passing " << count << " numbers at log position " << lsn << std::endl;
+        } else {
+            std::cerr << "Failed to snapshot for handoff: " << strerror(errno) << std::endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            reply.failed = true;
+            put_error(reply.output, handoff_id, ErrorCode::UNAVAILABLE, false);
+        }
+        handoff_inbox->post(std::move(reply));
+        if (!ok) {
+            resume();  // After the post: another drain may claim the handoff fields from here on
+        }
+    }
+    
+    // A handoff fell through after the drain: serves on
+    void resume() {
+        std::cerr << "Handoff did not complete, serving on" << std::endl;
+        handed_off = false;
+        if (handoff_snapshot >= 0) {
+            close(handoff_snapshot);
+            handoff_snapshot = -1;
+        }
+        handoff.resume();
+        draining = false;
+        for (auto& inbox : reactor_inboxes) {
+            inbox->ring();
+        }
+    }
+    
+    // limit 0 means no limit. The reply is produced by pump_scan().
+    void start_scan(Connection& conn, MessageType type, uint32_t id, int32_t lo, int32_t hi,
+                    uint32_t limit, bool legacy) {
+        ScanState scan{id, lo, hi, limit ? limit : std::numeric_limits<uint64_t>::max()};
+        scan.legacy = legacy;
+        scan.type = type;
+        scan.started = std::chrono::steady_clock::now();
+        if (type != MessageType::TIME_RANGE) {
+            scan.view = store->view();  // Every page comes from this point in time
+        }
+        conn.scan = std::move(scan);
+    }
+    
+    // Queues pages of the active scan until the output reaches SCAN_LOW_WATER
+    // or the scan completes. Without an executor the pages are read here; with
+    // one only the first is, which may well be all there is, and the rest are
+    // read in the bulk lane, a chunk at a time.
+    void pump_scan(Connection& conn) {
+        if (conn.offloaded || conn.pending_output() >= SCAN_LOW_WATER) {
+            return;  // Resumed once the chunk is back, or the client catches up
+        }
+        ScanState& scan = *conn.scan;
+        if (!executor || scan.sent == 0) {
+            if (fill_scan(scan, conn.micros, conn.out_buf, executor ? 1 : SCAN_LOW_WATER - conn.pending_output())) {
+                finish_scan(conn);
+                return;
+            }
+            if (!executor || conn.pending_output() >= SCAN_LOW_WATER) {
+                return;
+            }
+        }
+        offload(conn, Lane::BULK, scan.type,
+                [this, scan = scan, micros = conn.micros,
+                 room = SCAN_LOW_WATER - conn.pending_output()](OffloadResult& result) mutable {
+                    result.scan_done = fill_scan(scan, micros, result.output, room);
+                    result.scan = scan;
+                });
+    }
+    
+    // Appends pages of a scan to out until it has grown by room bytes or the
+    // scan completes. Returns true once the end of the reply is queued too.
+    // One extra entry is read per page to learn the resume cursor without a
+    // second lookup.
+    bool fill_scan(ScanState& scan, bool micros, std::vector<char>& out, size_t room) {
+        size_t start = out.size();
+        int32_t cursor = -1;  // Numbers are positive, so -1 marks an exhausted range
+        int64_t cursor_time = -1;
+        
+        while (true) {
+            if (out.size() - start >= room) {
+                return false;
+            }
+            
+            size_t page = static_cast<size_t>(std::min<uint64_t>(ENTRIES_PER_FRAME, scan.remaining));
+            auto entries = scan.by_time
+                ? store->time_range(scan.next_time, scan.next, scan.time_hi, page + 1)
+                : scan.view ? scan.view->range(scan.next, scan.hi, page + 1)
+                : store->range(scan.next, scan.hi, page + 1);
+            size_t count = std::min(entries.size(), page);
+            
+            if (scan.legacy) {
+                for (size_t i = 0; i < count; ++i) {
+                    IPCMessage data_msg;
+                    memset(&data_msg, 0, sizeof(data_msg));
+                    data_msg.type = MessageType::RESPONSE_DATA;
+                    data_msg.number = entries[i].number;
+                    data_msg.timestamp = wire_time(micros, entries[i].timestamp);
+                    const char* bytes = reinterpret_cast<const char*>(&data_msg);
+                    out.insert(out.end(), bytes, bytes + sizeof(data_msg));
+                }
+            } else if (count > 0) {
+                FrameBuilder frame(out, scan.id, MessageType::RESPONSE_DATA);
+                frame.put_u32(static_cast<uint32_t>(count));
+                for (size_t i = 0; i < count; ++i) {
+                    frame.put_entry(entries[i].number, wire_time(micros, entries[i].timestamp));
+                }
+                frame.finish();
+            }
+            scan.sent += count;
+            scan.remaining -= count;
+            
+            if (entries.size() <= page) {
+                break;
+            }
+            scan.next = entries[page].number;
+            scan.next_time = entries[page].timestamp;
+            if (scan.remaining == 0) {
+                cursor = scan.next;
+                cursor_time = wire_time(micros, scan.next_time);
+                break;
+            }
+        }
+        
+        if (scan.legacy) {
+            IPCMessage end_msg;
+            memset(&end_msg, 0, sizeof(end_msg));
+            end_msg.type = MessageType::RESPONSE_SUCCESS;
+            end_msg.number = -1; // End marker
+            const char* bytes = reinterpret_cast<const char*>(&end_msg);
+            out.insert(out.end(), bytes, bytes + sizeof(end_msg));
+        } else {
+            FrameBuilder end(out, scan.id, MessageType::RESPONSE_SUCCESS);
+            end.put_u64(scan.sent);
+            if (scan.type == MessageType::WATCH) {
+                end.put_u64(feed->next_sequence());
+            } else if (scan.by_time) {
+                end.put_i64(cursor_time).put_i32(cursor);
+            } else {
+                end.put_i32(cursor);
+            }
+            end.finish();
+        }
+        return true;
+    }
+    
+    // Counts a scan whose reply is complete
+    static void finish_scan(Connection& conn) {
+        conn.stats.record(conn.scan->type, false, std::chrono::steady_clock::now() - conn.scan->started);
+        conn.scan.reset();
+    }
+    
+    // Queues the changes a subscriber has not seen yet, once its listing is
+    // done, until the output reaches SCAN_LOW_WATER or it has caught up and
+    // waits for the feed's bell. Returns false if it fell out of the feed.
+    bool pump_watch(Connection& conn) {
+        if (!conn.watch || conn.scan) {
+            return true;
+        }
+        
+        conn.watch->clear_bell();
+        if (conn.released) {
+            return true;  // The subscription ended with the GOAWAY
+        }
+        bool queued = false;
+        while (conn.pending_output() < SCAN_LOW_WATER) {
+            size_t events = 0;
+            bool current = conn.watch->read(ENTRIES_PER_FRAME, [&](const ChangeEvent& event) {
+                FrameBuilder(conn.out_buf, conn.watch_id, MessageType::WATCH_EVENT)
+                    .put_u64(event.seq)
+                    .put_u8(static_cast<uint8_t>(event.op))
+                    .put_i64(wire_time(conn, event.timestamp))
+                    .put_u32(static_cast<uint32_t>(event.numbers.size()))
+                    .put_bytes(event.numbers.data(), event.numbers.size() * sizeof(int32_t))
+                    .finish();
+                ++events;
+            });
+            if (!current) {
+                return false;  // Slow consumer
+            }
+            queued = queued || events > 0;
+            if (events == 0 && conn.watch->prepare_idle()) {
+                break;
+            }
+        }
+        return !queued || flush_output(conn);
+    }
+    
+    // Serves a request in the legacy fixed-size IPCMessage protocol
+    void process_message(Connection& conn, const IPCMessage& msg) {
+        IPCMessage response;
+        memset(&response, 0, sizeof(response));
+        
+        if (msg.type == MessageType::PRINT_ALL) {
+            // Success header, one RESPONSE_DATA message per entry, then an end marker
+            response.type = MessageType::RESPONSE_SUCCESS;
+            conn.queue(&response, sizeof(response));
+            start_scan(conn, msg.type, 0, std::numeric_limits<int32_t>::min(),
+                       std::numeric_limits<int32_t>::max(), 0, true);
+            return;
+        }
+        
+        ErrorCode refused = !is_mutation(msg.type) ? ErrorCode::NONE
+                            : follower                ? ErrorCode::READ_ONLY
+                            : log && log->failed()    ? ErrorCode::LOG_FAILED
+                                                      : ErrorCode::NONE;
+        OpResult result = refused != ErrorCode::NONE ? OpResult{refused, msg.number, 0}
+                                                     : execute(msg.type, msg.number);
+        if (is_mutation(msg.type)) {
+            commit_mutation(conn);
+        }
+        if (result.code == ErrorCode::NONE) {
+            response.type = MessageType::RESPONSE_SUCCESS;
+            response.number = result.number;
+            response.timestamp = wire_time(conn, result.timestamp);
+        } else {
+            conn.request_failed = true;
+            response.type = MessageType::RESPONSE_ERROR;
+            strncpy(response.error_msg, error_string(result.code),
+                    sizeof(response.error_msg) - 1);
+        }
+        
+        conn.queue(&response, sizeof(response));
+    }
+};
+
+// Builds the storage engine selected with --engine, or nullptr for an unknown name
+std::unique_ptr<NumberStore> create_store(const std::string& engine, size_t shards) {
+    if (engine == "map") {
+        return std::make_unique<MapStore>(shards);
+    }
+    if (engine == "bitmap") {
+        return std::make_unique<BitmapStore>(shards);
+    }
+    if (engine == "mvcc") {
+        return std::make_unique<MvccStore>(shards);
+    }
+    return nullptr;
+}
+
+constexpr size_t DEFAULT_WORKERS = 2;
+constexpr const char* DEFAULT_SOCKET_PATH = "/tmp/number_daemon.sock";
+
+// Parses a byte count with an optional K, M or G suffix; false if malformed
+// or too large for size_t
+bool parse_size(const std::string& text, size_t& bytes) {
+    size_t digits = text.find_first_not_of("0123456789");
+    size_t value;
+    if (!parse_count(text.substr(0, digits), value)) {
+        return false;
+    }
+    std::string suffix = digits == std::string::npos ? "" : text.substr(digits);
+    unsigned shift = 0;
+    if (suffix == "K" || suffix == "k") {
+        shift = 10;
+    } else if (suffix == "M" || suffix == "m") {
+        shift = 20;
+    } else if (suffix == "G" || suffix == "g") {
+        shift = 30;
+    } else if (!suffix.empty()) {
+        return false;
+    }
+    if (value > (SIZE_MAX >> shift)) {
+        return false;
+    }
+    bytes = value << shift;
+    return true;
+}
+
+// The new process's side of HANDOFF: asks the daemon listening on path for
+// its socket, which arrives once it has drained, with its number count and
+// log position. replayed is how far this process has replayed the log
+// already, if at all; when the daemon's log holds the rest it passes the
+// socket alone and snapshot_fd is -1, otherwise a snapshot of its state.
+// Returns false with error set if it could not be asked or refused; absent
+// tells that no daemon listens there.
+bool take_over(const std::string& path, std::optional<uint64_t> replayed, int& listen_fd,
+               int& snapshot_fd, uint64_t& count, uint64_t& wal_lsn, bool& absent,
+               std::string& error) {
+    absent = false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = strerror(errno);
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        absent = errno == ENOENT || errno == ECONNREFUSED;
+        error = strerror(errno);
+        close(fd);
+        return false;
+    }
+    
+    // The hello is answered before HANDOFF is sent, so that the descriptors
+    // come with the first byte of the reply
+    std::vector<char> out;
+    encode_hello(out, PROTOCOL_VERSION, 0);
+    char hello[HELLO_SIZE];
+    bool ok = write_all(fd, out.data(), out.size());
+    for (size_t got = 0; ok && got < sizeof(hello);) {
+        ssize_t n = recv(fd, hello + got, sizeof(hello) - got, 0);
+        ok = n > 0 || (n < 0 && errno == EINTR);
+        got += std::max<ssize_t>(n, 0);
+    }
+    if (!ok || decode_hello(hello).version != PROTOCOL_VERSION) {
+        error = "handshake failed";
+        close(fd);
+        return false;
+    }
+    
+    out.clear();
+    FrameBuilder request(out, 1, MessageType::HANDOFF);
+    if (replayed) {
+        request.put_u64(*replayed);
+    }
+    request.finish();
+    FrameHeader header{};
+    std::vector<char> payload;
+    int fds[2] = {-1, -1};
+    ok = write_all(fd, out.data(), out.size()) && recv_frame_with_fds(fd, header, payload, fds, 2);
+    close(fd);
+    PayloadReader reply(payload.data(), payload.size());
+    count = reply.get_u64();
+    wal_lsn = reply.get_u64();
+    if (ok && header.type == MessageType::RESPONSE_SUCCESS && reply.good() && fds[0] >= 0 &&
+        (fds[1] >= 0 || replayed)) {
+        listen_fd = fds[0];
+        snapshot_fd = fds[1];
+        return true;
+    }
+    for (int passed : fds) {
+        if (passed >= 0) {
+            close(passed);
+        }
+    }
+    error = !ok ? "the daemon hung up" : error_string(header.status);
+    return false;
+}
+
+void print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [options]" << std::endl;
+    std::cout << "  -t, --threads N   Number of reactor threads (default: 1)" << std::endl;
+    std::cout << "  -s, --shards N    Number of store shards, rounded up to a power of two (default: "
+              << NumberStore::DEFAULT_SHARD_COUNT << ")" << std::endl;
+    std::cout << "  -e, --engine NAME Storage engine: map (ordered map, default)," << std::endl;
+    std::cout << "                    bitmap (compressed bitmap, compact for dense ID ranges) or" << std::endl;
+    std::cout << "                    mvcc (versioned trees; scans never block writers)" << std::endl;
+    std::cout << "  -w, --wal PATH    Log mutations to PATH and replay it at startup" << std::endl;
+    std::cout << "  --wal-sync MODE   When logged mutations are synced: always (sync at once)," << std::endl;
+    std::cout << "                    group (default, shared commits) or async (replies don't wait)" << std::endl;
+    std::cout << "  --wal-window USEC Group commit window, or async sync interval (default: 1000)" << std::endl;
+    std::cout << "  --snapshot PATH   Load PATH at startup and rewrite it periodically; the" << std::endl;
+    std::cout << "                    log is then only replayed from where the snapshot ends" << std::endl;
+    std::cout << "  --snapshot-interval SEC" << std::endl;
+    std::cout << "                    Seconds between snapshots (default: 300)" << std::endl;
+    std::cout << "  --time-index      Index numbers by insertion time to serve TIME_RANGE and" << std::endl;
+    std::cout << "                    COUNT_SINCE (default: refused; costs 64 bytes per number)" << std::endl;
+    std::cout << "  --watch-buffer N  Changes kept for WATCH subscribers, in numbers; slower" << std::endl;
+    std::cout << "                    subscribers are disconnected (default: "
+              << ChangeFeed::DEFAULT_CAPACITY << ")" << std::endl;
+    std::cout << "  --io BACKEND      Socket I/O: epoll (default) or uring (io_uring, where the" << std::endl;
+    std::cout << "                    kernel supports it; falls back to epoll otherwise)" << std::endl;
+    std::cout << "  --workers N       Worker threads for scans and large batches, which then no" << std::endl;
+    std::cout << "                    longer hold up a reactor; 0 runs everything on the reactors" << std::endl;
+    std::cout << "                    (default: " << DEFAULT_WORKERS << ")" << std::endl;
+    std::cout << "  --memory-limit SIZE" << std::endl;
+    std::cout << "                    Refuse INSERTs once the store would hold more than SIZE" << std::endl;
+    std::cout << "                    bytes (K, M or G suffix; default: no limit)" << std::endl;
+    std::cout << "  --files DIR       Serve IMPORT and EXPORT, reading and writing files in DIR" << std::endl;
+    std::cout << "                    only (default: refused)" << std::endl;
+    std::cout << "  --socket PATH     Listen on PATH (default: " << DEFAULT_SOCKET_PATH << ")" << std::endl;
+    std::cout << "  --follow PATH     Run as a read-only follower of the daemon listening on PATH," << std::endl;
+    std::cout << "                    copying its numbers and applying its changes as they happen" << std::endl;
+    std::cout << "  --takeover        Take the socket and the numbers over from the daemon running" << std::endl;
+    std::cout << "                    on it, which drains and exits (hot restart); starts afresh" << std::endl;
+    std::cout << "                    if there is none" << std::endl;
+    std::cout << "  -h, --help        Show this help" << std::endl;
+}
+
+int invalid_option(const char* prog, const std::string& option, const std::string& value) {
+    std::cerr << "Invalid value for " << option << ": " << value << std::endl;
+    print_usage(prog);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    size_t threads = 1;
+    size_t shards = NumberStore::DEFAULT_SHARD_COUNT;
+    std::string engine = "map";
+    std::string wal_path;
+    SyncPolicy sync_policy = SyncPolicy::GROUP;
+    long wal_window = 1000;
+    std::string snapshot_path;
+    long snapshot_interval = 300;
+    bool time_index = false;
+    size_t watch_buffer = ChangeFeed::DEFAULT_CAPACITY;
+    IoBackend io_backend = IoBackend::EPOLL;
+    size_t workers = DEFAULT_WORKERS;
+    size_t memory_limit = 0;
+    std::string file_directory;
+    std::string socket_path = DEFAULT_SOCKET_PATH;
+    std::string primary_path;
+    bool takeover = false;
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+            if (!parse_count(argv[++i], threads)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if ((arg == "-s" || arg == "--shards") && i + 1 < argc) {
+            if (!parse_count(argv[++i], shards)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if ((arg == "-e" || arg == "--engine") && i + 1 < argc) {
+            engine = argv[++i];
+        } else if ((arg == "-w" || arg == "--wal") && i + 1 < argc) {
+            wal_path = argv[++i];
+        } else if (arg == "--wal-sync" && i + 1 < argc) {
+            if (!parse_sync_policy(argv[++i], sync_policy)) {
+                std::cerr << "Unknown sync mode: " << argv[i] << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--wal-window" && i + 1 < argc) {
+            if (!parse_count(argv[++i], wal_window)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--snapshot" && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (arg == "--snapshot-interval" && i + 1 < argc) {
+            if (!parse_count(argv[++i], snapshot_interval)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--time-index") {
+            time_index = true;
+        } else if (arg == "--watch-buffer" && i + 1 < argc) {
+            if (!parse_count(argv[++i], watch_buffer)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--io" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "epoll") {
+                io_backend = IoBackend::EPOLL;
+            } else if (name == "uring") {
+                io_backend = IoBackend::URING;
+            } else {
+                std::cerr << "Unknown I/O backend: " << name << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--workers" && i + 1 < argc) {
+            if (!parse_count(argv[++i], workers)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--memory-limit" && i + 1 < argc) {
+            if (!parse_size(argv[++i], memory_limit)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--files" && i + 1 < argc) {
+            char resolved[PATH_MAX];
+            struct stat st;
+            if (!realpath(argv[++i], resolved) || stat(resolved, &st) < 0 || !S_ISDIR(st.st_mode)) {
+                std::cerr << "Not a directory: " << argv[i] << std::endl;
+                return 1;
+            }
+            file_directory = resolved;
+        } else if (arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--follow" && i + 1 < argc) {
+            primary_path = argv[++i];
+        } else if (arg == "--takeover") {
+            takeover = true;
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (!primary_path.empty() && (!wal_path.empty() || !snapshot_path.empty())) {
+        // The primary's listing is the follower's recovery
+        std::cerr << "--follow cannot be combined with --wal or --snapshot" << std::endl;
+        return 1;
+    }
+    if (primary_path == socket_path) {
+        std::cerr << "A daemon cannot follow itself" << std::endl;
+        return 1;
+    }
+    
+    auto store = create_store(engine, shards);
+    if (!store) {
+        std::cerr << "Unknown storage engine: " << engine << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (time_index) {
+        store->enable_time_index();
+    }
+    
+    if (io_backend == IoBackend::URING && !IoUring::probe()) {
+        std::cout << "io_uring is not supported here, using epoll" << std::endl;
+        io_backend = IoBackend::EPOLL;
+    }
+    
+    // Attached before the log is replayed so that it sees the logged TTLs
+    ExpiryIndex expiry;
+    store->add_listener(&expiry);
+    
+    // The snapshot file is loaded and the log replayed from where it ends.
+    // A takeover with a log does that while the old daemon still serves, and
+    // the old daemon then passes the socket alone, so that only what it
+    // logged meanwhile is replayed once it has drained. Otherwise its state
+    // arrives as a snapshot, which replaces the files.
+    std::unique_ptr<WriteAheadLog> log;
+    if (!wal_path.empty()) {
+        log = std::make_unique<WriteAheadLog>(wal_path, sync_policy,
+                                              std::chrono::microseconds(std::max(wal_window, 1L)));
+    }
+    uint64_t snapshot_lsn = 0;  // The store holds what was logged before it
+    bool loaded = false;
+    auto load_files = [&] {
+        loaded = true;
+        if (snapshot_path.empty()) {
+            return true;
+        }
+        auto start = std::chrono::steady_clock::now();
+        size_t count;
+        bool found;
+        if (!load_snapshot(snapshot_path, *store, &expiry, std::max(1u, std::thread::hardware_concurrency()),
+                           snapshot_lsn, count, found)) {
+            return false;
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start);
+        if (found) {
+            std::cout << "Loaded " << count << " numbers from " << snapshot_path << " in "
+                      << elapsed.count() << " ms" << std::endl;
+        }
+        return true;
+    };
+    
+    int listen_fd = -1;
+    std::optional<uint64_t> handed_lsn;  // Where the log ends that came with the socket alone
+    uint64_t handed_count = 0;
+    auto takeover_start = std::chrono::steady_clock::now();
+    if (takeover) {
+        std::optional<uint64_t> replayed;
+        if (log) {
+            int log_file = open(wal_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!load_files()) {
+                return 1;
+            }
+            size_t records;
+            uint64_t lsn = snapshot_lsn;
+            bool caught_up = log->catch_up(log_file, *store, records, lsn);
+            if (log_file >= 0) {
+                close(log_file);
+            }
+            if (caught_up) {
+                replayed = snapshot_lsn = lsn;
+                std::cout << "Replayed " << records << " log records from " << wal_path
+                          << " ahead of the takeover" << std::endl;
+            } else {
+                store->clear();
+                loaded = false;
+            }
+        }
+        takeover_start = std::chrono::steady_clock::now();
+        int snapshot_fd;
+        uint64_t count, wal_lsn;
+        bool absent;
+        std::string error;
+        if (take_over(socket_path, replayed, listen_fd, snapshot_fd, count, wal_lsn, absent, error)) {
+            if (snapshot_fd < 0) {
+                handed_lsn = wal_lsn;
+                handed_count = count;
+            } else {
+                if (replayed) {
+                    store->clear();
+                }
+                size_t loaded_count;
+                bool ok = load_snapshot_from(snapshot_fd, "handed over", *store, &expiry,
+                                             std::max(1u, std::thread::hardware_concurrency()),
+                                             snapshot_lsn, loaded_count);
+                close(snapshot_fd);
+                if (!ok) {
+                    return 1;
+                }
+                loaded = true;
+                auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - takeover_start);
+                std::cout << "Took over " << loaded_count << " numbers from the daemon on "
+                          << socket_path << " in " << elapsed.count() << " ms" << std::endl;
+            }
+        } else if (absent) {
+            std::cout << "No daemon to take over on " << socket_path << ", starting afresh" << std::endl;
+        } else {
+            std::cerr << "Cannot take over from the daemon on " << socket_path << ": " << error << std::endl;
+            return 1;
+        }
+    }
+    if (!loaded && !load_files()) {
+        return 1;
+    }
+    
+    if (log) {
+        size_t records;
+        if (!log->open(*store, records, snapshot_lsn)) {
+            return 1;
+        }
+        std::cout << "Replayed " << records << " log records from " << wal_path << " ("
+                  << store->size() << " numbers)" << std::endl;
+        if (handed_lsn) {
+            // Another --wal than the old daemon's would not end where its log did
+            if (log->appended_lsn() != *handed_lsn || store->size() != handed_count) {
+                std::cerr << wal_path << " does not hold the log of the daemon on " << socket_path
+                          << ", which passed " << handed_count << " numbers at log position "
+                          << *handed_lsn << std::endl;
+                return 1;
+            }
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - takeover_start);
+            std::cout << "Took over " << handed_count << " numbers from the daemon on "
+                      << socket_path << " in " << elapsed.count() << " ms" << std::endl;
+        }
+        store->add_listener(log.get());
+    }
+    if (expiry.size() > 0) {
+        std::cout << expiry.size() << " numbers have a TTL" << std::endl;
+    }
+    
+    ChangeFeed feed(watch_buffer);
+    store->add_listener(&feed);
+    
+    NumberStore& number_store = *store;
+    WriteAheadLog* write_ahead_log = log.get();
+    NumberDaemon daemon(socket_path, std::move(store), std::move(log), threads, &feed,
+                        io_backend, workers, memory_limit, file_directory);
+    if (listen_fd >= 0) {
+        daemon.adopt_listener(listen_fd);
+    }
+    
+    // Declared after the daemon so that they stop before the store goes away
+    std::unique_ptr<Follower> follower;
+    if (!primary_path.empty()) {
+        follower = std::make_unique<Follower>(primary_path, number_store);
+        daemon.set_follower(follower.get());
+    }
+    Expirer expirer(number_store, expiry);
+    std::unique_ptr<Snapshotter> snapshotter;
+    if (!snapshot_path.empty()) {
+        snapshotter = std::make_unique<Snapshotter>(
+            snapshot_path, number_store, &expiry, write_ahead_log,
+            std::chrono::seconds(std::max(snapshot_interval, 1L)), snapshot_lsn);
+    }
+    
+    NumberDaemon::HandoffHooks hooks;
+    hooks.quiesce = [&] {
+        if (follower) {
+            follower->stop();
+        }
+        expirer.stop();
+        if (snapshotter) {
+            snapshotter->stop();
+        }
+    };
+    hooks.resume = [&] {
+        if (follower) {
+            follower->start();
+        }
+        expirer.start();
+        if (snapshotter) {
+            snapshotter->start();
+        }
+    };
+    hooks.expiry = &expiry;
+    daemon.set_handoff(std::move(hooks));
+    
+    if (!daemon.start()) {
+        std::cerr << "Failed to start daemon" << std::endl;
+        return 1;
+    }
+    
+    if (follower) {
+        follower->start();
+    }
+    expirer.start();
+    if (snapshotter) {
+        snapshotter->start();
     }
     
     std::cout << "Number Daemon running. Press Ctrl+C to stop." << std::endl;
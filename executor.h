@@ -0,0 +1,199 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+// Fixed pool of worker threads for requests too long to run on a reactor.
+// Every worker has a deque per lane. Submitted tasks are spread over the
+// workers round-robin, and a worker takes the oldest task of its own deque
+// or, if that is empty, steals the newest of another worker's; claiming
+// only locks the deque it takes from. A worker looks for latency tasks in
+// every deque before it takes a bulk task, and bulk tasks occupy at most
+// all but one worker, so a latency task never waits behind a bulk task
+// unless there is only one worker. A worker that finds nothing to claim
+// parks until a submit or a finished bulk task wakes it.
+
+enum class Lane {
+    LATENCY,  // Short requests a client waits on
+    BULK      // Scans and other long-running work
+};
+
+class Executor {
+public:
+    using Task = std::function<void()>;
+    
+private:
+    static constexpr size_t LANES = 2;
+    static constexpr size_t LATENCY = static_cast<size_t>(Lane::LATENCY);
+    static constexpr size_t BULK = static_cast<size_t>(Lane::BULK);
+    
+    struct alignas(64) Worker {
+        std::mutex mutex;
+        std::deque<Task> lanes[LANES];
+    };
+    
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_worker{0};
+    
+    std::atomic<size_t> queued[LANES] = {};  // Tasks in the deques, changed under their worker's lock
+    std::atomic<size_t> pending{0};          // Tasks submitted and not yet finished
+    std::atomic<size_t> bulk_running{0};
+    size_t bulk_limit;
+    
+    // Parking: only taken by workers going to sleep and by whoever wakes them
+    std::mutex park_mutex;
+    std::condition_variable ready;
+    std::condition_variable idle;
+    std::atomic<size_t> sleepers{0};
+    std::atomic<bool> stopping{false};
+    
+    bool claimable() const {
+        return queued[LATENCY] > 0 || (queued[BULK] > 0 && bulk_running < bulk_limit);
+    }
+    
+    // Wakes a parked worker, if any. Every change that can make claimable()
+    // true comes before this, and a worker checks claimable() after counting
+    // itself as a sleeper, so one of the two sees the other.
+    void wake() {
+        if (sleepers > 0) {
+            std::lock_guard lock(park_mutex);
+            ready.notify_one();
+        }
+    }
+    
+    // Takes a task of lane, from worker home first
+    bool take(size_t home, size_t lane, Task& task) {
+        size_t n = workers.size();
+        for (size_t k = 0; k < n; ++k) {
+            Worker& worker = *workers[(home + k) % n];
+            std::lock_guard lock(worker.mutex);
+            auto& tasks = worker.lanes[lane];
+            if (tasks.empty()) {
+                continue;
+            }
+            if (k == 0) {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            } else {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            }
+            --queued[lane];
+            return true;
+        }
+        return false;
+    }
+    
+    void release_bulk() {
+        --bulk_running;
+        if (queued[BULK] > 0) {
+            wake();
+        }
+    }
+    
+    bool claim(size_t home, Task& task, size_t& lane) {
+        if (queued[LATENCY] > 0 && take(home, LATENCY, task)) {
+            lane = LATENCY;
+            return true;
+        }
+        if (queued[BULK] == 0) {
+            return false;
+        }
+        size_t running = bulk_running;
+        do {
+            if (running >= bulk_limit) {
+                return false;
+            }
+        } while (!bulk_running.compare_exchange_weak(running, running + 1));
+        if (take(home, BULK, task)) {
+            lane = BULK;
+            return true;
+        }
+        release_bulk();
+        return false;
+    }
+    
+    void work(size_t home) {
+        while (!stopping) {
+            size_t lane;
+            {
+                Task task;
+                if (!claim(home, task, lane)) {
+                    std::unique_lock lock(park_mutex);
+                    ++sleepers;
+                    ready.wait(lock, [this] { return stopping || claimable(); });
+                    --sleepers;
+                    continue;
+                }
+                task();
+            }
+            if (lane == BULK) {
+                release_bulk();
+            }
+            if (--pending == 0) {
+                std::lock_guard lock(park_mutex);
+                idle.notify_all();
+            }
+        }
+    }
+    
+public:
+    explicit Executor(size_t worker_count) {
+        size_t n = std::max<size_t>(worker_count, 1);
+        bulk_limit = std::max<size_t>(n - 1, 1);
+        for (size_t i = 0; i < n; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < n; ++i) {
+            threads.emplace_back(&Executor::work, this, i);
+        }
+    }
+    
+    // Waits for the running tasks; queued ones are dropped
+    ~Executor() {
+        {
+            std::lock_guard lock(park_mutex);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+    
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    
+    size_t size() const {
+        return workers.size();
+    }
+    
+    void submit(Lane lane, Task task) {
+        size_t index = static_cast<size_t>(lane);
+        Worker& worker = *workers[next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size()];
+        ++pending;
+        {
+            std::lock_guard lock(worker.mutex);
+            worker.lanes[index].push_back(std::move(task));
+            ++queued[index];
+        }
+        wake();
+    }
+    
+    // Blocks until no task is queued or running
+    void wait_idle() {
+        std::unique_lock lock(park_mutex);
+        idle.wait(lock, [this] { return pending == 0; });
+    }
+};
+
+#endif
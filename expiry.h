@@ -0,0 +1,289 @@
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "number_store.h"
+
+// Per-number TTLs. The store passes the expiry time of every insert to its
+// listeners; ExpiryIndex, one of them, files the numbers that have one in a
+// hierarchical timer wheel, and an Expirer thread removes them in batches
+// once they come due.
+
+struct Timer {
+    int32_t number;
+    int64_t deadline;  // Unix seconds
+};
+
+// Hierarchical timing wheel with one-second ticks. Level l has SLOTS slots
+// of 64^l seconds each; a timer is filed at the lowest level whose span
+// covers the time left until its deadline and drops a level each time its
+// slot comes around, so it is moved at most LEVELS times before it fires.
+// Deadlines past the top level (about 194 days out) wait in the top slot
+// that comes around last and are filed again from there.
+class TimerWheel {
+public:
+    static constexpr unsigned LEVEL_BITS = 6;
+    static constexpr unsigned LEVELS = 4;
+    static constexpr size_t SLOTS = size_t(1) << LEVEL_BITS;
+    
+private:
+    std::vector<Timer> slots[LEVELS][SLOTS];
+    int64_t current;  // Next tick to fire
+    size_t pending;
+    
+    void file(const Timer& timer) {
+        int64_t deadline = std::max(timer.deadline, current);
+        uint64_t delta = static_cast<uint64_t>(deadline - current);
+        unsigned level = (63 - __builtin_clzll(delta | 1)) / LEVEL_BITS;
+        size_t slot;
+        if (level < LEVELS) {
+            slot = (deadline >> (level * LEVEL_BITS)) & (SLOTS - 1);
+        } else {
+            level = LEVELS - 1;
+            slot = ((current >> (level * LEVEL_BITS)) - 1) & (SLOTS - 1);
+        }
+        slots[level][slot].push_back(timer);
+    }
+    
+    void cascade(unsigned level, size_t slot) {
+        std::vector<Timer> timers;
+        timers.swap(slots[level][slot]);
+        for (const auto& timer : timers) {
+            file(timer);
+        }
+    }
+    
+public:
+    explicit TimerWheel(int64_t now) : current(now), pending(0) {}
+    
+    void schedule(const Timer& timer) {
+        file(timer);
+        ++pending;
+    }
+    
+    // Appends the timers due at or before now to due
+    void advance(int64_t now, std::vector<Timer>& due) {
+        if (pending == 0) {
+            current = std::max(current, now + 1);
+            return;
+        }
+        while (current <= now) {
+            // Reaching slot 0 of a level empties the next slot of the level above
+            for (unsigned level = 1; level < LEVELS; ++level) {
+                if (current & ((int64_t(1) << (level * LEVEL_BITS)) - 1)) {
+                    break;
+                }
+                cascade(level, (current >> (level * LEVEL_BITS)) & (SLOTS - 1));
+            }
+            auto& slot = slots[0][current & (SLOTS - 1)];
+            due.insert(due.end(), slot.begin(), slot.end());
+            pending -= slot.size();
+            slot.clear();
+            ++current;
+        }
+    }
+    
+    void clear() {
+        for (auto& level : slots) {
+            for (auto& slot : level) {
+                std::vector<Timer>().swap(slot);
+            }
+        }
+        pending = 0;
+    }
+    
+    size_t size() const {
+        return pending;
+    }
+};
+
+// Expiry times of the stored numbers that have one, kept up to date as the
+// store's listener. Removing a number drops its expiry, so the wheel may
+// still hold timers that no longer apply; they are skipped when they fire.
+class ExpiryIndex : public ChangeListener {
+private:
+    mutable std::mutex mutex;
+    std::unordered_map<int32_t, int64_t> deadlines;
+    TimerWheel wheel;
+    std::atomic<size_t> tracked;  // deadlines.size(), readable without the mutex
+    
+public:
+    ExpiryIndex() : wheel(NumberStore::now_seconds()), tracked(0) {}
+    
+    void on_insert(const int32_t* numbers, size_t count, int64_t, int64_t expires_at) override {
+        // A newly inserted number has no expiry to drop: removing it dropped it
+        if (expires_at == NO_EXPIRY) {
+            return;
+        }
+        std::lock_guard lock(mutex);
+        for (size_t i = 0; i < count; ++i) {
+            deadlines[numbers[i]] = expires_at;
+            wheel.schedule(Timer{numbers[i], expires_at});
+        }
+        tracked.store(deadlines.size(), std::memory_order_relaxed);
+    }
+    
+    void on_remove(const int32_t* numbers, size_t count) override {
+        // The caller's shard lock orders this after the numbers' on_insert
+        if (tracked.load(std::memory_order_relaxed) == 0) {
+            return;
+        }
+        std::lock_guard lock(mutex);
+        for (size_t i = 0; i < count; ++i) {
+            deadlines.erase(numbers[i]);
+        }
+        tracked.store(deadlines.size(), std::memory_order_relaxed);
+    }
+    
+    void on_clear() override {
+        std::lock_guard lock(mutex);
+        deadlines.clear();
+        wheel.clear();
+        tracked.store(0, std::memory_order_relaxed);
+    }
+    
+    // Number of stored numbers that have an expiry
+    size_t size() const {
+        return tracked.load(std::memory_order_relaxed);
+    }
+    
+    // Appends the numbers whose expiry has passed by now to due
+    void collect(int64_t now, std::vector<int32_t>& due) {
+        std::vector<Timer> fired;
+        std::lock_guard lock(mutex);
+        wheel.advance(now, fired);
+        for (const auto& timer : fired) {
+            auto it = deadlines.find(timer.number);
+            if (it != deadlines.end() && it->second == timer.deadline) {
+                due.push_back(timer.number);
+            }
+        }
+    }
+    
+    // True if number has an expiry and it has passed by now
+    bool expired(int32_t number, int64_t now) const {
+        std::lock_guard lock(mutex);
+        auto it = deadlines.find(number);
+        return it != deadlines.end() && it->second <= now;
+    }
+    
+    // Copy in ascending number order, for snapshots
+    std::vector<Timer> entries() const {
+        std::vector<Timer> result;
+        {
+            std::lock_guard lock(mutex);
+            result.reserve(deadlines.size());
+            for (const auto& entry : deadlines) {
+                result.push_back(Timer{entry.first, entry.second});
+            }
+        }
+        std::sort(result.begin(), result.end(), [](const Timer& a, const Timer& b) {
+            return a.number < b.number;
+        });
+        return result;
+    }
+    
+    // Adds expiries loaded from a snapshot; the numbers must be in the store
+    void load(const int32_t* numbers, const int64_t* expiries, size_t count) {
+        std::lock_guard lock(mutex);
+        deadlines.reserve(deadlines.size() + count);
+        for (size_t i = 0; i < count; ++i) {
+            deadlines[numbers[i]] = expiries[i];
+            wheel.schedule(Timer{numbers[i], expiries[i]});
+        }
+        tracked.store(deadlines.size(), std::memory_order_relaxed);
+    }
+};
+
+// Expiry time for a TTL given in seconds, 0 meaning none
+inline int64_t expiry_after(uint32_t ttl_seconds) {
+    return ttl_seconds == 0 ? NO_EXPIRY : NumberStore::now_seconds() + ttl_seconds;
+}
+
+// Removes expired numbers in the background. Each round removes what came
+// due with remove_batch_if() in batches of BATCH numbers, so a shard lock is
+// held for at most one batch and readers of other shards never wait.
+class Expirer {
+public:
+    static constexpr size_t BATCH = 4096;
+    
+private:
+    NumberStore& store;
+    ExpiryIndex& index;
+    std::chrono::milliseconds interval;
+    std::atomic<uint64_t> expired;
+    
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+    std::thread thread;
+    
+    void run() {
+        std::unique_lock lock(mutex);
+        while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            reap();
+            lock.lock();
+        }
+    }
+    
+    void reap() {
+        int64_t now = NumberStore::now_seconds();
+        std::vector<int32_t> due;
+        index.collect(now, due);
+        
+        // A number re-inserted with a later expiry since it was collected stays
+        auto still_expired = [this, now](int32_t number) { return index.expired(number, now); };
+        std::vector<int32_t> batch;
+        std::vector<bool> removed;
+        for (size_t start = 0; start < due.size(); start += BATCH) {
+            batch.assign(due.begin() + start, due.begin() + std::min(due.size(), start + BATCH));
+            store.remove_batch_if(batch, still_expired, removed);
+            expired.fetch_add(std::count(removed.begin(), removed.end(), true),
+                              std::memory_order_relaxed);
+        }
+    }
+    
+public:
+    Expirer(NumberStore& number_store, ExpiryIndex& expiry_index,
+            std::chrono::milliseconds every = std::chrono::milliseconds(250))
+        : store(number_store), index(expiry_index), interval(every), expired(0),
+          stopping(false) {}
+    
+    ~Expirer() {
+        stop();
+    }
+    
+    void start() {
+        stopping = false;
+        reap();  // Whatever expired while the daemon was down
+        thread = std::thread(&Expirer::run, this);
+    }
+    
+    void stop() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    
+    // Numbers removed because they expired
+    uint64_t expired_count() const {
+        return expired.load(std::memory_order_relaxed);
+    }
+};
+
+#endif
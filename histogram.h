@@ -0,0 +1,146 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+// Log-linear latency histograms in the spirit of HdrHistogram. Values below
+// 2^SUB_BITS get a bucket each; above that every power of two is split into
+// 2^(SUB_BITS - 1) buckets, so a bucket is never wider than 2^(1 - SUB_BITS)
+// of its values. Values are nanoseconds by convention.
+template <unsigned SUB_BITS>
+struct LogLinearScale {
+    static constexpr uint64_t HALF = uint64_t(1) << (SUB_BITS - 1);
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 2) * HALF;
+    
+    static size_t index_of(uint64_t value) {
+        unsigned msb = 63 - __builtin_clzll(value | 1);
+        if (msb < SUB_BITS) {
+            return value;
+        }
+        unsigned shift = msb - (SUB_BITS - 1);
+        return shift * HALF + (value >> shift);
+    }
+    
+    // Highest value that falls into bucket index
+    static uint64_t value_of(size_t index) {
+        if (index < 2 * HALF) {
+            return index;
+        }
+        unsigned shift = index / HALF - 1;
+        uint64_t top = index - shift * HALF;
+        return ((top + 1) << shift) - 1;
+    }
+};
+
+template <unsigned SUB_BITS>
+class LogLinearHistogram {
+private:
+    using Scale = LogLinearScale<SUB_BITS>;
+    
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max_value = 0;
+    
+public:
+    static constexpr size_t BUCKETS = Scale::BUCKETS;
+    
+    LogLinearHistogram() : counts(BUCKETS, 0) {}
+    
+    void record(uint64_t value) {
+        ++counts[Scale::index_of(value)];
+        ++total;
+        sum += value;
+        max_value = std::max(max_value, value);
+    }
+    
+    // Adds n values known only by bucket, e.g. copied from a SharedHistogram
+    void add_bucket(size_t index, uint64_t n) {
+        counts[index] += n;
+        total += n;
+    }
+    
+    void add_summary(uint64_t value_sum, uint64_t value_max) {
+        sum += value_sum;
+        max_value = std::max(max_value, value_max);
+    }
+    
+    void merge(const LogLinearHistogram& other) {
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        max_value = std::max(max_value, other.max_value);
+    }
+    
+    uint64_t count() const { return total; }
+    uint64_t max() const { return max_value; }
+    
+    double mean() const {
+        return total ? static_cast<double>(sum) / total : 0;
+    }
+    
+    // Value at quantile q (0..1), accurate to the bucket width
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(Scale::value_of(i), max_value);
+            }
+        }
+        return max_value;
+    }
+};
+
+// Under 1% bucket width, for benchmarks
+using LatencyHistogram = LogLinearHistogram<8>;
+
+// Adds to a counter that only the calling thread writes. Readers on other
+// threads see every update whole, and no locked instruction is needed.
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Histogram with a single writer thread that other threads may copy at any
+// time. A copy taken during an update may miss that one value.
+template <unsigned SUB_BITS>
+class SharedHistogram {
+private:
+    using Scale = LogLinearScale<SUB_BITS>;
+    
+    std::atomic<uint64_t> counts[Scale::BUCKETS] = {};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max_value{0};
+    
+public:
+    void record(uint64_t value) {
+        bump(counts[Scale::index_of(value)]);
+        bump(sum, value);
+        if (value > max_value.load(std::memory_order_relaxed)) {
+            max_value.store(value, std::memory_order_relaxed);
+        }
+    }
+    
+    void add_to(LogLinearHistogram<SUB_BITS>& out) const {
+        for (size_t i = 0; i < Scale::BUCKETS; ++i) {
+            uint64_t n = counts[i].load(std::memory_order_relaxed);
+            if (n > 0) {
+                out.add_bucket(i, n);
+            }
+        }
+        out.add_summary(sum.load(std::memory_order_relaxed), max_value.load(std::memory_order_relaxed));
+    }
+};
+
+#endif
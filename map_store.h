@@ -0,0 +1,444 @@
+#ifndef MAP_STORE_H
+#define MAP_STORE_H
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+
+#include "common.h"
+#include "number_store.h"
+#include "node_pool.h"
+#include "sorted_tree.h"
+
+// Number -> timestamp store split into independently locked shards. A number
+// always lives in the shard chosen by hashing it, so point operations take a
+// single shard lock; ordered reads merge the shards back into key order.
+// Each shard is a red-black tree that also keeps subtree sizes, so ranks are
+// answered in O(log n) per shard. Tree nodes come from a node pool.
+class MapStore : public NumberStore {
+private:
+    struct Nodes {};  // Tags the pool of the trees' nodes
+    
+    using OrderedMap = __gnu_pbds::tree<int32_t, int64_t, std::less<int32_t>,
+                                        __gnu_pbds::rb_tree_tag,
+                                        __gnu_pbds::tree_order_statistics_node_update,
+                                        PoolAllocator<char, Nodes>>;
+    
+    // Cache-line aligned so that neighbouring shard locks don't false-share
+    struct alignas(64) Shard {
+        OrderedMap numbers;  // number -> timestamp mapping
+        mutable std::shared_mutex mutex;
+    };
+    
+    using SharedLocks = std::vector<std::shared_lock<std::shared_mutex>>;
+    
+    std::unique_ptr<Shard[]> shards;
+    size_t num_shards;
+    unsigned shard_bits;
+    
+    size_t shard_index(int32_t number) const {
+        if (shard_bits == 0) {
+            return 0;
+        }
+        // Fibonacci hashing spreads runs of sequential IDs over all shards
+        uint32_t hash = static_cast<uint32_t>(number) * 2654435769u;
+        return hash >> (32 - shard_bits);
+    }
+    
+    std::vector<std::vector<uint32_t>> partition(const std::vector<int32_t>& keys) const {
+        return partition_sorted(keys, num_shards,
+                                [this](int32_t number) { return shard_index(number); });
+    }
+    
+    // Moves it to the first element not less than key. Keys of a sorted batch
+    // usually sit a few nodes apart, so walk briefly before falling back to a
+    // full O(log n) search.
+    template <typename Map, typename Iterator>
+    static Iterator seek(Map& map, Iterator it, int32_t key) {
+        for (int steps = 0; steps < 8 && it != map.end() && it->first < key; ++steps) {
+            ++it;
+        }
+        if (it != map.end() && it->first < key) {
+            it = map.lower_bound(key);
+        }
+        return it;
+    }
+    
+    // Whether number sorts after every entry of shard, so it can be appended
+    static bool beyond(const Shard& shard, int32_t number) {
+        return shard.numbers.empty() || number > std::prev(shard.numbers.end())->first;
+    }
+    
+    // Shared locks on every shard, always taken in index order
+    SharedLocks lock_all_shared() const {
+        SharedLocks locks;
+        locks.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+        }
+        return locks;
+    }
+    
+    // Numbers below bound, which may be 2^31; every shard must be locked
+    uint64_t count_below_locked(int64_t bound) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < num_shards; ++i) {
+            const auto& numbers = shards[i].numbers;
+            total += bound > std::numeric_limits<int32_t>::max()
+                ? numbers.size()
+                : numbers.order_of_key(static_cast<int32_t>(std::max<int64_t>(
+                      bound, std::numeric_limits<int32_t>::min())));
+        }
+        return total;
+    }
+    
+protected:
+    // Input is sorted, so the shard's entries are appended in one run
+    void load_shard(size_t s, const int32_t* numbers, const int64_t* timestamps,
+                    size_t count) override {
+        Shard& shard = shards[s];
+        std::unique_lock lock(shard.mutex);
+        std::vector<std::pair<int32_t, int64_t>> run;
+        for (size_t i = 0; i < count; ++i) {
+            if (shard_index(numbers[i]) != s) {
+                continue;
+            }
+            if (run.empty() && !beyond(shard, numbers[i])) {
+                shard.numbers.insert(std::make_pair(numbers[i], timestamps[i]));
+            } else {
+                run.emplace_back(numbers[i], timestamps[i]);
+            }
+        }
+        append_sorted(shard.numbers, run.data(), run.size());
+    }
+    
+    // The node pool is shared by every MapStore in the process
+    size_t engine_memory_usage() const override {
+        return sizeof(Shard) * num_shards + pool_usage<Nodes>().used.load(std::memory_order_relaxed);
+    }
+    
+    size_t engine_entry_bytes() const override {
+        return std::max<size_t>(pool_usage<Nodes>().node_size.load(std::memory_order_relaxed), 64);
+    }
+    
+public:
+    using NumberStore::insert;
+    
+    // shard_count is rounded up to a power of two
+    explicit MapStore(size_t shard_count = DEFAULT_SHARD_COUNT)
+        : shard_bits(shard_bits_for(shard_count)) {
+        num_shards = size_t(1) << shard_bits;
+        shards.reset(new Shard[num_shards]);
+    }
+    
+    const char* engine_name() const override {
+        return "map";
+    }
+    
+    size_t shard_count() const override {
+        return num_shards;
+    }
+    
+    bool insert(int32_t number, int64_t& timestamp, int64_t expires_at) override {
+        Shard& shard = shards[shard_index(number)];
+        std::unique_lock lock(shard.mutex);
+        
+        auto result = shard.numbers.insert(std::make_pair(number, now_micros()));
+        timestamp = result.first->second;
+        if (result.second) {
+            notify_insert(&number, 1, timestamp, expires_at);
+        }
+        return result.second; // true if inserted, false if duplicate
+    }
+    
+    // Inserts a batch taking each shard lock once, walking the shard's sorted
+    // keys through its map so duplicates are found without a full search.
+    // Keys beyond the shard's last entry are appended in one run.
+    // inserted[i] is set when keys[i] was added.
+    void insert_batch_at(const std::vector<int32_t>& keys, int64_t timestamp,
+                         int64_t expires_at, std::vector<bool>& inserted) override {
+        auto groups = partition(keys);
+        inserted.assign(keys.size(), false);
+        std::vector<int32_t> added;
+        std::vector<std::pair<int32_t, int64_t>> run;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Shard& shard = shards[s];
+            std::unique_lock lock(shard.mutex);
+            auto it = shard.numbers.begin();
+            added.clear();
+            run.clear();
+            for (uint32_t i : groups[s]) {
+                if (!run.empty() || beyond(shard, keys[i])) {
+                    if (run.empty() || keys[i] != run.back().first) {
+                        run.emplace_back(keys[i], timestamp);
+                        inserted[i] = true;
+                        if (listening()) {
+                            added.push_back(keys[i]);
+                        }
+                    }
+                    continue;
+                }
+                it = seek(shard.numbers, it, keys[i]);
+                if (it != shard.numbers.end() && it->first == keys[i]) {
+                    continue; // Duplicate
+                }
+                it = shard.numbers.insert(std::make_pair(keys[i], timestamp)).first;
+                inserted[i] = true;
+                if (listening()) {
+                    added.push_back(keys[i]);
+                }
+            }
+            append_sorted(shard.numbers, run.data(), run.size());
+            notify_insert(added.data(), added.size(), timestamp, expires_at);
+        }
+    }
+    
+    bool remove(int32_t number) override {
+        Shard& shard = shards[shard_index(number)];
+        std::unique_lock lock(shard.mutex);
+        auto it = shard.numbers.find(number);
+        if (it == shard.numbers.end()) {
+            return false;
+        }
+        int64_t timestamp = it->second;
+        shard.numbers.erase(it);
+        notify_remove(&number, &timestamp, 1);
+        return true;
+    }
+    
+    // Removes a batch taking each shard lock once; removed[i] is set when
+    // keys[i] was present and passed condition
+    void remove_batch_if(const std::vector<int32_t>& keys, const RemoveCondition& condition,
+                         std::vector<bool>& removed) override {
+        auto groups = partition(keys);
+        removed.assign(keys.size(), false);
+        std::vector<int32_t> gone;
+        std::vector<int64_t> gone_timestamps;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Shard& shard = shards[s];
+            std::unique_lock lock(shard.mutex);
+            auto it = shard.numbers.begin();
+            gone.clear();
+            gone_timestamps.clear();
+            for (uint32_t i : groups[s]) {
+                it = seek(shard.numbers, it, keys[i]);
+                if (it != shard.numbers.end() && it->first == keys[i] &&
+                    (!condition || condition(keys[i]))) {
+                    if (listening()) {
+                        gone.push_back(keys[i]);
+                        gone_timestamps.push_back(it->second);
+                    }
+                    it = shard.numbers.erase(it);
+                    removed[i] = true;
+                }
+            }
+            notify_remove(gone.data(), gone_timestamps.data(), gone.size());
+        }
+    }
+    
+    // Empties every shard at once; locks are taken in index order
+    void clear() override {
+        std::vector<std::unique_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+        }
+        for (size_t i = 0; i < num_shards; ++i) {
+            shards[i].numbers.clear();
+        }
+        notify_clear();
+    }
+    
+    // O(log n) point lookup returning the stored entry, if any
+    std::optional<NumberEntry> find(int32_t number) const override {
+        const Shard& shard = shards[shard_index(number)];
+        std::shared_lock lock(shard.mutex);
+        auto it = shard.numbers.find(number);
+        if (it == shard.numbers.end()) {
+            return std::nullopt;
+        }
+        return NumberEntry(it->first, it->second);
+    }
+    
+    // Looks up a batch taking each shard lock once; returns each key's
+    // timestamp or -1
+    std::vector<int64_t> find_batch(const std::vector<int32_t>& keys) const override {
+        auto groups = partition(keys);
+        std::vector<int64_t> timestamps(keys.size(), -1);
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            const Shard& shard = shards[s];
+            std::shared_lock lock(shard.mutex);
+            auto it = shard.numbers.begin();
+            for (uint32_t i : groups[s]) {
+                it = seek(shard.numbers, it, keys[i]);
+                if (it != shard.numbers.end() && it->first == keys[i]) {
+                    timestamps[i] = it->second;
+                }
+            }
+        }
+        return timestamps;
+    }
+    
+    // Consistent sorted copy of the whole store: every shard is read-locked
+    // for the duration and the sorted shards are combined with a k-way merge
+    std::vector<NumberEntry> getAllSorted() const override {
+        using Iterator = OrderedMap::const_iterator;
+        using Cursor = std::pair<Iterator, Iterator>;  // current, end
+        
+        auto locks = lock_all_shared();
+        std::vector<NumberEntry> result;
+        std::vector<Cursor> heap;
+        size_t total = 0;
+        for (size_t i = 0; i < num_shards; ++i) {
+            const auto& numbers = shards[i].numbers;
+            total += numbers.size();
+            if (!numbers.empty()) {
+                heap.emplace_back(numbers.begin(), numbers.end());
+            }
+        }
+        result.reserve(total);
+        
+        // Min-heap on each shard's current number
+        auto later = [](const Cursor& a, const Cursor& b) {
+            return a.first->first > b.first->first;
+        };
+        std::make_heap(heap.begin(), heap.end(), later);
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& cursor = heap.back();
+            result.emplace_back(cursor.first->first, cursor.first->second);
+            if (++cursor.first == cursor.second) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+        return result;
+    }
+    
+    // k-way merge of each shard's [lo, hi] range, stopping after limit entries
+    std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const override {
+        using Iterator = OrderedMap::const_iterator;
+        using Cursor = std::pair<Iterator, Iterator>;  // current, end
+        
+        std::vector<NumberEntry> result;
+        if (hi < lo || limit == 0) {
+            return result;
+        }
+        
+        auto locks = lock_all_shared();
+        std::vector<Cursor> heap;
+        for (size_t i = 0; i < num_shards; ++i) {
+            const auto& numbers = shards[i].numbers;
+            auto first = numbers.lower_bound(lo);
+            auto last = numbers.upper_bound(hi);
+            if (first != last) {
+                heap.emplace_back(first, last);
+            }
+        }
+        
+        auto later = [](const Cursor& a, const Cursor& b) {
+            return a.first->first > b.first->first;
+        };
+        std::make_heap(heap.begin(), heap.end(), later);
+        while (!heap.empty() && result.size() < limit) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& cursor = heap.back();
+            result.emplace_back(cursor.first->first, cursor.first->second);
+            if (++cursor.first == cursor.second) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+        return result;
+    }
+    
+    // The smallest and largest entries are the first and last of some shard
+    std::optional<NumberEntry> min_entry() const override {
+        auto locks = lock_all_shared();
+        std::optional<NumberEntry> result;
+        for (size_t i = 0; i < num_shards; ++i) {
+            const auto& numbers = shards[i].numbers;
+            if (!numbers.empty() && (!result || numbers.begin()->first < result->number)) {
+                result.emplace(numbers.begin()->first, numbers.begin()->second);
+            }
+        }
+        return result;
+    }
+    
+    std::optional<NumberEntry> max_entry() const override {
+        auto locks = lock_all_shared();
+        std::optional<NumberEntry> result;
+        for (size_t i = 0; i < num_shards; ++i) {
+            const auto& numbers = shards[i].numbers;
+            if (numbers.empty()) {
+                continue;
+            }
+            auto last = std::prev(numbers.end());
+            if (!result || last->first > result->number) {
+                result.emplace(last->first, last->second);
+            }
+        }
+        return result;
+    }
+    
+    uint64_t rank(int32_t number) const override {
+        auto locks = lock_all_shared();
+        return count_below_locked(number);
+    }
+    
+    // Shards hold hashed numbers, so the k-th smallest is selected across
+    // them from their order statistics: O(shards * log^2 n)
+    std::optional<NumberEntry> select(uint64_t k) const override {
+        auto locks = lock_all_shared();
+        if (k >= count_below_locked(int64_t(1) << 31)) {
+            return std::nullopt;
+        }
+        int32_t number = select_sharded(
+            num_shards, k, [this](size_t i) { return shards[i].numbers.size(); },
+            [this](size_t i, uint64_t pos) { return shards[i].numbers.find_by_order(pos)->first; },
+            [this](size_t i, int32_t bound) { return shards[i].numbers.order_of_key(bound); });
+        auto it = shards[shard_index(number)].numbers.find(number);
+        return NumberEntry(number, it->second);
+    }
+    
+    uint64_t count_range(int32_t lo, int32_t hi) const override {
+        if (hi < lo) {
+            return 0;
+        }
+        auto locks = lock_all_shared();
+        return count_below_locked(int64_t(hi) + 1) - count_below_locked(lo);
+    }
+    
+    size_t size() const override {
+        size_t total = 0;
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::shared_lock lock(shards[i].mutex);
+            total += shards[i].numbers.size();
+        }
+        return total;
+    }
+};
+
+#endif
@@ -0,0 +1,742 @@
+#ifndef MVCC_STORE_H
+#define MVCC_STORE_H
+
+#include <vector>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <limits>
+#include <new>
+#include <cstdint>
+
+#include "common.h"
+#include "number_store.h"
+#include "node_pool.h"
+
+// Number -> timestamp store whose shards are persistent treaps. A write
+// copies the nodes on its path, leaving the previous version of the tree
+// intact, and publishes a new set of roots; readers pin the current set
+// with one atomic increment and then search or scan without holding any
+// lock. A full scan therefore never holds up writers, and it sees a single
+// point in time. Writers to one shard are serialized by the shard's writer
+// mutex. Nodes are reference counted and go back to the node pool with
+// the last version that uses them, so a long scan keeps alive the nodes
+// replaced while it runs.
+class MvccStore : public NumberStore {
+private:
+    struct Nodes {};  // Tags the pool of the trees' nodes
+    
+    // Immutable once published. A node belongs to the write that created
+    // it until then and only that write changes it in place.
+    struct Node {
+        int32_t number;
+        uint32_t priority;    // Heap order of the treap
+        int64_t timestamp;
+        Node* left;
+        Node* right;
+        uint64_t version;     // Write that created the node
+        uint32_t size;        // Entries in this subtree
+        std::atomic<uint32_t> refs;
+    };
+    
+    using Allocator = PoolAllocator<Node, Nodes>;
+    
+    struct alignas(64) Shard {
+        std::mutex writer;     // Held for the whole of a write
+        Node* root = nullptr;  // Last published; owns one reference, under writer
+        uint64_t version = 0;  // Last write started; under writer
+    };
+    
+    // The root of every shard at one point in time, holding a reference on
+    // each. Immutable once published.
+    struct RootSet {
+        mutable std::atomic<int64_t> refs;
+        std::vector<Node*> roots;
+    };
+    
+    // current packs the address of the published RootSet, which is below
+    // 2^48, with the number of pins taken on it since it was published in
+    // the upper bits: a split reference count. Pinning is one fetch_add on
+    // current, and a pin is given back on the set's own refs, which start at
+    // PUBLISHED_REFS. Unpublishing the set moves its pins over, after which
+    // refs counts exactly the pins still held. Before the pin count can
+    // overflow, a reader moves it over early.
+    static constexpr unsigned PIN_SHIFT = 48;
+    static constexpr uint64_t ONE_PIN = uint64_t(1) << PIN_SHIFT;
+    static constexpr uint64_t SET_MASK = ONE_PIN - 1;
+    static constexpr uint64_t PIN_TRANSFER = 4096;
+    static constexpr int64_t PUBLISHED_REFS = int64_t(1) << 40;
+    
+    std::unique_ptr<Shard[]> shards;
+    size_t num_shards;
+    unsigned shard_bits;
+    uint32_t seed;  // Keeps the tree shape from following the numbers
+    mutable std::atomic<uint64_t> current;
+    std::mutex publish_mutex;  // Serializes replacing current
+    
+    size_t shard_index(int32_t number) const {
+        if (shard_bits == 0) {
+            return 0;
+        }
+        // Fibonacci hashing spreads runs of sequential IDs over all shards
+        uint32_t hash = static_cast<uint32_t>(number) * 2654435769u;
+        return hash >> (32 - shard_bits);
+    }
+    
+    std::vector<std::vector<uint32_t>> partition(const std::vector<int32_t>& keys) const {
+        return partition_sorted(keys, num_shards,
+                                [this](int32_t number) { return shard_index(number); });
+    }
+    
+    uint32_t priority_of(int32_t number) const {
+        uint32_t x = static_cast<uint32_t>(number) ^ seed;
+        x = (x ^ (x >> 16)) * 0x7feb352du;
+        x = (x ^ (x >> 15)) * 0x846ca68bu;
+        return x ^ (x >> 16);
+    }
+    
+    static uint32_t size_of(const Node* node) {
+        return node ? node->size : 0;
+    }
+    
+    static void update(Node* node) {
+        node->size = 1 + size_of(node->left) + size_of(node->right);
+    }
+    
+    static void retain(Node* node) {
+        if (node) {
+            node->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    
+    static void release(Node* node) {
+        if (node && node->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            release(node->left);
+            release(node->right);
+            node->~Node();
+            Allocator().deallocate(node, 1);
+        }
+    }
+    
+    Node* make_node(int32_t number, int64_t timestamp, uint64_t version) const {
+        Node* node = new (Allocator().allocate(1)) Node;
+        node->number = number;
+        node->priority = priority_of(number);
+        node->timestamp = timestamp;
+        node->left = nullptr;
+        node->right = nullptr;
+        node->version = version;
+        node->size = 1;
+        node->refs.store(1, std::memory_order_relaxed);
+        return node;
+    }
+    
+    // The functions below take and return owned references. A node of an
+    // earlier version is replaced by a copy owned by this write.
+    static Node* own(Node* node, uint64_t version) {
+        if (node->version == version) {
+            return node;
+        }
+        Node* copy = new (Allocator().allocate(1)) Node;
+        copy->number = node->number;
+        copy->priority = node->priority;
+        copy->timestamp = node->timestamp;
+        copy->left = node->left;
+        copy->right = node->right;
+        copy->version = version;
+        copy->size = node->size;
+        copy->refs.store(1, std::memory_order_relaxed);
+        retain(copy->left);
+        retain(copy->right);
+        release(node);
+        return copy;
+    }
+    
+    // Splits node into the numbers below key and the rest
+    static void split(Node* node, int32_t key, Node*& below, Node*& rest, uint64_t version) {
+        if (!node) {
+            below = rest = nullptr;
+            return;
+        }
+        node = own(node, version);
+        if (node->number < key) {
+            split(node->right, key, node->right, rest, version);
+            below = node;
+        } else {
+            split(node->left, key, below, node->left, version);
+            rest = node;
+        }
+        update(node);
+    }
+    
+    // Every number of low is below every number of high
+    static Node* merge(Node* low, Node* high, uint64_t version) {
+        if (!low || !high) {
+            return low ? low : high;
+        }
+        if (low->priority > high->priority) {
+            low = own(low, version);
+            low->right = merge(low->right, high, version);
+            update(low);
+            return low;
+        }
+        high = own(high, version);
+        high->left = merge(low, high->left, version);
+        update(high);
+        return high;
+    }
+    
+    // fresh's number must not be in node
+    static Node* insert_node(Node* node, Node* fresh, uint64_t version) {
+        if (!node) {
+            return fresh;
+        }
+        if (fresh->priority > node->priority) {
+            split(node, fresh->number, fresh->left, fresh->right, version);
+            update(fresh);
+            return fresh;
+        }
+        node = own(node, version);
+        if (fresh->number < node->number) {
+            node->left = insert_node(node->left, fresh, version);
+        } else {
+            node->right = insert_node(node->right, fresh, version);
+        }
+        update(node);
+        return node;
+    }
+    
+    // number must be in node
+    static Node* erase_node(Node* node, int32_t number, uint64_t version) {
+        if (node->number == number) {
+            Node* left = node->left;
+            Node* right = node->right;
+            retain(left);
+            retain(right);
+            release(node);
+            return merge(left, right, version);
+        }
+        node = own(node, version);
+        if (number < node->number) {
+            node->left = erase_node(node->left, number, version);
+        } else {
+            node->right = erase_node(node->right, number, version);
+        }
+        update(node);
+        return node;
+    }
+    
+    static const Node* find_node(const Node* node, int32_t number) {
+        while (node && node->number != number) {
+            node = number < node->number ? node->left : node->right;
+        }
+        return node;
+    }
+    
+    // Node at position pos of node's subtree, which must hold more than pos
+    static const Node* node_at(const Node* node, uint64_t pos) {
+        while (true) {
+            uint64_t left = size_of(node->left);
+            if (pos == left) {
+                return node;
+            }
+            if (pos < left) {
+                node = node->left;
+            } else {
+                pos -= left + 1;
+                node = node->right;
+            }
+        }
+    }
+    
+    // Numbers in node below bound, which may be 2^31
+    static uint64_t count_below(const Node* node, int64_t bound) {
+        uint64_t total = 0;
+        while (node) {
+            if (node->number < bound) {
+                total += size_of(node->left) + 1;
+                node = node->right;
+            } else {
+                node = node->left;
+            }
+        }
+        return total;
+    }
+    
+    static RootSet* set_of(uint64_t word) {
+        return reinterpret_cast<RootSet*>(word & SET_MASK);
+    }
+    
+    static uint64_t word_of(RootSet* set) {
+        return reinterpret_cast<uint64_t>(set);
+    }
+    
+    // Pins the current roots of every shard; give them back with unpin()
+    const RootSet* pin_roots() const {
+        uint64_t word = current.fetch_add(ONE_PIN, std::memory_order_acquire) + ONE_PIN;
+        RootSet* set = set_of(word);
+        while ((word >> PIN_SHIFT) >= PIN_TRANSFER && set_of(word) == set) {
+            // Moved before the swap, so that the set cannot be freed with
+            // these pins in flight; taken back if another change came first
+            int64_t pins = static_cast<int64_t>(word >> PIN_SHIFT);
+            set->refs.fetch_add(pins, std::memory_order_relaxed);
+            if (current.compare_exchange_weak(word, word & SET_MASK, std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+                break;
+            }
+            set->refs.fetch_sub(pins, std::memory_order_relaxed);  // Our own pin keeps it above 0
+        }
+        return set;
+    }
+    
+    static void unpin(const RootSet* set, int64_t pins = 1) {
+        if (set->refs.fetch_sub(pins, std::memory_order_acq_rel) == pins) {
+            for (Node* root : set->roots) {
+                release(root);
+            }
+            delete set;
+        }
+    }
+    
+    // Replaces the current RootSet; publish_mutex must be held unless the
+    // store is being built or destroyed
+    void replace_roots(RootSet* set) {
+        set->refs.store(PUBLISHED_REFS, std::memory_order_relaxed);
+        uint64_t old = current.exchange(word_of(set), std::memory_order_acq_rel);
+        if (old) {
+            unpin(set_of(old), PUBLISHED_REFS - static_cast<int64_t>(old >> PIN_SHIFT));
+        }
+    }
+    
+    // Publishes root as shard s's, next to the other shards' current roots.
+    // Takes a reference on root.
+    void publish_root(size_t s, Node* root) {
+        RootSet* set = new RootSet;
+        std::lock_guard lock(publish_mutex);
+        set->roots = set_of(current.load(std::memory_order_relaxed))->roots;
+        set->roots[s] = root;
+        for (Node* each : set->roots) {
+            retain(each);
+        }
+        replace_roots(set);
+    }
+    
+    // A write on one shard: takes the current root, and publish() makes the
+    // result visible to readers at once
+    class Write {
+    private:
+        MvccStore& store;
+        Shard& shard;
+        std::lock_guard<std::mutex> lock;
+        
+    public:
+        const uint64_t version;
+        Node* root;
+        
+        Write(MvccStore& owner, size_t s)
+            : store(owner), shard(owner.shards[s]), lock(shard.writer), version(++shard.version),
+              root(shard.root) {
+            retain(root);
+        }
+        
+        ~Write() {
+            release(root);
+        }
+        
+        void publish() {
+            store.publish_root(&shard - store.shards.get(), root);
+            std::swap(shard.root, root);
+            release(root);
+            root = nullptr;
+        }
+    };
+    
+    // In-order walk of the numbers of a tree in [lo, hi]
+    class Cursor {
+    private:
+        std::vector<const Node*> path;  // Ancestors still to visit, nearest last
+        int32_t hi;
+        
+        void descend(const Node* node, int32_t lo) {
+            while (node) {
+                if (node->number < lo) {
+                    node = node->right;
+                } else {
+                    path.push_back(node);
+                    node = node->left;
+                }
+            }
+        }
+        
+    public:
+        Cursor(const Node* root, int32_t lo, int32_t last) : hi(last) {
+            descend(root, lo);
+        }
+        
+        bool valid() const {
+            return !path.empty() && path.back()->number <= hi;
+        }
+        
+        const Node* current() const {
+            return path.back();
+        }
+        
+        // Moves to the next number; false once past hi
+        bool next() {
+            const Node* node = path.back();
+            path.pop_back();
+            descend(node->right, std::numeric_limits<int32_t>::min());
+            return valid();
+        }
+    };
+    
+    // A consistent cut over every shard: the published RootSet, pinned
+    class Roots {
+    private:
+        const RootSet* set;
+        
+    public:
+        const std::vector<Node*>& roots;
+        
+        explicit Roots(const MvccStore& store) : set(store.pin_roots()), roots(set->roots) {}
+        
+        ~Roots() {
+            unpin(set);
+        }
+        
+        Roots(const Roots&) = delete;
+        Roots& operator=(const Roots&) = delete;
+        
+        uint64_t size() const {
+            uint64_t total = 0;
+            for (const Node* root : roots) {
+                total += size_of(root);
+            }
+            return total;
+        }
+        
+        uint64_t count_below(int64_t bound) const {
+            uint64_t total = 0;
+            for (const Node* root : roots) {
+                total += MvccStore::count_below(root, bound);
+            }
+            return total;
+        }
+        
+        // k-way merge of each shard's [lo, hi] range, stopping after limit entries
+        std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const {
+            std::vector<NumberEntry> result;
+            if (hi < lo || limit == 0) {
+                return result;
+            }
+            std::vector<Cursor> heap;
+            for (const Node* root : roots) {
+                Cursor cursor(root, lo, hi);
+                if (cursor.valid()) {
+                    heap.push_back(std::move(cursor));
+                }
+            }
+            
+            // Min-heap on each shard's current number
+            auto later = [](const Cursor& a, const Cursor& b) {
+                return a.current()->number > b.current()->number;
+            };
+            std::make_heap(heap.begin(), heap.end(), later);
+            while (!heap.empty() && result.size() < limit) {
+                std::pop_heap(heap.begin(), heap.end(), later);
+                Cursor& cursor = heap.back();
+                result.emplace_back(cursor.current()->number, cursor.current()->timestamp);
+                if (!cursor.next()) {
+                    heap.pop_back();
+                } else {
+                    std::push_heap(heap.begin(), heap.end(), later);
+                }
+            }
+            return result;
+        }
+    };
+    
+    // A pinned version of the whole store
+    class View : public StoreView {
+    private:
+        Roots roots;
+        
+    public:
+        explicit View(const MvccStore& store) : roots(store) {}
+        
+        std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const override {
+            return roots.range(lo, hi, limit);
+        }
+        
+        size_t size() const override {
+            return roots.size();
+        }
+    };
+    
+protected:
+    void load_shard(size_t s, const int32_t* numbers, const int64_t* timestamps,
+                    size_t count) override {
+        Write write(*this, s);
+        for (size_t i = 0; i < count; ++i) {
+            if (shard_index(numbers[i]) == s && !find_node(write.root, numbers[i])) {
+                write.root = insert_node(write.root, make_node(numbers[i], timestamps[i], write.version),
+                                         write.version);
+            }
+        }
+        write.publish();
+    }
+    
+    // Nodes of versions still pinned by readers count too. The node pool is
+    // shared by every MvccStore in the process.
+    size_t engine_memory_usage() const override {
+        return sizeof(Shard) * num_shards + pool_usage<Nodes>().used.load(std::memory_order_relaxed);
+    }
+    
+    size_t engine_entry_bytes() const override {
+        return std::max<size_t>(pool_usage<Nodes>().node_size.load(std::memory_order_relaxed),
+                                sizeof(Node));
+    }
+    
+public:
+    using NumberStore::insert;
+    
+    // shard_count is rounded up to a power of two
+    explicit MvccStore(size_t shard_count = DEFAULT_SHARD_COUNT)
+        : shard_bits(shard_bits_for(shard_count)), seed(std::random_device()()) {
+        num_shards = size_t(1) << shard_bits;
+        shards.reset(new Shard[num_shards]);
+        current.store(0, std::memory_order_relaxed);
+        RootSet* empty = new RootSet;
+        empty->roots.assign(num_shards, nullptr);
+        replace_roots(empty);
+    }
+    
+    ~MvccStore() override {
+        uint64_t last = current.load(std::memory_order_relaxed);
+        unpin(set_of(last), PUBLISHED_REFS - static_cast<int64_t>(last >> PIN_SHIFT));
+        for (size_t i = 0; i < num_shards; ++i) {
+            release(shards[i].root);
+        }
+    }
+    
+    const char* engine_name() const override {
+        return "mvcc";
+    }
+    
+    size_t shard_count() const override {
+        return num_shards;
+    }
+    
+    bool insert(int32_t number, int64_t& timestamp, int64_t expires_at) override {
+        Write write(*this, shard_index(number));
+        if (const Node* existing = find_node(write.root, number)) {
+            timestamp = existing->timestamp;
+            return false;
+        }
+        timestamp = now_micros();
+        write.root = insert_node(write.root, make_node(number, timestamp, write.version), write.version);
+        notify_insert(&number, 1, timestamp, expires_at);
+        write.publish();
+        return true;
+    }
+    
+    // Each shard's part of the batch becomes visible at once
+    void insert_batch_at(const std::vector<int32_t>& keys, int64_t timestamp,
+                         int64_t expires_at, std::vector<bool>& inserted) override {
+        auto groups = partition(keys);
+        inserted.assign(keys.size(), false);
+        std::vector<int32_t> added;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Write write(*this, s);
+            added.clear();
+            for (uint32_t i : groups[s]) {
+                if (find_node(write.root, keys[i])) {
+                    continue; // Duplicate
+                }
+                write.root = insert_node(write.root, make_node(keys[i], timestamp, write.version),
+                                         write.version);
+                inserted[i] = true;
+                if (listening()) {
+                    added.push_back(keys[i]);
+                }
+            }
+            notify_insert(added.data(), added.size(), timestamp, expires_at);
+            write.publish();
+        }
+    }
+    
+    bool remove(int32_t number) override {
+        Write write(*this, shard_index(number));
+        const Node* existing = find_node(write.root, number);
+        if (!existing) {
+            return false;
+        }
+        int64_t timestamp = existing->timestamp;
+        write.root = erase_node(write.root, number, write.version);
+        notify_remove(&number, &timestamp, 1);
+        write.publish();
+        return true;
+    }
+    
+    void remove_batch_if(const std::vector<int32_t>& keys, const RemoveCondition& condition,
+                         std::vector<bool>& removed) override {
+        auto groups = partition(keys);
+        removed.assign(keys.size(), false);
+        std::vector<int32_t> gone;
+        std::vector<int64_t> gone_timestamps;
+        
+        for (size_t s = 0; s < num_shards; ++s) {
+            if (groups[s].empty()) {
+                continue;
+            }
+            Write write(*this, s);
+            gone.clear();
+            gone_timestamps.clear();
+            for (uint32_t i : groups[s]) {
+                const Node* existing = find_node(write.root, keys[i]);
+                if (existing && (!condition || condition(keys[i]))) {
+                    if (listening()) {
+                        gone.push_back(keys[i]);
+                        gone_timestamps.push_back(existing->timestamp);
+                    }
+                    write.root = erase_node(write.root, keys[i], write.version);
+                    removed[i] = true;
+                }
+            }
+            notify_remove(gone.data(), gone_timestamps.data(), gone.size());
+            write.publish();
+        }
+    }
+    
+    // Empties every shard at once; writer locks are taken in index order
+    void clear() override {
+        std::vector<std::unique_lock<std::mutex>> writers;
+        writers.reserve(num_shards);
+        for (size_t i = 0; i < num_shards; ++i) {
+            writers.emplace_back(shards[i].writer);
+        }
+        RootSet* empty = new RootSet;
+        empty->roots.assign(num_shards, nullptr);
+        {
+            std::lock_guard lock(publish_mutex);
+            replace_roots(empty);
+        }
+        std::vector<Node*> old_roots(num_shards, nullptr);
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::swap(shards[i].root, old_roots[i]);
+        }
+        notify_clear();
+        writers.clear();
+        for (Node* root : old_roots) {
+            release(root);
+        }
+    }
+    
+    std::optional<NumberEntry> find(int32_t number) const override {
+        Roots roots(*this);
+        std::optional<NumberEntry> result;
+        if (const Node* node = find_node(roots.roots[shard_index(number)], number)) {
+            result.emplace(node->number, node->timestamp);
+        }
+        return result;
+    }
+    
+    // Answered from one pinned version
+    std::vector<int64_t> find_batch(const std::vector<int32_t>& keys) const override {
+        auto groups = partition(keys);
+        std::vector<int64_t> timestamps(keys.size(), -1);
+        Roots roots(*this);
+        for (size_t s = 0; s < num_shards; ++s) {
+            for (uint32_t i : groups[s]) {
+                if (const Node* node = find_node(roots.roots[s], keys[i])) {
+                    timestamps[i] = node->timestamp;
+                }
+            }
+        }
+        return timestamps;
+    }
+    
+    std::shared_ptr<const StoreView> view() const override {
+        return std::make_shared<View>(*this);
+    }
+    
+    // Copied from a pinned version; writers go on meanwhile
+    std::vector<NumberEntry> getAllSorted() const override {
+        Roots roots(*this);
+        size_t total = roots.size();
+        return roots.range(std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max(),
+                           total);
+    }
+    
+    std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const override {
+        return Roots(*this).range(lo, hi, limit);
+    }
+    
+    std::optional<NumberEntry> min_entry() const override {
+        Roots roots(*this);
+        std::optional<NumberEntry> result;
+        for (const Node* node : roots.roots) {
+            while (node && node->left) {
+                node = node->left;
+            }
+            if (node && (!result || node->number < result->number)) {
+                result.emplace(node->number, node->timestamp);
+            }
+        }
+        return result;
+    }
+    
+    std::optional<NumberEntry> max_entry() const override {
+        Roots roots(*this);
+        std::optional<NumberEntry> result;
+        for (const Node* node : roots.roots) {
+            while (node && node->right) {
+                node = node->right;
+            }
+            if (node && (!result || node->number > result->number)) {
+                result.emplace(node->number, node->timestamp);
+            }
+        }
+        return result;
+    }
+    
+    uint64_t rank(int32_t number) const override {
+        return Roots(*this).count_below(number);
+    }
+    
+    // Selected across the shards as in MapStore, on one pinned version
+    std::optional<NumberEntry> select(uint64_t k) const override {
+        Roots roots(*this);
+        if (k >= roots.size()) {
+            return std::nullopt;
+        }
+        const std::vector<Node*>& trees = roots.roots;
+        int32_t number = select_sharded(
+            num_shards, k, [&trees](size_t i) { return size_of(trees[i]); },
+            [&trees](size_t i, uint64_t pos) { return node_at(trees[i], pos)->number; },
+            [&trees](size_t i, int32_t bound) { return count_below(trees[i], bound); });
+        const Node* node = find_node(trees[shard_index(number)], number);
+        return NumberEntry(number, node->timestamp);
+    }
+    
+    uint64_t count_range(int32_t lo, int32_t hi) const override {
+        if (hi < lo) {
+            return 0;
+        }
+        Roots roots(*this);
+        return roots.count_below(int64_t(hi) + 1) - roots.count_below(lo);
+    }
+    
+    size_t size() const override {
+        return Roots(*this).size();
+    }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#ifndef NODE_POOL_H
+#define NODE_POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <algorithm>
+#include <cstddef>
+
+// Pooled allocation for the nodes of the stores' trees. With the default
+// allocator every node is a separate heap block; under churn the freed
+// blocks end up scattered over the heap and RSS stays well above the live
+// data. A pool carves nodes of one size out of 64 KiB slabs and reuses
+// freed nodes before carving more, so its footprint follows the peak node
+// count and does not fragment. Slabs are kept until exit. Each thread
+// keeps a few free nodes of its own and trades them with the pool in
+// batches, so most allocations take no lock. Nodes in use are counted one
+// by one, so that a node freed into a thread's cache no longer counts
+// against a memory budget.
+
+// What the pools of one kind of tree hold, for memory accounting
+struct PoolUsage {
+    std::atomic<size_t> reserved{0};   // Bytes of slabs taken from the heap
+    std::atomic<size_t> used{0};       // Bytes of nodes in use, counted node by node
+    std::atomic<size_t> node_size{0};  // Largest node size pooled
+};
+
+// One usage record per tag type, shared by every allocator with that tag
+template <typename Tag>
+PoolUsage& pool_usage() {
+    static PoolUsage* usage = new PoolUsage;  // Never destroyed: caches return nodes at thread exit
+    return *usage;
+}
+
+class NodePool {
+public:
+    static constexpr size_t ALIGNMENT = 16;
+    static constexpr size_t SLAB_SIZE = 64 * 1024;
+    static constexpr size_t BATCH = 32;  // Nodes moved between a thread cache and the pool at once
+    
+    struct FreeNode {
+        FreeNode* next;
+    };
+    
+    // A thread's free nodes of one pool
+    class Cache {
+    private:
+        NodePool& pool;
+        FreeNode* head = nullptr;
+        size_t count = 0;
+        
+        void release(size_t n) {
+            FreeNode* first = head;
+            FreeNode* last = head;
+            for (size_t i = 1; i < n; ++i) {
+                last = last->next;
+            }
+            head = last->next;
+            count -= n;
+            pool.give_back(first, last);
+        }
+        
+    public:
+        explicit Cache(NodePool& node_pool) : pool(node_pool) {}
+        
+        ~Cache() {
+            if (count > 0) {
+                release(count);
+            }
+        }
+        
+        void* allocate() {
+            if (!head) {
+                count += pool.take(head);
+            }
+            FreeNode* node = head;
+            head = node->next;
+            --count;
+            pool.usage.used.fetch_add(pool.node_size, std::memory_order_relaxed);
+            return node;
+        }
+        
+        void deallocate(void* p) {
+            pool.usage.used.fetch_sub(pool.node_size, std::memory_order_relaxed);
+            FreeNode* node = static_cast<FreeNode*>(p);
+            node->next = head;
+            head = node;
+            if (++count >= 2 * BATCH) {
+                release(BATCH);
+            }
+        }
+    };
+    
+private:
+    const size_t node_size;
+    PoolUsage& usage;
+    std::mutex mutex;
+    FreeNode* free_list = nullptr;
+    
+    // Called with mutex held
+    void carve() {
+        char* slab = static_cast<char*>(::operator new(SLAB_SIZE));
+        for (size_t offset = 0; offset + node_size <= SLAB_SIZE; offset += node_size) {
+            FreeNode* node = reinterpret_cast<FreeNode*>(slab + offset);
+            node->next = free_list;
+            free_list = node;
+        }
+        usage.reserved.fetch_add(SLAB_SIZE, std::memory_order_relaxed);
+    }
+    
+    // Moves up to BATCH free nodes onto an empty list and returns how many
+    size_t take(FreeNode*& list) {
+        std::lock_guard lock(mutex);
+        if (!free_list) {
+            carve();
+        }
+        size_t n = 0;
+        while (free_list && n < BATCH) {
+            FreeNode* node = free_list;
+            free_list = node->next;
+            node->next = list;
+            list = node;
+            ++n;
+        }
+        return n;
+    }
+    
+    void give_back(FreeNode* first, FreeNode* last) {
+        std::lock_guard lock(mutex);
+        last->next = free_list;
+        free_list = first;
+    }
+    
+public:
+    NodePool(size_t size, PoolUsage& pool_usage)
+        : node_size((std::max(size, sizeof(FreeNode)) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT),
+          usage(pool_usage) {
+        size_t largest = usage.node_size.load();
+        while (largest < node_size && !usage.node_size.compare_exchange_weak(largest, node_size)) {
+        }
+    }
+    
+    NodePool(const NodePool&) = delete;
+    NodePool& operator=(const NodePool&) = delete;
+};
+
+// Stateless allocator drawing single objects from a pool per type and
+// tag; arrays go to the heap. Meant for node-based containers, including
+// the pb_ds trees, which keep their allocator in a static.
+template <typename T, typename Tag>
+class PoolAllocator {
+private:
+    static constexpr bool POOLED = alignof(T) <= NodePool::ALIGNMENT;
+    
+    static NodePool::Cache& cache() {
+        static NodePool* pool = new NodePool(sizeof(T), pool_usage<Tag>());  // Outlives every cache
+        thread_local NodePool::Cache local(*pool);
+        return local;
+    }
+    
+public:
+    // pb_ds still expects the pre-C++11 allocator members
+    using value_type = T;
+    using size_type = size_t;
+    using difference_type = std::ptrdiff_t;
+    using pointer = T*;
+    using const_pointer = const T*;
+    using reference = T&;
+    using const_reference = const T&;
+    
+    template <typename U>
+    struct rebind {
+        using other = PoolAllocator<U, Tag>;
+    };
+    
+    PoolAllocator() noexcept = default;
+    
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U, Tag>&) noexcept {}
+    
+    T* allocate(size_t n) {
+        if (n != 1 || !POOLED) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(cache().allocate());
+    }
+    
+    void deallocate(T* p, size_t n) noexcept {
+        if (n != 1 || !POOLED) {
+            ::operator delete(p);
+        } else {
+            cache().deallocate(p);
+        }
+    }
+    
+    template <typename U>
+    bool operator==(const PoolAllocator<U, Tag>&) const noexcept {
+        return true;
+    }
+    
+    template <typename U>
+    bool operator!=(const PoolAllocator<U, Tag>&) const noexcept {
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,594 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <cmath>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "shm_ring.h"
+#include "histogram.h"
+
+// Load generator for a running daemon
+//
+//   ./number_bench [options]
+//
+// Each client thread opens its own framed connection and runs a closed loop
+// with --depth requests in flight, picking operations from --mix and numbers
+// from --dist. Latency is measured from sending a request to reading the
+// last frame of its reply and kept in log-linear (HDR-style) histograms.
+// STATS taken before and after the run gives the daemon's socket system
+// calls per request, which is how its I/O backends (--io) differ.
+
+using Clock = std::chrono::steady_clock;
+
+enum Op { OP_INSERT, OP_DELETE, OP_FIND, OP_PRINT_ALL, OP_COUNT };
+
+static const char* const OP_NAMES[OP_COUNT] = {"insert", "delete", "find", "print_all"};
+static const MessageType OP_TYPES[OP_COUNT] = {
+    MessageType::INSERT, MessageType::DELETE, MessageType::FIND, MessageType::PRINT_ALL};
+
+// Numbers in [1, keys] with the probability of rank r proportional to
+// 1 / r^theta (Gray et al., "Quickly generating billion-record synthetic
+// databases", as used by YCSB)
+class ZipfianGenerator {
+private:
+    uint64_t items;
+    double theta, alpha, zetan, eta;
+    
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1.0 / std::pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+    
+public:
+    ZipfianGenerator(uint64_t keys, double skew)
+        : items(keys), theta(skew), alpha(1.0 / (1.0 - skew)), zetan(zeta(keys, skew)) {
+        double zeta2 = zeta(2, theta);
+        eta = (1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta2 / zetan);
+    }
+    
+    template <typename Rng>
+    uint64_t next(Rng& rng) const {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetan;
+        if (uz < 1) {
+            return 1;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 2;
+        }
+        return 1 + static_cast<uint64_t>(items * std::pow(eta * u - eta + 1, alpha)) % items;
+    }
+};
+
+struct BenchConfig {
+    std::string socket_path = "/tmp/number_daemon.sock";
+    size_t clients = 4;
+    size_t depth = 1;
+    double seconds = 10;
+    uint32_t keys = 1000000;
+    uint32_t preload = 500000;
+    std::string dist = "uniform";
+    double theta = 0.99;
+    unsigned weights[OP_COUNT] = {10, 10, 80, 0};
+    bool shm = false;
+    bool busy_poll = false;
+    bool json = false;
+};
+
+struct ClientResult {
+    LatencyHistogram latency[OP_COUNT];
+    uint64_t errors[OP_COUNT] = {};
+    bool failed = false;
+};
+
+// One framed connection, over the socket or shared-memory rings
+class BenchConnection {
+private:
+    int sockfd = -1;
+    std::unique_ptr<ShmChannel> shm;
+    std::vector<char> in_buf;
+    size_t in_pos = 0;
+    
+    bool fill() {
+        if (in_pos > 0) {
+            in_buf.erase(in_buf.begin(), in_buf.begin() + in_pos);
+            in_pos = 0;
+        }
+        const size_t chunk = 64 * 1024;
+        size_t old_size = in_buf.size();
+        in_buf.resize(old_size + chunk);
+        while (true) {
+            ssize_t n;
+            if (shm) {
+                n = shm->receive(in_buf.data() + old_size, chunk);
+                if (n == 0 && shm->wait(true, false)) {
+                    continue;
+                }
+            } else {
+                n = read(sockfd, in_buf.data() + old_size, chunk);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+            }
+            in_buf.resize(old_size + std::max<ssize_t>(n, 0));
+            return n > 0;
+        }
+    }
+    
+    bool read_exact(void* data, size_t len) {
+        while (in_buf.size() - in_pos < len) {
+            if (!fill()) {
+                return false;
+            }
+        }
+        memcpy(data, in_buf.data() + in_pos, len);
+        in_pos += len;
+        return true;
+    }
+    
+public:
+    ~BenchConnection() {
+        shm.reset();
+        if (sockfd >= 0) {
+            close(sockfd);
+        }
+    }
+    
+    bool open(const BenchConfig& config) {
+        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, config.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        if (sockfd < 0 || connect(sockfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            return false;
+        }
+        
+        std::vector<char> hello;
+        encode_hello(hello, PROTOCOL_VERSION, 0);
+        char reply[HELLO_SIZE];
+        if (!send_all(hello) || !read_exact(reply, sizeof(reply)) ||
+            decode_hello(reply).version != PROTOCOL_VERSION) {
+            return false;
+        }
+        
+        if (config.shm) {
+            ErrorCode error;
+            shm = shm_attach(sockfd, 0, 0, config.busy_poll ? SHM_BUSY_POLL : 0, error);
+            return shm != nullptr;
+        }
+        return true;
+    }
+    
+    bool send_all(const std::vector<char>& buf) {
+        if (shm) {
+            return shm->write_all(buf.data(), buf.size());
+        }
+        size_t sent = 0;
+        while (sent < buf.size()) {
+            ssize_t n = send(sockfd, buf.data() + sent, buf.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+    
+    bool read_frame(FrameHeader& header, std::vector<char>& payload) {
+        char raw[FRAME_HEADER_SIZE];
+        if (!read_exact(raw, sizeof(raw)) || !decode_frame_header(raw, header)) {
+            return false;
+        }
+        payload.resize(header.payload_size());
+        return read_exact(payload.data(), payload.size());
+    }
+};
+
+// Inserts 1..config.preload in batches before the clock starts
+static bool preload(const BenchConfig& config) {
+    BenchConnection conn;
+    BenchConfig plain = config;
+    plain.shm = false;
+    if (!conn.open(plain)) {
+        return false;
+    }
+    const uint32_t chunk = 64 * 1024;
+    for (uint32_t first = 1; first <= config.preload; first += chunk) {
+        uint32_t count = std::min(chunk, config.preload - first + 1);
+        std::vector<char> request;
+        FrameBuilder frame(request, first, MessageType::INSERT_BATCH);
+        frame.put_u32(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            frame.put_i32(static_cast<int32_t>(first + i));
+        }
+        frame.finish();
+        
+        FrameHeader header;
+        std::vector<char> payload;
+        if (!conn.send_all(request) || !conn.read_frame(header, payload) ||
+            header.type != MessageType::RESPONSE_SUCCESS) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Socket system calls the daemon made during the run, from STATS before and after
+struct DaemonIo {
+    bool known = false;
+    std::string backend;
+    uint64_t syscalls = 0;
+};
+
+static bool daemon_stats(const BenchConfig& config, DaemonStats& stats) {
+    BenchConnection conn;
+    BenchConfig plain = config;
+    plain.shm = false;
+    std::vector<char> request;
+    FrameBuilder(request, 1, MessageType::STATS).finish();
+    FrameHeader header;
+    std::vector<char> payload;
+    if (!conn.open(plain) || !conn.send_all(request) || !conn.read_frame(header, payload) ||
+        header.type != MessageType::RESPONSE_SUCCESS) {
+        return false;
+    }
+    PayloadReader reader(payload.data(), payload.size());
+    return stats.parse(reader);
+}
+
+static void run_client(const BenchConfig& config, size_t index, const ZipfianGenerator* zipf,
+                       Clock::time_point deadline, ClientResult& result) {
+    BenchConnection conn;
+    if (!conn.open(config)) {
+        result.failed = true;
+        return;
+    }
+    
+    std::mt19937_64 rng(0x9e3779b97f4a7c15ull * (index + 1));
+    std::discrete_distribution<int> pick_op(std::begin(config.weights), std::end(config.weights));
+    std::uniform_int_distribution<uint32_t> uniform(1, config.keys);
+    uint64_t sequence = index;  // Sequential clients interleave over the key space
+    
+    auto next_number = [&]() -> int32_t {
+        if (config.dist == "sequential") {
+            int32_t number = static_cast<int32_t>(1 + sequence % config.keys);
+            sequence += config.clients;
+            return number;
+        }
+        if (zipf) {
+            return static_cast<int32_t>(zipf->next(rng));
+        }
+        return static_cast<int32_t>(uniform(rng));
+    };
+    
+    struct InFlight {
+        Op op;
+        Clock::time_point sent;
+    };
+    std::deque<InFlight> in_flight;
+    std::vector<char> request;
+    FrameHeader header;
+    std::vector<char> payload;
+    uint32_t next_id = 1;
+    
+    while (true) {
+        // Keep the pipeline full until the deadline, then drain it
+        bool running = Clock::now() < deadline;
+        request.clear();
+        while (running && in_flight.size() < config.depth) {
+            Op op = static_cast<Op>(pick_op(rng));
+            FrameBuilder frame(request, next_id++, OP_TYPES[op]);
+            if (op != OP_PRINT_ALL) {
+                frame.put_i32(next_number());
+            }
+            frame.finish();
+            in_flight.push_back({op, Clock::now()});
+        }
+        if (!request.empty() && !conn.send_all(request)) {
+            result.failed = true;
+            return;
+        }
+        if (in_flight.empty()) {
+            return;
+        }
+        
+        // Replies come back in request order; a PRINT_ALL reply ends with its first non-data frame
+        do {
+            if (!conn.read_frame(header, payload)) {
+                result.failed = true;
+                return;
+            }
+        } while (header.type == MessageType::RESPONSE_DATA);
+        
+        InFlight done = in_flight.front();
+        in_flight.pop_front();
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - done.sent);
+        result.latency[done.op].record(elapsed.count());
+        if (header.type == MessageType::RESPONSE_ERROR) {
+            ++result.errors[done.op];
+        }
+    }
+}
+
+static void print_text(const BenchConfig& config, double seconds, const LatencyHistogram* latency,
+                       const uint64_t* errors, const LatencyHistogram& all, const DaemonIo& io) {
+    std::cout << config.clients << " clients x depth " << config.depth << ", " << config.dist
+              << " keys in [1, " << config.keys << "], " << (config.shm ? "shm" : "socket")
+              << " transport, " << std::fixed << std::setprecision(1) << seconds << " s" << std::endl;
+    std::cout << std::left << std::setw(10) << "op" << std::right
+              << std::setw(12) << "count" << std::setw(12) << "ops/s" << std::setw(10) << "errors"
+              << std::setw(10) << "p50 us" << std::setw(10) << "p99 us"
+              << std::setw(10) << "p99.9 us" << std::setw(10) << "max us" << std::endl;
+    
+    auto row = [&](const char* name, const LatencyHistogram& h, uint64_t errs) {
+        std::cout << std::left << std::setw(10) << name << std::right
+                  << std::setw(12) << h.count()
+                  << std::setw(12) << std::setprecision(0) << h.count() / seconds
+                  << std::setw(10) << errs << std::setprecision(1)
+                  << std::setw(10) << h.percentile(0.5) / 1000.0
+                  << std::setw(10) << h.percentile(0.99) / 1000.0
+                  << std::setw(10) << h.percentile(0.999) / 1000.0
+                  << std::setw(10) << h.max() / 1000.0 << std::endl;
+    };
+    uint64_t total_errors = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        if (latency[op].count() > 0) {
+            row(OP_NAMES[op], latency[op], errors[op]);
+        }
+        total_errors += errors[op];
+    }
+    row("all", all, total_errors);
+    if (io.known && all.count() > 0) {
+        std::cout << "daemon " << io.backend << " I/O: " << io.syscalls << " socket system calls, "
+                  << std::setprecision(2) << static_cast<double>(io.syscalls) / all.count()
+                  << " per request" << std::endl;
+    }
+}
+
+static void print_json(const BenchConfig& config, double seconds, const LatencyHistogram* latency,
+                       const uint64_t* errors, const LatencyHistogram& all, const DaemonIo& io) {
+    auto stats = [&](const LatencyHistogram& h, uint64_t errs) {
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3)
+            << "{\"count\": " << h.count() << ", \"errors\": " << errs
+            << ", \"ops_per_sec\": " << h.count() / seconds
+            << ", \"mean_us\": " << h.mean() / 1000.0
+            << ", \"p50_us\": " << h.percentile(0.5) / 1000.0
+            << ", \"p99_us\": " << h.percentile(0.99) / 1000.0
+            << ", \"p999_us\": " << h.percentile(0.999) / 1000.0
+            << ", \"max_us\": " << h.max() / 1000.0 << "}";
+        return out.str();
+    };
+    
+    std::cout << "{\n  \"config\": {\"clients\": " << config.clients << ", \"depth\": " << config.depth
+              << ", \"seconds\": " << config.seconds << ", \"keys\": " << config.keys
+              << ", \"preload\": " << config.preload << ", \"dist\": \"" << config.dist << "\""
+              << ", \"transport\": \"" << (config.shm ? (config.busy_poll ? "shm-busy-poll" : "shm")
+                                                       : "socket") << "\""
+              << ", \"mix\": {";
+    for (int op = 0; op < OP_COUNT; ++op) {
+        std::cout << (op ? ", " : "") << "\"" << OP_NAMES[op] << "\": " << config.weights[op];
+    }
+    std::cout << "}},\n  \"elapsed_sec\": " << std::fixed << std::setprecision(3) << seconds
+              << ",\n  \"ops\": {";
+    uint64_t total_errors = 0;
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        total_errors += errors[op];
+        if (latency[op].count() == 0) {
+            continue;
+        }
+        std::cout << (first ? "\n" : ",\n") << "    \"" << OP_NAMES[op] << "\": "
+                  << stats(latency[op], errors[op]);
+        first = false;
+    }
+    std::cout << "\n  },\n  \"all\": " << stats(all, total_errors);
+    if (io.known) {
+        std::cout << ",\n  \"daemon_io\": {\"backend\": \"" << io.backend << "\", \"syscalls\": "
+                  << io.syscalls << ", \"syscalls_per_op\": "
+                  << (all.count() ? static_cast<double>(io.syscalls) / all.count() : 0) << "}";
+    }
+    std::cout << "\n}" << std::endl;
+}
+
+// Parses "insert=10,delete=10,find=80,print_all=0"; unnamed ops get weight 0
+static bool parse_mix(const std::string& text, unsigned* weights) {
+    std::fill(weights, weights + OP_COUNT, 0);
+    std::istringstream input(text);
+    std::string item;
+    uint64_t total = 0;
+    while (std::getline(input, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) {
+            return false;
+        }
+        std::string name = item.substr(0, eq);
+        auto it = std::find_if(std::begin(OP_NAMES), std::end(OP_NAMES),
+                               [&](const char* op) { return name == op; });
+        if (it == std::end(OP_NAMES)) {
+            return false;
+        }
+        unsigned weight;
+        if (!parse_count(item.substr(eq + 1), weight)) {
+            return false;
+        }
+        weights[it - std::begin(OP_NAMES)] = weight;
+        total += weight;
+    }
+    return total > 0;
+}
+
+static void print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [options]" << std::endl;
+    std::cout << "  -c, --clients N     Client threads, one connection each (default: 4)" << std::endl;
+    std::cout << "  -d, --duration SEC  Measured run time (default: 10)" << std::endl;
+    std::cout << "  --depth N           Requests in flight per connection (default: 1)" << std::endl;
+    std::cout << "  --mix SPEC          Operation weights (default: insert=10,delete=10,find=80,print_all=0)" << std::endl;
+    std::cout << "  --keys N            Numbers are drawn from [1, N] (default: 1000000)" << std::endl;
+    std::cout << "  --dist NAME         uniform (default), zipfian or sequential" << std::endl;
+    std::cout << "  --theta X           Zipfian skew, below 1 (default: 0.99)" << std::endl;
+    std::cout << "  --preload N         Insert 1..N before the run (default: 500000)" << std::endl;
+    std::cout << "  --shm               Use shared-memory rings instead of the socket" << std::endl;
+    std::cout << "  --busy-poll         Same as --shm, spinning instead of sleeping" << std::endl;
+    std::cout << "  --json              Print results as JSON" << std::endl;
+    std::cout << "  -s, --socket PATH   Daemon socket (default: /tmp/number_daemon.sock)" << std::endl;
+}
+
+static int invalid_option(const char* prog, const std::string& option, const std::string& value) {
+    std::cerr << "Invalid value for " << option << ": " << value << std::endl;
+    print_usage(prog);
+    return 1;
+}
+
+// Numbers have to be positive int32s
+static bool parse_key_count(const std::string& text, uint32_t& value) {
+    return parse_count(text, value) && value <= static_cast<uint32_t>(INT32_MAX);
+}
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if ((arg == "-c" || arg == "--clients") && has_value) {
+            if (!parse_count(argv[++i], config.clients)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+            config.clients = std::max<size_t>(config.clients, 1);
+        } else if ((arg == "-d" || arg == "--duration") && has_value) {
+            if (!parse_count(argv[++i], config.seconds)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--depth" && has_value) {
+            if (!parse_count(argv[++i], config.depth)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+            config.depth = std::max<size_t>(config.depth, 1);
+        } else if (arg == "--mix" && has_value) {
+            if (!parse_mix(argv[++i], config.weights)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--keys" && has_value) {
+            if (!parse_key_count(argv[++i], config.keys)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+            config.keys = std::max<uint32_t>(config.keys, 1);
+        } else if (arg == "--dist" && has_value) {
+            config.dist = argv[++i];
+        } else if (arg == "--theta" && has_value) {
+            if (!parse_count(argv[++i], config.theta)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--preload" && has_value) {
+            if (!parse_key_count(argv[++i], config.preload)) {
+                return invalid_option(argv[0], arg, argv[i]);
+            }
+        } else if (arg == "--shm") {
+            config.shm = true;
+        } else if (arg == "--busy-poll") {
+            config.shm = true;
+            config.busy_poll = true;
+        } else if (arg == "--json") {
+            config.json = true;
+        } else if ((arg == "-s" || arg == "--socket") && has_value) {
+            config.socket_path = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (config.dist != "uniform" && config.dist != "zipfian" && config.dist != "sequential") {
+        std::cerr << "Unknown distribution: " << config.dist << std::endl;
+        return 1;
+    }
+    if (config.dist == "zipfian" && (config.theta <= 0 || config.theta >= 1)) {
+        std::cerr << "--theta must be between 0 and 1" << std::endl;
+        return 1;
+    }
+    
+    if (config.preload > 0 && !preload(config)) {
+        std::cerr << "Failed to preload the daemon at " << config.socket_path << std::endl;
+        return 1;
+    }
+    
+    std::unique_ptr<ZipfianGenerator> zipf;
+    if (config.dist == "zipfian") {
+        zipf = std::make_unique<ZipfianGenerator>(config.keys, config.theta);
+    }
+    
+    DaemonStats stats_before;
+    bool stats_known = daemon_stats(config, stats_before);
+    
+    std::vector<ClientResult> results(config.clients);
+    std::vector<std::thread> threads;
+    auto start = Clock::now();
+    auto deadline = start + std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(config.seconds));
+    for (size_t i = 0; i < config.clients; ++i) {
+        threads.emplace_back(run_client, std::cref(config), i, zipf.get(), deadline,
+                             std::ref(results[i]));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    
+    DaemonIo io;
+    DaemonStats stats_after;
+    if (stats_known && daemon_stats(config, stats_after) && stats_after.has_io) {
+        io.known = true;
+        io.backend = stats_after.io_backend_name();
+        io.syscalls = stats_after.io_syscalls - stats_before.io_syscalls;
+    }
+    
+    LatencyHistogram latency[OP_COUNT];
+    uint64_t errors[OP_COUNT] = {};
+    LatencyHistogram all;
+    size_t failed = 0;
+    for (const auto& result : results) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            latency[op].merge(result.latency[op]);
+            all.merge(result.latency[op]);
+            errors[op] += result.errors[op];
+        }
+        failed += result.failed;
+    }
+    if (failed > 0) {
+        std::cerr << failed << " of " << config.clients << " clients lost their connection"
+                  << std::endl;
+    }
+    
+    if (config.json) {
+        print_json(config, seconds, latency, errors, all, io);
+    } else {
+        print_text(config, seconds, latency, errors, all, io);
+    }
+    return failed > 0 ? 1 : 0;
+}
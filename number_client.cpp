@@ -0,0 +1,506 @@
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "number_client.h"
+#include "shm_ring.h"
+
+// One pooled connection; touched by the I/O thread only, once connected
+struct NumberClient::Connection {
+    int fd = -1;                      // -1 while closed
+    std::unique_ptr<ShmChannel> shm;  // Rings, if attached
+    uint32_t next_id = 1;
+    std::vector<char> out;            // Request frames, sent up to out_pos
+    size_t out_pos = 0;
+    std::vector<char> in;             // Receive buffer, never shrunk
+    size_t in_pos = 0;                // Parsed up to here
+    size_t in_len = 0;                // Received up to here
+    std::unordered_map<uint32_t, Pending> pending;  // By request id
+    size_t outstanding = 0;           // Pending requests not replied to yet
+    bool going_away = false;          // The daemon sent GOAWAY
+};
+
+static constexpr size_t READ_CHUNK = 64 * 1024;
+
+Request make_request(MessageType type) {
+    Request request;
+    FrameBuilder(request.frame, 0, type).finish();
+    return request;
+}
+
+Request make_request(MessageType type, int32_t number) {
+    Request request;
+    FrameBuilder(request.frame, 0, type).put_i32(number).finish();
+    return request;
+}
+
+static bool write_full(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_full(int fd, char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+NumberClient::NumberClient(ClientOptions client_options) : options(std::move(client_options)) {
+    options.connections = std::max<size_t>(options.connections, 1);
+}
+
+NumberClient::~NumberClient() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+    }
+    if (io_thread.joinable()) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+        io_thread.join();
+    }
+    for (auto& conn : pool) {
+        close(*conn);
+    }
+    for (Pending& pending : submitted) {
+        pending.reply.lost = true;
+        pending.reply.status = ErrorCode::UNAVAILABLE;
+        pending.done(pending.reply);
+    }
+    if (wake_fd >= 0) {
+        ::close(wake_fd);
+    }
+}
+
+// Connects, negotiates the framed protocol and attaches rings if asked to.
+// Blocking; the socket is switched to non-blocking afterwards.
+bool NumberClient::open(Connection& conn, std::string& error) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error = "Failed to create socket";
+        return false;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, options.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    if (::connect(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) < 0) {
+        error = "Cannot connect to daemon. Is the daemon running?";
+        ::close(fd);
+        return false;
+    }
+    
+    std::vector<char> hello;
+    encode_hello(hello, PROTOCOL_VERSION, 0);
+    char reply[HELLO_SIZE];
+    if (!write_full(fd, hello.data(), hello.size()) || !read_full(fd, reply, sizeof(reply))) {
+        error = "Handshake with daemon failed";
+        ::close(fd);
+        return false;
+    }
+    Hello accepted = decode_hello(reply);
+    if (accepted.magic != PROTOCOL_MAGIC || accepted.version != PROTOCOL_VERSION) {
+        error = "Daemon does not support protocol version " + std::to_string(PROTOCOL_VERSION);
+        ::close(fd);
+        return false;
+    }
+    
+    conn.next_id = 1;
+    if (options.shared_memory) {
+        ErrorCode code;
+        conn.shm = shm_attach(fd, conn.next_id++, 0, options.busy_poll ? SHM_BUSY_POLL : 0, code);
+        if (!conn.shm) {
+            error = "Shared-memory transport not available";
+            if (code != ErrorCode::NONE) {
+                error += std::string(" (") + error_string(code) + ")";
+            }
+            ::close(fd);
+            return false;
+        }
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    conn.fd = fd;
+    return true;
+}
+
+// Fails every request of a broken or closing connection
+void NumberClient::fail_all(std::unordered_map<uint32_t, Pending>& pending) {
+    for (auto& entry : pending) {
+        Pending& request = entry.second;
+        if (request.watching) {
+            if (request.request.on_closed) {
+                request.request.on_closed();
+            }
+        } else {
+            request.reply.lost = true;
+            request.reply.status = ErrorCode::UNAVAILABLE;
+            request.done(request.reply);
+        }
+    }
+}
+
+// Queues the requests a draining daemon did not serve again, ahead of
+// newer ones and in the order they were sent. Subscriptions end.
+void NumberClient::resubmit(std::unordered_map<uint32_t, Pending>& pending) {
+    std::vector<uint32_t> ids;
+    for (auto& entry : pending) {
+        Pending& request = entry.second;
+        if (!request.watching) {
+            ids.push_back(entry.first);
+        } else if (request.request.on_closed) {
+            request.request.on_closed();
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+    {
+        std::lock_guard lock(mutex);
+        for (auto id = ids.rbegin(); id != ids.rend(); ++id) {
+            submitted.push_front(std::move(pending.at(*id)));
+        }
+    }
+    if (!ids.empty()) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void NumberClient::close(Connection& conn) {
+    std::unordered_map<uint32_t, Pending> failed;
+    failed.swap(conn.pending);
+    bool going_away = conn.going_away;
+    conn.going_away = false;
+    conn.shm.reset();
+    if (conn.fd >= 0) {
+        ::close(conn.fd);
+        conn.fd = -1;
+    }
+    conn.out.clear();
+    conn.out_pos = 0;
+    conn.in_pos = 0;
+    conn.in_len = 0;
+    conn.outstanding = 0;
+    if (going_away) {
+        resubmit(failed);
+    } else {
+        fail_all(failed);
+    }
+}
+
+// Queues a request on the open connection with the fewest replies
+// outstanding, opening another one of the pool rather than queuing behind
+// a busy connection
+void NumberClient::assign(Pending pending) {
+    Connection* best = nullptr;
+    for (auto& conn : pool) {
+        if (conn->fd >= 0 && (!best || conn->outstanding < best->outstanding)) {
+            best = conn.get();
+        }
+    }
+    if (!best || best->outstanding > 0) {
+        for (auto& conn : pool) {
+            if (conn->fd < 0) {
+                std::string error;
+                if (open(*conn, error)) {
+                    best = conn.get();
+                }
+                break;
+            }
+        }
+    }
+    if (!best || pending.request.frame.size() < FRAME_HEADER_SIZE) {
+        pending.reply.lost = !best;
+        pending.reply.status = best ? ErrorCode::MALFORMED : ErrorCode::UNAVAILABLE;
+        pending.done(pending.reply);
+        return;
+    }
+    
+    uint32_t id = best->next_id++;
+    std::vector<char>& frame = pending.request.frame;
+    FrameHeader header;
+    decode_frame_header(frame.data(), header);
+    pending.type = header.type;
+    memcpy(frame.data() + FRAME_LENGTH_SIZE, &id, sizeof(id));
+    best->out.insert(best->out.end(), frame.begin(), frame.end());
+    ++best->outstanding;
+    best->pending.emplace(id, std::move(pending));
+}
+
+// Sends what the connection takes without blocking; false once it failed
+bool NumberClient::flush(Connection& conn) {
+    while (conn.out_pos < conn.out.size()) {
+        const char* data = conn.out.data() + conn.out_pos;
+        size_t len = conn.out.size() - conn.out_pos;
+        ssize_t n = conn.shm ? static_cast<ssize_t>(conn.shm->send(data, len))
+                             : send(conn.fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            conn.out_pos += n;
+        } else if (n == 0 || errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    if (conn.out_pos == conn.out.size()) {
+        conn.out.clear();
+        conn.out_pos = 0;
+    }
+    return true;
+}
+
+// Reads whatever has arrived and dispatches every complete frame; false
+// once the connection failed or the daemon closed it
+bool NumberClient::receive(Connection& conn) {
+    while (true) {
+        if (conn.in.size() - conn.in_len < READ_CHUNK) {
+            conn.in.resize(conn.in_len + READ_CHUNK);
+        }
+        char* space = conn.in.data() + conn.in_len;
+        ssize_t n = conn.shm ? static_cast<ssize_t>(conn.shm->receive(space, READ_CHUNK))
+                             : recv(conn.fd, space, READ_CHUNK, MSG_DONTWAIT);
+        conn.in_len += std::max<ssize_t>(n, 0);
+        if (n == 0 && !conn.shm) {
+            return false;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            return false;
+        }
+        
+        while (conn.in_len - conn.in_pos >= FRAME_HEADER_SIZE) {
+            FrameHeader header;
+            if (!decode_frame_header(conn.in.data() + conn.in_pos, header)) {
+                return false;
+            }
+            size_t frame_size = FRAME_LENGTH_SIZE + header.length;
+            if (conn.in_len - conn.in_pos < frame_size) {
+                break;
+            }
+            if (!dispatch(conn, header, conn.in.data() + conn.in_pos + FRAME_HEADER_SIZE)) {
+                return false;
+            }
+            conn.in_pos += frame_size;
+        }
+        // Keep a partial frame at the front
+        if (conn.in_pos > 0) {
+            memmove(conn.in.data(), conn.in.data() + conn.in_pos, conn.in_len - conn.in_pos);
+            conn.in_len -= conn.in_pos;
+            conn.in_pos = 0;
+        }
+        if (n <= 0) {
+            return true;
+        }
+    }
+}
+
+bool NumberClient::dispatch(Connection& conn, const FrameHeader& header, const char* payload) {
+    // The daemon is draining and closes the connection; whatever it has
+    // not answered goes to another one
+    if (header.type == MessageType::GOAWAY) {
+        conn.going_away = true;
+        return false;
+    }
+    auto it = conn.pending.find(header.id);
+    if (it == conn.pending.end()) {
+        return true;  // Nothing asked for it
+    }
+    Pending& pending = it->second;
+    PayloadReader reader(payload, header.payload_size());
+    
+    if (header.type == MessageType::RESPONSE_DATA) {
+        uint32_t count = reader.get_u32();
+        std::vector<NumberEntry> streamed;
+        std::vector<NumberEntry>& entries = pending.request.on_entries ? streamed : pending.reply.entries;
+        for (uint32_t i = 0; i < count && reader.good(); ++i) {
+            int32_t number = reader.get_i32();
+            int64_t timestamp = reader.get_i64();
+            if (reader.good()) {
+                entries.emplace_back(number, timestamp);
+            }
+        }
+        if (pending.request.on_entries) {
+            pending.request.on_entries(streamed);
+        }
+        return reader.good();
+    }
+    if (header.type == MessageType::WATCH_EVENT) {
+        if (pending.watching && pending.request.on_event) {
+            pending.request.on_event(reader);
+        }
+        return true;
+    }
+    
+    // The closing frame
+    Reply reply = std::move(pending.reply);
+    reply.type = header.type;
+    reply.status = header.status;
+    reply.payload.assign(payload, payload + header.payload_size());
+    ReplyCallback done = std::move(pending.done);
+    --conn.outstanding;
+    if (pending.type == MessageType::WATCH && header.type == MessageType::RESPONSE_SUCCESS) {
+        pending.watching = true;
+    } else {
+        conn.pending.erase(it);
+    }
+    done(reply);
+    return true;
+}
+
+void NumberClient::run() {
+    std::vector<struct pollfd> fds;
+    std::deque<Pending> batch;
+    
+    while (true) {
+        {
+            std::lock_guard lock(mutex);
+            if (stopping) {
+                return;
+            }
+            batch.swap(submitted);
+        }
+        for (Pending& pending : batch) {
+            assign(std::move(pending));
+        }
+        batch.clear();
+        
+        bool busy = false;  // Rings that may make progress without a bell
+        for (auto& conn : pool) {
+            if (conn->fd >= 0 && (!flush(*conn) || !receive(*conn))) {
+                close(*conn);
+            }
+        }
+        
+        // Sleep until the daemon or a submitter has something for us
+        fds.clear();
+        fds.push_back({wake_fd, POLLIN, 0});
+        for (auto& conn : pool) {
+            if (conn->fd < 0) {
+                continue;
+            }
+            bool sending = conn->out_pos < conn->out.size();
+            if (conn->shm) {
+                if (options.busy_poll ? conn->outstanding > 0 || sending
+                                      : !conn->shm->prepare_sleep(true, sending)) {
+                    busy = true;
+                }
+                fds.push_back({conn->shm->bell_fd(), POLLIN, 0});
+                fds.push_back({conn->fd, POLLIN, 0});  // The daemon never writes to it once attached
+            } else {
+                fds.push_back({conn->fd, static_cast<short>(POLLIN | (sending ? POLLOUT : 0)), 0});
+            }
+        }
+        if (poll(fds.data(), fds.size(), busy ? 0 : -1) < 0 && errno != EINTR) {
+            return;
+        }
+        if (fds[0].revents) {
+            uint64_t value;
+            ssize_t ignored = read(wake_fd, &value, sizeof(value));
+            (void)ignored;
+        }
+        size_t index = 1;
+        for (auto& conn : pool) {
+            if (conn->fd < 0) {
+                continue;
+            }
+            if (conn->shm) {
+                if (fds[index].revents) {
+                    conn->shm->clear_bell();
+                }
+                if (fds[index + 1].revents) {
+                    receive(*conn);  // A GOAWAY may still wait in the ring
+                    close(*conn);
+                }
+                index += 2;
+            } else {
+                ++index;
+            }
+        }
+    }
+}
+
+bool NumberClient::connect(std::string& error) {
+    if (io_thread.joinable()) {
+        return true;
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        error = "Failed to create eventfd";
+        return false;
+    }
+    for (size_t i = 0; i < options.connections; ++i) {
+        pool.push_back(std::make_unique<Connection>());
+        if (!open(*pool.back(), error)) {
+            pool.clear();
+            ::close(wake_fd);
+            wake_fd = -1;
+            return false;
+        }
+    }
+    io_thread = std::thread([this] { run(); });
+    return true;
+}
+
+bool NumberClient::defer(Request request, ReplyCallback done) {
+    Pending pending;
+    pending.request = std::move(request);
+    pending.done = std::move(done);
+    std::lock_guard lock(mutex);
+    bool idle = submitted.empty();
+    submitted.push_back(std::move(pending));
+    return idle;
+}
+
+void NumberClient::flush() {
+    bool queued;
+    {
+        std::lock_guard lock(mutex);
+        queued = !submitted.empty();
+    }
+    if (queued && wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(wake_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void NumberClient::submit(Request request, ReplyCallback done) {
+    // The I/O thread takes the whole queue at once, so only the first
+    // request of a burst needs to wake it
+    if (defer(std::move(request), std::move(done))) {
+        flush();
+    }
+}
+
+std::future<Reply> NumberClient::submit(Request request) {
+    auto promise = std::make_shared<std::promise<Reply>>();
+    std::future<Reply> future = promise->get_future();
+    submit(std::move(request), [promise](Reply& reply) {
+        promise->set_value(std::move(reply));
+    });
+    return future;
+}
@@ -0,0 +1,134 @@
+#ifndef NUMBER_CLIENT_H
+#define NUMBER_CLIENT_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+#include "common.h"
+#include "protocol.h"
+
+// Asynchronous client for the daemon's framed protocol (libnumberclient.a).
+// It keeps a pool of persistent connections, socket or shared-memory rings,
+// served by one I/O thread. Requests go to the connection with the fewest
+// replies outstanding and may be submitted from any thread without limit;
+// their replies are matched by request id, so any number can be in flight.
+// Callbacks run on the I/O thread and must not wait for other replies of
+// the same client. A broken connection fails its outstanding requests and
+// is reopened for the next request. When the daemon drains a connection
+// (GOAWAY), the requests it did not answer are sent again on another one,
+// so a hot restart goes unnoticed.
+//
+//   NumberClient client;
+//   std::string error;
+//   if (client.connect(error)) {
+//       Reply reply = client.call(make_request(MessageType::FIND, 42));
+//   }
+
+struct ClientOptions {
+    std::string socket_path = "/tmp/number_daemon.sock";
+    size_t connections = 1;
+    bool shared_memory = false;  // Attach shared-memory rings to every connection
+    bool busy_poll = false;      // With shared_memory, spin instead of sleeping
+};
+
+// The outcome of one request
+struct Reply {
+    MessageType type = MessageType::RESPONSE_ERROR;  // Of the closing frame
+    ErrorCode status = ErrorCode::NONE;
+    bool lost = false;                 // The connection failed first; status is UNAVAILABLE
+    std::vector<char> payload;         // Of the closing frame
+    std::vector<NumberEntry> entries;  // Of the RESPONSE_DATA frames, unless streamed
+    
+    bool ok() const {
+        return !lost && type == MessageType::RESPONSE_SUCCESS;
+    }
+    
+    PayloadReader reader() const {
+        return PayloadReader(payload.data(), payload.size());
+    }
+};
+
+using ReplyCallback = std::function<void(Reply&)>;
+
+// A request frame, built with FrameBuilder under any id; the client assigns
+// the id when it sends the frame
+struct Request {
+    std::vector<char> frame;
+    // Receives the entries of each RESPONSE_DATA frame as it arrives,
+    // instead of collecting them in Reply::entries
+    std::function<void(const std::vector<NumberEntry>&)> on_entries;
+    // WATCH: receives the payload of every WATCH_EVENT after the reply
+    std::function<void(PayloadReader&)> on_event;
+    // WATCH: called once the subscription ends with its connection
+    std::function<void()> on_closed;
+};
+
+// Requests with no payload, or with just a number
+Request make_request(MessageType type);
+Request make_request(MessageType type, int32_t number);
+
+class NumberClient {
+private:
+    struct Pending {
+        Request request;
+        ReplyCallback done;
+        Reply reply;
+        MessageType type = MessageType::INSERT;  // Of the request
+        bool watching = false;  // Replied to; WATCH_EVENTs follow
+    };
+    
+    struct Connection;
+    
+    ClientOptions options;
+    std::vector<std::unique_ptr<Connection>> pool;  // I/O thread only, once connected
+    std::mutex mutex;
+    std::deque<Pending> submitted;  // Not yet handed to a connection
+    bool stopping = false;
+    int wake_fd = -1;               // eventfd rung by submit() and the destructor
+    std::thread io_thread;
+    
+    static void fail_all(std::unordered_map<uint32_t, Pending>& pending);
+    void resubmit(std::unordered_map<uint32_t, Pending>& pending);
+    bool open(Connection& conn, std::string& error);
+    void close(Connection& conn);
+    void assign(Pending pending);
+    bool flush(Connection& conn);
+    bool receive(Connection& conn);
+    bool dispatch(Connection& conn, const FrameHeader& header, const char* payload);
+    void run();
+    
+public:
+    explicit NumberClient(ClientOptions client_options = ClientOptions());
+    ~NumberClient();
+    
+    NumberClient(const NumberClient&) = delete;
+    NumberClient& operator=(const NumberClient&) = delete;
+    
+    // Opens the pool and starts the I/O thread. On failure error says why.
+    bool connect(std::string& error);
+    
+    // done receives the reply on the I/O thread
+    void submit(Request request, ReplyCallback done);
+    std::future<Reply> submit(Request request);
+    
+    // Queues a request without waking the I/O thread, so that a burst
+    // goes out in one write after flush() instead of one at a time.
+    // Returns whether the queue was empty before.
+    bool defer(Request request, ReplyCallback done);
+    void flush();
+    
+    // Blocks for the reply
+    Reply call(Request request) {
+        return submit(std::move(request)).get();
+    }
+};
+
+#endif
@@ -0,0 +1,355 @@
+#ifndef NUMBER_FILE_H
+#define NUMBER_FILE_H
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <limits>
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <cstdlib>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "protocol.h"
+#include "number_store.h"
+#include "wal.h"
+
+// Number files read by IMPORT and written by EXPORT, in one of two formats:
+//   NUMBER_FILE_TEXT    decimal numbers, one per line; blank lines are
+//                       skipped and whatever follows the number on its line
+//                       after a space or tab is ignored
+//   NUMBER_FILE_BINARY  packed int32 numbers in host byte order
+// Exports hold the stored numbers in ascending order. Both sides work on a
+// mapping of the file: an import parses it in place, split between
+// threads, and an export formats straight into the page cache, so neither
+// copies the data through a buffer.
+
+// Largest text line EXPORT writes: a number and a newline
+constexpr size_t NUMBER_TEXT_MAX = 11;
+
+// The daemon only touches files inside one directory, given as a canonical
+// path. Resolves path, taken relative to directory unless absolute, into
+// resolved; false if it leads outside directory, following symbolic links.
+// An existing file is required unless create is set, in which case the
+// last component may be missing and is not followed.
+inline bool resolve_number_file(const std::string& directory, const std::string& path, bool create,
+                                std::string& resolved) {
+    if (path.empty() || path.find('\0') != std::string::npos) {
+        return false;
+    }
+    std::string full = path[0] == '/' ? path : directory + "/" + path;
+    std::string target = full;
+    std::string name;
+    if (create) {
+        size_t slash = full.rfind('/');
+        name = full.substr(slash + 1);
+        target = slash == 0 ? "/" : full.substr(0, slash);
+        if (name.empty() || name == "." || name == "..") {
+            return false;
+        }
+    }
+    char buffer[PATH_MAX];
+    if (!realpath(target.c_str(), buffer)) {
+        return false;
+    }
+    resolved = buffer;
+    std::string prefix = directory == "/" ? directory : directory + "/";
+    bool inside = resolved.compare(0, prefix.size(), prefix) == 0;
+    if (create) {
+        inside = inside || resolved == directory;
+        resolved += resolved == "/" ? name : "/" + name;
+    }
+    return inside;
+}
+
+// Parses text[begin, end) into numbers, counting those that are not
+// positive int32s in invalid. False if a line is not a number.
+inline bool parse_number_text(const char* begin, const char* end, std::vector<int32_t>& numbers,
+                              uint64_t& invalid) {
+    const char* p = begin;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+            ++p;
+        }
+        if (p < end && *p == '\n') {
+            ++p;
+            continue;
+        }
+        if (p == end) {
+            break;
+        }
+        
+        const char* digits = *p == '+' ? p + 1 : p;  // from_chars takes no '+'
+        int64_t value;
+        auto [next, error] = std::from_chars(digits, end, value);
+        if (error == std::errc::result_out_of_range) {
+            value = 0;  // Counted as invalid
+            next = digits + (*digits == '-');
+            while (next < end && *next >= '0' && *next <= '9') {
+                ++next;
+            }
+        } else if (error != std::errc()) {
+            return false;
+        }
+        if (next < end && *next != '\n' && *next != ' ' && *next != '\t' && *next != '\r') {
+            return false;
+        }
+        if (value > 0 && value <= std::numeric_limits<int32_t>::max()) {
+            numbers.push_back(static_cast<int32_t>(value));
+        } else {
+            ++invalid;
+        }
+        p = static_cast<const char*>(memchr(next, '\n', end - next));
+        p = p ? p + 1 : end;
+    }
+    return true;
+}
+
+// Reads the number file at path into numbers, sorted and without
+// duplicates, with up to threads threads parsing disjoint parts. read
+// counts the numbers in the file, invalid those that are not positive and
+// were left out. Returns FILE_ERROR if the file cannot be read and
+// MALFORMED if it is not in format.
+inline ErrorCode read_number_file(const std::string& path, uint8_t format, size_t threads,
+                                  std::vector<int32_t>& numbers, uint64_t& read, uint64_t& invalid) {
+    numbers.clear();
+    read = 0;
+    invalid = 0;
+    if (format != NUMBER_FILE_TEXT && format != NUMBER_FILE_BINARY) {
+        return ErrorCode::MALFORMED;
+    }
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return ErrorCode::FILE_ERROR;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return ErrorCode::FILE_ERROR;
+    }
+    size_t size = st.st_size;
+    if (format == NUMBER_FILE_BINARY && size % sizeof(int32_t) != 0) {
+        close(fd);
+        return ErrorCode::MALFORMED;
+    }
+    if (size == 0) {
+        close(fd);
+        return ErrorCode::NONE;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return ErrorCode::FILE_ERROR;
+    }
+    const char* data = static_cast<const char*>(mapped);
+    
+    // Parts of at least 1 MiB, split after a newline (or a whole number)
+    threads = std::clamp<size_t>(size / (1024 * 1024), 1, std::max<size_t>(threads, 1));
+    std::vector<size_t> bounds(threads + 1, size);
+    bounds[0] = 0;
+    for (size_t t = 1; t < threads; ++t) {
+        size_t bound = std::max(size / threads * t, bounds[t - 1]);
+        if (format == NUMBER_FILE_BINARY) {
+            bound -= bound % sizeof(int32_t);
+        } else {
+            const char* newline = static_cast<const char*>(memchr(data + bound, '\n', size - bound));
+            bound = newline ? newline - data + 1 : size;
+        }
+        bounds[t] = bound;
+    }
+    
+    // Each part comes back sorted
+    std::vector<std::vector<int32_t>> parts(threads);
+    std::vector<uint64_t> part_invalid(threads, 0);
+    std::vector<char> part_ok(threads, 1);
+    auto work = [&](size_t t) {
+        const char* begin = data + bounds[t];
+        const char* end = data + bounds[t + 1];
+        std::vector<int32_t>& part = parts[t];
+        if (format == NUMBER_FILE_BINARY) {
+            part.resize((end - begin) / sizeof(int32_t));
+            memcpy(part.data(), begin, end - begin);
+            auto valid_end = std::partition(part.begin(), part.end(), [](int32_t n) { return n > 0; });
+            part_invalid[t] = part.end() - valid_end;
+            part.erase(valid_end, part.end());
+        } else {
+            part.reserve((end - begin) / 8);
+            part_ok[t] = parse_number_text(begin, end, part, part_invalid[t]);
+        }
+        std::sort(part.begin(), part.end());
+    };
+    std::vector<std::thread> workers;
+    for (size_t t = 1; t < threads; ++t) {
+        workers.emplace_back(work, t);
+    }
+    work(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    munmap(mapped, size);
+    
+    for (size_t t = 0; t < threads; ++t) {
+        if (!part_ok[t]) {
+            return ErrorCode::MALFORMED;
+        }
+        read += parts[t].size() + part_invalid[t];
+        invalid += part_invalid[t];
+    }
+    
+    // Merge the parts pairwise, each round in parallel
+    for (size_t width = 1; width < threads; width *= 2) {
+        std::vector<std::thread> mergers;
+        for (size_t t = 0; t + width < threads; t += 2 * width) {
+            mergers.emplace_back([&parts, t, width] {
+                std::vector<int32_t> merged(parts[t].size() + parts[t + width].size());
+                std::merge(parts[t].begin(), parts[t].end(), parts[t + width].begin(),
+                           parts[t + width].end(), merged.begin());
+                parts[t].swap(merged);
+                std::vector<int32_t>().swap(parts[t + width]);
+            });
+        }
+        for (auto& merger : mergers) {
+            merger.join();
+        }
+    }
+    numbers.swap(parts[0]);
+    numbers.erase(std::unique(numbers.begin(), numbers.end()), numbers.end());
+    return ErrorCode::NONE;
+}
+
+// A file written through a shared mapping that grows as needed
+class MappedOutput {
+private:
+    int fd;
+    char* data = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    
+public:
+    explicit MappedOutput(int file) : fd(file) {}
+    
+    ~MappedOutput() {
+        if (data) {
+            munmap(data, capacity);
+        }
+    }
+    
+    MappedOutput(const MappedOutput&) = delete;
+    MappedOutput& operator=(const MappedOutput&) = delete;
+    
+    // Room for at least bytes more; nullptr if the file cannot grow
+    char* reserve(size_t bytes) {
+        if (used + bytes <= capacity) {
+            return data + used;
+        }
+        size_t grown = std::max(capacity * 2, used + bytes);
+        grown = (grown + 0xfffff) & ~size_t(0xfffff);
+        if (ftruncate(fd, grown) < 0) {
+            return nullptr;
+        }
+        void* mapped = data ? mremap(data, capacity, grown, MREMAP_MAYMOVE)
+                            : mmap(nullptr, grown, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return nullptr;
+        }
+        data = static_cast<char*>(mapped);
+        capacity = grown;
+        return data + used;
+    }
+    
+    void advance(size_t bytes) {
+        used += bytes;
+    }
+    
+    size_t size() const {
+        return used;
+    }
+    
+    // Unmaps the file and cuts it to what was written
+    bool finish() {
+        if (data) {
+            munmap(data, capacity);
+            data = nullptr;
+        }
+        return ftruncate(fd, used) == 0;
+    }
+};
+
+// Writes the numbers in store to path in format, replacing the file only
+// once the new one is durable. count and bytes report what was written.
+// Like a snapshot, the copy is a single point in time when the engine
+// keeps versions and otherwise blocks writers for one page at a time.
+inline ErrorCode write_number_file(const std::string& path, uint8_t format, const NumberStore& store,
+                                   uint64_t& count, uint64_t& bytes) {
+    count = 0;
+    bytes = 0;
+    if (format != NUMBER_FILE_TEXT && format != NUMBER_FILE_BINARY) {
+        return ErrorCode::MALFORMED;
+    }
+    // A temporary name of this call's own: EXPORTs of the same file may run
+    // at once, and other files in the directory are left alone
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkostemp(tmp_path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        return ErrorCode::FILE_ERROR;
+    }
+    if (fchmod(fd, 0644) < 0) {
+        close(fd);
+        unlink(tmp_path.c_str());
+        return ErrorCode::FILE_ERROR;
+    }
+    
+    const size_t page = 64 * 1024;
+    const size_t line_max = format == NUMBER_FILE_TEXT ? NUMBER_TEXT_MAX : sizeof(int32_t);
+    auto view = store.view();
+    MappedOutput output(fd);
+    bool ok = output.reserve((view ? view->size() : store.size()) * line_max + 1) != nullptr;
+    int32_t next = 0;
+    while (ok) {
+        auto entries = view ? view->range(next, std::numeric_limits<int32_t>::max(), page)
+                            : store.range(next, std::numeric_limits<int32_t>::max(), page);
+        char* out = output.reserve(entries.size() * line_max);
+        if (!out) {
+            ok = false;
+            break;
+        }
+        char* p = out;
+        if (format == NUMBER_FILE_TEXT) {
+            for (const auto& entry : entries) {
+                p = std::to_chars(p, p + NUMBER_TEXT_MAX, entry.number).ptr;
+                *p++ = '\n';
+            }
+        } else {
+            for (const auto& entry : entries) {
+                memcpy(p, &entry.number, sizeof(int32_t));
+                p += sizeof(int32_t);
+            }
+        }
+        output.advance(p - out);
+        count += entries.size();
+        if (entries.size() < page || entries.back().number == std::numeric_limits<int32_t>::max()) {
+            break;
+        }
+        next = entries.back().number + 1;
+    }
+    bytes = output.size();
+    ok = output.finish() && ok && fdatasync(fd) == 0;
+    close(fd);
+    
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        unlink(tmp_path.c_str());
+        return ErrorCode::FILE_ERROR;
+    }
+    sync_parent_directory(path);
+    return ErrorCode::NONE;
+}
+
+#endif
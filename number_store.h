@@ -0,0 +1,423 @@
+#ifndef NUMBER_STORE_H
+#define NUMBER_STORE_H
+
+#include <vector>
+#include <optional>
+#include <chrono>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cmath>
+
+#include "common.h"
+#include "time_index.h"
+
+// expires_at value of numbers that are kept until removed
+constexpr int64_t NO_EXPIRY = 0;
+
+// Receives every mutation a store applies, e.g. to log it. Calls are made
+// with the affected shard locks held, so changes to the same number arrive
+// in the order they were applied; implementations must not block for long
+// or call back into the store.
+class ChangeListener {
+public:
+    virtual ~ChangeListener() = default;
+    
+    // Numbers newly inserted with the given timestamp (Unix microseconds) and
+    // expiry time (Unix seconds, or NO_EXPIRY); duplicates are not reported
+    virtual void on_insert(const int32_t* numbers, size_t count, int64_t timestamp,
+                           int64_t expires_at) = 0;
+    // Numbers that were present and have been removed
+    virtual void on_remove(const int32_t* numbers, size_t count) = 0;
+    virtual void on_clear() = 0;
+};
+
+// The entries of a store as of one point in time, unaffected by later
+// writes; from NumberStore::view()
+class StoreView {
+public:
+    virtual ~StoreView() = default;
+    
+    // Same as NumberStore::range()
+    virtual std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const = 0;
+    virtual size_t size() const = 0;
+};
+
+// Storage engine interface for the daemon's number -> timestamp set.
+// Implementations are thread-safe; batch operations take each internal lock
+// at most once.
+class NumberStore {
+public:
+    static constexpr size_t DEFAULT_SHARD_COUNT = 16;
+    static constexpr size_t MAX_SHARD_COUNT = 1024;
+    
+    // Decides under the shard lock whether remove_batch_if() removes a number
+    using RemoveCondition = std::function<bool(int32_t)>;
+    
+    virtual ~NumberStore() = default;
+    
+    virtual const char* engine_name() const = 0;
+    virtual size_t shard_count() const = 0;
+    
+    bool insert(int32_t number) {
+        int64_t timestamp;
+        return insert(number, timestamp, NO_EXPIRY);
+    }
+    
+    // Same as insert(number), also reporting the timestamp assigned to the
+    // number, or the existing one if it was a duplicate
+    bool insert(int32_t number, int64_t& timestamp) {
+        return insert(number, timestamp, NO_EXPIRY);
+    }
+    
+    // Inserts a number that expires at expires_at (Unix seconds, or
+    // NO_EXPIRY). The store only passes the expiry on to its listeners; a
+    // duplicate keeps the expiry it had.
+    virtual bool insert(int32_t number, int64_t& timestamp, int64_t expires_at) = 0;
+    
+    // inserted[i] is set when keys[i] was added. Returns the timestamp given
+    // to every inserted number.
+    int64_t insert_batch(const std::vector<int32_t>& keys, std::vector<bool>& inserted,
+                         int64_t expires_at = NO_EXPIRY) {
+        int64_t timestamp = now_micros();
+        insert_batch_at(keys, timestamp, expires_at, inserted);
+        return timestamp;
+    }
+    
+    // Same as insert_batch() with a caller-supplied timestamp, used when
+    // replaying logged inserts
+    virtual void insert_batch_at(const std::vector<int32_t>& keys, int64_t timestamp,
+                                 int64_t expires_at, std::vector<bool>& inserted) = 0;
+    
+    virtual bool remove(int32_t number) = 0;
+    
+    // removed[i] is set when keys[i] was present
+    void remove_batch(const std::vector<int32_t>& keys, std::vector<bool>& removed) {
+        remove_batch_if(keys, RemoveCondition(), removed);
+    }
+    
+    // Same as remove_batch(), skipping present keys for which condition
+    // (when set) returns false. condition runs with the key's shard locked,
+    // so it sees the key's state exactly as the store does.
+    virtual void remove_batch_if(const std::vector<int32_t>& keys, const RemoveCondition& condition,
+                                 std::vector<bool>& removed) = 0;
+    
+    virtual void clear() = 0;
+    
+    bool contains(int32_t number) const {
+        return find(number).has_value();
+    }
+    
+    // Point lookup returning the stored entry, if any
+    virtual std::optional<NumberEntry> find(int32_t number) const = 0;
+    
+    // Returns each key's timestamp, or -1 for keys that are not stored
+    virtual std::vector<int64_t> find_batch(const std::vector<int32_t>& keys) const = 0;
+    
+    // Consistent copy of every entry in ascending number order
+    virtual std::vector<NumberEntry> getAllSorted() const = 0;
+    
+    // Up to limit entries with lo <= number <= hi, in ascending number order.
+    // Cost is bounded by limit, not by the store size.
+    virtual std::vector<NumberEntry> range(int32_t lo, int32_t hi, size_t limit) const = 0;
+    
+    // Pins the current entries for a long read that must neither block
+    // writers nor see their changes, e.g. paging through a full scan.
+    // nullptr when the engine keeps no versions.
+    virtual std::shared_ptr<const StoreView> view() const {
+        return nullptr;
+    }
+    
+    // Starts maintaining the insertion-time index behind time_range() and
+    // count_since(). Call while the store is still empty.
+    void enable_time_index() {
+        time_index = std::make_unique<TimeIndex>(shard_count());
+    }
+    
+    bool has_time_index() const {
+        return time_index != nullptr;
+    }
+    
+    // Up to limit entries inserted from (from, from_number) to timestamp to,
+    // in (timestamp, number) order; O(log n + limit). Needs the time index.
+    std::vector<NumberEntry> time_range(int64_t from, int32_t from_number, int64_t to,
+                                        size_t limit) const {
+        return time_index ? time_index->range(from, from_number, to, limit)
+                          : std::vector<NumberEntry>();
+    }
+    
+    // Entries inserted at or after since; O(log n). Needs the time index.
+    uint64_t count_since(int64_t since) const {
+        return time_index ? time_index->count_since(since) : 0;
+    }
+    
+    // Order statistics, consistent across shards and O(log n) per shard.
+    // The smallest and largest entries, if the store is not empty:
+    virtual std::optional<NumberEntry> min_entry() const = 0;
+    virtual std::optional<NumberEntry> max_entry() const = 0;
+    // Numbers stored below number
+    virtual uint64_t rank(int32_t number) const = 0;
+    // The entry with rank k, i.e. the (k + 1)-th smallest, if there is one
+    virtual std::optional<NumberEntry> select(uint64_t k) const = 0;
+    // Numbers stored in [lo, hi]
+    virtual uint64_t count_range(int32_t lo, int32_t hi) const = 0;
+    
+    virtual size_t size() const = 0;
+    
+    // Approximate bytes held by the entries and their time index, for the
+    // daemon's memory budget. Cheap enough to check before every insert.
+    size_t memory_usage() const {
+        return engine_memory_usage() + (time_index ? time_index->memory_usage() : 0);
+    }
+    
+    // Approximate bytes a further entry adds to memory_usage()
+    size_t entry_bytes() const {
+        return engine_entry_bytes() + (time_index ? time_index->entry_bytes() : 0);
+    }
+    
+    // Bulk-loads entries sorted by number, each with its own timestamp, with
+    // up to threads threads working on disjoint shards. Meant for filling an
+    // empty store from a snapshot; listeners are not told about them, but
+    // the time index is filled.
+    void load_sorted(const int32_t* numbers, const int64_t* timestamps, size_t count,
+                     size_t threads) {
+        size_t shards = shard_count();
+        threads = std::min(std::max<size_t>(threads, 1), shards);
+        auto work = [=](size_t first) {
+            for (size_t s = first; s < shards; s += threads) {
+                load_shard(s, numbers, timestamps, count);
+                if (time_index) {
+                    time_index->load_shard(s, numbers, timestamps, count);
+                }
+            }
+        };
+        
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < threads; ++t) {
+            workers.emplace_back(work, t);
+        }
+        work(0);
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+    
+    // Attaches a listener for applied mutations; listeners are called in the
+    // order they were added. Not synchronized with concurrent mutations; add
+    // them before serving.
+    void add_listener(ChangeListener* listener) {
+        listeners.push_back(listener);
+    }
+    
+    static int64_t now_seconds() {
+        auto now = std::chrono::system_clock::now();
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            now.time_since_epoch()).count();
+    }
+    
+    // Clock for entry timestamps
+    static int64_t now_micros() {
+        auto now = std::chrono::system_clock::now();
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            now.time_since_epoch()).count();
+    }
+    
+protected:
+    std::vector<ChangeListener*> listeners;
+    std::unique_ptr<TimeIndex> time_index;  // Optional
+    
+    // True when the notify_* hooks need the changed numbers
+    bool listening() const {
+        return time_index || !listeners.empty();
+    }
+    
+    virtual size_t engine_memory_usage() const = 0;
+    virtual size_t engine_entry_bytes() const = 0;
+    
+    // Adds the entries of a sorted column that belong to the given shard
+    virtual void load_shard(size_t shard, const int32_t* numbers, const int64_t* timestamps,
+                            size_t count) = 0;
+    
+    // Listener hooks; engines call them while holding the affected shard locks
+    void notify_insert(const int32_t* numbers, size_t count, int64_t timestamp,
+                       int64_t expires_at) const {
+        if (count > 0) {
+            if (time_index) {
+                time_index->insert(numbers, count, timestamp);
+            }
+            for (ChangeListener* listener : listeners) {
+                listener->on_insert(numbers, count, timestamp, expires_at);
+            }
+        }
+    }
+    
+    // timestamps are those of the removed entries
+    void notify_remove(const int32_t* numbers, const int64_t* timestamps, size_t count) const {
+        if (count > 0) {
+            if (time_index) {
+                time_index->remove(numbers, timestamps, count);
+            }
+            for (ChangeListener* listener : listeners) {
+                listener->on_remove(numbers, count);
+            }
+        }
+    }
+    
+    void notify_clear() const {
+        if (time_index) {
+            time_index->clear();
+        }
+        for (ChangeListener* listener : listeners) {
+            listener->on_clear();
+        }
+    }
+    
+    // log2 of the shard count, after clamping it and rounding up to a power of two
+    static unsigned shard_bits_for(size_t shard_count) {
+        shard_count = std::min(std::max<size_t>(shard_count, 1), MAX_SHARD_COUNT);
+        unsigned bits = 0;
+        while ((size_t(1) << bits) < shard_count) {
+            ++bits;
+        }
+        return bits;
+    }
+    
+    // Batch positions grouped by shard, each group in ascending key order.
+    // Repeated keys keep their batch order so the first occurrence is the
+    // one applied.
+    template <typename ShardOf>
+    static std::vector<std::vector<uint32_t>> partition_sorted(const std::vector<int32_t>& keys,
+                                                               size_t num_shards,
+                                                               ShardOf shard_of) {
+        std::vector<std::vector<uint32_t>> groups(num_shards);
+        for (uint32_t i = 0; i < keys.size(); ++i) {
+            groups[shard_of(keys[i])].push_back(i);
+        }
+        for (auto& group : groups) {
+            std::stable_sort(group.begin(), group.end(), [&keys](uint32_t a, uint32_t b) {
+                return keys[a] < keys[b];
+            });
+        }
+        return groups;
+    }
+    
+    // Number of rank k across shards that each keep their numbers sorted and
+    // distinct from the other shards'; k must be below their total. Given a
+    // shard's size, its number at a position and its count of numbers below
+    // a value, it narrows a window of positions per shard that holds the
+    // answer: ranking a pivot moves either the start or the end of every
+    // window past it. Rounds guess where the answer sits in the widest
+    // window and rank pivots just below and above it, which for hashed
+    // shards leaves about the square root of the numbers in the windows.
+    // Whenever that keeps more than half, the next round ranks the weighted
+    // median of the windows' middles instead, which drops at least a
+    // quarter. That bounds it to O(log n) rounds of O(shards) lookups; the
+    // last few numbers are read and sorted.
+    template <typename SizeOf, typename NumberAt, typename CountBelow>
+    static int32_t select_sharded(size_t num_shards, uint64_t k, SizeOf size_of, NumberAt number_at,
+                                  CountBelow count_below) {
+        struct Pivot {
+            int32_t number;
+            size_t shard;
+            uint64_t weight;  // Size of the window it was taken from
+        };
+        std::vector<uint64_t> lo(num_shards, 0), hi(num_shards), below(num_shards);
+        uint64_t skipped = 0;  // Numbers before the windows
+        uint64_t left = 0;     // Numbers in them
+        for (size_t i = 0; i < num_shards; ++i) {
+            hi[i] = size_of(i);
+            left += hi[i];
+        }
+        
+        // The number place / left of the way into the widest window
+        auto guess = [&](uint64_t place) {
+            size_t widest = 0;
+            for (size_t i = 1; i < num_shards; ++i) {
+                if (hi[i] - lo[i] > hi[widest] - lo[widest]) {
+                    widest = i;
+                }
+            }
+            uint64_t weight = hi[widest] - lo[widest];
+            uint64_t offset = std::min(weight - 1, weight * place / left);
+            return Pivot{number_at(widest, lo[widest] + offset), widest, weight};
+        };
+        
+        std::vector<Pivot> middles;
+        auto middle = [&]() {
+            middles.clear();
+            for (size_t i = 0; i < num_shards; ++i) {
+                if (lo[i] < hi[i]) {
+                    uint64_t weight = hi[i] - lo[i];
+                    middles.push_back({number_at(i, lo[i] + weight / 2), i, weight});
+                }
+            }
+            std::sort(middles.begin(), middles.end(),
+                      [](const Pivot& a, const Pivot& b) { return a.number < b.number; });
+            size_t m = 0;
+            uint64_t seen = middles[0].weight;
+            while (seen * 2 < left) {
+                seen += middles[++m].weight;
+            }
+            return middles[m];
+        };
+        
+        // Ranks pivot and narrows the windows by it; true if it is the answer
+        auto narrow = [&](const Pivot& pivot) {
+            uint64_t rank = 0;
+            for (size_t i = 0; i < num_shards; ++i) {
+                below[i] = count_below(i, pivot.number);
+                rank += below[i];
+            }
+            if (rank == k) {
+                return true;
+            }
+            skipped = left = 0;
+            for (size_t i = 0; i < num_shards; ++i) {
+                if (rank < k) {
+                    lo[i] = std::max(lo[i], below[i] + (i == pivot.shard));
+                } else {
+                    hi[i] = std::min(hi[i], below[i]);
+                }
+                skipped += lo[i];
+                left += hi[i] - lo[i];
+            }
+            return false;
+        };
+        
+        bool guessing = true;
+        while (left > 4 * num_shards) {
+            uint64_t before = left;
+            if (guessing) {
+                uint64_t place = k - skipped;
+                uint64_t margin = static_cast<uint64_t>(std::sqrt(double(left)));
+                Pivot low = guess(place > margin ? place - margin : 0);
+                if (narrow(low)) {
+                    return low.number;
+                }
+                Pivot high = guess(std::min(k - skipped + margin, left - 1));
+                if (narrow(high)) {
+                    return high.number;
+                }
+            } else {
+                Pivot pivot = middle();
+                if (narrow(pivot)) {
+                    return pivot.number;
+                }
+            }
+            guessing = left <= before / 2;
+        }
+        
+        std::vector<int32_t> rest;
+        for (size_t i = 0; i < num_shards; ++i) {
+            for (uint64_t pos = lo[i]; pos < hi[i]; ++pos) {
+                rest.push_back(number_at(i, pos));
+            }
+        }
+        std::nth_element(rest.begin(), rest.begin() + (k - skipped), rest.end());
+        return rest[k - skipped];
+    }
+};
+
+#endif
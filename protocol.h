@@ -0,0 +1,403 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include "common.h"
+
+// Framed wire protocol (version 3)
+//
+// A client opens the connection with a handshake:
+//   client -> daemon  HELLO  { uint32 magic, uint16 max_version, uint16 flags }
+//   daemon -> client  HELLO  { uint32 magic, uint16 version,     uint16 flags }
+// after which every message is a length-prefixed frame:
+//   uint32 length   number of bytes following this field
+//   uint32 id       request id, echoed back on every response frame
+//   uint8  type     MessageType
+//   uint8  status   ErrorCode on responses, 0 on requests
+//   ...            payload (length - 6 bytes)
+// All integers are in host byte order; the transport is a local socket.
+// Timestamps are Unix microseconds. A client that asks for version 2 gets
+// the same protocol with timestamps in whole seconds.
+//
+// A connection whose first bytes are not the magic is served with the
+// legacy fixed-size IPCMessage protocol (version 1).
+
+constexpr uint32_t PROTOCOL_MAGIC = 0x444d554e;  // "NUMD"
+constexpr uint16_t PROTOCOL_VERSION_LEGACY = 1;
+constexpr uint16_t PROTOCOL_VERSION_SECONDS = 2;  // Framed, timestamps in seconds
+constexpr uint16_t PROTOCOL_VERSION = 3;
+
+// Handshake flags
+constexpr uint16_t HELLO_ERROR_TEXT = 0x0001;  // Append error text to RESPONSE_ERROR frames
+
+constexpr size_t HELLO_SIZE = 8;
+constexpr size_t FRAME_LENGTH_SIZE = 4;
+constexpr size_t FRAME_HEADER_SIZE = 10;
+constexpr uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+
+// INSERT, DELETE and FIND carry { int32 number }. INSERT may append a uint32
+// TTL in seconds, as may INSERT_BATCH after its numbers; numbers inserted
+// with a non-zero TTL are removed within about a second of it running out.
+// A duplicate keeps the TTL it was inserted with.
+//
+// Batch requests carry { uint32 count, count x int32 number } and are answered with
+//   INSERT_BATCH -> { uint32 count, int64 timestamp, bitmap of inserted numbers }
+//   DELETE_BATCH -> { uint32 count, bitmap of deleted numbers }
+//   FIND_BATCH   -> { uint32 count, count x int64 timestamp (-1 if absent) }
+// Bitmaps hold one bit per request item, least significant bit first.
+constexpr uint32_t MAX_BATCH_SIZE = 1024 * 1024;
+
+inline size_t bitmap_size(uint32_t count) {
+    return (static_cast<size_t>(count) + 7) / 8;
+}
+
+inline bool bitmap_test(const uint8_t* bitmap, uint32_t index) {
+    return (bitmap[index / 8] >> (index % 8)) & 1;
+}
+
+inline void bitmap_set(uint8_t* bitmap, uint32_t index) {
+    bitmap[index / 8] |= static_cast<uint8_t>(1u << (index % 8));
+}
+
+// PRINT_ALL and RANGE { int32 lo, int32 hi, uint32 limit (0 = no limit) } stream
+// RESPONSE_DATA frames of { uint32 count, count x (int32 number, int64 timestamp) }
+// in ascending number order, ended by RESPONSE_SUCCESS { uint64 total, int32 cursor }.
+// cursor is the next number in range when the limit cut the scan short, or -1;
+// sending RANGE again with lo = cursor resumes the scan. Pages are read from the
+// store as the client consumes them, so a scan sees writes made while it runs.
+constexpr uint32_t ENTRIES_PER_FRAME = 4096;
+constexpr size_t ENTRY_WIRE_SIZE = sizeof(int32_t) + sizeof(int64_t);
+
+// TIME_RANGE { int64 from, int64 to, uint32 limit (0 = no limit), int32 from_number }
+// streams the numbers inserted in [from, to] the same way, ordered by
+// (timestamp, number) and starting at (from, from_number). It ends with
+// RESPONSE_SUCCESS { uint64 total, int64 next_timestamp, int32 next_number },
+// the entry to resume from when the limit cut the scan short, or -1 and -1.
+// COUNT_SINCE { int64 since } is answered with RESPONSE_SUCCESS { uint64 count },
+// the number of entries inserted at or after since. Both take O(log n) to
+// find their place in the store's time index, which the daemon only keeps
+// with --time-index; without it both fail with DISABLED.
+
+// Order statistics, each answered with one RESPONSE_SUCCESS in O(log n):
+//   COUNT (no payload)                 -> { uint64 count }
+//   COUNT_RANGE { int32 lo, int32 hi } -> { uint64 count }, numbers in [lo, hi]
+//   RANK { int32 number }              -> { uint64 rank }, numbers below number
+//   SELECT { uint64 k }                -> { int32 number, int64 timestamp }, the
+//                                         number of rank k, i.e. the (k+1)-th smallest
+//   MIN_NUMBER, MAX_NUMBER (no payload) -> { int32 number, int64 timestamp }
+// As for FIND, timestamp is -1 (and number 0) when there is no such entry.
+
+// IMPORT and EXPORT { uint8 format, path } have the daemon read or write a
+// local file of numbers (see number_file.h). path fills the rest of the
+// payload and must lead into the daemon's --files directory, which relative
+// paths start from; without one both fail with DISABLED.
+//   IMPORT -> { uint64 read, uint64 inserted, uint64 invalid, int64 timestamp }
+//             numbers in the file, those added, those left out for not being
+//             positive int32s, and the timestamp the added ones were given
+//   EXPORT -> { uint64 count, uint64 bytes } written, in ascending order
+// A file that cannot be opened, read or written fails with FILE_ERROR, one
+// that is not in format with MALFORMED; an import that fails adds nothing.
+constexpr uint8_t NUMBER_FILE_TEXT = 0;
+constexpr uint8_t NUMBER_FILE_BINARY = 1;
+
+// WATCH (no payload) subscribes the connection to changes. The current
+// entries are streamed first, as for PRINT_ALL, ended by RESPONSE_SUCCESS
+// { uint64 total, uint64 synced_seq }. After that every change to the store
+// is pushed as a WATCH_EVENT frame carrying the WATCH request's id:
+//   { uint64 seq, uint8 op, int64 timestamp, uint32 count, count x int32 number }
+// op is INSERT, DELETE or DELETE_ALL (count 0), timestamp is set for INSERT
+// only, and seq counts up by one per event. Events start with the first
+// change made after the subscription, so those below synced_seq may already
+// show in the listing; applied in order on top of it, they make the copy
+// exact from synced_seq - 1 on. A subscriber that falls further behind than
+// the daemon's change window (--watch-buffer) is disconnected. Other
+// requests may still be sent on the connection.
+
+// HANDOFF { [uint64 replayed_lsn] } hands the daemon over to the process
+// that sent it, a daemon started with --takeover by the same user (or
+// root); others get NOT_PERMITTED, and a second HANDOFF while one is under
+// way UNAVAILABLE. The daemon stops accepting connections, lets the others
+// go (see GOAWAY), stops writing to its store and log, and replies with
+// RESPONSE_SUCCESS { uint64 count, uint64 wal_lsn }, its number count and
+// log position, passing descriptors with its first byte (SCM_RIGHTS). A
+// sender that has replayed the daemon's log up to replayed_lsn itself gets
+// the listening socket alone if the log still holds every record from there
+// on. Otherwise it gets the listening socket and a memfd holding a snapshot
+// of count numbers (see snapshot.h) that the log continues from wal_lsn on.
+// The daemon then exits, leaving the socket path to the new process. If the
+// snapshot cannot be taken, the reply is UNAVAILABLE and the daemon goes
+// on serving.
+//
+// GOAWAY (id 0, no payload) is pushed to framed connections when the
+// daemon drains them, on HANDOFF or on SIGINT and SIGTERM. Every request
+// the daemon read before it has been answered; requests still without a
+// reply were not served and may be sent again on a new connection. The
+// daemon reads nothing more and closes the connection, ending any WATCH.
+// Legacy connections are closed once idle.
+
+// STATS (no payload) is answered with RESPONSE_SUCCESS
+//   { uint64 uptime_sec, uint64 store_size, uint64 active_connections,
+//     uint64 accepted_connections, uint32 reactors, uint32 rows,
+//     rows x { uint8 type, uint64 count, uint64 errors, uint64 mean_ns,
+//              uint64 p50_ns, uint64 p99_ns, uint64 p999_ns, uint64 max_ns } }
+// with a row for every request type served since startup (type 255 stands
+// for unknown types). Service time runs from parsing a request to queuing
+// its reply; for PRINT_ALL and RANGE it ends when the last page is queued.
+// The rows are followed by { uint8 io_backend, uint64 io_syscalls }: the
+// reactors' I/O backend (STATS_IO_EPOLL or STATS_IO_URING) and the socket
+// and readiness system calls they have made. Then come { uint64 memory_used,
+// uint64 memory_limit }: the store's approximate footprint and the budget
+// past which INSERTs fail with MEMORY_LIMIT, 0 for none. Last come
+// { uint64 change_seq, uint8 replica_state, uint64 applied_seq,
+//   uint64 primary_seq, uint64 lag_us }: the seq of the daemon's latest
+// WATCH event (0 if none), then for a follower (--follow) how far it has
+// got. replica_state is STATS_PRIMARY for a daemon that follows nobody, in
+// which case the rest is 0. applied_seq is the last event of the primary
+// applied, primary_seq the primary's change_seq when it was last asked and
+// lag_us how long the oldest change known to be missing has been waiting,
+// 0 when caught up. Older daemons end after the rows, the I/O fields or the
+// memory fields.
+constexpr uint8_t STATS_UNKNOWN_TYPE = 255;
+constexpr uint8_t STATS_IO_EPOLL = 0;
+constexpr uint8_t STATS_IO_URING = 1;
+constexpr uint8_t STATS_PRIMARY = 0;
+constexpr uint8_t STATS_REPLICA_CONNECTING = 1;  // Waiting for the primary
+constexpr uint8_t STATS_REPLICA_SYNCING = 2;     // Applying the primary's listing
+constexpr uint8_t STATS_REPLICA_STREAMING = 3;   // Applying its changes as they happen
+
+struct Hello {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+};
+
+struct FrameHeader {
+    uint32_t length;  // Bytes after the length field, header included
+    uint32_t id;
+    MessageType type;
+    ErrorCode status;
+    
+    size_t payload_size() const {
+        return length - (FRAME_HEADER_SIZE - FRAME_LENGTH_SIZE);
+    }
+};
+
+inline void encode_hello(std::vector<char>& buf, uint16_t version, uint16_t flags) {
+    Hello hello{PROTOCOL_MAGIC, version, flags};
+    const char* bytes = reinterpret_cast<const char*>(&hello);
+    buf.insert(buf.end(), bytes, bytes + HELLO_SIZE);
+}
+
+inline Hello decode_hello(const char* data) {
+    Hello hello;
+    memcpy(&hello, data, HELLO_SIZE);
+    return hello;
+}
+
+// Parses a frame header; data must hold at least FRAME_HEADER_SIZE bytes.
+// Returns false for a length that cannot belong to a valid frame.
+inline bool decode_frame_header(const char* data, FrameHeader& header) {
+    uint8_t type, status;
+    memcpy(&header.length, data, sizeof(header.length));
+    memcpy(&header.id, data + 4, sizeof(header.id));
+    memcpy(&type, data + 8, sizeof(type));
+    memcpy(&status, data + 9, sizeof(status));
+    header.type = static_cast<MessageType>(type);
+    header.status = static_cast<ErrorCode>(status);
+    return header.length >= FRAME_HEADER_SIZE - FRAME_LENGTH_SIZE &&
+           header.length <= MAX_FRAME_SIZE;
+}
+
+// Appends one frame to a byte buffer; the length is patched in by finish()
+class FrameBuilder {
+private:
+    std::vector<char>& buf;
+    size_t start;
+    
+    template <typename T>
+    FrameBuilder& put(T value) {
+        const char* bytes = reinterpret_cast<const char*>(&value);
+        buf.insert(buf.end(), bytes, bytes + sizeof(value));
+        return *this;
+    }
+    
+public:
+    FrameBuilder(std::vector<char>& out, uint32_t id, MessageType type,
+                 ErrorCode status = ErrorCode::NONE)
+        : buf(out), start(out.size()) {
+        put<uint32_t>(0);
+        put<uint32_t>(id);
+        put<uint8_t>(static_cast<uint8_t>(type));
+        put<uint8_t>(static_cast<uint8_t>(status));
+    }
+    
+    FrameBuilder& put_u8(uint8_t value) { return put(value); }
+    FrameBuilder& put_i32(int32_t value) { return put(value); }
+    FrameBuilder& put_u32(uint32_t value) { return put(value); }
+    FrameBuilder& put_i64(int64_t value) { return put(value); }
+    FrameBuilder& put_u64(uint64_t value) { return put(value); }
+    
+    FrameBuilder& put_bytes(const void* data, size_t len) {
+        const char* bytes = static_cast<const char*>(data);
+        buf.insert(buf.end(), bytes, bytes + len);
+        return *this;
+    }
+    
+    FrameBuilder& put_entry(int32_t number, int64_t timestamp) {
+        return put_i32(number).put_i64(timestamp);
+    }
+    
+    void finish() {
+        uint32_t length = static_cast<uint32_t>(buf.size() - start - FRAME_LENGTH_SIZE);
+        memcpy(buf.data() + start, &length, sizeof(length));
+    }
+};
+
+// Bounds-checked reader over a frame payload
+class PayloadReader {
+private:
+    const char* data;
+    size_t remaining;
+    bool ok;
+    
+    template <typename T>
+    T get() {
+        T value{};
+        if (remaining < sizeof(T)) {
+            ok = false;
+            remaining = 0;
+            return value;
+        }
+        memcpy(&value, data, sizeof(T));
+        data += sizeof(T);
+        remaining -= sizeof(T);
+        return value;
+    }
+    
+public:
+    PayloadReader(const char* payload, size_t size)
+        : data(payload), remaining(size), ok(true) {}
+    
+    uint8_t get_u8() { return get<uint8_t>(); }
+    int32_t get_i32() { return get<int32_t>(); }
+    uint32_t get_u32() { return get<uint32_t>(); }
+    int64_t get_i64() { return get<int64_t>(); }
+    uint64_t get_u64() { return get<uint64_t>(); }
+    
+    // Returns a pointer to the next len bytes, or nullptr if the payload is short
+    const char* get_bytes(size_t len) {
+        if (remaining < len) {
+            ok = false;
+            remaining = 0;
+            return nullptr;
+        }
+        const char* bytes = data;
+        data += len;
+        remaining -= len;
+        return bytes;
+    }
+    
+    std::string get_rest() {
+        std::string rest(data, remaining);
+        data += remaining;
+        remaining = 0;
+        return rest;
+    }
+    
+    size_t left() const { return remaining; }
+    
+    // True while every read so far was within the payload
+    bool good() const { return ok; }
+};
+
+// A decoded STATS reply
+struct DaemonStats {
+    struct Row {
+        uint8_t type;
+        uint64_t count, errors, mean_ns, p50_ns, p99_ns, p999_ns, max_ns;
+    };
+    
+    uint64_t uptime_sec = 0;
+    uint64_t store_size = 0;
+    uint64_t active_connections = 0;
+    uint64_t accepted_connections = 0;
+    uint32_t reactors = 0;
+    std::vector<Row> rows;
+    bool has_io = false;  // Set if the daemon reported the fields below
+    uint8_t io_backend = STATS_IO_EPOLL;
+    uint64_t io_syscalls = 0;
+    bool has_memory = false;  // Likewise
+    uint64_t memory_used = 0;
+    uint64_t memory_limit = 0;
+    bool has_replication = false;  // Likewise
+    uint64_t change_seq = 0;
+    uint8_t replica_state = STATS_PRIMARY;
+    uint64_t applied_seq = 0;
+    uint64_t primary_seq = 0;
+    uint64_t lag_us = 0;
+    
+    bool parse(PayloadReader& reader) {
+        uptime_sec = reader.get_u64();
+        store_size = reader.get_u64();
+        active_connections = reader.get_u64();
+        accepted_connections = reader.get_u64();
+        reactors = reader.get_u32();
+        uint32_t count = reader.get_u32();
+        rows.clear();
+        for (uint32_t i = 0; i < count && reader.good(); ++i) {
+            Row row;
+            row.type = reader.get_u8();
+            row.count = reader.get_u64();
+            row.errors = reader.get_u64();
+            row.mean_ns = reader.get_u64();
+            row.p50_ns = reader.get_u64();
+            row.p99_ns = reader.get_u64();
+            row.p999_ns = reader.get_u64();
+            row.max_ns = reader.get_u64();
+            rows.push_back(row);
+        }
+        has_io = reader.good() && reader.left() > 0;
+        if (has_io) {
+            io_backend = reader.get_u8();
+            io_syscalls = reader.get_u64();
+        }
+        has_memory = reader.good() && reader.left() > 0;
+        if (has_memory) {
+            memory_used = reader.get_u64();
+            memory_limit = reader.get_u64();
+        }
+        has_replication = reader.good() && reader.left() > 0;
+        if (has_replication) {
+            change_seq = reader.get_u64();
+            replica_state = reader.get_u8();
+            applied_seq = reader.get_u64();
+            primary_seq = reader.get_u64();
+            lag_us = reader.get_u64();
+        }
+        return reader.good();
+    }
+    
+    static const char* type_name(uint8_t type) {
+        return type == STATS_UNKNOWN_TYPE ? "unknown" : message_type_name(static_cast<MessageType>(type));
+    }
+    
+    const char* io_backend_name() const {
+        return io_backend == STATS_IO_URING ? "io_uring" : "epoll";
+    }
+    
+    const char* replica_state_name() const {
+        switch (replica_state) {
+            case STATS_PRIMARY:            return "primary";
+            case STATS_REPLICA_CONNECTING: return "connecting";
+            case STATS_REPLICA_SYNCING:    return "syncing";
+            case STATS_REPLICA_STREAMING:  return "streaming";
+        }
+        return "unknown";
+    }
+};
+
+#endif
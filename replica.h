@@ -0,0 +1,334 @@
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+
+#include "common.h"
+#include "protocol.h"
+#include "number_store.h"
+#include "number_client.h"
+
+// The follower side of log shipping. A follower daemon (--follow) keeps a
+// copy of a primary's numbers to serve reads from: it subscribes to the
+// primary with WATCH, makes its store match the listing page by page, then
+// applies the change events in order, one store batch per event. Numbers
+// the primary expires arrive as DELETEs, so the copy keeps no TTLs.
+// When the connection breaks, e.g. because the follower fell out of the
+// primary's change window, it reconnects and syncs again. The listing is
+// compared with what is stored instead of being loaded into an emptied
+// store, so readers keep seeing every number that did not change. A STATS
+// request every poll interval tracks the primary's position for measuring
+// the lag.
+class Follower {
+public:
+    static constexpr size_t PAGE = 64 * 1024;  // Stored entries compared at a time
+    
+    struct Status {
+        uint8_t state = STATS_REPLICA_CONNECTING;
+        uint64_t applied_seq = 0;
+        uint64_t primary_seq = 0;
+        uint64_t lag_us = 0;
+    };
+    
+private:
+    // A position of the primary seen by a poll and not yet applied
+    struct Observation {
+        uint64_t seq;
+        std::chrono::steady_clock::time_point at;
+    };
+    
+    std::string primary_path;
+    NumberStore& store;
+    std::chrono::milliseconds poll_interval;
+    std::chrono::milliseconds retry_interval;
+    
+    mutable std::mutex status_mutex;
+    uint8_t state = STATS_REPLICA_CONNECTING;
+    uint64_t applied_seq = 0;
+    uint64_t primary_seq = 0;
+    std::deque<Observation> missing;  // Ascending seq
+    
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+    bool session_over = false;
+    std::thread thread;
+    
+    // Session state, used by the client's I/O thread only
+    int64_t listed = 0;  // Numbers below this one match the listing
+    std::chrono::steady_clock::time_point sync_started;
+    std::vector<int32_t> numbers;
+    std::vector<bool> changed;
+    
+    void run() {
+        bool reachable = true;  // Reports each outage once
+        std::unique_lock lock(mutex);
+        while (!stopping) {
+            lock.unlock();
+            bool connected = follow(reachable);
+            reachable = connected;
+            lock.lock();
+            cv.wait_for(lock, retry_interval, [this] { return stopping; });
+        }
+    }
+    
+    // One session with the primary, until its connection breaks or the
+    // follower stops. False if the primary could not be reached.
+    bool follow(bool report) {
+        ClientOptions options;
+        options.socket_path = primary_path;
+        NumberClient client(options);
+        std::string error;
+        if (!client.connect(error)) {
+            if (report) {
+                std::cerr << "Cannot follow " << primary_path << ": " << error << std::endl;
+            }
+            return false;
+        }
+        {
+            std::lock_guard lock(mutex);
+            session_over = false;
+        }
+        set_state(STATS_REPLICA_SYNCING);
+        listed = std::numeric_limits<int32_t>::min();
+        sync_started = std::chrono::steady_clock::now();
+        
+        Request request = make_request(MessageType::WATCH);
+        request.on_entries = [this](const std::vector<NumberEntry>& entries) {
+            if (!entries.empty()) {
+                reconcile(entries, entries.back().number);
+            }
+        };
+        request.on_event = [this](PayloadReader& reader) {
+            apply(reader);
+        };
+        request.on_closed = [this] {
+            end_session();
+        };
+        client.submit(std::move(request), [this](Reply& reply) {
+            if (!reply.ok()) {
+                if (!reply.lost) {
+                    std::cerr << "Cannot follow " << primary_path << ": " << error_string(reply.status)
+                              << std::endl;
+                }
+                end_session();
+                return;
+            }
+            PayloadReader reader = reply.reader();
+            reader.get_u64();  // total
+            uint64_t synced_seq = reader.get_u64();
+            reconcile({}, std::numeric_limits<int32_t>::max());
+            synced(synced_seq);
+        });
+        
+        std::unique_lock lock(mutex);
+        while (!stopping && !session_over) {
+            lock.unlock();
+            client.submit(make_request(MessageType::STATS), [this](Reply& reply) {
+                observe(reply);
+            });
+            lock.lock();
+            cv.wait_for(lock, poll_interval, [this] { return stopping || session_over; });
+        }
+        bool lost = !stopping;
+        lock.unlock();
+        if (lost) {
+            std::cerr << "Lost the primary at " << primary_path << ", reconnecting" << std::endl;
+        }
+        set_state(STATS_REPLICA_CONNECTING);
+        return true;
+    }
+    
+    void end_session() {
+        {
+            std::lock_guard lock(mutex);
+            session_over = true;
+        }
+        cv.notify_all();
+    }
+    
+    // Makes the stored numbers from listed up to hi match entries, which
+    // are the primary's numbers in that range in ascending order
+    void reconcile(const std::vector<NumberEntry>& entries, int32_t hi) {
+        std::vector<int32_t> stale;
+        std::vector<NumberEntry> fresh;
+        size_t next = 0;
+        int64_t from = listed;
+        while (from <= hi) {
+            auto stored = store.range(static_cast<int32_t>(from), hi, PAGE);
+            for (const auto& entry : stored) {
+                for (; next < entries.size() && entries[next].number < entry.number; ++next) {
+                    fresh.push_back(entries[next]);
+                }
+                if (next < entries.size() && entries[next].number == entry.number) {
+                    if (entries[next].timestamp != entry.timestamp) {
+                        stale.push_back(entry.number);
+                        fresh.push_back(entries[next]);
+                    }
+                    ++next;
+                } else {
+                    stale.push_back(entry.number);
+                }
+            }
+            if (stored.size() < PAGE) {
+                break;
+            }
+            from = static_cast<int64_t>(stored.back().number) + 1;
+        }
+        fresh.insert(fresh.end(), entries.begin() + next, entries.end());
+        listed = static_cast<int64_t>(hi) + 1;
+        
+        if (!stale.empty()) {
+            store.remove_batch(stale, changed);
+        }
+        // The listing carries a timestamp per entry; entries inserted together share one
+        std::stable_sort(fresh.begin(), fresh.end(), [](const NumberEntry& a, const NumberEntry& b) {
+            return a.timestamp < b.timestamp;
+        });
+        for (size_t i = 0; i < fresh.size();) {
+            numbers.clear();
+            size_t j = i;
+            for (; j < fresh.size() && fresh[j].timestamp == fresh[i].timestamp; ++j) {
+                numbers.push_back(fresh[j].number);
+            }
+            store.insert_batch_at(numbers, fresh[i].timestamp, NO_EXPIRY, changed);
+            i = j;
+        }
+    }
+    
+    // The listing is complete. Events below synced_seq that are still to
+    // come were made while it was read, so it counts as applied up to there.
+    void synced(uint64_t synced_seq) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - sync_started);
+        {
+            std::lock_guard lock(status_mutex);
+            state = STATS_REPLICA_STREAMING;
+            if (synced_seq - 1 < applied_seq) {
+                missing.clear();  // The primary restarted and numbers its changes anew
+            }
+            applied_seq = synced_seq - 1;
+            drop_applied();
+        }
+        std::cout << "Synced with " << primary_path << " in " << elapsed.count() << " ms ("
+                  << store.size() << " numbers)" << std::endl;
+    }
+    
+    void apply(PayloadReader& reader) {
+        uint64_t seq = reader.get_u64();
+        MessageType op = static_cast<MessageType>(reader.get_u8());
+        int64_t timestamp = reader.get_i64();
+        uint32_t count = reader.get_u32();
+        const char* bytes = reader.get_bytes(size_t(count) * sizeof(int32_t));
+        if (!reader.good()) {
+            return;
+        }
+        numbers.resize(count);
+        memcpy(numbers.data(), bytes, size_t(count) * sizeof(int32_t));
+        
+        switch (op) {
+            case MessageType::INSERT:
+                store.insert_batch_at(numbers, timestamp, NO_EXPIRY, changed);
+                break;
+            case MessageType::DELETE:
+                store.remove_batch(numbers, changed);
+                break;
+            case MessageType::DELETE_ALL:
+                store.clear();
+                break;
+            default:
+                break;
+        }
+        
+        std::lock_guard lock(status_mutex);
+        applied_seq = std::max(applied_seq, seq);
+        drop_applied();
+    }
+    
+    // Takes the primary's position from a STATS reply
+    void observe(Reply& reply) {
+        DaemonStats stats;
+        PayloadReader reader = reply.reader();
+        if (!reply.ok() || !stats.parse(reader) || !stats.has_replication) {
+            return;
+        }
+        std::lock_guard lock(status_mutex);
+        primary_seq = stats.change_seq;
+        if (primary_seq > applied_seq && (missing.empty() || primary_seq > missing.back().seq)) {
+            missing.push_back(Observation{primary_seq, std::chrono::steady_clock::now()});
+        }
+    }
+    
+    // Called with status_mutex held
+    void drop_applied() {
+        while (!missing.empty() && missing.front().seq <= applied_seq) {
+            missing.pop_front();
+        }
+    }
+    
+    void set_state(uint8_t new_state) {
+        std::lock_guard lock(status_mutex);
+        state = new_state;
+    }
+    
+public:
+    Follower(const std::string& primary_socket, NumberStore& number_store,
+             std::chrono::milliseconds poll = std::chrono::milliseconds(250),
+             std::chrono::milliseconds retry = std::chrono::milliseconds(1000))
+        : primary_path(primary_socket), store(number_store), poll_interval(poll), retry_interval(retry) {}
+    
+    ~Follower() {
+        stop();
+    }
+    
+    Follower(const Follower&) = delete;
+    Follower& operator=(const Follower&) = delete;
+    
+    void start() {
+        stopping = false;
+        thread = std::thread(&Follower::run, this);
+    }
+    
+    void stop() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    
+    const std::string& primary() const {
+        return primary_path;
+    }
+    
+    // lag_us is how long the oldest change the follower is known to miss
+    // has been waiting, counted from the poll that first saw it
+    Status status() const {
+        std::lock_guard lock(status_mutex);
+        Status status;
+        status.state = state;
+        status.applied_seq = applied_seq;
+        status.primary_seq = primary_seq;
+        if (!missing.empty()) {
+            status.lag_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - missing.front().at).count();
+        }
+        return status;
+    }
+};
+
+#endif
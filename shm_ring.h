@@ -0,0 +1,485 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "common.h"
+#include "protocol.h"
+
+// Shared-memory transport for clients on the same host
+//
+// On a framed connection a client may send SHM_ATTACH { uint32 ring_size,
+// uint32 flags } with no other request in flight. The daemon answers with
+// RESPONSE_SUCCESS { uint32 ring_size } and passes three descriptors along
+// with that frame (SCM_RIGHTS):
+//   memfd        a request ring (client -> daemon) followed by a response ring
+//   daemon bell  eventfd the client writes to wake the daemon
+//   client bell  eventfd the daemon writes to wake the client
+// From then on both sides exchange exactly the frames they would have sent on
+// the socket, through the rings; the socket is only watched for a hangup.
+//
+// A side that runs out of work sets a waiting flag in the ring before it
+// sleeps on its bell, and the other side only writes the bell when it sees
+// the flag, so a pair of busy peers makes no system calls. With
+// SHM_BUSY_POLL both sides also spin for SHM_SPIN_TIME before sleeping.
+
+constexpr uint32_t SHM_DEFAULT_RING_SIZE = 1024 * 1024;
+constexpr uint32_t SHM_MIN_RING_SIZE = 64 * 1024;
+constexpr uint32_t SHM_MAX_RING_SIZE = 64 * 1024 * 1024;
+
+// SHM_ATTACH flags
+constexpr uint32_t SHM_BUSY_POLL = 0x0001;
+
+constexpr auto SHM_SPIN_TIME = std::chrono::microseconds(50);
+
+// Shared control block of one ring. head and tail are running byte counts,
+// each written by one side only and kept on its own cache line.
+struct RingControl {
+    alignas(64) std::atomic<uint64_t> head;  // Producer
+    alignas(64) std::atomic<uint64_t> tail;  // Consumer
+    alignas(64) std::atomic<uint32_t> reader_waiting;
+    std::atomic<uint32_t> writer_waiting;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "ring counters are shared between processes");
+
+// Ring size actually used for a request: a power of two within bounds, 0 picks the default
+inline uint32_t shm_ring_size(uint32_t requested) {
+    if (requested == 0) {
+        return SHM_DEFAULT_RING_SIZE;
+    }
+    uint32_t size = SHM_MIN_RING_SIZE;
+    while (size < requested && size < SHM_MAX_RING_SIZE) {
+        size <<= 1;
+    }
+    return size;
+}
+
+// Single-producer single-consumer byte ring over shared memory. The peer is
+// not trusted: counters it corrupts can garble the stream but never move a
+// copy outside the ring.
+class SpscRing {
+private:
+    RingControl* ctl = nullptr;
+    char* data = nullptr;
+    uint64_t capacity = 0;
+    
+public:
+    SpscRing() = default;
+    
+    SpscRing(void* base, uint32_t size)
+        : ctl(static_cast<RingControl*>(base)),
+          data(static_cast<char*>(base) + sizeof(RingControl)), capacity(size) {}
+    
+    RingControl& control() const {
+        return *ctl;
+    }
+    
+    size_t readable() const {
+        uint64_t used = ctl->head.load(std::memory_order_acquire) -
+                        ctl->tail.load(std::memory_order_relaxed);
+        return used > capacity ? 0 : used;
+    }
+    
+    size_t writable() const {
+        uint64_t used = ctl->head.load(std::memory_order_relaxed) -
+                        ctl->tail.load(std::memory_order_acquire);
+        return used >= capacity ? 0 : capacity - used;
+    }
+    
+    // Copies in as much of src as fits and publishes it
+    size_t write(const char* src, size_t len) {
+        size_t n = std::min(len, writable());
+        uint64_t head = ctl->head.load(std::memory_order_relaxed);
+        size_t offset = head & (capacity - 1);
+        size_t first = std::min<size_t>(n, capacity - offset);
+        memcpy(data + offset, src, first);
+        memcpy(data, src + first, n - first);
+        ctl->head.store(head + n, std::memory_order_release);
+        return n;
+    }
+    
+    // Copies out up to len bytes and releases their space
+    size_t read(char* dst, size_t len) {
+        size_t n = std::min(len, readable());
+        uint64_t tail = ctl->tail.load(std::memory_order_relaxed);
+        size_t offset = tail & (capacity - 1);
+        size_t first = std::min<size_t>(n, capacity - offset);
+        memcpy(dst, data + offset, first);
+        memcpy(dst + first, data, n - first);
+        ctl->tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+};
+
+// One side's view of an attached ring pair
+class ShmChannel {
+private:
+    void* region = MAP_FAILED;
+    size_t region_size = 0;
+    uint32_t ring_size = 0;
+    int memfd = -1;
+    int local_bell = -1;   // Readable when the peer woke us
+    int remote_bell = -1;  // Written to wake the peer
+    int peer_fd = -1;      // Client side: the daemon socket, not owned
+    int epoll_fd = -1;     // Daemon side: epoll set local_bell is registered with
+    bool busy_poll = false;
+    SpscRing inbound;
+    SpscRing outbound;
+    
+    ShmChannel(uint32_t size, bool spin) : ring_size(size), busy_poll(spin) {}
+    
+    static size_t region_size_for(uint32_t size) {
+        return 2 * (sizeof(RingControl) + size);
+    }
+    
+    // The request ring comes first; the daemon reads it and the client writes it
+    bool map(bool daemon_side) {
+        region_size = region_size_for(ring_size);
+        region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+        if (region == MAP_FAILED) {
+            return false;
+        }
+        char* base = static_cast<char*>(region);
+        SpscRing requests(base, ring_size);
+        SpscRing responses(base + sizeof(RingControl) + ring_size, ring_size);
+        inbound = daemon_side ? requests : responses;
+        outbound = daemon_side ? responses : requests;
+        return true;
+    }
+    
+    static void ring_bell(int fd) {
+        uint64_t one = 1;
+        ssize_t ignored = write(fd, &one, sizeof(one));
+        (void)ignored;
+    }
+    
+    static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+    
+public:
+    ~ShmChannel() {
+        if (epoll_fd >= 0 && local_bell >= 0) {
+            // The client may still hold the bell open, which would keep it registered
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, local_bell, nullptr);
+        }
+        if (region != MAP_FAILED) {
+            munmap(region, region_size);
+        }
+        for (int fd : {memfd, local_bell, remote_bell}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    
+    ShmChannel(const ShmChannel&) = delete;
+    ShmChannel& operator=(const ShmChannel&) = delete;
+    
+    // Daemon side: allocates the rings and both bells. Returns nullptr if the
+    // memory or descriptors are not available. The memfd is sealed at its
+    // size, so that the client cannot truncate it under the daemon's mapping.
+    static std::unique_ptr<ShmChannel> create(uint32_t requested_size, bool busy_poll) {
+        std::unique_ptr<ShmChannel> channel(new ShmChannel(shm_ring_size(requested_size), busy_poll));
+        channel->memfd = memfd_create("number_daemon_ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        channel->local_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        channel->remote_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (channel->memfd < 0 || channel->local_bell < 0 || channel->remote_bell < 0 ||
+            ftruncate(channel->memfd, region_size_for(channel->ring_size)) < 0 ||
+            fcntl(channel->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+            !channel->map(true)) {
+            return nullptr;
+        }
+        // Zero-filled memory is a valid empty ring; construct the atomics properly anyway
+        new (&channel->inbound.control()) RingControl();
+        new (&channel->outbound.control()) RingControl();
+        return channel;
+    }
+    
+    // Client side: takes ownership of the descriptors received with the
+    // SHM_ATTACH reply, in the order they were passed
+    static std::unique_ptr<ShmChannel> attach(const int fds[3], uint32_t size, bool busy_poll,
+                                              int sockfd) {
+        std::unique_ptr<ShmChannel> channel(new ShmChannel(size, busy_poll));
+        channel->memfd = fds[0];
+        channel->remote_bell = fds[1];
+        channel->local_bell = fds[2];
+        channel->peer_fd = sockfd;
+        struct stat st;
+        if (size < SHM_MIN_RING_SIZE || size > SHM_MAX_RING_SIZE || (size & (size - 1)) != 0 ||
+            fstat(channel->memfd, &st) < 0 ||
+            static_cast<size_t>(st.st_size) < region_size_for(size) || !channel->map(false)) {
+            return nullptr;
+        }
+        return channel;
+    }
+    
+    // Descriptors for the client, in SCM_RIGHTS order: memfd, daemon bell, client bell
+    std::vector<int> client_fds() const {
+        return {memfd, local_bell, remote_bell};
+    }
+    
+    uint32_t size() const { return ring_size; }
+    bool busy_polling() const { return busy_poll; }
+    
+    // Bytes waiting in the inbound ring
+    size_t readable() const { return inbound.readable(); }
+    
+    // Daemon side: readable when the client rang; for watching it other than with watch()
+    int bell_fd() const { return local_bell; }
+    
+    // Daemon side: watches the bell from an epoll set until destroyed
+    bool watch(int epoll, struct epoll_event& ev) {
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, local_bell, &ev) < 0) {
+            return false;
+        }
+        epoll_fd = epoll;
+        return true;
+    }
+    
+    // Writes as much of data as fits, waking the peer if it waits for input
+    size_t send(const char* data, size_t len) {
+        size_t n = outbound.write(data, len);
+        if (n > 0) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (outbound.control().reader_waiting.load(std::memory_order_relaxed) &&
+                outbound.control().reader_waiting.exchange(0)) {
+                ring_bell(remote_bell);
+            }
+        }
+        return n;
+    }
+    
+    // Reads up to len bytes, waking the peer if it waits for space
+    size_t receive(char* data, size_t len) {
+        size_t n = inbound.read(data, len);
+        if (n > 0) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (inbound.control().writer_waiting.load(std::memory_order_relaxed) &&
+                inbound.control().writer_waiting.exchange(0)) {
+                ring_bell(remote_bell);
+            }
+        }
+        return n;
+    }
+    
+    bool ready(bool want_read, bool want_write) const {
+        return (want_read && inbound.readable() > 0) || (want_write && outbound.writable() > 0);
+    }
+    
+    // Spins for up to SHM_SPIN_TIME; true once ready
+    bool spin(bool want_read, bool want_write) const {
+        auto deadline = std::chrono::steady_clock::now() + SHM_SPIN_TIME;
+        do {
+            for (int i = 0; i < 64; ++i) {
+                if (ready(want_read, want_write)) {
+                    return true;
+                }
+                cpu_relax();
+            }
+        } while (std::chrono::steady_clock::now() < deadline);
+        return false;
+    }
+    
+    // Asks the peer to ring the bell on progress in the wanted directions.
+    // Returns false if progress was made meanwhile and sleeping would miss it.
+    bool prepare_sleep(bool want_read, bool want_write) {
+        if (want_read) {
+            inbound.control().reader_waiting.store(1, std::memory_order_relaxed);
+        }
+        if (want_write) {
+            outbound.control().writer_waiting.store(1, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return !ready(want_read, want_write);
+    }
+    
+    void clear_bell() {
+        uint64_t value;
+        ssize_t ignored = read(local_bell, &value, sizeof(value));
+        (void)ignored;
+    }
+    
+    // Client side: blocks until the rings can make progress in the wanted
+    // direction. Returns false once the daemon has hung up.
+    bool wait(bool want_read, bool want_write) {
+        if (busy_poll && spin(want_read, want_write)) {
+            return true;
+        }
+        while (prepare_sleep(want_read, want_write)) {
+            struct pollfd fds[2] = {{local_bell, POLLIN, 0}, {peer_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            if (fds[1].revents) {
+                return false;  // The daemon never writes to the socket once attached
+            }
+            clear_bell();
+        }
+        return true;
+    }
+    
+    bool write_all(const char* data, size_t len) {
+        while (len > 0) {
+            size_t n = send(data, len);
+            data += n;
+            len -= n;
+            if (len > 0 && !wait(false, true)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    bool read_exact(char* data, size_t len) {
+        while (len > 0) {
+            size_t n = receive(data, len);
+            data += n;
+            len -= n;
+            if (len > 0 && !wait(true, false)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Fills in msg to send data with descriptors passed alongside its first
+// byte (SCM_RIGHTS); iov and control must outlive the send
+inline void build_fd_message(struct msghdr& msg, struct iovec& iov, std::vector<char>& control,
+                             const char* data, size_t len, const std::vector<int>& fds) {
+    iov.iov_base = const_cast<char*>(data);
+    iov.iov_len = len;
+    
+    control.assign(CMSG_SPACE(fds.size() * sizeof(int)), 0);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+}
+
+// send() that also passes descriptors with the first byte
+inline ssize_t send_with_fds(int sockfd, const char* data, size_t len, const std::vector<int>& fds) {
+    struct msghdr msg;
+    struct iovec iov;
+    std::vector<char> control;
+    build_fd_message(msg, iov, control, data, len, fds);
+    return sendmsg(sockfd, &msg, MSG_NOSIGNAL);
+}
+
+// Reads one frame from a blocking socket, taking up to n descriptors passed
+// with its first byte into fds; those that did not come stay -1. False if
+// the connection failed first.
+inline bool recv_frame_with_fds(int sockfd, FrameHeader& header, std::vector<char>& payload,
+                                int* fds, size_t n) {
+    char raw[FRAME_HEADER_SIZE];
+    std::vector<char> control(CMSG_SPACE(n * sizeof(int)));
+    size_t received = 0;
+    bool ok = true;
+    while (ok && received < sizeof(raw)) {
+        struct iovec iov;
+        iov.iov_base = raw + received;
+        iov.iov_len = sizeof(raw) - received;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        
+        ssize_t got = recvmsg(sockfd, &msg, MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        ok = got > 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); ok && cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            size_t passed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), std::min(passed, n) * sizeof(int));
+        }
+        received += ok ? got : 0;
+    }
+    
+    ok = ok && decode_frame_header(raw, header);
+    if (ok) {
+        payload.resize(header.payload_size());
+        for (size_t got = 0; ok && got < payload.size();) {
+            ssize_t more = recv(sockfd, payload.data() + got, payload.size() - got, 0);
+            if (more < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = more > 0;
+            got += ok ? more : 0;
+        }
+    }
+    return ok;
+}
+
+// Client side of SHM_ATTACH on a framed connection with nothing in flight.
+// Returns nullptr with error set if the daemon refused, or with error NONE
+// if the connection failed.
+inline std::unique_ptr<ShmChannel> shm_attach(int sockfd, uint32_t id, uint32_t ring_size,
+                                              uint32_t flags, ErrorCode& error) {
+    error = ErrorCode::NONE;
+    std::vector<char> request;
+    FrameBuilder(request, id, MessageType::SHM_ATTACH).put_u32(ring_size).put_u32(flags).finish();
+    if (send(sockfd, request.data(), request.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(request.size())) {
+        return nullptr;
+    }
+    
+    FrameHeader header{};
+    std::vector<char> payload;
+    int fds[3] = {-1, -1, -1};
+    bool ok = recv_frame_with_fds(sockfd, header, payload, fds, 3) && header.id == id;
+    
+    if (ok && header.type == MessageType::RESPONSE_SUCCESS && fds[0] >= 0) {
+        PayloadReader reader(payload.data(), payload.size());
+        uint32_t size = reader.get_u32();
+        return ShmChannel::attach(fds, reader.good() ? size : 0, flags & SHM_BUSY_POLL, sockfd);
+    }
+    
+    for (int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (ok && header.type == MessageType::RESPONSE_ERROR) {
+        error = header.status;
+    }
+    return nullptr;
+}
+
+#endif
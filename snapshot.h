@@ -0,0 +1,331 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "checksum.h"
+#include "number_store.h"
+#include "wal.h"
+#include "expiry.h"
+
+// Snapshot file: a sorted copy of the store in columnar form
+//   SnapshotHeader
+//   count x int32 number      ascending
+//   zero padding to a multiple of 8 bytes
+//   count x int64 timestamp   in the same order, Unix microseconds
+//   expiring x int32 number   ascending, the numbers that have an expiry
+//   zero padding to a multiple of 8 bytes
+//   expiring x int64 expiry   in the same order
+// The columns are used in place through mmap, so loading costs no parsing.
+// Version 1 files end after the timestamps, and versions 1 and 2 have
+// timestamps in seconds.
+// A snapshot is read from the live store a page at a time and may reflect
+// writes made while it was taken; replaying the log from wal_lsn on top of
+// it gives the exact state.
+
+constexpr uint32_t SNAPSHOT_MAGIC = 0x504e534e;  // "NSNP"
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t wal_lsn;   // Log position the snapshot was started at
+    int64_t created;    // Unix seconds
+    uint32_t crc;       // CRC-32C of all columns
+    uint32_t expiring;  // 0 in version 1
+};
+
+static_assert(sizeof(SnapshotHeader) == 40, "SnapshotHeader is part of the file format");
+
+inline size_t snapshot_timestamps_offset(uint64_t count) {
+    size_t end = sizeof(SnapshotHeader) + count * sizeof(int32_t);
+    return (end + 7) & ~size_t(7);
+}
+
+inline size_t snapshot_expiring_offset(uint64_t count) {
+    return snapshot_timestamps_offset(count) + count * sizeof(int64_t);
+}
+
+inline size_t snapshot_expiries_offset(uint64_t count, uint64_t expiring) {
+    size_t end = snapshot_expiring_offset(count) + expiring * sizeof(int32_t);
+    return (end + 7) & ~size_t(7);
+}
+
+inline size_t snapshot_size(uint64_t count, uint64_t expiring) {
+    return snapshot_expiries_offset(count, expiring) + expiring * sizeof(int64_t);
+}
+
+// Writes a snapshot of store, and the expiries in expiry if given, to fd.
+// Writers are blocked for at most one page at a time, or not at all when
+// the engine keeps versions, which also makes the copy a single point in
+// time.
+inline bool write_snapshot_to(int fd, const NumberStore& store, const ExpiryIndex* expiry,
+                              uint64_t wal_lsn, size_t& count) {
+    const size_t page = 64 * 1024;
+    auto view = store.view();
+    std::vector<int32_t> numbers;
+    std::vector<int64_t> timestamps;
+    numbers.reserve(view ? view->size() : store.size());
+    timestamps.reserve(view ? view->size() : store.size());
+    
+    int32_t next = 0;
+    while (true) {
+        auto entries = view ? view->range(next, std::numeric_limits<int32_t>::max(), page)
+                            : store.range(next, std::numeric_limits<int32_t>::max(), page);
+        for (const auto& entry : entries) {
+            numbers.push_back(entry.number);
+            timestamps.push_back(entry.timestamp);
+        }
+        if (entries.size() < page || entries.back().number == std::numeric_limits<int32_t>::max()) {
+            break;
+        }
+        next = entries.back().number + 1;
+    }
+    count = numbers.size();
+    
+    // Only expiries of numbers in the snapshot, so that every loaded expiry
+    // belongs to a stored number
+    std::vector<int32_t> expiring;
+    std::vector<int64_t> expiries;
+    if (expiry) {
+        auto timers = expiry->entries();
+        auto it = numbers.begin();
+        for (const auto& timer : timers) {
+            it = std::lower_bound(it, numbers.end(), timer.number);
+            if (it != numbers.end() && *it == timer.number) {
+                expiring.push_back(timer.number);
+                expiries.push_back(timer.deadline);
+            }
+        }
+    }
+    
+    SnapshotHeader header{};
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = count;
+    header.wal_lsn = wal_lsn;
+    header.expiring = static_cast<uint32_t>(expiring.size());
+    header.created = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    
+    size_t numbers_size = count * sizeof(int32_t);
+    size_t padding = snapshot_timestamps_offset(count) - sizeof(SnapshotHeader) - numbers_size;
+    size_t expiring_size = expiring.size() * sizeof(int32_t);
+    size_t expiring_padding = snapshot_expiries_offset(count, expiring.size()) -
+                              snapshot_expiring_offset(count) - expiring_size;
+    char zeros[8] = {};
+    header.crc = crc32c(reinterpret_cast<const char*>(numbers.data()), numbers_size);
+    header.crc = crc32c(reinterpret_cast<const char*>(timestamps.data()),
+                        count * sizeof(int64_t), header.crc);
+    header.crc = crc32c(reinterpret_cast<const char*>(expiring.data()), expiring_size, header.crc);
+    header.crc = crc32c(reinterpret_cast<const char*>(expiries.data()),
+                        expiries.size() * sizeof(int64_t), header.crc);
+    
+    return write_all(fd, reinterpret_cast<const char*>(&header), sizeof(header)) &&
+           write_all(fd, reinterpret_cast<const char*>(numbers.data()), numbers_size) &&
+           write_all(fd, zeros, padding) &&
+           write_all(fd, reinterpret_cast<const char*>(timestamps.data()), count * sizeof(int64_t)) &&
+           write_all(fd, reinterpret_cast<const char*>(expiring.data()), expiring_size) &&
+           write_all(fd, zeros, expiring_padding) &&
+           write_all(fd, reinterpret_cast<const char*>(expiries.data()),
+                     expiries.size() * sizeof(int64_t));
+}
+
+// Writes a snapshot to path, replacing the previous one only once the new
+// file is durable
+inline bool write_snapshot(const std::string& path, const NumberStore& store,
+                           const ExpiryIndex* expiry, uint64_t wal_lsn, size_t& count) {
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create snapshot " << tmp_path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    bool ok = write_snapshot_to(fd, store, expiry, wal_lsn, count) && fdatasync(fd) == 0;
+    close(fd);
+    
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+        std::cerr << "Failed to write snapshot " << path << ": " << strerror(errno) << std::endl;
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    sync_parent_directory(path);
+    return true;
+}
+
+// Maps the snapshot in fd, verifies it and bulk-loads it into store, and
+// its expiries into expiry if given, using up to threads threads. path
+// names the snapshot in messages.
+inline bool load_snapshot_from(int fd, const std::string& path, NumberStore& store,
+                               ExpiryIndex* expiry, size_t threads, uint64_t& wal_lsn,
+                               size_t& count) {
+    wal_lsn = 0;
+    count = 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        std::cerr << "Snapshot " << path << " is truncated" << std::endl;
+        return false;
+    }
+    size_t size = st.st_size;
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Failed to map snapshot " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    
+    const char* data = static_cast<const char*>(mapped);
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool ok = header.magic == SNAPSHOT_MAGIC && header.version >= 1 &&
+              header.version <= SNAPSHOT_VERSION && (header.version > 1 || header.expiring == 0) &&
+              header.count <= (size - sizeof(SnapshotHeader)) / (sizeof(int32_t) + sizeof(int64_t)) &&
+              header.expiring <= header.count &&
+              size == snapshot_size(header.count, header.expiring);
+    
+    const char* numbers = data + sizeof(SnapshotHeader);
+    const char* timestamps = data + (ok ? snapshot_timestamps_offset(header.count) : 0);
+    const char* expiring = data + (ok ? snapshot_expiring_offset(header.count) : 0);
+    const char* expiries = data + (ok ? snapshot_expiries_offset(header.count, header.expiring) : 0);
+    if (ok) {
+        uint32_t crc = crc32c(numbers, header.count * sizeof(int32_t));
+        crc = crc32c(timestamps, header.count * sizeof(int64_t), crc);
+        crc = crc32c(expiring, header.expiring * sizeof(int32_t), crc);
+        crc = crc32c(expiries, header.expiring * sizeof(int64_t), crc);
+        ok = crc == header.crc;
+    }
+    
+    if (ok) {
+        // Every column is naturally aligned within the page-aligned mapping
+        const int64_t* stamps = reinterpret_cast<const int64_t*>(timestamps);
+        std::vector<int64_t> converted;
+        if (header.version < 3) {
+            converted.assign(stamps, stamps + header.count);
+            for (auto& timestamp : converted) {
+                timestamp *= MICROS_PER_SECOND;
+            }
+            stamps = converted.data();
+        }
+        store.load_sorted(reinterpret_cast<const int32_t*>(numbers), stamps, header.count, threads);
+        if (expiry) {
+            expiry->load(reinterpret_cast<const int32_t*>(expiring),
+                         reinterpret_cast<const int64_t*>(expiries), header.expiring);
+        }
+        wal_lsn = header.wal_lsn;
+        count = header.count;
+    } else {
+        std::cerr << path << " is not a valid version " << SNAPSHOT_VERSION << " snapshot" << std::endl;
+    }
+    munmap(mapped, size);
+    return ok;
+}
+
+// Loads the snapshot at path. A missing file is not an error: found is
+// false, count is 0 and replay starts at the beginning of the log.
+inline bool load_snapshot(const std::string& path, NumberStore& store, ExpiryIndex* expiry,
+                          size_t threads, uint64_t& wal_lsn, size_t& count, bool& found) {
+    wal_lsn = 0;
+    count = 0;
+    found = false;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return true;
+        }
+        std::cerr << "Failed to open snapshot " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    found = true;
+    bool ok = load_snapshot_from(fd, path, store, expiry, threads, wal_lsn, count);
+    close(fd);
+    return ok;
+}
+
+// Writes a snapshot every interval in the background, skipping intervals
+// without writes, and then drops the log records the snapshot covers
+class Snapshotter {
+private:
+    std::string path;
+    const NumberStore& store;
+    const ExpiryIndex* expiry;  // Optional
+    WriteAheadLog* log;         // Optional
+    std::chrono::seconds interval;
+    uint64_t last_lsn;
+    
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping;
+    std::thread thread;
+    
+    void run() {
+        std::unique_lock lock(mutex);
+        while (!cv.wait_for(lock, interval, [this] { return stopping; })) {
+            lock.unlock();
+            take();
+            lock.lock();
+        }
+    }
+    
+    void take() {
+        // Without a log there is no cheap way to tell if anything changed
+        uint64_t lsn = log ? log->appended_lsn() : 0;
+        if (log && lsn == last_lsn) {
+            return;
+        }
+        size_t count;
+        if (!write_snapshot(path, store, expiry, lsn, count)) {
+            return;
+        }
+        last_lsn = lsn;
+        if (log && !log->compact(lsn)) {
+            std::cerr << "Failed to compact write-ahead log after snapshot" << std::endl;
+        }
+    }
+    
+public:
+    // loaded_lsn is the wal_lsn of the snapshot the store was loaded from
+    Snapshotter(const std::string& snapshot_path, const NumberStore& number_store,
+                const ExpiryIndex* expiry_index, WriteAheadLog* write_ahead_log,
+                std::chrono::seconds every, uint64_t loaded_lsn)
+        : path(snapshot_path), store(number_store), expiry(expiry_index), log(write_ahead_log),
+          interval(every),
+          last_lsn(loaded_lsn), stopping(false) {}
+    
+    ~Snapshotter() {
+        stop();
+    }
+    
+    void start() {
+        stopping = false;
+        thread = std::thread(&Snapshotter::run, this);
+    }
+    
+    void stop() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+};
+
+#endif
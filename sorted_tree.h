@@ -0,0 +1,31 @@
+#ifndef SORTED_TREE_H
+#define SORTED_TREE_H
+
+#include <cstddef>
+
+// Sorted appends to the stores' pb_ds trees. The trees take no insertion
+// hint, and keeping subtree sizes costs O(log n) per insert anyway. A run of
+// values above every key is instead built in halves, each a tree of its own,
+// which are then joined; a join of red-black trees takes O(log n), so the
+// run costs O(1) amortised per value.
+
+constexpr size_t SORTED_TREE_RUN = 8;  // Values inserted one by one at the bottom
+
+// Appends values[0, count), ascending and distinct, to tree, whose keys must
+// all be smaller
+template <typename Tree, typename Value>
+void append_sorted(Tree& tree, const Value* values, size_t count) {
+    if (count <= SORTED_TREE_RUN) {
+        for (size_t i = 0; i < count; ++i) {
+            tree.insert(values[i]);
+        }
+        return;
+    }
+    size_t half = count / 2;
+    append_sorted(tree, values, half);
+    Tree rest;
+    append_sorted(rest, values + half, count - half);
+    tree.join(rest);
+}
+
+#endif
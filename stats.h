@@ -0,0 +1,65 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+
+#include "common.h"
+#include "protocol.h"
+#include "histogram.h"
+
+// Request statistics kept by each reactor thread and summed by STATS.
+// Only the owning reactor writes its counters, so recording a request costs
+// a few plain stores and two clock reads; nothing is shared between
+// reactors on the hot path.
+
+// Service-time buckets are at most 1/16 of their value wide
+constexpr unsigned STATS_SUB_BITS = 5;
+
+struct OpCounters {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> errors{0};  // Answered with RESPONSE_ERROR
+    SharedHistogram<STATS_SUB_BITS> service_time;
+};
+
+struct ReactorStats {
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> closed{0};
+    std::atomic<uint64_t> io_syscalls{0};  // Socket and readiness system calls made by the reactor
+    OpCounters ops[MESSAGE_TYPE_COUNT + 1];  // Indexed by MessageType; the last slot is unknown types
+    
+    void record(MessageType type, bool error, std::chrono::steady_clock::duration elapsed) {
+        OpCounters& op = ops[std::min(static_cast<size_t>(type), MESSAGE_TYPE_COUNT)];
+        bump(op.count);
+        if (error) {
+            bump(op.errors);
+        }
+        op.service_time.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+// Sum over reactors, read while they keep running
+struct StatsTotals {
+    uint64_t accepted = 0;
+    uint64_t closed = 0;
+    uint64_t io_syscalls = 0;
+    uint64_t count[MESSAGE_TYPE_COUNT + 1] = {};
+    uint64_t errors[MESSAGE_TYPE_COUNT + 1] = {};
+    LogLinearHistogram<STATS_SUB_BITS> service_time[MESSAGE_TYPE_COUNT + 1];
+    
+    void add(const ReactorStats& reactor) {
+        // closed first: a reactor never closes more connections than it accepted
+        closed += reactor.closed.load(std::memory_order_relaxed);
+        accepted += reactor.accepted.load(std::memory_order_relaxed);
+        io_syscalls += reactor.io_syscalls.load(std::memory_order_relaxed);
+        for (size_t i = 0; i <= MESSAGE_TYPE_COUNT; ++i) {
+            count[i] += reactor.ops[i].count.load(std::memory_order_relaxed);
+            errors[i] += reactor.ops[i].errors.load(std::memory_order_relaxed);
+            reactor.ops[i].service_time.add_to(service_time[i]);
+        }
+    }
+};
+
+#endif
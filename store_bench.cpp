@@ -0,0 +1,418 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <memory>
+#include <fstream>
+#include <atomic>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "number_store.h"
+#include "map_store.h"
+#include "bitmap_store.h"
+#include "mvcc_store.h"
+#include "wal.h"
+#include "histogram.h"
+
+// Micro-benchmarks for NumberStore, run without the daemon or sockets
+//
+//   ./store_bench [latency] [engine]                 FIND/INSERT latency as the store grows
+//   ./store_bench scale [threads] [shards] [engine]  write throughput for 1..threads writers,
+//                                                    single lock vs sharded store
+//   ./store_bench memory [count]                     RSS, FIND and full-scan cost per engine
+//   ./store_bench wal [threads] [path]               durable INSERT throughput per log sync policy
+//   ./store_bench scan [count] [scanners]            writer latency while full scans run, per engine
+//
+// engine is "map" (default), "bitmap" or "mvcc".
+
+using Clock = std::chrono::steady_clock;
+
+// Keeps the optimizer from discarding benchmark results
+static volatile int64_t sink;
+
+static std::unique_ptr<NumberStore> make_store(const std::string& engine, size_t shards) {
+    if (engine == "bitmap") {
+        return std::make_unique<BitmapStore>(shards);
+    }
+    if (engine == "mvcc") {
+        return std::make_unique<MvccStore>(shards);
+    }
+    return std::make_unique<MapStore>(shards);
+}
+
+static size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static double ns_per_op(Clock::time_point start, Clock::time_point end, size_t ops) {
+    return std::chrono::duration<double, std::nano>(end - start).count() / ops;
+}
+
+// Distinct positive numbers in random order; even values only, so that any
+// odd value is guaranteed to miss
+static std::vector<int32_t> make_keys(size_t count, std::mt19937& rng) {
+    std::vector<int32_t> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        keys[i] = static_cast<int32_t>(2 * (i + 1));
+    }
+    std::shuffle(keys.begin(), keys.end(), rng);
+    return keys;
+}
+
+static void fill(NumberStore& store, const std::vector<int32_t>& keys) {
+    const size_t chunk = 64 * 1024;
+    std::vector<bool> inserted;
+    for (size_t i = 0; i < keys.size(); i += chunk) {
+        std::vector<int32_t> batch(keys.begin() + i,
+                                   keys.begin() + std::min(keys.size(), i + chunk));
+        store.insert_batch(batch, inserted);
+    }
+}
+
+static void run_latency(const std::string& engine) {
+    const std::vector<size_t> sizes = {1000, 10000, 100000, 1000000, 4000000};
+    const size_t ops = 200000;
+    std::mt19937 rng(42);
+    
+    std::cout << "FIND/INSERT latency by store size, " << engine << " engine ("
+              << ops << " ops each)" << std::endl;
+    std::cout << std::setw(10) << "Entries" << " | "
+              << std::setw(12) << "FIND hit" << " | "
+              << std::setw(12) << "FIND miss" << " | "
+              << std::setw(12) << "INSERT" << std::endl;
+    std::cout << std::string(56, '-') << std::endl;
+    
+    for (size_t size : sizes) {
+        auto store_ptr = make_store(engine, NumberStore::DEFAULT_SHARD_COUNT);
+        NumberStore& store = *store_ptr;
+        auto keys = make_keys(size, rng);
+        fill(store, keys);
+        
+        std::uniform_int_distribution<size_t> pick(0, size - 1);
+        std::vector<int32_t> hits(ops), misses(ops), fresh(ops);
+        for (size_t i = 0; i < ops; ++i) {
+            hits[i] = keys[pick(rng)];
+            misses[i] = keys[pick(rng)] - 1;
+        }
+        // Odd numbers above the store's range are always new
+        for (size_t i = 0; i < ops; ++i) {
+            fresh[i] = static_cast<int32_t>(2 * (size + i) + 1);
+        }
+        std::shuffle(fresh.begin(), fresh.end(), rng);
+        
+        int64_t total = 0;
+        auto start = Clock::now();
+        for (int32_t number : hits) {
+            total += store.find(number)->timestamp;
+        }
+        auto after_hits = Clock::now();
+        for (int32_t number : misses) {
+            total += store.find(number).has_value();
+        }
+        auto after_misses = Clock::now();
+        for (int32_t number : fresh) {
+            int64_t timestamp;
+            total += store.insert(number, timestamp);
+        }
+        auto end = Clock::now();
+        sink = total;
+        
+        std::cout << std::setw(10) << size << " | "
+                  << std::setw(9) << std::fixed << std::setprecision(1)
+                  << ns_per_op(start, after_hits, ops) << " ns | "
+                  << std::setw(9) << ns_per_op(after_hits, after_misses, ops) << " ns | "
+                  << std::setw(9) << ns_per_op(after_misses, end, ops) << " ns" << std::endl;
+    }
+}
+
+// Every writer thread alternates INSERT and DELETE of random keys
+static double writer_throughput(const std::string& engine, size_t shard_count, size_t threads) {
+    const size_t ops_per_thread = 200000;
+    const int32_t key_space = 1 << 20;
+    
+    auto store_ptr = make_store(engine, shard_count);
+    NumberStore& store = *store_ptr;
+    std::mt19937 rng(7);
+    fill(store, make_keys(key_space / 4, rng));
+    
+    std::vector<std::thread> writers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        writers.emplace_back([&store, t, key_space] {
+            std::mt19937 local(static_cast<unsigned>(t + 1));
+            std::uniform_int_distribution<int32_t> pick(1, key_space);
+            int64_t total = 0;
+            for (size_t i = 0; i < ops_per_thread; ++i) {
+                int32_t number = pick(local);
+                total += (i & 1) ? store.remove(number) : store.insert(number);
+            }
+            sink = total;
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    auto end = Clock::now();
+    
+    double seconds = std::chrono::duration<double>(end - start).count();
+    return threads * ops_per_thread / seconds;
+}
+
+static void run_scale(size_t max_threads, size_t shard_count, const std::string& engine) {
+    std::vector<size_t> thread_counts;
+    for (size_t t = 1; t < max_threads; t *= 2) {
+        thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+    
+    std::cout << "Writer throughput, " << engine << " engine, 1 shard vs "
+              << shard_count << " shards (Mops/s)" << std::endl;
+    std::cout << std::setw(8) << "Threads" << " | "
+              << std::setw(10) << "1 shard" << " | "
+              << std::setw(10) << (std::to_string(shard_count) + " shards") << " | "
+              << std::setw(8) << "Speedup" << std::endl;
+    std::cout << std::string(46, '-') << std::endl;
+    
+    for (size_t threads : thread_counts) {
+        double single = writer_throughput(engine, 1, threads);
+        double sharded = writer_throughput(engine, shard_count, threads);
+        std::cout << std::setw(8) << threads << " | "
+                  << std::setw(10) << std::fixed << std::setprecision(2) << single / 1e6 << " | "
+                  << std::setw(10) << sharded / 1e6 << " | "
+                  << std::setw(7) << sharded / single << "x" << std::endl;
+    }
+}
+
+// Measured in a child process so every engine starts from a clean heap
+static void measure_memory(const std::string& engine, const std::string& layout, size_t count) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        return;
+    }
+    
+    // dense: 1..count, sparse: every 16th number, random: spread over the int32 range
+    std::mt19937 rng(11);
+    std::vector<int32_t> keys(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (layout == "dense") {
+            keys[i] = static_cast<int32_t>(i + 1);
+        } else if (layout == "sparse") {
+            keys[i] = static_cast<int32_t>(16 * i + 1);
+        } else {
+            keys[i] = static_cast<int32_t>(rng() & 0x7fffffff);
+        }
+    }
+    std::vector<int32_t> probes(200000);
+    for (auto& probe : probes) {
+        probe = keys[rng() % count];
+    }
+    
+    size_t before = resident_bytes();
+    auto store = make_store(engine, NumberStore::DEFAULT_SHARD_COUNT);
+    fill(*store, keys);
+    size_t after = resident_bytes();
+    
+    int64_t total = 0;
+    auto start = Clock::now();
+    for (int32_t number : probes) {
+        total += store->contains(number);
+    }
+    auto after_find = Clock::now();
+    auto entries = store->getAllSorted();
+    auto end = Clock::now();
+    sink = total + entries.size();
+    
+    std::cout << std::setw(7) << engine << " | " << std::setw(7) << layout << " | "
+              << std::setw(9) << std::fixed << std::setprecision(1)
+              << (after - before) / (1024.0 * 1024.0) << " MiB | "
+              << std::setw(7) << double(after - before) / store->size() << " B | "
+              << std::setw(7) << ns_per_op(start, after_find, probes.size()) << " ns | "
+              << std::setw(7) << std::chrono::duration<double, std::milli>(end - after_find).count()
+              << " ms" << std::endl;
+    _exit(0);
+}
+
+static void run_memory(size_t count) {
+    std::cout << "Memory and scan cost for " << count << " numbers" << std::endl;
+    std::cout << std::setw(7) << "Engine" << " | " << std::setw(7) << "Layout" << " | "
+              << std::setw(13) << "RSS" << " | " << std::setw(9) << "Per entry" << " | "
+              << std::setw(10) << "FIND" << " | " << std::setw(10) << "Full scan" << std::endl;
+    std::cout << std::string(72, '-') << std::endl;
+    
+    for (const char* layout : {"dense", "sparse", "random"}) {
+        for (const char* engine : {"map", "bitmap", "mvcc"}) {
+            measure_memory(engine, layout, count);
+        }
+    }
+}
+
+// Every writer inserts fresh numbers and waits for each one to be durable,
+// as the daemon does before replying
+static void measure_wal(const std::string& path, SyncPolicy policy, size_t threads) {
+    const size_t ops_per_thread = policy == SyncPolicy::ALWAYS ? 2000 : 20000;
+    unlink(path.c_str());
+    
+    MapStore store;
+    WriteAheadLog log(path, policy, std::chrono::microseconds(1000));
+    size_t records;
+    if (!log.open(store, records)) {
+        return;
+    }
+    store.add_listener(&log);
+    
+    std::vector<std::thread> writers;
+    auto start = Clock::now();
+    for (size_t t = 0; t < threads; ++t) {
+        writers.emplace_back([&store, &log, t, threads, ops_per_thread] {
+            for (size_t i = 0; i < ops_per_thread; ++i) {
+                store.insert(static_cast<int32_t>(i * threads + t + 1));
+                log.wait(log.commit());
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    auto end = Clock::now();
+    
+    size_t ops = threads * ops_per_thread;
+    std::cout << std::setw(7) << sync_policy_name(policy) << " | "
+              << std::setw(10) << std::fixed << std::setprecision(0)
+              << ops / std::chrono::duration<double>(end - start).count() << " | "
+              << std::setw(9) << std::setprecision(1) << ns_per_op(start, end, ops) / 1000 << " us | "
+              << std::setw(7) << log.sync_count() << std::endl;
+    unlink(path.c_str());
+}
+
+static void run_wal(size_t threads, const std::string& path) {
+    std::cout << "Durable INSERT throughput, " << threads << " writer thread"
+              << (threads == 1 ? "" : "s") << ", log at " << path << std::endl;
+    std::cout << std::setw(7) << "Sync" << " | " << std::setw(10) << "Ops/s" << " | "
+              << std::setw(12) << "Per op" << " | " << std::setw(7) << "Syncs" << std::endl;
+    std::cout << std::string(46, '-') << std::endl;
+    
+    for (SyncPolicy policy : {SyncPolicy::ALWAYS, SyncPolicy::GROUP, SyncPolicy::ASYNC}) {
+        measure_wal(path, policy, threads);
+    }
+}
+
+// One writer alternates INSERT and DELETE of random numbers for a fixed
+// time, timing each, while reader threads copy the whole store in a loop,
+// or with ranks run RANK queries back to back, each a short read of every
+// shard at one point in time
+static void measure_scan_writers(const std::string& engine, size_t count, size_t scanners,
+                                 bool ranks = false) {
+    const auto duration = std::chrono::seconds(2);
+    const int32_t key_space = static_cast<int32_t>(std::min<size_t>(count * 2, 0x7fffffff));
+    
+    auto store_ptr = make_store(engine, NumberStore::DEFAULT_SHARD_COUNT);
+    NumberStore& store = *store_ptr;
+    std::mt19937 rng(5);
+    fill(store, make_keys(count, rng));
+    
+    // Scanners stop on their own: a writer can be starved for as long as
+    // they keep overlapping
+    auto start = Clock::now();
+    auto deadline = start + duration;
+    std::atomic<size_t> scans{0};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < scanners; ++t) {
+        threads.emplace_back([&store, &scans, deadline, ranks, key_space, t] {
+            std::mt19937 reader_rng(static_cast<uint32_t>(t));
+            std::uniform_int_distribution<int32_t> probe(1, key_space);
+            while (Clock::now() < deadline) {
+                sink = ranks ? store.rank(probe(reader_rng)) : store.getAllSorted().size();
+                scans.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    }
+    
+    LatencyHistogram latency;
+    std::uniform_int_distribution<int32_t> pick(1, key_space);
+    size_t writes = 0;
+    for (auto now = start; now < deadline; ++writes) {
+        int32_t number = pick(rng);
+        if (writes & 1) {
+            store.remove(number);
+        } else {
+            store.insert(number);
+        }
+        auto done = Clock::now();
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(done - now).count());
+        now = done;
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    
+    std::cout << std::setw(7) << engine << " | " << std::setw(6) << (scanners == 0 ? "-" : ranks ? "rank" : "scan")
+              << " | " << std::setw(7) << scanners << " | "
+              << std::setw(9) << scans.load() << " | " << std::setw(9) << writes << " | "
+              << std::setw(9) << std::fixed << std::setprecision(1)
+              << latency.percentile(0.5) / 1000.0 << " us | "
+              << std::setw(9) << latency.percentile(0.99) / 1000.0 << " us | "
+              << std::setw(9) << latency.percentile(0.999) / 1000.0 << " us | "
+              << std::setw(9) << latency.max() / 1000.0 << " us" << std::endl;
+}
+
+static void run_scan_writers(size_t count, size_t scanners) {
+    std::cout << "Writer latency during full scans and RANKs of " << count << " numbers" << std::endl;
+    std::cout << std::setw(7) << "Engine" << " | " << std::setw(6) << "Reader" << " | "
+              << std::setw(7) << "Threads" << " | "
+              << std::setw(9) << "Reads" << " | " << std::setw(9) << "Writes" << " | "
+              << std::setw(12) << "p50" << " | " << std::setw(12) << "p99" << " | "
+              << std::setw(12) << "p99.9" << " | " << std::setw(12) << "max" << std::endl;
+    std::cout << std::string(110, '-') << std::endl;
+    
+    for (const char* engine : {"map", "bitmap", "mvcc"}) {
+        measure_scan_writers(engine, count, 0);
+        measure_scan_writers(engine, count, scanners);
+        measure_scan_writers(engine, count, scanners, true);
+    }
+}
+
+static void print_usage(const char* prog) {
+    std::cout << "Usage: " << prog << " [latency] [engine]" << std::endl;
+    std::cout << "       " << prog << " scale [threads] [shards] [engine]" << std::endl;
+    std::cout << "       " << prog << " memory [count]" << std::endl;
+    std::cout << "       " << prog << " wal [threads] [path]" << std::endl;
+    std::cout << "       " << prog << " scan [count] [readers]" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::string mode = argc > 1 ? argv[1] : "latency";
+    
+    if (mode == "latency") {
+        run_latency(argc > 2 ? argv[2] : "map");
+    } else if (mode == "scale") {
+        size_t threads = argc > 2 ? std::stoul(argv[2])
+                                  : std::max(1u, std::thread::hardware_concurrency());
+        size_t shards = argc > 3 ? std::stoul(argv[3]) : NumberStore::DEFAULT_SHARD_COUNT;
+        run_scale(std::max<size_t>(threads, 1), shards, argc > 4 ? argv[4] : "map");
+    } else if (mode == "memory") {
+        run_memory(argc > 2 ? std::stoul(argv[2]) : 4000000);
+    } else if (mode == "wal") {
+        size_t threads = argc > 2 ? std::stoul(argv[2]) : 64;
+        run_wal(std::max<size_t>(threads, 1), argc > 3 ? argv[3] : "/tmp/store_bench.wal");
+    } else if (mode == "scan") {
+        size_t count = argc > 2 ? std::stoul(argv[2]) : 1000000;
+        size_t scanners = argc > 3 ? std::stoul(argv[3]) : 2;
+        run_scan_writers(std::max<size_t>(count, 1), std::max<size_t>(scanners, 1));
+    } else {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    return 0;
+}
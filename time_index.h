@@ -0,0 +1,188 @@
+#ifndef TIME_INDEX_H
+#define TIME_INDEX_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <cstdint>
+#include <ext/pb_ds/assoc_container.hpp>
+#include <ext/pb_ds/tree_policy.hpp>
+
+#include "common.h"
+#include "node_pool.h"
+#include "sorted_tree.h"
+
+// Secondary index of a store's entries ordered by insertion time. Kept in
+// shards like MapStore, each an order-statistic tree of (timestamp, number)
+// pairs, so a time window is found in O(log n) and counted without walking
+// it. Stores update it from their change notifications, i.e. with the
+// affected number's shard lock held.
+class TimeIndex {
+private:
+    struct Nodes {};  // Tags the pool of the trees' nodes
+    
+    using Key = std::pair<int64_t, int32_t>;  // timestamp, number
+    using Tree = __gnu_pbds::tree<Key, __gnu_pbds::null_type, std::less<Key>,
+                                  __gnu_pbds::rb_tree_tag,
+                                  __gnu_pbds::tree_order_statistics_node_update,
+                                  PoolAllocator<char, Nodes>>;
+    
+    struct alignas(64) Shard {
+        Tree entries;
+        mutable std::shared_mutex mutex;
+    };
+    
+    std::unique_ptr<Shard[]> shards;
+    size_t num_shards;
+    unsigned shard_bits;
+    
+    // Same hash as MapStore, so a map store's batch touches one index shard
+    size_t shard_index(int32_t number) const {
+        if (shard_bits == 0) {
+            return 0;
+        }
+        uint32_t hash = static_cast<uint32_t>(number) * 2654435769u;
+        return hash >> (32 - shard_bits);
+    }
+    
+    // Calls f(shard, i) for i in [0, count) with each entry's shard locked,
+    // taking a lock only when the shard changes
+    template <typename F>
+    void for_each_locked(const int32_t* numbers, size_t count, F f) {
+        std::unique_lock<std::shared_mutex> lock;
+        size_t locked = num_shards;
+        for (size_t i = 0; i < count; ++i) {
+            size_t s = shard_index(numbers[i]);
+            if (s != locked) {
+                lock = std::unique_lock(shards[s].mutex);
+                locked = s;
+            }
+            f(shards[s], i);
+        }
+    }
+    
+public:
+    // shard_count must be a power of two
+    explicit TimeIndex(size_t shard_count) : num_shards(shard_count), shard_bits(0) {
+        while ((size_t(1) << shard_bits) < num_shards) {
+            ++shard_bits;
+        }
+        shards.reset(new Shard[num_shards]);
+    }
+    
+    size_t shard_count() const {
+        return num_shards;
+    }
+    
+    // Bytes of the index's nodes; the pool is shared by every index in the process
+    size_t memory_usage() const {
+        return sizeof(Shard) * num_shards + pool_usage<Nodes>().used.load(std::memory_order_relaxed);
+    }
+    
+    // Bytes a further entry takes
+    size_t entry_bytes() const {
+        return std::max<size_t>(pool_usage<Nodes>().node_size.load(std::memory_order_relaxed), 64);
+    }
+    
+    void insert(const int32_t* numbers, size_t count, int64_t timestamp) {
+        for_each_locked(numbers, count, [&](Shard& shard, size_t i) {
+            shard.entries.insert(Key(timestamp, numbers[i]));
+        });
+    }
+    
+    // Takes the numbers' timestamps, which the store reports on removal
+    void remove(const int32_t* numbers, const int64_t* timestamps, size_t count) {
+        for_each_locked(numbers, count, [&](Shard& shard, size_t i) {
+            shard.entries.erase(Key(timestamps[i], numbers[i]));
+        });
+    }
+    
+    void clear() {
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::unique_lock lock(shards[i].mutex);
+            shards[i].entries.clear();
+        }
+    }
+    
+    // Adds the entries of a snapshot column that belong to shard s, sorted
+    // by time first so that they are appended in one run
+    void load_shard(size_t s, const int32_t* numbers, const int64_t* timestamps, size_t count) {
+        std::vector<Key> keys;
+        for (size_t i = 0; i < count; ++i) {
+            if (shard_index(numbers[i]) == s) {
+                keys.emplace_back(timestamps[i], numbers[i]);
+            }
+        }
+        std::sort(keys.begin(), keys.end());
+        
+        Tree& entries = shards[s].entries;
+        std::unique_lock lock(shards[s].mutex);
+        size_t first = 0;
+        for (; first < keys.size() && !entries.empty() && !(*std::prev(entries.end()) < keys[first]); ++first) {
+            entries.insert(keys[first]);
+        }
+        append_sorted(entries, keys.data() + first, keys.size() - first);
+    }
+    
+    // Up to limit entries from (from, from_number) up to timestamp to, in
+    // (timestamp, number) order. Merges the shards under their read locks.
+    std::vector<NumberEntry> range(int64_t from, int32_t from_number, int64_t to,
+                                   size_t limit) const {
+        using Iterator = Tree::const_iterator;
+        using Cursor = std::pair<Iterator, Iterator>;  // current, end
+        
+        std::vector<NumberEntry> result;
+        if (to < from || limit == 0) {
+            return result;
+        }
+        
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        locks.reserve(num_shards);
+        std::vector<Cursor> heap;
+        Key first(from, from_number);
+        Key last(to, std::numeric_limits<int32_t>::max());
+        for (size_t i = 0; i < num_shards; ++i) {
+            locks.emplace_back(shards[i].mutex);
+            const Tree& entries = shards[i].entries;
+            auto begin = entries.lower_bound(first);
+            auto end = entries.upper_bound(last);
+            if (begin != end) {
+                heap.emplace_back(begin, end);
+            }
+        }
+        
+        auto later = [](const Cursor& a, const Cursor& b) {
+            return *a.first > *b.first;
+        };
+        std::make_heap(heap.begin(), heap.end(), later);
+        while (!heap.empty() && result.size() < limit) {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Cursor& cursor = heap.back();
+            result.emplace_back(cursor.first->second, cursor.first->first);
+            if (++cursor.first == cursor.second) {
+                heap.pop_back();
+            } else {
+                std::push_heap(heap.begin(), heap.end(), later);
+            }
+        }
+        return result;
+    }
+    
+    // Entries with a timestamp of at least since; O(log n) per shard
+    uint64_t count_since(int64_t since) const {
+        uint64_t total = 0;
+        Key first(since, std::numeric_limits<int32_t>::min());
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::shared_lock lock(shards[i].mutex);
+            const Tree& entries = shards[i].entries;
+            total += entries.size() - entries.order_of_key(first);
+        }
+        return total;
+    }
+};
+
+#endif
@@ -0,0 +1,329 @@
+#ifndef URING_H
+#define URING_H
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Minimal io_uring driver for the daemon's reactors, on the raw system
+// calls rather than liburing. A ring is owned by one thread: requests are
+// queued as submission entries and all go to the kernel with the next
+// wait(), which also collects the completions.
+//
+// Receives use buffers provided to the kernel up front: a multishot receive
+// picks a free one per completion, and the caller hands it back with
+// recycle() once the data is copied out. They are provided with
+// IORING_OP_PROVIDE_BUFFERS requests rather than a registered buffer ring,
+// which not every kernel that accepts the registration hands out from.
+
+class IoUring {
+private:
+    int ring_fd = -1;
+    
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned sq_local_tail = 0;  // Entries queued locally, not yet published
+    unsigned sq_submitted = 0;   // Entries published to the kernel
+    
+    void* cq_ring = MAP_FAILED;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    
+    std::vector<char> buffers;
+    unsigned buffer_size = 0;
+    uint16_t buffer_group = 0;
+    std::vector<uint16_t> returned;  // Recycled buffers not yet provided again
+    
+    // user_data of the requests providing buffers, which only complete on failure
+    static constexpr uint64_t PROVIDE_TAG = ~uint64_t(0);
+    
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+        return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                                        nullptr, 0));
+    }
+    
+    // Queues the requests that provide the recycled buffers again, one per
+    // run of consecutive ids. Any that do not fit wait for the next submit.
+    void provide_returned() {
+        if (returned.empty()) {
+            return;
+        }
+        std::sort(returned.begin(), returned.end());
+        size_t i = 0;
+        while (i < returned.size()) {
+            size_t j = i + 1;
+            while (j < returned.size() && returned[j] == returned[j - 1] + 1) {
+                ++j;
+            }
+            io_uring_sqe* sqe = get_sqe();
+            if (!sqe) {
+                break;
+            }
+            prep_provide(sqe, returned[i], static_cast<unsigned>(j - i));
+            i = j;
+        }
+        returned.erase(returned.begin(), returned.begin() + i);
+    }
+    
+    void prep_provide(io_uring_sqe* sqe, unsigned first, unsigned count) {
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffers.data() + static_cast<size_t>(first) * buffer_size);
+        sqe->len = buffer_size;
+        sqe->off = first;
+        sqe->buf_group = buffer_group;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = PROVIDE_TAG;
+    }
+    
+    // Hands the locally queued entries to the kernel's view of the queue
+    unsigned publish() {
+        provide_returned();
+        unsigned pending = sq_local_tail - sq_submitted;
+        if (pending > 0) {
+            __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+            sq_submitted = sq_local_tail;
+        }
+        return pending;
+    }
+    
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+    
+    ~IoUring() {
+        // Closing the ring cancels whatever is still in flight
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (sq_ring != MAP_FAILED) {
+            munmap(sq_ring, sq_ring_size);
+        }
+    }
+    
+    // Sets up a ring with room for entries queued requests. Completions may
+    // outnumber them; the kernel keeps any overflow until they are read.
+    bool init(unsigned entries) {
+        io_uring_params params;
+        int fd = -1;
+        // Newest flags first: completion work is then only run inside wait()
+        const unsigned flag_sets[] = {
+            IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+            IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN,
+            0,
+        };
+        for (unsigned flags : flag_sets) {
+            memset(&params, 0, sizeof(params));
+            params.flags = flags | IORING_SETUP_CQSIZE;
+            params.cq_entries = entries * 4;
+            fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd >= 0 || errno != EINVAL) {
+                break;
+            }
+        }
+        if (fd < 0) {
+            return false;
+        }
+        ring_fd = fd;
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+            return false;
+        }
+        
+        sq_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED) {
+            return false;
+        }
+        cq_ring = sq_ring;  // One mapping holds both rings
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        
+        char* sq = static_cast<char*>(sq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        // Slot i of the submission queue always holds entry i
+        unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries; ++i) {
+            array[i] = i;
+        }
+        sq_local_tail = sq_submitted = *sq_tail;
+        
+        char* cq = static_cast<char*>(cq_ring);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+    
+    // Provides count buffers of size bytes as group, with the next submit
+    void provide_buffers(uint16_t group, unsigned count, unsigned size) {
+        buffers.resize(static_cast<size_t>(count) * size);
+        buffer_size = size;
+        buffer_group = group;
+        returned.clear();
+        for (unsigned id = 0; id < count; ++id) {
+            returned.push_back(static_cast<uint16_t>(id));
+        }
+    }
+    
+    const char* buffer(unsigned id) const {
+        return buffers.data() + static_cast<size_t>(id) * buffer_size;
+    }
+    
+    // Returns a buffer picked by a receive to the kernel with the next submit
+    void recycle(unsigned id) {
+        returned.push_back(static_cast<uint16_t>(id));
+    }
+    
+    // A cleared entry to fill in, or nullptr while the queue is full and
+    // needs a submit()
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (sq_local_tail - head >= sq_entries) {
+            return nullptr;
+        }
+        io_uring_sqe* sqe = &sqes[sq_local_tail & sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        ++sq_local_tail;
+        return sqe;
+    }
+    
+    // Passes the queued entries to the kernel without waiting
+    int submit() {
+        unsigned pending = publish();
+        return pending ? enter(ring_fd, pending, 0, 0) : 0;
+    }
+    
+    // Submits the queued entries and waits for at least one completion
+    int wait() {
+        return enter(ring_fd, publish(), 1, IORING_ENTER_GETEVENTS);
+    }
+    
+    // Calls f(cqe) for every completion that has arrived
+    template <typename F>
+    void for_each_completion(F f) {
+        unsigned head = *cq_head;
+        while (true) {
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail) {
+                break;
+            }
+            for (; head != tail; ++head) {
+                if (cqes[head & cq_mask].user_data != PROVIDE_TAG) {
+                    f(cqes[head & cq_mask]);
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    
+    // Request preparation; each fills in a fresh entry from get_sqe()
+    
+    static void prep_accept_multishot(io_uring_sqe* sqe, int fd, uint64_t user_data) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = user_data;
+    }
+    
+    void prep_recv_multishot(io_uring_sqe* sqe, int fd, uint64_t user_data) const {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = user_data;
+    }
+    
+    static void prep_send(io_uring_sqe* sqe, int fd, const void* data, size_t len, uint64_t user_data) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(std::min<size_t>(len, UINT32_MAX));
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data;
+    }
+    
+    static void prep_sendmsg(io_uring_sqe* sqe, int fd, const struct msghdr* msg, uint64_t user_data) {
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(msg);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = user_data;
+    }
+    
+    // Completes every time fd becomes readable, until cancelled
+    static void prep_poll_multishot(io_uring_sqe* sqe, int fd, uint64_t user_data) {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = user_data;
+    }
+    
+    static void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = target;
+        sqe->user_data = user_data;
+    }
+    
+    // True if this kernel runs everything the daemon needs: a multishot
+    // receive into provided buffers on a socket. Older kernels, or sandboxes
+    // that block io_uring, fail here.
+    static bool probe() {
+        IoUring ring;
+        int fds[2];
+        if (!ring.init(8) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+            return false;
+        }
+        bool supported = false;
+        ring.provide_buffers(0, 2, 64);
+        ring.submit();
+        io_uring_sqe* sqe = ring.get_sqe();
+        ring.prep_recv_multishot(sqe, fds[0], 1);
+        char byte = 0;
+        if (ring.submit() >= 0 && write(fds[1], &byte, 1) == 1 && ring.wait() >= 0) {
+            ring.for_each_completion([&](const io_uring_cqe& cqe) {
+                supported = cqe.user_data == 1 && cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE) &&
+                            (cqe.flags & IORING_CQE_F_BUFFER);
+            });
+        }
+        close(fds[0]);
+        close(fds[1]);
+        return supported;
+    }
+};
+
+#endif
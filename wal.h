@@ -0,0 +1,579 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "number_store.h"
+
+// Append-only write-ahead log of store mutations
+//
+// The file starts with { uint32 magic "NWAL", uint32 version, uint64 base_lsn }
+// followed by records:
+//   uint32 length   bytes after the checksum
+//   uint32 crc      CRC-32C of those bytes
+//   uint8  op       WalOp, with WAL_MICROSECONDS set if timestamp is in microseconds
+//   ...            INSERT { int64 timestamp, uint32 count, count x int32 number }
+//                  REMOVE { uint32 count, count x int32 number }
+//                  CLEAR  {}
+//                  INSERT_EXPIRING { int64 timestamp, int64 expires_at,
+//                                    uint32 count, count x int32 number }
+// Only changes that took effect are logged, in the order the store applied
+// them to each number. Replay stops at the first short or corrupt record,
+// which is what a crash in the middle of a write leaves behind, and
+// truncates the file there.
+//
+// A record's LSN is base_lsn plus its offset after the header, so LSNs keep
+// growing when compact() drops the records a snapshot already covers.
+// Version 1 files have an 8-byte header and base_lsn 0.
+
+constexpr uint32_t WAL_MAGIC = 0x4c41574e;  // "NWAL"
+constexpr uint32_t WAL_VERSION = 2;
+constexpr size_t WAL_HEADER_SIZE = 16;
+constexpr size_t WAL_V1_HEADER_SIZE = 8;
+constexpr size_t WAL_RECORD_HEADER_SIZE = 8;
+
+// Set in the op byte of records written since timestamps became microseconds;
+// records without it carry seconds
+constexpr uint8_t WAL_MICROSECONDS = 0x80;
+
+enum class WalOp : uint8_t {
+    INSERT = 1,
+    REMOVE,
+    CLEAR,
+    INSERT_EXPIRING  // INSERT of numbers with a TTL
+};
+
+// When appended records reach the disk
+enum class SyncPolicy {
+    ALWAYS,  // Replies wait for a sync started as soon as the flusher wakes
+    GROUP,   // Replies wait for a group commit at most one window after the first record
+    ASYNC    // Replies don't wait; a background sync runs every window
+};
+
+inline bool parse_sync_policy(const std::string& name, SyncPolicy& policy) {
+    if (name == "always") {
+        policy = SyncPolicy::ALWAYS;
+    } else if (name == "group") {
+        policy = SyncPolicy::GROUP;
+    } else if (name == "async") {
+        policy = SyncPolicy::ASYNC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* sync_policy_name(SyncPolicy policy) {
+    switch (policy) {
+        case SyncPolicy::ALWAYS: return "always";
+        case SyncPolicy::GROUP: return "group";
+        case SyncPolicy::ASYNC: return "async";
+    }
+    return "unknown";
+}
+
+// Writes all of data, retrying short writes
+inline bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// fsyncs the directory holding path, making a rename or file creation durable
+inline bool sync_parent_directory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return false;
+    }
+    bool ok = fsync(dir_fd) == 0;
+    close(dir_fd);
+    return ok;
+}
+
+// Records a store's mutations as its ChangeListener. A reply that depends
+// on a mutation may be sent once durable_lsn() has reached the LSN returned
+// by commit(). A write or sync error latches failed(): the records not yet
+// durable are dropped, nothing more is appended and durable_lsn() stops
+// where it was, so replies still waiting for it have to be failed.
+class WriteAheadLog : public ChangeListener {
+public:
+    // A group commit starts early once this much is buffered
+    static constexpr size_t GROUP_COMMIT_BYTES = 1024 * 1024;
+    
+private:
+    using Clock = std::chrono::steady_clock;
+    
+    std::string path;
+    int fd;
+    size_t header_size;  // Both guarded by io_mutex once the log is open
+    uint64_t base;       // LSN of the first record in the file
+    SyncPolicy policy;
+    std::chrono::microseconds window;
+    
+    std::mutex buffer_mutex;
+    std::condition_variable flush_cv;  // Wakes the flusher thread
+    std::vector<char> buffer;          // Records not yet written to the file
+    uint64_t appended;                 // LSN after the last buffered record
+    bool stopping;
+    
+    std::mutex io_mutex;               // Held by the thread writing and syncing
+    std::vector<char> writing;         // Records being written, guarded by io_mutex
+    std::atomic<uint64_t> durable;
+    std::atomic<uint64_t> syncs;
+    std::atomic<bool> failure;         // Set once by a failed write or sync
+    
+    std::mutex durable_mutex;
+    std::condition_variable durable_cv;
+    std::function<void()> durable_callback;
+    
+    std::thread flusher;
+    
+    // Appends one record; buffer_mutex must be held
+    void append_record(WalOp op, int64_t timestamp, int64_t expires_at, const int32_t* numbers,
+                       size_t count) {
+        if (failed()) {
+            return;  // Records after a gap could not be replayed anyway
+        }
+        size_t start = buffer.size();
+        buffer.resize(start + WAL_RECORD_HEADER_SIZE);
+        auto put = [this](const void* data, size_t len) {
+            const char* bytes = static_cast<const char*>(data);
+            buffer.insert(buffer.end(), bytes, bytes + len);
+        };
+        
+        uint8_t code = static_cast<uint8_t>(op) | WAL_MICROSECONDS;
+        put(&code, sizeof(code));
+        if (op == WalOp::INSERT || op == WalOp::INSERT_EXPIRING) {
+            put(&timestamp, sizeof(timestamp));
+        }
+        if (op == WalOp::INSERT_EXPIRING) {
+            put(&expires_at, sizeof(expires_at));
+        }
+        if (op != WalOp::CLEAR) {
+            uint32_t n = static_cast<uint32_t>(count);
+            put(&n, sizeof(n));
+            put(numbers, count * sizeof(int32_t));
+        }
+        
+        const char* body = buffer.data() + start + WAL_RECORD_HEADER_SIZE;
+        uint32_t length = static_cast<uint32_t>(buffer.size() - start - WAL_RECORD_HEADER_SIZE);
+        uint32_t crc = crc32c(body, length);
+        memcpy(buffer.data() + start, &length, sizeof(length));
+        memcpy(buffer.data() + start + 4, &crc, sizeof(crc));
+        
+        bool was_empty = start == 0;
+        appended += buffer.size() - start;
+        if (was_empty || (buffer.size() >= GROUP_COMMIT_BYTES && start < GROUP_COMMIT_BYTES)) {
+            flush_cv.notify_one();
+        }
+    }
+    
+    // Applies every intact record at or after from_lsn; returns the file
+    // offset just past the last intact record
+    size_t replay(const std::vector<char>& data, uint64_t from_lsn, NumberStore& store,
+                  size_t& records) const {
+        size_t pos = header_size;
+        std::vector<int32_t> numbers;
+        std::vector<bool> applied;
+        
+        while (data.size() - pos >= WAL_RECORD_HEADER_SIZE) {
+            uint32_t length, crc;
+            memcpy(&length, data.data() + pos, sizeof(length));
+            memcpy(&crc, data.data() + pos + 4, sizeof(crc));
+            const char* body = data.data() + pos + WAL_RECORD_HEADER_SIZE;
+            if (length > data.size() - pos - WAL_RECORD_HEADER_SIZE || crc32c(body, length) != crc) {
+                break;
+            }
+            
+            if (base + (pos - header_size) < from_lsn) {
+                pos += WAL_RECORD_HEADER_SIZE + length;
+                continue;  // Already part of the snapshot the store was loaded from
+            }
+            
+            PayloadReader reader(body, length);
+            uint8_t code = reader.get_u8();
+            WalOp op = static_cast<WalOp>(code & ~WAL_MICROSECONDS);
+            bool insert = op == WalOp::INSERT || op == WalOp::INSERT_EXPIRING;
+            int64_t timestamp = insert ? reader.get_i64() : 0;
+            if (!(code & WAL_MICROSECONDS)) {
+                timestamp *= MICROS_PER_SECOND;
+            }
+            int64_t expires_at = op == WalOp::INSERT_EXPIRING ? reader.get_i64() : NO_EXPIRY;
+            if (insert || op == WalOp::REMOVE) {
+                uint32_t count = reader.get_u32();
+                const char* raw = reader.get_bytes(static_cast<size_t>(count) * sizeof(int32_t));
+                if (!raw) {
+                    break;
+                }
+                numbers.resize(count);
+                memcpy(numbers.data(), raw, count * sizeof(int32_t));
+                if (insert) {
+                    store.insert_batch_at(numbers, timestamp, expires_at, applied);
+                } else {
+                    store.remove_batch(numbers, applied);
+                }
+            } else if (op == WalOp::CLEAR) {
+                store.clear();
+            } else {
+                break;
+            }
+            
+            pos += WAL_RECORD_HEADER_SIZE + length;
+            ++records;
+        }
+        return pos;
+    }
+    
+    // Reads the whole log behind file into data and takes base and
+    // header_size from its header. An empty file is a new log. False, with
+    // the reason printed, if it cannot be read or is not a log.
+    bool read_log(int file, std::vector<char>& data) {
+        char chunk[64 * 1024];
+        ssize_t n;
+        while ((n = read(file, chunk, sizeof(chunk))) != 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                std::cerr << "Failed to read write-ahead log " << path << ": "
+                          << strerror(errno) << std::endl;
+                return false;
+            }
+            data.insert(data.end(), chunk, chunk + n);
+        }
+        if (data.size() < WAL_V1_HEADER_SIZE) {
+            return true;
+        }
+        
+        uint32_t magic, version;
+        memcpy(&magic, data.data(), sizeof(magic));
+        memcpy(&version, data.data() + 4, sizeof(version));
+        if (magic != WAL_MAGIC || version < 1 || version > WAL_VERSION ||
+            (version == WAL_VERSION && data.size() < WAL_HEADER_SIZE)) {
+            std::cerr << path << " is not a version " << WAL_VERSION
+                      << " write-ahead log" << std::endl;
+            return false;
+        }
+        if (version == 1) {
+            header_size = WAL_V1_HEADER_SIZE;
+            base = 0;
+        } else {
+            header_size = WAL_HEADER_SIZE;
+            memcpy(&base, data.data() + 8, sizeof(base));
+        }
+        return true;
+    }
+    
+    // Commits whatever is buffered once a window has passed since the first
+    // buffered record, or sooner if GROUP_COMMIT_BYTES accumulate. With
+    // ALWAYS there is no window: records appended while a sync runs go
+    // out together in the next one.
+    void flush_loop() {
+        std::unique_lock lock(buffer_mutex);
+        while (true) {
+            flush_cv.wait(lock, [this] { return stopping || !buffer.empty(); });
+            if (buffer.empty()) {
+                break;
+            }
+            if (policy != SyncPolicy::ALWAYS) {
+                flush_cv.wait_until(lock, Clock::now() + window, [this] {
+                    return stopping || buffer.size() >= GROUP_COMMIT_BYTES;
+                });
+            }
+            lock.unlock();
+            sync();
+            lock.lock();
+        }
+    }
+    
+public:
+    WriteAheadLog(const std::string& log_path, SyncPolicy sync_policy,
+                  std::chrono::microseconds group_window)
+        : path(log_path), fd(-1), header_size(WAL_HEADER_SIZE), base(0), policy(sync_policy),
+          window(group_window), appended(0), stopping(false), durable(0), syncs(0),
+          failure(false) {}
+    
+    ~WriteAheadLog() {
+        if (flusher.joinable()) {
+            {
+                std::lock_guard lock(buffer_mutex);
+                stopping = true;
+            }
+            flush_cv.notify_one();
+            flusher.join();
+        }
+        if (fd >= 0) {
+            sync();
+            close(fd);
+        }
+    }
+    
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+    
+    // Opens or creates the log and replays the records from from_lsn on into
+    // store, i.e. those not covered by a snapshot taken at from_lsn. Must be
+    // called before the log is attached to the store as a listener.
+    bool open(NumberStore& store, size_t& records, uint64_t from_lsn = 0) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to open write-ahead log " << path << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        
+        std::vector<char> data;
+        if (!read_log(fd, data)) {
+            return false;
+        }
+        
+        records = 0;
+        size_t valid;
+        if (data.size() >= WAL_V1_HEADER_SIZE) {
+            uint64_t end = base + (data.size() - header_size);
+            if (from_lsn < base || from_lsn > end) {
+                std::cerr << path << " holds log positions " << base << " to " << end
+                          << " but replay has to start at " << from_lsn << std::endl;
+                return false;
+            }
+            valid = replay(data, from_lsn, store, records);
+        } else {
+            // A new log starts where the snapshot, if any, left off
+            base = from_lsn;
+            char header[WAL_HEADER_SIZE];
+            uint32_t fields[2] = {WAL_MAGIC, WAL_VERSION};
+            memcpy(header, fields, sizeof(fields));
+            memcpy(header + 8, &base, sizeof(base));
+            if (ftruncate(fd, 0) < 0 || pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+                std::cerr << "Failed to initialize write-ahead log " << path << std::endl;
+                return false;
+            }
+            valid = WAL_HEADER_SIZE;
+        }
+        
+        // Drop a torn tail so that new records follow the last intact one
+        if ((valid < data.size() && ftruncate(fd, valid) < 0) || lseek(fd, valid, SEEK_SET) < 0 ||
+            fdatasync(fd) < 0) {
+            std::cerr << "Failed to prepare write-ahead log " << path << ": "
+                      << strerror(errno) << std::endl;
+            return false;
+        }
+        
+        appended = base + (valid - header_size);
+        durable = appended;
+        flusher = std::thread(&WriteAheadLog::flush_loop, this);
+        return true;
+    }
+    
+    // Replays the records from lsn on into store like open(), but from file,
+    // the log opened read-only, and moves lsn past the last intact record. A
+    // daemon taking over from another catches up with the log this way while
+    // the other still appends to it; open() then replays only the rest.
+    // Opened before the snapshot the store was loaded from, file still holds
+    // the records after it if the log is compacted meanwhile. False if there
+    // is no log, or it cannot be read or no longer holds the records from lsn.
+    bool catch_up(int file, NumberStore& store, size_t& records, uint64_t& lsn) {
+        records = 0;
+        std::vector<char> data;
+        if (file < 0 || !read_log(file, data) || data.size() < WAL_V1_HEADER_SIZE) {
+            return false;  // A log in use has its header
+        }
+        if (lsn < base || lsn > base + (data.size() - header_size)) {
+            return false;
+        }
+        lsn = base + (replay(data, lsn, store, records) - header_size);
+        return true;
+    }
+    
+    // Replaces the log with one holding only the records from lsn on, which
+    // must be a value returned by appended_lsn(). Used once a snapshot taken
+    // at lsn is durable.
+    bool compact(uint64_t lsn) {
+        sync();
+        std::lock_guard io(io_mutex);
+        if (failed()) {
+            return false;
+        }
+        uint64_t end = durable_lsn();
+        if (lsn <= base || lsn > end) {
+            return lsn <= base;
+        }
+        
+        std::string tmp_path = path + ".tmp";
+        // Read by the next compaction once it has become the log
+        int out = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out < 0) {
+            return false;
+        }
+        
+        char header[WAL_HEADER_SIZE];
+        uint32_t fields[2] = {WAL_MAGIC, WAL_VERSION};
+        memcpy(header, fields, sizeof(fields));
+        memcpy(header + 8, &lsn, sizeof(lsn));
+        bool ok = write_all(out, header, sizeof(header));
+        
+        // Records after lsn that are already in the file move over
+        std::vector<char> chunk(1024 * 1024);
+        off_t offset = static_cast<off_t>(header_size + (lsn - base));
+        off_t stop = static_cast<off_t>(header_size + (end - base));
+        while (ok && offset < stop) {
+            size_t want = std::min<size_t>(chunk.size(), stop - offset);
+            ssize_t n = pread(fd, chunk.data(), want, offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            ok = n > 0 && write_all(out, chunk.data(), n);
+            offset += n > 0 ? n : 0;
+        }
+        
+        if (!ok || fdatasync(out) < 0 || rename(tmp_path.c_str(), path.c_str()) < 0) {
+            close(out);
+            unlink(tmp_path.c_str());
+            return false;
+        }
+        sync_parent_directory(path);
+        
+        close(fd);
+        fd = out;
+        header_size = WAL_HEADER_SIZE;
+        base = lsn;
+        return true;
+    }
+    
+    // Called from the flusher thread after each sync, and when the log
+    // fails; must not block
+    void set_durable_callback(std::function<void()> callback) {
+        durable_callback = std::move(callback);
+    }
+    
+    SyncPolicy sync_policy() const {
+        return policy;
+    }
+    
+    void on_insert(const int32_t* numbers, size_t count, int64_t timestamp,
+                   int64_t expires_at) override {
+        std::lock_guard lock(buffer_mutex);
+        append_record(expires_at == NO_EXPIRY ? WalOp::INSERT : WalOp::INSERT_EXPIRING,
+                      timestamp, expires_at, numbers, count);
+    }
+    
+    void on_remove(const int32_t* numbers, size_t count) override {
+        std::lock_guard lock(buffer_mutex);
+        append_record(WalOp::REMOVE, 0, NO_EXPIRY, numbers, count);
+    }
+    
+    void on_clear() override {
+        std::lock_guard lock(buffer_mutex);
+        append_record(WalOp::CLEAR, 0, NO_EXPIRY, nullptr, 0);
+    }
+    
+    // Call after a mutation; returns the LSN its reply has to wait for, 0
+    // with ASYNC, where replies never wait. Never syncs itself: the flusher
+    // does, so the caller can go on serving until durable_lsn() gets there.
+    uint64_t commit() {
+        return policy == SyncPolicy::ASYNC ? 0 : appended_lsn();
+    }
+    
+    // LSN of the first record the file holds; records before it were
+    // dropped by compact()
+    uint64_t first_lsn() {
+        std::lock_guard io(io_mutex);
+        return base;
+    }
+    
+    // LSN just past the last record handed to the log
+    uint64_t appended_lsn() {
+        std::lock_guard lock(buffer_mutex);
+        return appended;
+    }
+    
+    uint64_t durable_lsn() const {
+        return durable.load(std::memory_order_acquire);
+    }
+    
+    // True once a write or sync has failed; mutations can no longer be made durable
+    bool failed() const {
+        return failure.load(std::memory_order_acquire);
+    }
+    
+    // Number of write + fdatasync rounds so far
+    uint64_t sync_count() const {
+        return syncs.load(std::memory_order_relaxed);
+    }
+    
+    // Blocks until lsn is durable or the log has failed; false in the latter case
+    bool wait(uint64_t lsn) {
+        std::unique_lock lock(durable_mutex);
+        durable_cv.wait(lock, [this, lsn] { return durable_lsn() >= lsn || failed(); });
+        return durable_lsn() >= lsn;
+    }
+    
+    // Writes and syncs everything appended so far. Threads arriving while
+    // another one syncs wait for it and usually find their records covered.
+    void sync() {
+        std::lock_guard io(io_mutex);
+        uint64_t end;
+        writing.clear();
+        {
+            std::lock_guard lock(buffer_mutex);
+            writing.swap(buffer);
+            end = appended;
+        }
+        if (end <= durable_lsn() || failed()) {
+            return;
+        }
+        
+        // A partly written tail would be cut off at the next replay, but
+        // nothing after it could be, so the log takes no more records
+        bool ok = write_all(fd, writing.data(), writing.size()) && fdatasync(fd) == 0;
+        if (!ok) {
+            std::cerr << "Write-ahead log " << path << " failed: " << strerror(errno)
+                      << "; refusing mutations from here on" << std::endl;
+        }
+        
+        {
+            std::lock_guard lock(durable_mutex);
+            if (ok) {
+                durable.store(end, std::memory_order_release);
+            } else {
+                failure.store(true, std::memory_order_release);
+            }
+        }
+        if (ok) {
+            syncs.fetch_add(1, std::memory_order_relaxed);
+        }
+        durable_cv.notify_all();
+        if (durable_callback) {
+            durable_callback();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "number_store.h"
+
+// Change stream behind WATCH. The feed is a store listener that numbers
+// every change and keeps the most recent ones in a window shared by all
+// subscribers, each reading it from its own cursor. A subscriber that falls
+// so far behind that its next change has left the window is lagging and
+// gets disconnected, so a slow consumer costs the daemon nothing beyond the
+// window. Nothing is recorded while there are no subscribers.
+
+struct ChangeEvent {
+    uint64_t seq;
+    MessageType op;     // INSERT, DELETE or DELETE_ALL
+    int64_t timestamp;  // INSERT only
+    std::vector<int32_t> numbers;
+};
+
+class ChangeFeed;
+
+// One subscriber's position in the feed, with an eventfd bell the feed
+// rings when a change arrives while the subscriber is idle
+class Subscription {
+private:
+    friend class ChangeFeed;
+    
+    ChangeFeed& feed;
+    int bell;
+    uint64_t cursor;                 // Next change to deliver
+    std::atomic<bool> idle{false};   // Caught up and waiting for the bell
+    
+    void ring() {
+        if (idle.exchange(false)) {
+            uint64_t one = 1;
+            ssize_t ignored = write(bell, &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+    
+public:
+    explicit Subscription(ChangeFeed& change_feed);
+    ~Subscription();
+    
+    Subscription(const Subscription&) = delete;
+    Subscription& operator=(const Subscription&) = delete;
+    
+    // -1 if the eventfd could not be created
+    int bell_fd() const {
+        return bell;
+    }
+    
+    void clear_bell() {
+        uint64_t value;
+        ssize_t ignored = ::read(bell, &value, sizeof(value));
+        (void)ignored;
+    }
+    
+    // Asks for the bell on the next change. Returns false if one arrived
+    // meanwhile and waiting would miss it.
+    bool prepare_idle();
+    
+    // Calls f(event) for the changes after the cursor, up to about budget
+    // numbers' worth, and advances the cursor. Returns false if the
+    // subscriber is lagging.
+    template <typename F>
+    bool read(size_t budget, F f);
+};
+
+class ChangeFeed : public ChangeListener {
+private:
+    mutable std::mutex mutex;
+    std::deque<ChangeEvent> events;  // The window, ending at next_seq - 1
+    size_t retained = 0;             // Numbers held in events, DELETE_ALL counting as one
+    size_t capacity;
+    uint64_t next_seq = 1;
+    std::vector<Subscription*> subscribers;
+    std::atomic<size_t> subscriber_count{0};
+    
+    friend class Subscription;
+    
+    void publish(MessageType op, int64_t timestamp, const int32_t* numbers, size_t count) {
+        if (subscriber_count.load() == 0) {
+            return;
+        }
+        std::lock_guard lock(mutex);
+        if (subscribers.empty()) {
+            return;
+        }
+        events.push_back(ChangeEvent{next_seq++, op, timestamp,
+                                     std::vector<int32_t>(numbers, numbers + count)});
+        retained += std::max<size_t>(count, 1);
+        while (retained > capacity && events.size() > 1) {
+            retained -= std::max<size_t>(events.front().numbers.size(), 1);
+            events.pop_front();
+        }
+        for (Subscription* subscriber : subscribers) {
+            subscriber->ring();
+        }
+    }
+    
+public:
+    static constexpr size_t DEFAULT_CAPACITY = 1024 * 1024;
+    
+    // Keeps about capacity numbers' worth of changes for lagging subscribers
+    explicit ChangeFeed(size_t window = DEFAULT_CAPACITY) : capacity(std::max<size_t>(window, 1)) {}
+    
+    void on_insert(const int32_t* numbers, size_t count, int64_t timestamp, int64_t) override {
+        publish(MessageType::INSERT, timestamp, numbers, count);
+    }
+    
+    void on_remove(const int32_t* numbers, size_t count) override {
+        publish(MessageType::DELETE, 0, numbers, count);
+    }
+    
+    void on_clear() override {
+        publish(MessageType::DELETE_ALL, 0, nullptr, 0);
+    }
+    
+    // Sequence number the next change will get
+    uint64_t next_sequence() const {
+        std::lock_guard lock(mutex);
+        return next_seq;
+    }
+};
+
+// Subscribes at the current end of the feed. Changes the store notifies
+// from here on are delivered, so whatever a scan started afterwards misses
+// is in the feed.
+inline Subscription::Subscription(ChangeFeed& change_feed)
+    : feed(change_feed), bell(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    std::lock_guard lock(feed.mutex);
+    cursor = feed.next_seq;
+    feed.subscribers.push_back(this);
+    feed.subscriber_count.store(feed.subscribers.size());
+}
+
+inline Subscription::~Subscription() {
+    {
+        std::lock_guard lock(feed.mutex);
+        auto& list = feed.subscribers;
+        list.erase(std::find(list.begin(), list.end(), this));
+        feed.subscriber_count.store(list.size());
+        if (list.empty()) {
+            feed.events.clear();
+            feed.retained = 0;
+        }
+    }
+    if (bell >= 0) {
+        close(bell);
+    }
+}
+
+inline bool Subscription::prepare_idle() {
+    idle.store(true);
+    if (feed.next_sequence() == cursor) {
+        return true;
+    }
+    idle.store(false);
+    return false;
+}
+
+template <typename F>
+bool Subscription::read(size_t budget, F f) {
+    std::lock_guard lock(feed.mutex);
+    uint64_t first = feed.next_seq - feed.events.size();
+    if (cursor < first) {
+        return false;
+    }
+    size_t taken = 0;
+    for (size_t i = cursor - first; i < feed.events.size() && taken < budget; ++i) {
+        const ChangeEvent& event = feed.events[i];
+        f(event);
+        taken += std::max<size_t>(event.numbers.size(), 1);
+        cursor = event.seq + 1;
+    }
+    return true;
+}
+
+#endif